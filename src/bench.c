@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+// Micro benchmarks of the YAML parser and the z3 libraries, `anvil run --target bench`.
+// Prints one JSON object per case, so runs can be diffed and checked for regressions
+
+#include <errno.h>
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define Z3_TOYS_IMPL
+#define Z3_STRING_IMPL
+#define Z3_HASHMAP_IMPL
+#define Z3_VECTOR_IMPL
+#define Z3_ARENA_IMPL
+#include <yaml.h>
+#include <z3_arena.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#define BENCH_SAMPLES   5          // timed samples of each case, the median is reported
+#define BENCH_SAMPLE_NS 50000000   // a sample runs the case for at least 50 ms
+#define BENCH_BATCH     1024       // operations per call of the small cases
+#define BENCH_QUICK_MAX (1 << 20)  // largest document of `--quick`
+#define BENCH_NS        1000000000
+#define BENCH_KEY_SIZE  24         // `macro_<n>` and `other_<n>`, NUL included
+#define BENCH_MAP_SLOTS 65536      // key counts below are picked as loads of this table
+#define BENCH_PUSH_LEN  65536      // items pushed per call of the vector cases
+#define BENCH_PUSH_N    64         // items per z3_push_n
+#define BENCH_APPEND    (1 << 20)  // bytes appended per call of string.pushl
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+// Allocations are counted by taking over malloc, glibc forwards its own calls here too.
+// Sanitizers bring their own allocator, those builds report no counts
+#if defined(__GLIBC__) && !__has_feature (address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#define BENCH_COUNT_ALLOCS 1
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+// Allocations counted so far, while a case runs
+typedef struct {
+  u64 count;  // calls of malloc, calloc and realloc
+  u64 bytes;  // bytes they asked for
+} AllocStats;
+
+// the allocator is process wide, and so is what counts its calls
+static AllocStats bench_allocs;
+
+#if BENCH_COUNT_ALLOCS
+extern void* __libc_malloc (usize size);
+extern void* __libc_calloc (usize n, usize size);
+extern void* __libc_realloc (void* ptr, usize size);
+
+void* malloc (usize size) {
+  bench_allocs.count++;
+  bench_allocs.bytes += size;
+  return __libc_malloc (size);
+}
+
+void* calloc (usize n, usize size) {
+  bench_allocs.count++;
+  bench_allocs.bytes += n * size;
+  return __libc_calloc (n, size);
+}
+
+void* realloc (void* ptr, usize size) {
+  bench_allocs.count++;
+  bench_allocs.bytes += size;
+  return __libc_realloc (ptr, size);
+}
+#endif
+
+// What to run, from the command line
+typedef struct {
+  nstr filter;  // only cases with this in `group/name`, nullptr for all
+  bool quick;   // skip documents over BENCH_QUICK_MAX
+} BenchOptions;
+
+// One benchmark, `run` is timed, `setup` and `teardown` run around each call of it
+typedef struct {
+  nstr group;   // what is measured, `yaml.mmap`, `hashmap.get`...
+  nstr name;    // the input it is measured on
+  usize ops;    // operations per call of `run`
+  usize bytes;  // input bytes per call of `run`, 0 when throughput means nothing
+  void (*setup) (void* ctx);
+  void (*run) (void* ctx);
+  void (*teardown) (void* ctx);
+  void* ctx;
+} BenchCase;
+
+static u64 now_ns (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((u64)ts.tv_sec * BENCH_NS) + (u64)ts.tv_nsec;
+}
+
+// Cycle (or constant rate tick) counter, 0 where there is none
+static u64 now_cycles (void) {
+#if __has_builtin(__builtin_readcyclecounter)
+  return __builtin_readcyclecounter ();
+#else
+  return 0;
+#endif
+}
+
+static int cmp_f64 (const void* a, const void* b) {
+  f64 x = *(const f64*)a;
+  f64 y = *(const f64*)b;
+  return (x > y) - (x < y);
+}
+
+// `calls` calls of a case, only `run` is timed and counted
+static void bench_sample (const BenchCase* bc, usize calls, u64* ns, u64* cycles) {
+  *ns = 0;
+  *cycles = 0;
+  for (usize i = 0; i < calls; i++) {
+    // setup and teardown allocate too, those are left out
+    AllocStats kept = bench_allocs;
+    if (bc->setup) bc->setup (bc->ctx);
+
+    AllocStats before = bench_allocs;
+    u64 c0 = now_cycles ();
+    u64 t0 = now_ns ();
+    bc->run (bc->ctx);
+    *ns += now_ns () - t0;
+    *cycles += now_cycles () - c0;
+    AllocStats after = bench_allocs;
+
+    if (bc->teardown) bc->teardown (bc->ctx);
+    bench_allocs.count = kept.count + after.count - before.count;
+    bench_allocs.bytes = kept.bytes + after.bytes - before.bytes;
+  }
+}
+
+// Run a case unless filtered out and print its line
+static void bench_run (const BenchOptions* opts, const BenchCase* bc) {
+  if (opts->filter) {
+    ScopedString id = z3_str (64);  // NOLINT (readability-magic-numbers)
+    z3_pushf (&id, "%s/%s", bc->group, bc->name);
+    if (!strstr ((nstr)id.chr, opts->filter)) return;
+  }
+
+  // calls per sample, doubled until a sample is long enough to time
+  usize calls = 1;
+  u64 ns = 0;
+  u64 cycles = 0;
+  while (true) {
+    bench_sample (bc, calls, &ns, &cycles);
+    if (ns >= BENCH_SAMPLE_NS) break;
+    calls *= 2;
+  }
+
+  f64 per_op[BENCH_SAMPLES];
+  f64 cycles_op[BENCH_SAMPLES];
+  bench_allocs = (AllocStats) {0};
+  for (usize s = 0; s < BENCH_SAMPLES; s++) {
+    bench_sample (bc, calls, &ns, &cycles);
+    f64 ops = (f64)calls * (f64)bc->ops;
+    per_op[s] = (f64)ns / ops;
+    cycles_op[s] = (f64)cycles / ops;
+  }
+  AllocStats allocs = bench_allocs;
+  qsort (per_op, BENCH_SAMPLES, sizeof (f64), cmp_f64);
+  qsort (cycles_op, BENCH_SAMPLES, sizeof (f64), cmp_f64);
+
+  f64 total_ops = (f64)calls * (f64)bc->ops * BENCH_SAMPLES;
+  f64 median = per_op[BENCH_SAMPLES / 2];
+
+  printf ("{\"group\":\"%s\",\"case\":\"%s\"", bc->group, bc->name);
+  printf (",\"ops\":%.0f,\"ns_per_op\":%.3f", total_ops, median);
+  printf (",\"min_ns_per_op\":%.3f", per_op[0]);
+  printf (",\"max_ns_per_op\":%.3f", per_op[BENCH_SAMPLES - 1]);
+
+  if (cycles_op[BENCH_SAMPLES / 2] > 0)
+    printf (",\"cycles_per_op\":%.3f", cycles_op[BENCH_SAMPLES / 2]);
+  else
+    printf (",\"cycles_per_op\":null");
+
+  if (BENCH_COUNT_ALLOCS) {
+    printf (",\"allocs_per_op\":%.3f", (f64)allocs.count / total_ops);
+    printf (",\"alloc_bytes_per_op\":%.1f", (f64)allocs.bytes / total_ops);
+  } else {
+    printf (",\"allocs_per_op\":null,\"alloc_bytes_per_op\":null");
+  }
+
+  if (bc->bytes > 0) {
+    f64 mb_s = ((f64)bc->bytes / (f64)bc->ops) / median * BENCH_NS / (1 << 20);
+    printf (",\"mb_per_s\":%.1f", mb_s);
+  }
+  printf ("}\n");
+  fflush (stdout);  // NOLINT (cert-err33-c)
+}
+
+/* --- YAML --- */
+
+// Shapes of the synthetic documents
+typedef enum {
+  DOC_FLAT,     // many top level keys of small maps, like a big anvil.yaml
+  DOC_ANCHORS,  // every other value an anchor, its alias or a `<<` merge of it
+  DOC_DEEP,     // maps nested 32 levels down, over and over
+} DocShape;
+
+static const nstr doc_shape_names[] = {"flat", "anchors", "deep"};
+
+// Append entry `i` of a document of `shape`
+static void doc_entry (String* doc, DocShape shape, usize i) {
+  switch (shape) {
+    case DOC_FLAT:
+      z3_pushf (
+        doc, "key_%zu: { name: 'value %zu', jobs: %zu, list: ['-O2', '-Wall', 3], on: true }\n",
+        i, i, i % 64  // NOLINT (readability-magic-numbers)
+      );
+      break;
+    case DOC_ANCHORS:
+      z3_pushf (doc, "base_%zu: &base_%zu { cflags: ['-O2', '-Wall'], jobs: 4 }\n", i, i);
+      z3_pushf (doc, "copy_%zu: *base_%zu\n", i, i);
+      z3_pushf (doc, "over_%zu: { <<: *base_%zu, jobs: 8 }\n", i, i);
+      break;
+    case DOC_DEEP:
+      z3_pushf (doc, "root_%zu: ", i);
+      for (u8 d = 0; d < 32; d++) z3_pushlit (doc, "{ a: ");  // NOLINT
+      z3_pushlit (doc, "'leaf'");
+      for (u8 d = 0; d < 32; d++) z3_pushlit (doc, " }");  // NOLINT
+      z3_pushc (doc, '\n');
+      break;
+  }
+}
+
+// A document of `shape`, at least `size` bytes, written to a temporary file
+typedef struct {
+  String path;
+  usize size;
+  YamlStore store;
+  bool events;  // parse_yaml_events instead of a tree
+  bool mapped;  // parse_yaml_mmap instead of parse_yaml
+} YamlBench;
+
+static bool yaml_doc_write (YamlBench* yb, DocShape shape, usize size) {
+  ScopedString doc = z3_str (size + 256);  // NOLINT (readability-magic-numbers)
+  z3_pushlit (&doc, "# synthetic document of the anvil benchmarks\n");
+  for (usize i = 0; doc.len < size; i++) doc_entry (&doc, shape, i);
+  yb->size = doc.len;
+
+  nstr tmp = getenv ("TMPDIR");  // NOLINT (concurrency-mt-unsafe)
+  yb->path = z3_str (64);        // NOLINT (readability-magic-numbers)
+  z3_pushf (&yb->path, "%s/anvil-bench-XXXXXX", (tmp && *tmp) ? tmp : "/tmp");
+
+  int fd = mkstemp ((rstr)yb->path.chr);
+  if (fd < 0) return false;
+  bool ok = write (fd, doc.chr, doc.len) == (isize)doc.len;
+  close (fd);
+  return ok;
+}
+
+static void yaml_run (void* ctx) {
+  YamlBench* yb = ctx;
+  yb->store = (YamlStore) {0};
+  if (yb->events) {
+    YamlHandler none = {0};
+    parse_yaml_events ((nstr)yb->path.chr, &yb->store, &none);
+  } else if (yb->mapped) {
+    if (!parse_yaml_mmap ((nstr)yb->path.chr, &yb->store))
+      die ("could not parse '%s'\n", yb->path.chr);
+  } else if (!parse_yaml ((nstr)yb->path.chr, &yb->store)) {
+    die ("could not parse '%s'\n", yb->path.chr);
+  }
+}
+
+static void yaml_teardown (void* ctx) { free_yaml (&((YamlBench*)ctx)->store); }
+
+static void bench_yaml (const BenchOptions* opts) {
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  const usize sizes[] = {10 * 1024, 1 << 20, 50 << 20};
+  const nstr size_names[] = {"10KB", "1MB", "50MB"};
+
+  for (usize s = 0; s < sizeof (sizes) / sizeof (*sizes); s++) {
+    if (opts->quick && sizes[s] > BENCH_QUICK_MAX) continue;
+
+    for (u8 shape = DOC_FLAT; shape <= DOC_DEEP; shape++) {
+      ScopedString name = z3_str (32);  // NOLINT (readability-magic-numbers)
+      z3_pushf (&name, "%s-%s", doc_shape_names[shape], size_names[s]);
+
+      YamlBench yb = {0};
+      if (!yaml_doc_write (&yb, shape, sizes[s])) {
+        // NOLINTNEXTLINE (concurrency-mt-unsafe)
+        errpfmt ("could not write '%s': %s\n", yb.path.chr, strerror (errno));
+        z3_drops (&yb.path);
+        continue;
+      }
+
+      BenchCase bc = {
+        .name = (nstr)name.chr,
+        .ops = 1,
+        .bytes = yb.size,
+        .run = yaml_run,
+        .teardown = yaml_teardown,
+        .ctx = &yb,
+      };
+
+      // lexing and structure only, no tree
+      yb.events = true;
+      bc.group = "yaml.events";
+      bench_run (opts, &bc);
+
+      yb.events = false;
+      yb.mapped = true;
+      bc.group = "yaml.mmap";
+      bench_run (opts, &bc);
+
+      yb.mapped = false;
+      bc.group = "yaml.read";
+      bench_run (opts, &bc);
+
+      unlink ((nstr)yb.path.chr);
+      z3_drops (&yb.path);
+    }
+  }
+}
+
+/* --- HashMap --- */
+
+typedef struct {
+  c8 (*keys)[BENCH_KEY_SIZE];    // `macro_<n>`, in the map
+  c8 (*absent)[BENCH_KEY_SIZE];  // `other_<n>`, never in it
+  usize count;
+  HashMap* map;    // filled with `keys`, values are index + 1
+  HashMap* owned;  // the same with allocated values, removal frees them
+  usize sink;      // keeps lookups from being optimized away
+} MapBench;
+
+static void map_fill (MapBench* mb, HashMap* map, bool owned) {
+  for (usize i = 0; i < mb->count; i++) {
+    void* val = owned ? malloc (1) : (void*)(uintptr_t)(i + 1);
+    z3_hashmap_put (map, mb->keys[i], val);
+  }
+}
+
+static void map_put_run (void* ctx) {
+  MapBench* mb = ctx;
+  HashMap* map = z3_hashmap_create ();
+  map_fill (mb, map, false);
+  z3_hashmap_drop_shallow (map);
+}
+
+static void map_get_run (void* ctx) {
+  MapBench* mb = ctx;
+  for (usize i = 0; i < mb->count; i++)
+    mb->sink += (uintptr_t)z3_hashmap_get (mb->map, mb->keys[i]);
+}
+
+static void map_miss_run (void* ctx) {
+  MapBench* mb = ctx;
+  for (usize i = 0; i < mb->count; i++)
+    mb->sink += (uintptr_t)z3_hashmap_get (mb->map, mb->absent[i]);
+}
+
+static void map_iter_run (void* ctx) {
+  MapBench* mb = ctx;
+  HashMapIterator it = z3_hashmap_iterator (mb->map);
+  while (z3_hashmap_iter_next (&it)) mb->sink += (uintptr_t)it.val;
+}
+
+static void map_remove_setup (void* ctx) {
+  MapBench* mb = ctx;
+  mb->owned = z3_hashmap_create ();
+  map_fill (mb, mb->owned, true);
+}
+
+static void map_remove_run (void* ctx) {
+  MapBench* mb = ctx;
+  for (usize i = 0; i < mb->count; i++) z3_hashmap_remove (mb->owned, mb->keys[i]);
+}
+
+static void map_remove_teardown (void* ctx) { z3_hashmap_drop (((MapBench*)ctx)->owned); }
+
+static void bench_hashmap (const BenchOptions* opts) {
+  // just over a grow (0.375), then up to the 0.75 limit, all in BENCH_MAP_SLOTS slots
+  const usize counts[] = {
+    (BENCH_MAP_SLOTS * 3 / 8) + 1, BENCH_MAP_SLOTS / 2, BENCH_MAP_SLOTS * 5 / 8,
+    BENCH_MAP_SLOTS * 3 / 4
+  };
+  usize most = counts[(sizeof (counts) / sizeof (*counts)) - 1];
+
+  MapBench mb = {0};
+  mb.keys = malloc (most * BENCH_KEY_SIZE);
+  mb.absent = malloc (most * BENCH_KEY_SIZE);
+  if (!mb.keys || !mb.absent) die ("Out of memory allocating benchmark keys\n");
+  for (usize i = 0; i < most; i++) {
+    snprintf (mb.keys[i], BENCH_KEY_SIZE, "macro_%zu", i);
+    snprintf (mb.absent[i], BENCH_KEY_SIZE, "other_%zu", i);
+  }
+
+  for (usize c = 0; c < sizeof (counts) / sizeof (*counts); c++) {
+    mb.count = counts[c];
+    mb.map = z3_hashmap_create ();
+    map_fill (&mb, mb.map, false);
+
+    ScopedString name = z3_str (32);  // NOLINT (readability-magic-numbers)
+    z3_pushf (&name, "load-%.3f", (f64)mb.map->len / (f64)mb.map->max);
+
+    BenchCase bc = {.name = (nstr)name.chr, .ops = mb.count, .ctx = &mb};
+    bc.group = "hashmap.put";
+    bc.run = map_put_run;
+    bench_run (opts, &bc);
+
+    bc.group = "hashmap.get";
+    bc.run = map_get_run;
+    bench_run (opts, &bc);
+
+    bc.group = "hashmap.miss";
+    bc.run = map_miss_run;
+    bench_run (opts, &bc);
+
+    bc.group = "hashmap.iterate";
+    bc.run = map_iter_run;
+    bench_run (opts, &bc);
+
+    bc.group = "hashmap.remove";
+    bc.setup = map_remove_setup;
+    bc.run = map_remove_run;
+    bc.teardown = map_remove_teardown;
+    bench_run (opts, &bc);
+
+    z3_hashmap_drop_shallow (mb.map);
+  }
+
+  free ((void*)mb.keys);
+  free ((void*)mb.absent);
+}
+
+/* --- String --- */
+
+typedef struct {
+  nstr text;      // template, or the bytes appended by string.pushl
+  usize len;      // of `text`
+  Template tmpl;  // `text` compiled
+  usize sink;
+} StringBench;
+
+// Placeholders of the template below, values the size of real ones
+static bool string_filler (String* res, void* /*unused*/, cstr name, usize len) {
+  if (len == 3 && memcmp (name, "AWD", 3) == 0)
+    z3_pushlit (res, "/home/user/projects/anvil");
+  else
+    z3_pushlit (res, "9f2c41d7e0b86a3c5d14e7f08b29c6a1d3e5f704");
+  return true;
+}
+
+static void string_interp_run (void* ctx) {
+  StringBench* sb = ctx;
+  for (usize i = 0; i < BENCH_BATCH; i++) {
+    String s = z3_interpl ((cstr)sb->text, sb->len, string_filler, nullptr);
+    sb->sink += s.len;
+    z3_drops (&s);
+  }
+}
+
+static void string_render_run (void* ctx) {
+  StringBench* sb = ctx;
+  for (usize i = 0; i < BENCH_BATCH; i++) {
+    String s = z3_render (&sb->tmpl, string_filler, nullptr);
+    sb->sink += s.len;
+    z3_drops (&s);
+  }
+}
+
+static void string_pushl_run (void* ctx) {
+  StringBench* sb = ctx;
+  String s = z3_str (16);  // NOLINT (readability-magic-numbers)
+  for (usize n = 0; n < BENCH_APPEND; n += sb->len) z3_pushl (&s, sb->text, sb->len);
+  sb->sink += s.len;
+  z3_drops (&s);
+}
+
+static void bench_string (const BenchOptions* opts) {
+  StringBench sb = {.text = "-DGIT_HASH=#{arg:git_hash} -I#{AWD}/src/libs -o #{AWD}/build/x.o"};
+  sb.len = strlen (sb.text);
+  sb.tmpl = z3_template ((cstr)sb.text, sb.len);
+
+  BenchCase bc = {.name = "macro", .ops = BENCH_BATCH, .bytes = sb.len * BENCH_BATCH};
+  bc.ctx = &sb;
+  bc.group = "string.interp";
+  bc.run = string_interp_run;
+  bench_run (opts, &bc);
+
+  bc.group = "string.render";
+  bc.run = string_render_run;
+  bench_run (opts, &bc);
+  z3_drop_template (&sb.tmpl);
+
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  const usize sizes[] = {8, 64, 4096};
+  ScopedString chunk = z3_str (4096);  // NOLINT (readability-magic-numbers)
+  for (usize i = 0; i < 4096; i++) z3_pushc (&chunk, (c8)('a' + (i % 26)));  // NOLINT
+
+  for (usize i = 0; i < sizeof (sizes) / sizeof (*sizes); i++) {
+    ScopedString name = z3_str (16);  // NOLINT (readability-magic-numbers)
+    z3_pushf (&name, "%zuB", sizes[i]);
+    sb.text = (nstr)chunk.chr;
+    sb.len = sizes[i];
+
+    usize pushes = (BENCH_APPEND + sizes[i] - 1) / sizes[i];
+    BenchCase pc = {
+      .group = "string.pushl",
+      .name = (nstr)name.chr,
+      .ops = pushes,
+      .bytes = pushes * sizes[i],
+      .run = string_pushl_run,
+      .ctx = &sb,
+    };
+    bench_run (opts, &pc);
+  }
+}
+
+/* --- Vector --- */
+
+Z3_VEC_DEFINE (usize);
+
+typedef struct {
+  bool reserve;  // reserve every item before pushing
+  usize sink;
+} VectorBench;
+
+static void vec_push_run (void* ctx) {
+  VectorBench* vb = ctx;
+  Vector vec = z3_vec (usize);
+  if (vb->reserve) z3_vec_reserve (&vec, BENCH_PUSH_LEN);
+  for (usize i = 0; i < BENCH_PUSH_LEN; i++) z3_push (vec, i);
+  vb->sink += vec.len;
+  z3_drop_vec (vec);
+}
+
+static void vec_push_typed_run (void* ctx) {
+  VectorBench* vb = ctx;
+  Vector vec = z3_vec (usize);
+  if (vb->reserve) z3_vec_reserve (&vec, BENCH_PUSH_LEN);
+  for (usize i = 0; i < BENCH_PUSH_LEN; i++) z3_push_usize (&vec, i);
+  vb->sink += vec.len;
+  z3_drop_vec (vec);
+}
+
+static void vec_push_n_run (void* ctx) {
+  VectorBench* vb = ctx;
+  usize items[BENCH_PUSH_N];
+  for (usize i = 0; i < BENCH_PUSH_N; i++) items[i] = i;
+
+  Vector vec = z3_vec (usize);
+  for (usize i = 0; i < BENCH_PUSH_LEN; i += BENCH_PUSH_N) z3_push_n (vec, items, BENCH_PUSH_N);
+  vb->sink += vec.len;
+  z3_drop_vec (vec);
+}
+
+static void bench_vector (const BenchOptions* opts) {
+  VectorBench vb = {0};
+  BenchCase bc = {.name = "grow", .ops = BENCH_PUSH_LEN, .ctx = &vb};
+
+  bc.group = "vector.push";
+  bc.run = vec_push_run;
+  bench_run (opts, &bc);
+
+  bc.group = "vector.push_typed";
+  bc.run = vec_push_typed_run;
+  bench_run (opts, &bc);
+
+  bc.group = "vector.push_n";
+  bc.run = vec_push_n_run;
+  bench_run (opts, &bc);
+
+  vb.reserve = true;
+  bc.name = "reserved";
+  bc.group = "vector.push";
+  bc.run = vec_push_run;
+  bench_run (opts, &bc);
+
+  bc.group = "vector.push_typed";
+  bc.run = vec_push_typed_run;
+  bench_run (opts, &bc);
+}
+
+static void print_usage (nstr argv_zero) {
+  printf ("Usage: %s [options]\n\n", argv_zero);
+  printf ("Prints one JSON object per benchmark case\n\n");
+  printf ("Options:\n");
+  printf ("  -f, --filter <text>  Only cases with <text> in `group/case`\n");
+  printf ("  -q, --quick          Skip YAML documents over 1 MB\n");
+}
+
+int main (int argc, char** argv) {
+  nstr this_file = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+
+  BenchOptions opts = {0};
+  while (argc > 0) {
+    nstr arg = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+    if (strcmp (arg, "-f") == 0 || strcmp (arg, "--filter") == 0) {
+      opts.filter = argc > 0 ? popf (argc, argv) : nullptr;  // NOLINT (concurrency-mt-unsafe)
+    } else if (strcmp (arg, "-q") == 0 || strcmp (arg, "--quick") == 0) {
+      opts.quick = true;
+    } else if (strcmp (arg, "-h") == 0 || strcmp (arg, "--help") == 0) {
+      print_usage (this_file);
+      return 0;
+    } else {
+      errpfmt ("unknown option '%s'\n", arg);
+      print_usage (this_file);
+      return 1;
+    }
+  }
+
+  bench_yaml (&opts);
+  bench_hashmap (&opts);
+  bench_string (&opts);
+  bench_vector (&opts);
+  return 0;
+}
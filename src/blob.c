@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "blob.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <notrust.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+
+#define BLOB_ALIGN 8
+
+static_assert (sizeof (void*) == sizeof (u64), "blob pointers are stored as u64 offsets");
+
+// Anything that changes how the config is laid out, the maps carry z3_hash_key hashes too
+static u64 blob_layout (void) {
+  usize sizes[] = {
+    sizeof (AnvilConfig),      sizeof (WorkspaceConfig), sizeof (BuildTarget),
+    sizeof (TargetConfig),     sizeof (BuildConfig),     sizeof (ArgumentConfig),
+    sizeof (DependencyConfig), sizeof (HashMap),         sizeof (HashMapEntry),
+    sizeof (ProfileConfig),    Z3_HASH_KEY_VERSION,
+  };
+  return z3_hash_bytes (Z3_HASH_SEED, sizes, sizeof (sizes));
+}
+
+// FNV-1a of a whole file, false if it can't be read
+static bool hash_file (nstr path, u64* hash) {
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return false;
+
+  u8 buf[1 << 14];  // NOLINT (readability-magic-numbers)
+  *hash = Z3_HASH_SEED;
+  isize n = 0;
+  while ((n = read (fd, buf, sizeof (buf))) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    *hash = z3_hash_bytes (*hash, buf, (usize)n);
+  }
+  close (fd);
+  return n == 0;
+}
+
+typedef struct {
+  String data;    // the blob, offsets into it are stable
+  Vector relocs;  // u64, offsets of pointer slots
+} BlobWriter;
+
+// Zeroed, aligned room for `size` bytes, returns its offset
+static usize blob_reserve (BlobWriter* w, usize size) {
+  while (w->data.len % BLOB_ALIGN) z3_pushc (&w->data, 0);
+
+  usize at = w->data.len;
+  z3_reserve (&w->data, size);
+  memset (w->data.chr + at, 0, size);
+  w->data.len += size;
+  return at;
+}
+
+// Address of an offset, valid until the next blob_reserve
+[[clang::always_inline]]
+static void* blob_at (BlobWriter* w, usize at) {
+  return w->data.chr + at;
+}
+
+// Make the pointer slot at `at` point to `target`, offset 0 is nullptr
+static void blob_point (BlobWriter* w, usize at, usize target) {
+  if (target == 0) return;
+
+  u64 value = target;
+  memcpy (blob_at (w, at), &value, sizeof (value));
+  u64 slot = at;
+  z3_push (w->relocs, slot);
+}
+
+static usize blob_str (BlobWriter* w, cstr str) {
+  if (!str) return 0;
+
+  usize len = strlen ((nstr)str) + 1;
+  usize at = blob_reserve (w, len);
+  memcpy (blob_at (w, at), str, len);
+  return at;
+}
+
+// Array of `count` strings, returns its offset
+static usize blob_strs (BlobWriter* w, const u8* const* strs, usize count) {
+  if (!strs) return 0;
+
+  usize at = blob_reserve (w, sizeof (u8*) * count);
+  for (usize i = 0; i < count; i++) {
+    blob_point (w, at + sizeof (u8*) * i, blob_str (w, strs[i]));
+  }
+  return at;
+}
+
+typedef usize (*BlobValueFn) (BlobWriter* w, const void* val);
+
+static usize blob_str_value (BlobWriter* w, const void* val) {
+  return blob_str (w, val);
+}
+
+static usize blob_argument (BlobWriter* w, const void* val) {
+  const ArgumentConfig* acon = val;
+  usize at = blob_reserve (w, sizeof (ArgumentConfig));
+  ((ArgumentConfig*)blob_at (w, at))->command_len = acon->command_len;
+
+  blob_point (w, at + offsetof (ArgumentConfig, validation), blob_str (w, acon->validation));
+  usize policy = blob_str (w, acon->cache_policy);
+  blob_point (w, at + offsetof (ArgumentConfig, cache_policy), policy);
+  usize cmd = blob_strs (w, acon->command, acon->command_len);
+  blob_point (w, at + offsetof (ArgumentConfig, command), cmd);
+  return at;
+}
+
+// Profile flags, each profile gets its own array here
+static usize blob_flags (BlobWriter* w, const void* val) {
+  const ProfileConfig* prof = val;
+  usize at = blob_reserve (w, sizeof (ProfileConfig));
+  ((ProfileConfig*)blob_at (w, at))->flags_count = prof->flags_count;
+
+  usize items = blob_strs (w, prof->flags, prof->flags_count);
+  blob_point (w, at + offsetof (ProfileConfig, flags), items);
+  return at;
+}
+
+// The table is copied as is, z3_hashmap_get and the iterator work on it unchanged
+static usize blob_hashmap (BlobWriter* w, const HashMap* map, BlobValueFn value) {
+  if (!map) return 0;
+
+  usize at = blob_reserve (w, sizeof (HashMap));
+  *(HashMap*)blob_at (w, at) = (HashMap) {.max = map->max, .len = map->len};
+
+  usize dist = blob_reserve (w, map->max);
+  memcpy (blob_at (w, dist), map->dist, map->max);
+  blob_point (w, at + offsetof (HashMap, dist), dist);
+
+  usize beds = blob_reserve (w, map->max * sizeof (HashMapEntry));
+  blob_point (w, at + offsetof (HashMap, beds), beds);
+
+  for (usize i = 0; i < map->max; i++) {
+    const HashMapEntry* entry = &map->beds[i];
+    usize bed = beds + i * sizeof (HashMapEntry);
+    *(HashMapEntry*)blob_at (w, bed) = (HashMapEntry) {.hash = entry->hash, .len = entry->len};
+
+    blob_point (w, bed + offsetof (HashMapEntry, key), blob_str (w, (cstr)entry->key));
+    if (entry->val) blob_point (w, bed + offsetof (HashMapEntry, val), value (w, entry->val));
+  }
+  return at;
+}
+
+// Fill the target at `at`, its `for` points into the pool of triples copied at `triples`
+static void blob_target (
+  BlobWriter* w, usize at, const BuildTarget* tconf, const TargetConfig* tari, usize triples
+) {
+  ((TargetConfig*)blob_at (w, at))->target_count = tari->target_count;
+  ((TargetConfig*)blob_at (w, at))->unity = tari->unity;
+
+  blob_point (w, at + offsetof (TargetConfig, name), blob_str (w, tari->name));
+  blob_point (w, at + offsetof (TargetConfig, type), blob_str (w, tari->type));
+  blob_point (w, at + offsetof (TargetConfig, main), blob_str (w, tari->main));
+  blob_point (w, at + offsetof (TargetConfig, pch), blob_str (w, tari->pch));
+  blob_point (w, at + offsetof (TargetConfig, lto), blob_str (w, tari->lto));
+  if (tari->target && triples) {
+    usize first = sizeof (u8*) * (usize)(tari->target - tconf->triples);
+    blob_point (w, at + offsetof (TargetConfig, target), triples + first);
+  }
+  usize macros = blob_hashmap (w, tari->macros, blob_str_value);
+  blob_point (w, at + offsetof (TargetConfig, macros), macros);
+}
+
+static usize blob_targets (BlobWriter* w, const BuildTarget* tconf) {
+  if (!tconf) return 0;
+
+  usize at = blob_reserve (w, sizeof (BuildTarget));
+  ((BuildTarget*)blob_at (w, at))->count = tconf->count;
+  ((BuildTarget*)blob_at (w, at))->triples_count = tconf->triples_count;
+  if (!tconf->target) return at;
+
+  usize triples = blob_strs (w, tconf->triples, tconf->triples_count);
+  blob_point (w, at + offsetof (BuildTarget, triples), triples);
+  usize list = blob_reserve (w, sizeof (TargetConfig) * tconf->count);
+  blob_point (w, at + offsetof (BuildTarget, target), list);
+  for (usize i = 0; i < tconf->count; i++) {
+    blob_target (w, list + sizeof (TargetConfig) * i, tconf, &tconf->target[i], triples);
+  }
+  return at;
+}
+
+static usize blob_build (BlobWriter* w, const BuildConfig* bconf) {
+  if (!bconf) return 0;
+
+  usize at = blob_reserve (w, sizeof (BuildConfig));
+  ((BuildConfig*)blob_at (w, at))->jobs = bconf->jobs;
+  ((BuildConfig*)blob_at (w, at))->deps_count = bconf->deps_count;
+
+  blob_point (w, at + offsetof (BuildConfig, compiler), blob_str (w, bconf->compiler));
+  blob_point (w, at + offsetof (BuildConfig, cstd), blob_str (w, bconf->cstd));
+  blob_point (w, at + offsetof (BuildConfig, cache), blob_str (w, bconf->cache));
+
+  usize map = blob_hashmap (w, bconf->macros, blob_str_value);
+  blob_point (w, at + offsetof (BuildConfig, macros), map);
+  map = blob_hashmap (w, bconf->arguments, blob_argument);
+  blob_point (w, at + offsetof (BuildConfig, arguments), map);
+  map = blob_hashmap (w, bconf->hooks, blob_argument);
+  blob_point (w, at + offsetof (BuildConfig, hooks), map);
+
+  if (!bconf->deps) return at;
+
+  usize deps = blob_reserve (w, sizeof (DependencyConfig) * bconf->deps_count);
+  blob_point (w, at + offsetof (BuildConfig, deps), deps);
+  for (usize i = 0; i < bconf->deps_count; i++) {
+    const DependencyConfig* dep = &bconf->deps[i];
+    usize d = deps + sizeof (DependencyConfig) * i;
+    blob_point (w, d + offsetof (DependencyConfig, name), blob_str (w, dep->name));
+    blob_point (w, d + offsetof (DependencyConfig, type), blob_str (w, dep->type));
+    blob_point (w, d + offsetof (DependencyConfig, repo), blob_str (w, dep->repo));
+    blob_point (w, d + offsetof (DependencyConfig, path), blob_str (w, dep->path));
+    blob_point (w, d + offsetof (DependencyConfig, ref), blob_str (w, dep->ref));
+  }
+  return at;
+}
+
+bool config_blob_save (const AnvilConfig* conf, nstr manifest, nstr path) {
+  struct stat fst;
+  ConfigBlobHeader head = {.magic = CONFIG_BLOB_MAGIC, .version = CONFIG_BLOB_VERSION};
+  if (stat (manifest, &fst) != 0 || !hash_file (manifest, &head.hash)) return false;
+
+  head.layout = blob_layout ();
+  head.sec = fst.st_mtim.tv_sec;
+  head.nsec = fst.st_mtim.tv_nsec;
+  head.size = fst.st_size;
+
+  BlobWriter w = {.data = z3_str (1 << 12), .relocs = z3_vec (u64)};  // NOLINT
+  usize at = blob_reserve (&w, sizeof (ConfigBlobHeader));
+  usize root = blob_reserve (&w, sizeof (AnvilConfig));
+
+  blob_point (&w, root + offsetof (AnvilConfig, package), blob_str (&w, conf->package));
+  blob_point (&w, root + offsetof (AnvilConfig, version), blob_str (&w, conf->version));
+  blob_point (&w, root + offsetof (AnvilConfig, author), blob_str (&w, conf->author));
+  usize desc = blob_str (&w, conf->description);
+  blob_point (&w, root + offsetof (AnvilConfig, description), desc);
+
+  if (conf->workspace) {
+    usize ws = blob_reserve (&w, sizeof (WorkspaceConfig));
+    blob_point (&w, root + offsetof (AnvilConfig, workspace), ws);
+    usize libs = blob_str (&w, conf->workspace->libs);
+    blob_point (&w, ws + offsetof (WorkspaceConfig, libs), libs);
+    usize build = blob_str (&w, conf->workspace->build);
+    blob_point (&w, ws + offsetof (WorkspaceConfig, build), build);
+  }
+
+  blob_point (&w, root + offsetof (AnvilConfig, targets), blob_targets (&w, conf->targets));
+  blob_point (&w, root + offsetof (AnvilConfig, build), blob_build (&w, conf->build));
+  usize profiles = blob_hashmap (&w, conf->profiles, blob_flags);
+  blob_point (&w, root + offsetof (AnvilConfig, profiles), profiles);
+
+  head.relocs = blob_reserve (&w, w.relocs.len * sizeof (u64));
+  head.reloc_count = w.relocs.len;
+  if (w.relocs.len > 0) memcpy (blob_at (&w, head.relocs), w.relocs.val, w.relocs.len * 8);
+  head.total = w.data.len;
+  memcpy (blob_at (&w, at), &head, sizeof (head));
+
+  ScopedString dest = z3_strcpy ((cstr)path);
+  create_parent_dirs (&dest);
+  bool ok = z3_write_atomic (path, &w.data);
+
+  z3_drops (&w.data);
+  z3_drop_vec (w.relocs);
+  return ok;
+}
+
+// Whether the blob was saved for the manifest as it is now
+static bool blob_fresh (const ConfigBlobHeader* head, nstr manifest) {
+  struct stat fst;
+  if (stat (manifest, &fst) != 0) return false;
+  if (head->size != fst.st_size) return false;
+  if (head->sec == fst.st_mtim.tv_sec && head->nsec == fst.st_mtim.tv_nsec) return true;
+
+  // touched, or checked out again, but the same content
+  u64 hash = 0;
+  return hash_file (manifest, &hash) && hash == head->hash;
+}
+
+// Rebase every pointer of the blob, checking each one stays inside of it
+static bool blob_relocate (u8* base, usize size) {
+  // NOLINTNEXTLINE (cast-align) the mapping is page aligned
+  const ConfigBlobHeader* head = (const ConfigBlobHeader*)base;
+  if (head->relocs % BLOB_ALIGN || head->relocs > size) return false;
+  if (head->relocs < sizeof (ConfigBlobHeader) + sizeof (AnvilConfig)) return false;
+  if ((size - head->relocs) / sizeof (u64) < head->reloc_count) return false;
+
+  // NOLINTNEXTLINE (cast-align)
+  const u64* relocs = (const u64*)(base + head->relocs);
+  for (u64 i = 0; i < head->reloc_count; i++) {
+    u64 slot = relocs[i];
+    if (slot % BLOB_ALIGN || slot > head->relocs - sizeof (u64)) return false;
+
+    u64 target = 0;
+    memcpy (&target, base + slot, sizeof (target));
+    if (target == 0 || target >= head->relocs) return false;
+
+    u8* ptr = base + target;
+    memcpy (base + slot, &ptr, sizeof (ptr));
+  }
+  return true;
+}
+
+AnvilConfig* config_blob_load (ConfigBlob* blob, nstr manifest, nstr path) {
+  *blob = (ConfigBlob) {0};
+
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  ConfigBlobHeader head;
+  struct stat fst;
+  bool ok = fstat (fd, &fst) == 0 && (usize)fst.st_size > sizeof (head) &&
+            pread (fd, &head, sizeof (head), 0) == (isize)sizeof (head);
+
+  ok = ok && head.magic == CONFIG_BLOB_MAGIC && head.version == CONFIG_BLOB_VERSION &&
+       head.layout == blob_layout () && head.total == (u64)fst.st_size && head.relocs > 0;
+  if (!ok || !blob_fresh (&head, manifest)) {
+    close (fd);
+    return nullptr;
+  }
+
+  // private, the relocation writes never reach the file
+  void* data = mmap (nullptr, head.total, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED) return nullptr;
+
+  if (!blob_relocate (data, head.total)) {
+    munmap (data, head.total);
+    return nullptr;
+  }
+
+  blob->data = data;
+  blob->size = head.total;
+  // NOLINTNEXTLINE (cast-align) right after the header, aligned by the writer
+  return (AnvilConfig*)((u8*)data + sizeof (ConfigBlobHeader));
+}
+
+void config_blob_drop (ConfigBlob* blob) {
+  if (blob->data) munmap (blob->data, blob->size);
+  *blob = (ConfigBlob) {0};
+}
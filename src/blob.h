@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define CONFIG_BLOB_PATH    ".anvil/config.bin"
+#define CONFIG_BLOB_MAGIC   0x4746434E  // "NCFG"
+#define CONFIG_BLOB_VERSION 8
+
+// Layout: header, then the lowered AnvilConfig and everything it points to, with every
+// pointer stored as an offset from the start of the file, then the relocation table:
+// the offsets of those pointers, rebased in place once the file is mapped
+typedef struct {
+  u32 magic;
+  u32 version;
+  u64 layout;       // sizes of the config structs, a rebuilt anvil may differ
+  i64 sec;          // mtime of the manifest
+  i64 nsec;         // mtime of the manifest, nanoseconds
+  i64 size;         // size of the manifest
+  u64 hash;         // FNV-1a of the manifest, when only its stat changed
+  u64 relocs;       // offset of the relocation table
+  u64 reloc_count;  // entries of the relocation table
+  u64 total;        // size of the file
+} ConfigBlobHeader;
+
+// A config loaded from its blob, it points into the mapping and is read only
+typedef struct {
+  void* data;  // the mapping, nullptr if there is none
+  usize size;  // size of the mapping
+} ConfigBlob;
+
+// Map the blob at `path` if it was saved for `manifest` as it is now, nullptr otherwise
+AnvilConfig* config_blob_load (ConfigBlob* blob, nstr manifest, nstr path);
+
+// Save a lowered config for `manifest` at `path`, false if it can't be written
+bool config_blob_save (const AnvilConfig* conf, nstr manifest, nstr path);
+
+// Unmap a loaded blob, the config it returned is gone with it
+void config_blob_drop (ConfigBlob* blob);
@@ -4,15 +4,40 @@
 #include "build.h"
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <time.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
 #include <z3_string.h>
 #include <z3_toys.h>
 #include <z3_vector.h>
 
+#include "cache.h"
+#include "fetch.h"
+#include "hooks.h"
+#include "pkgconfig.h"
+#include "runner.h"
+
+static void drop_object (BuildObject* obj) {
+  z3_drops (&obj->src);
+  z3_drops (&obj->obj);
+  z3_drops (&obj->dep);
+}
+
+z3_vec_drop_fn (BuildObject, drop_object);
+
+static bool mtime_newer (const struct timespec* a, const struct timespec* b) {
+  return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
 bool target_needs_rebuild (String* target, Vector deps) {
   struct stat target_stat;
 
@@ -21,25 +46,17 @@ bool target_needs_rebuild (String* target, Vector deps) {
     return true;
   }
 
-  // target modification time
-  time_t target_mtime = target_stat.st_mtime;
-
   for (usize i = 0; i < deps.len; i++) {
     String* dep = z3_get (deps, i);
 
     struct stat dep_stat;
 
-    if (stat ((nstr)dep->chr, &dep_stat) != 0) {
-      die (
-        "Dependency '%s' for target '%s' doesn't exist or can't be accessed: %s\n",
-        dep->chr,
-        target->chr,
-        strerror (errno) // NOLINT(concurrency-mt-unsafe) we are dying- girl
-      );
-    }
+    // removed or renamed since the last build, the compiler will tell
+    // if it is still needed
+    if (stat ((nstr)dep->chr, &dep_stat) != 0) return true;
 
     // dependency newer than target
-    if (dep_stat.st_mtime > target_mtime) {
+    if (mtime_newer (&dep_stat.st_mtim, &target_stat.st_mtim)) {
       return true;
     }
   }
@@ -65,15 +82,1339 @@ void parse_dependencies (String* rule_str, Vector* deps) {
     while (i < rule_str->len && !isspace (rule_str->chr[i])) i++;
 
     usize len = i - start;
+    // `\` at the end of a line is a continuation, not a dependency
+    if (len == 1 && rule_str->chr[start] == '\\') continue;
+
     if (len > 0) {
       String s = z3_str (len);
 
       z3_pushl (&s, (nstr)&rule_str->chr[start], len);
-      z3_push (*deps, s);
+      z3_push_String (deps, s);
+    }
+  }
+}
+
+bool get_make_dependencies (String* depfile, Vector* deps) {
+  ScopedString rule = {0};
+  if (!z3_read_file ((nstr)depfile->chr, &rule)) return false;
+
+  parse_dependencies (&rule, deps);
+  return true;
+}
+
+void create_parent_dirs (String* path) {
+  for (usize i = 1; i < path->len; i++) {
+    if (path->chr[i] != '/') continue;
+
+    path->chr[i] = '\0';
+    // NOLINTNEXTLINE (readability-magic-numbers)
+    if (mkdir ((nstr)path->chr, 0755) != 0 && errno != EEXIST) {
+      // NOLINTNEXTLINE (concurrency-mt-unsafe)
+      die ("could not create directory '%s': %s\n", path->chr, strerror (errno));
+    }
+    path->chr[i] = '/';
+  }
+}
+
+static bool build_filler (String* res, void* ctx, cstr path, usize len) {
+  BuildContext* bctx = ctx;
+
+  if (len == 3 && memcmp (path, "AWD", 3) == 0) {
+    z3_pushl (res, (nstr)bctx->awd.chr, bctx->awd.len);
+    return true;
+  }
+
+  return bctx->hooks && hooks_eval (bctx->hooks, path, len, res);
+}
+
+String build_expand (BuildContext* ctx, cstr tmpl) {
+  return z3_interpl (tmpl, strlen ((nstr)tmpl), build_filler, ctx);
+}
+
+static void cmd_push (Vector* cmd, nstr arg) {
+  z3_push_String (cmd, z3_strcpy ((cstr)arg));
+}
+
+static void cmd_push_joined (Vector* cmd, nstr prefix, nstr value) {
+  usize plen = strlen (prefix);
+  usize vlen = strlen (value);
+
+  StringSlice parts[] = {{plen, (cstr)prefix}, {vlen, (cstr)value}};
+  String s = z3_str (plen + vlen + 1);
+  z3_pushv (&s, parts, sizeof (parts) / sizeof (*parts));
+  z3_push_String (cmd, s);
+}
+
+// A macro, its value compiled once for both collecting its hooks and expanding it
+typedef struct {
+  nstr key;
+  Template value;
+} MacroTemplate;
+
+// Compile every macro of `macros` into `out`
+static void compile_macros (Vector* out, HashMap* macros) {
+  if (!macros) return;
+
+  HashMapIterator it = z3_hashmap_iterator (macros);
+  while (z3_hashmap_iter_next (&it)) {
+    MacroTemplate m = {.key = it.key, .value = z3_template (it.val, strlen (it.val))};
+    z3_push (*out, m);
+  }
+}
+
+// `-DKEY=value` of every macro into `defines`, values are expanded here only
+static void expand_defines (BuildContext* ctx, const Vector* macros) {
+  for (usize i = 0; i < macros->len; i++) {
+    MacroTemplate* m = z3_get (*macros, i);
+    ScopedString value = z3_render (&m->value, build_filler, ctx);
+
+    usize klen = strlen (m->key);
+    StringSlice parts[] = {
+      {2, (cstr) "-D"}, {klen, (cstr)m->key}, {1, (cstr) "="}, {value.len, value.chr}
+    };
+    String s = z3_str (klen + value.len + 4);
+    z3_pushv (&s, parts, sizeof (parts) / sizeof (*parts));
+    z3_push_String (&ctx->defines, s);
+  }
+}
+
+static void cmd_push_compiler (BuildContext* ctx, Vector* cmd) {
+  cmd_push (cmd, ctx->compiler);
+  if (ctx->triple) cmd_push_joined (cmd, "--target=", ctx->triple);
+}
+
+static void cmd_push_profile (BuildContext* ctx, Vector* cmd) {
+  for (usize i = 0; i < ctx->profile->flags_count; i++) {
+    cmd_push (cmd, (nstr)ctx->profile->flags[i]);
+  }
+}
+
+// Instrumented or optimized for the profile, compiles and links alike
+static void cmd_push_pgo (BuildContext* ctx, Vector* cmd) {
+  if (ctx->pgo == PGO_GENERATE) {
+    // one file per binary, runs of it are merged into it as they exit
+    ScopedString raw = z3_strdup (&ctx->pgo_dir);
+    z3_pushlit (&raw, "/%m.profraw");
+    cmd_push_joined (cmd, "-fprofile-instr-generate=", (nstr)raw.chr);
+  } else if (ctx->pgo == PGO_USE) {
+    cmd_push_joined (cmd, "-fprofile-instr-use=", (nstr)ctx->profdata.chr);
+  }
+}
+
+// `mode` is `-c` to compile, `-E` to preprocess into `out`, dependencies go to `dep`
+static void generate_tu_command (
+  BuildContext* ctx, BuildObject* obj, nstr mode, nstr out, nstr dep, Vector* cmd
+) {
+  BuildConfig* bconf = ctx->config->build;
+  nstr cstd = (bconf && bconf->cstd) ? (nstr)bconf->cstd : DEFAULT_CSTD;
+
+  // NOLINTNEXTLINE (readability-magic-numbers) arguments besides the profile and macros
+  z3_vec_reserve (cmd, ctx->profile->flags_count + ctx->defines.len + ctx->dep_cflags.len + 15);
+  cmd_push_compiler (ctx, cmd);
+  cmd_push_joined (cmd, "-std=", cstd);
+  cmd_push_profile (ctx, cmd);
+  cmd_push_pgo (ctx, cmd);
+  if (ctx->thin_lto) cmd_push (cmd, "-flto=thin");
+  cmd_push_joined (cmd, "-I", (nstr)ctx->libs.chr);
+  for (usize i = 0; i < ctx->dep_cflags.len; i++) {
+    cmd_push (cmd, (nstr)((String*)z3_get (ctx->dep_cflags, i))->chr);
+  }
+
+  for (usize i = 0; i < ctx->defines.len; i++) {
+    cmd_push (cmd, (nstr)((String*)z3_get (ctx->defines, i))->chr);
+  }
+
+  if (obj->header) {
+    // built into `out` as a PCH, whatever `mode` is
+    cmd_push (cmd, "-x");
+    cmd_push (cmd, "c-header");
+  } else {
+    if (ctx->pch.len > 0) {
+      // preprocessed for the content cache, the header has to be in the output
+      bool pre = strcmp (mode, "-E") == 0;
+      cmd_push (cmd, pre ? "-include" : "-include-pch");
+      cmd_push (cmd, pre ? (nstr)ctx->pch.chr : (nstr)ctx->pch_out.chr);
+    }
+    cmd_push (cmd, mode);
+  }
+  cmd_push (cmd, (nstr)obj->src.chr);
+  cmd_push (cmd, "-o");
+  cmd_push (cmd, out);
+  cmd_push (cmd, "-MMD");
+  cmd_push (cmd, "-MF");
+  cmd_push (cmd, dep);
+}
+
+void generate_build_command (BuildContext* ctx, BuildObject* obj, Vector* cmd) {
+  generate_tu_command (ctx, obj, "-c", (nstr)obj->obj.chr, (nstr)obj->dep.chr, cmd);
+}
+
+static String preprocessed_path (BuildObject* obj) {
+  String path = z3_strdup (&obj->obj);
+  z3_pushlit (&path, ".i");
+  return path;
+}
+
+// Depfile of the scan of a unity build source, also the output its record is under
+static String scan_path (BuildObject* obj) {
+  String path = z3_strdup (&obj->obj);
+  z3_pushlit (&path, ".scan");
+  return path;
+}
+
+static void generate_scan_command (BuildContext* ctx, BuildObject* obj, Vector* cmd) {
+  ScopedString scan = scan_path (obj);
+  generate_tu_command (ctx, obj, "-E", "/dev/null", (nstr)scan.chr, cmd);
+}
+
+static void generate_link_command (BuildContext* ctx, Vector objects, Vector* cmd) {
+  z3_vec_reserve (cmd, ctx->profile->flags_count + objects.len + ctx->dep_libs.len + 8);
+  cmd_push_compiler (ctx, cmd);
+  cmd_push_profile (ctx, cmd);
+  cmd_push_pgo (ctx, cmd);
+  if (ctx->thin_lto) {
+    // the cache dir is an lld option, and lld keeps it pruned
+    cmd_push (cmd, "-flto=thin");
+    cmd_push (cmd, "-fuse-ld=lld");
+    cmd_push_joined (cmd, "-Wl,--thinlto-cache-dir=", (nstr)ctx->lto_cache.chr);
+  }
+
+  for (usize i = 0; i < objects.len; i++) {
+    BuildObject* obj = z3_get (objects, i);
+    cmd_push (cmd, (nstr)obj->obj.chr);
+  }
+  // after the objects, so the linker knows what they need from them
+  for (usize i = 0; i < ctx->dep_libs.len; i++) {
+    cmd_push (cmd, (nstr)((String*)z3_get (ctx->dep_libs, i))->chr);
+  }
+
+  cmd_push (cmd, "-o");
+  cmd_push (cmd, (nstr)ctx->bin.chr);
+}
+
+// nullptr terminated view of a Vector of String, strings are borrowed
+static nstr* command_argv (Vector* cmd) {
+  nstr* argv = (nstr*)malloc (sizeof (nstr) * (cmd->len + 1));
+  if (argv == nullptr) die ("Out of memory allocating %zu bytes", sizeof (nstr) * cmd->len);
+
+  for (usize i = 0; i < cmd->len; i++) {
+    argv[i] = (nstr)((String*)z3_get (*cmd, i))->chr;
+  }
+  argv[cmd->len] = nullptr;
+
+  return argv;
+}
+
+static bool path_has_prefix (nstr path, usize len, const String* prefix) {
+  return len > prefix->len && memcmp (path, prefix->chr, prefix->len) == 0 &&
+         path[prefix->len] == '/';
+}
+
+// path relative to the AWD when inside it, for output and object names
+static nstr relative_to_awd (BuildContext* ctx, const String* path) {
+  if (path_has_prefix ((nstr)path->chr, path->len, &ctx->awd))
+    return (nstr)path->chr + ctx->awd.len + 1;
+
+  nstr p = (nstr)path->chr;
+  while (*p == '/') p++;
+  return p;
+}
+
+// `parent` is the index + 1 of the object `src` was found from, 0 if none
+static void add_object (
+  BuildContext* ctx, Vector* objects, HashMap* seen, nstr src, usize parent
+) {
+  if (z3_hashmap_has (seen, src)) return;
+
+  BuildObject obj = {.src = z3_strcpy ((cstr)src), .parent = parent};
+  nstr rel = relative_to_awd (ctx, &obj.src);
+  usize rlen = strlen (rel);
+
+  // <obj_dir>/<rel>.o and .d, each sized once
+  StringSlice parts[] = {
+    {ctx->obj_dir.len, ctx->obj_dir.chr}, {1, (cstr) "/"}, {rlen, (cstr)rel}, {2, (cstr) ".o"}
+  };
+  usize olen = ctx->obj_dir.len + rlen + 3;
+
+  obj.obj = z3_str (olen + 1);
+  z3_pushv (&obj.obj, parts, sizeof (parts) / sizeof (*parts));
+  parts[3].chr = (cstr) ".d";
+  obj.dep = z3_str (olen + 1);
+  z3_pushv (&obj.dep, parts, sizeof (parts) / sizeof (*parts));
+
+  z3_push (*objects, obj);
+  // index + 1, values can't be null
+  z3_hashmap_put (seen, src, (void*)(uintptr_t)objects->len);
+}
+
+// `name.c` for a header, next to it, next to main or inside the libs folder
+static rstr find_header_source (BuildContext* ctx, nstr header, usize hlen) {
+  nstr base = strrchr (header, '/');
+  base = base ? base + 1 : header;
+  usize blen = strlen (base) - 1;  // without the `h`
+
+  nstr main_end = strrchr ((nstr)ctx->main.chr, '/');
+  usize main_dlen = (usize)(main_end - (nstr)ctx->main.chr);
+
+  ScopedString cand = z3_str (hlen + ctx->main.len + ctx->libs.len);
+  for (u8 attempt = 0; attempt < 3; attempt++) {
+    cand.len = 0;
+    switch (attempt) {
+      case 0:
+        z3_pushl (&cand, header, hlen - 1);
+        break;
+      case 1:
+        z3_pushl (&cand, (nstr)ctx->main.chr, main_dlen + 1);
+        z3_pushl (&cand, base, blen);
+        break;
+      default:
+        z3_pushl (&cand, (nstr)ctx->libs.chr, ctx->libs.len);
+        z3_pushc (&cand, '/');
+        z3_pushl (&cand, base, blen);
+        break;
+    }
+    z3_pushc (&cand, 'c');
+
+    rstr real = realpath ((nstr)cand.chr, nullptr);
+    if (real) return real;
+  }
+
+  return nullptr;
+}
+
+// Add to the build the source implementing `dep`, if it is a project header
+static void discover_source (
+  BuildContext* ctx, nstr from, nstr dep, Vector* objects, HashMap* seen
+) {
+  usize len = strlen (dep);
+  if (len < 3 || memcmp (dep + len - 2, ".h", 2) != 0) return;
+  // system and third party headers are not ours to compile
+  if (!path_has_prefix (dep, len, &ctx->awd)) return;
+
+  rstr src = find_header_source (ctx, dep, len);
+  if (!src) return;
+
+  if (strcmp (src, from) != 0) {
+    usize parent = (usize)(uintptr_t)z3_hashmap_get (seen, from);
+    add_object (ctx, objects, seen, src, parent);
+  }
+  free (src);
+}
+
+static u64 command_hash (Vector cmd) {
+  u64 h = Z3_HASH_SEED;
+  for (usize i = 0; i < cmd.len; i++) {
+    String* arg = z3_get (cmd, i);
+    // NUL included, so `-a -b` and `-a-b` differ
+    h = z3_hash_bytes (h, arg->chr, arg->len + 1);
+  }
+  return h;
+}
+
+// Whether an object is up to date, from its last record or, without one, its depfile
+static bool object_deps_fresh (BuildContext* ctx, BuildState* st, BuildObject* obj) {
+  if (obj->record) return state_record_fresh (st, obj->record, obj->cmd_hash);
+
+  // built before the state file existed
+  ScopedVector_ (String) deps = z3_vec (String);
+  if (!get_make_dependencies (&obj->dep, &deps)) return false;
+
+  // the manifest holds macros and flags, which are not in the depfile
+  String manifest = z3_strdup (&ctx->manifest);
+  z3_push (deps, manifest);
+
+  return !target_needs_rebuild (&obj->obj, deps);
+}
+
+// `<rel> (<triple>)`, the name of the spans of `path` in the trace
+static String span_name (BuildContext* ctx, const String* path) {
+  nstr rel = relative_to_awd (ctx, path);
+  String name = z3_str (strlen (rel) + 1);
+  z3_pushl (&name, rel, strlen (rel));
+  if (ctx->triple) z3_pushf (&name, " (%s)", ctx->triple);
+  return name;
+}
+
+static bool object_is_fresh (BuildContext* ctx, BuildState* st, BuildObject* obj) {
+  u64 started = trace_now (ctx->trace);
+  bool fresh = object_deps_fresh (ctx, st, obj);
+  if (ctx->trace) {
+    ScopedString name = span_name (ctx, &obj->src);
+    trace_span (ctx->trace, "deps", (nstr)name.chr, started);
+  }
+  return fresh;
+}
+
+// Cargo style status line, `what` tagged with the triple when cross compiling
+static void print_status (BuildContext* ctx, nstr verb, nstr what) {
+  if (ctx->triple)
+    printf ("%12s %s (%s)\n", verb, what, ctx->triple);
+  else
+    printf ("%12s %s\n", verb, what);
+}
+
+static void spawn_command (BuildContext* ctx, Runner* rn, Vector* cmd, usize tag) {
+  // its stderr is a pipe to the runner, not the terminal; after the command hash
+  if (ctx->color) cmd_push (cmd, "-fdiagnostics-color=always");
+  nstr* argv = command_argv (cmd);
+  fflush (stdout);  // NOLINT (cert-err33-c)
+  runner_spawn (rn, argv, tag, nullptr);
+  free ((void*)argv);
+}
+
+static TargetConfig* find_target (BuildTarget* targets, nstr selected) {
+  if (!selected) return &targets->target[0];
+
+  for (usize i = 0; i < targets->count; i++) {
+    TargetConfig* tgt = &targets->target[i];
+    if (tgt->name && strcmp ((nstr)tgt->name, selected) == 0) return tgt;
+  }
+
+  rstr end = nullptr;
+  usize idx = strtoul (selected, &end, 10);  // NOLINT (readability-magic-numbers)
+  if (end != selected && *end == '\0' && idx < targets->count) return &targets->target[idx];
+
+  die ("target '%s' is not defined\n", selected);
+}
+
+// <build>[/<triple>]/<profile> and the object folder and binary inside it
+static void context_set_outputs (BuildContext* ctx) {
+  nstr name = (nstr)ctx->target->name;
+
+  ctx->out_dir = z3_strdup (&ctx->build_dir);
+  if (ctx->triple) {
+    z3_pushc (&ctx->out_dir, '/');
+    z3_pushl (&ctx->out_dir, ctx->triple, strlen (ctx->triple));
+  }
+  z3_pushc (&ctx->out_dir, '/');
+  z3_pushl (&ctx->out_dir, ctx->profile_name, strlen (ctx->profile_name));
+
+  ctx->obj_dir = z3_strdup (&ctx->out_dir);
+  z3_pushlit (&ctx->obj_dir, "/.obj/");
+  z3_pushl (&ctx->obj_dir, name, strlen (name));
+
+  ctx->bin = z3_strdup (&ctx->out_dir);
+  z3_pushc (&ctx->bin, '/');
+  z3_pushl (&ctx->bin, name, strlen (name));
+
+  if (ctx->pgo != PGO_NONE) {
+    ctx->pgo_dir = z3_strdup (&ctx->out_dir);
+    z3_pushc (&ctx->pgo_dir, '/');
+    z3_pushlit (&ctx->pgo_dir, PGO_DIR_NAME);
+    z3_pushc (&ctx->pgo_dir, '/');
+    z3_pushl (&ctx->pgo_dir, name, strlen (name));
+    ctx->profdata = z3_strdup (&ctx->pgo_dir);
+    z3_pushlit (&ctx->profdata, ".profdata");
+  }
+
+  if (ctx->pch.len > 0) {
+    ctx->pch_out = z3_strdup (&ctx->obj_dir);
+    z3_pushc (&ctx->pch_out, '/');
+    nstr rel = relative_to_awd (ctx, &ctx->pch);
+    z3_pushl (&ctx->pch_out, rel, strlen (rel));
+    z3_pushlit (&ctx->pch_out, ".pch");
+  }
+}
+
+// Whether the executable name of `compiler` contains `name`, `clang-18` is clang
+static bool compiler_named (nstr compiler, nstr name) {
+  nstr base = strrchr (compiler, '/');
+  base = base ? base + 1 : compiler;
+  return strstr (base, name) != nullptr;
+}
+
+// Ask for colored diagnostics only when they reach a terminal, `NO_COLOR` is unset and the
+// compiler is one that takes -fdiagnostics-color (clang or gcc, by its name)
+static bool compiler_color (nstr compiler) {
+  nstr no_color = getenv ("NO_COLOR");  // NOLINT (concurrency-mt-unsafe)
+  if ((no_color && *no_color) || isatty (STDERR_FILENO) != 1) return false;
+  return compiler_named (compiler, "clang") || compiler_named (compiler, "gcc");
+}
+
+void build_context_init (BuildContext* ctx, AnvilConfig* config, const BuildOptions* opts) {
+  *ctx = (BuildContext) {0};
+  ctx->config = config;
+
+  if (!config->targets || config->targets->count == 0) die ("no targets defined\n");
+  ctx->target = find_target (config->targets, opts->target);
+
+  TargetConfig* tgt = ctx->target;
+  if (!tgt->name || !tgt->main) die ("target is missing `name` or `main`\n");
+  if (tgt->type && strcmp ((nstr)tgt->type, "exec") != 0)
+    die ("target '%s': type '%s' is not supported\n", tgt->name, tgt->type);
+
+  ctx->profile_name = opts->profile ? opts->profile : DEFAULT_PROFILE;
+  ctx->profile =
+    config->profiles ? z3_hashmap_get (config->profiles, ctx->profile_name) : nullptr;
+  if (!ctx->profile) die ("profile '%s' is not defined\n", ctx->profile_name);
+
+  BuildConfig* bconf = config->build;
+  ctx->compiler = (bconf && bconf->compiler) ? (nstr)bconf->compiler : DEFAULT_COMPILER;
+  ctx->jobs = bconf ? bconf->jobs : 0;
+  ctx->rebuild = opts->rebuild;
+  ctx->pgo = opts->pgo;
+  ctx->trace = opts->trace;
+  ctx->js = opts->js;
+  ctx->unity = tgt->unity;
+  if (tgt->lto && strcmp ((nstr)tgt->lto, "thin") != 0)
+    die ("target '%s': lto '%s' is not supported, only 'thin'\n", tgt->name, tgt->lto);
+  ctx->thin_lto = tgt->lto != nullptr;
+  ctx->color = compiler_color (ctx->compiler);
+  // gcc rejects it, its compiles are traced by wall clock only
+  ctx->time_trace = ctx->trace && compiler_named (ctx->compiler, "clang");
+
+  rstr cwd = getcwd (nullptr, 0);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (!cwd) die ("could not get working directory: %s\n", strerror (errno));
+  ctx->awd = z3_strcpy ((cstr)cwd);
+  free (cwd);
+
+  WorkspaceConfig* ws = config->workspace;
+  ctx->libs = build_expand (ctx, (ws && ws->libs) ? ws->libs : (cstr)DEFAULT_LIBS_PATH);
+  ctx->build_dir =
+    build_expand (ctx, (ws && ws->build) ? ws->build : (cstr)DEFAULT_TARGET_PATH);
+
+  ScopedString main = build_expand (ctx, tgt->main);
+  rstr real = realpath ((nstr)main.chr, nullptr);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (!real) die ("target '%s': main '%s': %s\n", tgt->name, main.chr, strerror (errno));
+  ctx->main = z3_strcpy ((cstr)real);
+  free (real);
+
+  if (tgt->pch) {
+    ScopedString pch = build_expand (ctx, tgt->pch);
+    real = realpath ((nstr)pch.chr, nullptr);
+    // NOLINTNEXTLINE (concurrency-mt-unsafe)
+    if (!real) die ("target '%s': pch '%s': %s\n", tgt->name, pch.chr, strerror (errno));
+    ctx->pch = z3_strcpy ((cstr)real);
+    free (real);
+  }
+  context_set_outputs (ctx);
+
+  ctx->manifest = z3_strdup (&ctx->awd);
+  z3_pushc (&ctx->manifest, '/');
+  z3_pushlit (&ctx->manifest, ANVIL_MANIFEST);
+
+  ctx->content_cache = bconf && bconf->cache && strcmp ((nstr)bconf->cache, "content") == 0;
+  ctx->cache_dir = z3_strdup (&ctx->build_dir);
+  z3_pushc (&ctx->cache_dir, '/');
+  z3_pushlit (&ctx->cache_dir, CACHE_DIR_NAME);
+  if (ctx->thin_lto) {
+    ctx->lto_cache = z3_strdup (&ctx->build_dir);
+    z3_pushc (&ctx->lto_cache, '/');
+    z3_pushlit (&ctx->lto_cache, THINLTO_DIR_NAME);
+  }
+
+  // downloaded into workspace.libs before anything can include them
+  ctx->dep_cflags = z3_vec (String);
+  ctx->dep_libs = z3_vec (String);
+  if (!fetch_deps (bconf, &ctx->libs, ctx->trace, &ctx->dep_cflags))
+    die ("target '%s': dependencies could not be fetched\n", tgt->name);
+  if (!pkgconfig_resolve (
+        bconf, &ctx->build_dir, ctx->rebuild, ctx->trace, &ctx->dep_cflags, &ctx->dep_libs
+      ))
+    die ("target '%s': pkg-config dependencies could not be resolved\n", tgt->name);
+
+  // the same for every triple, expanded once
+  Hooks hooks;
+  hooks_init (&hooks, config, &ctx->awd, &ctx->build_dir, opts->rebuild);
+  hooks.trace = ctx->trace;
+  ctx->hooks = &hooks;
+
+  ScopedVector macros = z3_vec (MacroTemplate);
+  if (bconf) compile_macros (&macros, bconf->macros);
+  compile_macros (&macros, tgt->macros);
+
+  // every argument and hook that has to run does so at once, before expanding
+  for (usize i = 0; i < macros.len; i++)
+    hooks_collect (&hooks, &((MacroTemplate*)z3_get (macros, i))->value);
+  hooks_run_pending (&hooks);
+
+  ctx->defines = z3_vec (String);
+  expand_defines (ctx, &macros);
+  for (usize i = 0; i < macros.len; i++)
+    z3_drop_template (&((MacroTemplate*)z3_get (macros, i))->value);
+
+  ctx->hooks = nullptr;
+  hooks_drop (&hooks);
+}
+
+void build_context_for_triple (BuildContext* ctx, const BuildContext* base, nstr triple) {
+  *ctx = *base;
+  ctx->triple = triple;
+
+  ctx->awd = z3_strdup (&base->awd);
+  ctx->libs = z3_strdup (&base->libs);
+  ctx->main = z3_strdup (&base->main);
+  ctx->pch = z3_strdup (&base->pch);
+  ctx->manifest = z3_strdup (&base->manifest);
+  ctx->build_dir = z3_strdup (&base->build_dir);
+  ctx->cache_dir = z3_strdup (&base->cache_dir);
+  ctx->lto_cache = z3_strdup (&base->lto_cache);
+
+  ctx->defines = z3_vec (String);
+  z3_vec_init_capacity (ctx->defines, base->defines.len);
+  for (usize i = 0; i < base->defines.len; i++)
+    z3_push_String (&ctx->defines, z3_strdup (z3_at_String (&base->defines, i)));
+
+  ctx->dep_cflags = z3_vec (String);
+  z3_vec_init_capacity (ctx->dep_cflags, base->dep_cflags.len);
+  for (usize i = 0; i < base->dep_cflags.len; i++)
+    z3_push_String (&ctx->dep_cflags, z3_strdup (z3_at_String (&base->dep_cflags, i)));
+
+  ctx->dep_libs = z3_vec (String);
+  z3_vec_init_capacity (ctx->dep_libs, base->dep_libs.len);
+  for (usize i = 0; i < base->dep_libs.len; i++)
+    z3_push_String (&ctx->dep_libs, z3_strdup (z3_at_String (&base->dep_libs, i)));
+
+  context_set_outputs (ctx);
+}
+
+nstr build_host_triple (const BuildContext* ctx) {
+  TargetConfig* tgt = ctx->target;
+  if (tgt->target_count == 0) return nullptr;
+
+  struct utsname host;
+  usize mlen = 0;
+  if (uname (&host) == 0) mlen = strlen (host.machine);
+
+  nstr first = nullptr;
+  for (usize i = 0; i < tgt->target_count; i++) {
+    nstr triple = (nstr)tgt->target[i];
+    if (!triple) continue;
+    if (!first) first = triple;
+
+    // the architecture is everything up to the first `-`
+    if (mlen > 0 && strncmp (triple, host.machine, mlen) == 0 && triple[mlen] == '-')
+      return triple;
+  }
+
+  return first;
+}
+
+BuildContext* build_units_init (BuildContext* base, nstr triple, usize* count) {
+  TargetConfig* tgt = base->target;
+  usize n = (triple || tgt->target_count == 0) ? 1 : tgt->target_count;
+
+  BuildContext* units = malloc (sizeof (BuildContext) * n);
+  if (units == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (BuildContext) * n);
+
+  *count = 0;
+  if (triple || tgt->target_count == 0) {
+    build_context_for_triple (&units[(*count)++], base, triple);
+    return units;
+  }
+
+  for (usize i = 0; i < tgt->target_count; i++) {
+    if (!tgt->target[i]) continue;
+    build_context_for_triple (&units[(*count)++], base, (nstr)tgt->target[i]);
+  }
+  if (*count == 0) die ("target '%s': `for` has no triples\n", tgt->name);
+
+  return units;
+}
+
+void build_units_drop (BuildContext* units, usize count) {
+  for (usize i = 0; i < count; i++) build_context_drop (&units[i]);
+  free (units);
+}
+
+void build_context_drop (BuildContext* ctx) {
+  z3_drops (&ctx->awd);
+  z3_drops (&ctx->libs);
+  z3_drops (&ctx->main);
+  z3_drops (&ctx->pch);
+  z3_drops (&ctx->manifest);
+  z3_drops (&ctx->out_dir);
+  z3_drops (&ctx->obj_dir);
+  z3_drops (&ctx->bin);
+  z3_drops (&ctx->pch_out);
+  z3_drops (&ctx->build_dir);
+  z3_drops (&ctx->cache_dir);
+  z3_drops (&ctx->pgo_dir);
+  z3_drops (&ctx->profdata);
+  z3_drops (&ctx->lto_cache);
+  z3_vec_drop_String (&ctx->defines);
+  z3_vec_drop_String (&ctx->dep_cflags);
+  z3_vec_drop_String (&ctx->dep_libs);
+}
+
+// Scheduling state of one triple, every unit of a build shares the job pool
+typedef struct {
+  BuildContext* ctx;
+  BuildState state;   // loaded from the last build
+  StateWriter next;   // written for the next build
+  String state_path;  // <obj_dir>/STATE_FILE_NAME
+  Vector objects;     // BuildObject, every source found
+  Vector bundles;     // BuildObject, what a unity build compiles once its sources are known
+  Vector* compile;    // what gets compiled and linked, `objects` or `bundles`
+  BuildObject pch;    // built before any object, STAGE_DONE from the start without one
+  HashMap* seen;      // source path -> index + 1 in `objects`
+  Vector misses;      // usize, missed the content cache, waiting for a slot to compile
+  usize next_obj;     // first object not looked at yet
+  usize running;      // processes in flight for this unit
+  usize compiled;     // objects compiled or fetched from the cache
+  u64 link_hash;      // hash of the link command, while linking
+  u64 link_started;   // trace_now () when the link was spawned
+  u32 link_lane;      // trace lane of the link
+  usize link_span;    // index + 1 of the link in the trace, 0 if none
+  bool linking;       // the link is the process in flight
+  bool planned;       // the sources of a unity build are grouped into `bundles`
+  bool done;          // linked, or the binary was fresh
+} BuildGraph;
+
+// Record an object that is now up to date and discover sources from its dependencies,
+// `built` if it was compiled (or fetched from the cache) by this build
+static void object_finished (BuildGraph* g, BuildObject* obj, bool built) {
+  BuildContext* ctx = g->ctx;
+  // the depfile of a scan is all it writes, and its record is under it
+  bool scan = obj->stage == STAGE_SCAN;
+  obj->stage = STAGE_DONE;
+  // `objects` may grow, the strings outlive the element
+  ScopedString src = z3_strdup (&obj->src);
+  ScopedString scan_out = scan ? scan_path (obj) : (String) {0};
+  String* out = scan ? &scan_out : &obj->obj;
+
+  if (!built && obj->record) {
+    const StateRecord* rec = obj->record;
+    state_writer_keep (&g->next, &g->state, rec);
+    for (u32 i = 0; i < rec->dep_count; i++) {
+      nstr dep = state_dep_path (&g->state, rec, i);
+      discover_source (ctx, (nstr)src.chr, dep, &g->objects, g->seen);
     }
+    return;
+  }
+
+  ScopedVector_ (String) deps = z3_vec (String);
+  if (!get_make_dependencies (scan ? out : &obj->dep, &deps)) return;
+  // rebuilding the PCH makes every object compiled with it stale
+  if (!obj->header && !scan && ctx->pch.len > 0)
+    z3_push_String (&deps, z3_strdup (&ctx->pch_out));
+  // and so does a new profile, the objects optimized for the old one
+  if (!scan && ctx->pgo == PGO_USE) z3_push_String (&deps, z3_strdup (&ctx->profdata));
+
+  state_writer_add (&g->next, &g->state, (nstr)out->chr, obj->cmd_hash, deps);
+  for (usize i = 0; i < deps.len; i++) {
+    nstr dep = (nstr)((String*)z3_get (deps, i))->chr;
+    discover_source (ctx, (nstr)src.chr, dep, &g->objects, g->seen);
   }
 }
 
-// void get_make_dependencies (BuildConfig *config, Vector *deps) {
-//   //
-// }
+// Preprocess step of the content cache finished, true on a hit
+static bool object_cache_lookup (BuildContext* ctx, BuildObject* obj) {
+  ScopedString pre = preprocessed_path (obj);
+  ScopedVector_ (String) cmd = z3_vec (String);
+  generate_build_command (ctx, obj, &cmd);
+
+  // the command only names the profile, what is in it decides the object as well
+  u64 tool_id = ctx->compiler_id;
+  if (ctx->pgo == PGO_USE) tool_id = z3_hash_bytes (tool_id, &ctx->profdata_id, sizeof (u64));
+
+  obj->keyed = cache_object_key (&pre, cmd, tool_id, &obj->key);
+  unlink ((nstr)pre.chr);
+
+  // unhashable means uncacheable, compile it anyway
+  if (!obj->keyed) return false;
+  return cache_fetch (&ctx->cache_dir, obj->key, &obj->obj);
+}
+
+// Trace the process about to be spawned for `obj`, compiles with clang also get its own trace
+static void object_trace_start (BuildContext* ctx, BuildObject* obj, Vector* cmd) {
+  if (!ctx->trace) return;
+  obj->started = trace_now (ctx->trace);
+  obj->lane = trace_lane (ctx->trace);
+  // not in generate_build_command, the command hash stays the same with --timings
+  if (ctx->time_trace && obj->stage == STAGE_COMPILE) cmd_push (cmd, "-ftime-trace");
+}
+
+// Record the process of `obj` that just exited
+static void object_trace_end (BuildContext* ctx, BuildObject* obj) {
+  if (!ctx->trace) return;
+  ScopedString name = span_name (ctx, &obj->src);
+  nstr cat = obj->stage == STAGE_COMPILE ? "compile" : "preprocess";
+  obj->span = trace_proc (ctx->trace, cat, (nstr)name.chr, obj->started, obj->lane);
+  if (!ctx->time_trace || obj->stage != STAGE_COMPILE) return;
+
+  // clang writes it next to the output, `.json` instead of its last extension
+  ScopedString json = z3_strdup (&obj->obj);
+  nstr dot = strrchr ((nstr)json.chr, '.');
+  if (dot) json.len = (usize)(dot - (nstr)json.chr);
+  z3_pushlit (&json, ".json");
+  trace_clang (ctx->trace, obj->span, (nstr)json.chr);
+}
+
+// Record the chain the link of a unit waited on: the PCH, then the objects each one was
+// found from, down to the last one to finish, then the link
+static void unit_trace_path (BuildGraph* g) {
+  BuildContext* ctx = g->ctx;
+  if (!ctx->trace) return;
+
+  BuildObject* last = nullptr;
+  u64 last_end = 0;
+  for (usize i = 0; i < g->compile->len; i++) {
+    BuildObject* obj = z3_get (*g->compile, i);
+    TraceSpan* sp = trace_get (ctx->trace, obj->span);
+    if (sp && sp->start + sp->dur >= last_end) {
+      last = obj;
+      last_end = sp->start + sp->dur;
+    }
+  }
+
+  // gathered last to first
+  ScopedVector chain = z3_vec (usize);
+  if (g->link_span) z3_push (chain, g->link_span);
+  for (BuildObject* obj = last; obj;) {
+    if (obj->span) z3_push (chain, obj->span);
+    obj = obj->parent ? z3_get (*g->compile, obj->parent - 1) : nullptr;
+  }
+  if (g->pch.span) z3_push (chain, g->pch.span);
+  if (chain.len == 0) return;
+
+  for (usize i = 0, j = chain.len - 1; i < j; i++, j--) {
+    usize tmp = *(usize*)z3_get (chain, i);
+    *(usize*)z3_get (chain, i) = *(usize*)z3_get (chain, j);
+    *(usize*)z3_get (chain, j) = tmp;
+  }
+
+  ScopedString label = span_name (ctx, &ctx->bin);
+  trace_path (ctx->trace, (nstr)label.chr, &chain);
+}
+
+static void object_spawn (BuildContext* ctx, Runner* rn, BuildObject* obj, usize tag) {
+  ScopedVector_ (String) cmd = z3_vec (String);
+
+  if (obj->stage == STAGE_PENDING && ctx->content_cache && !ctx->rebuild) {
+    obj->stage = STAGE_PREPROCESS;
+    ScopedString pre = preprocessed_path (obj);
+    generate_tu_command (ctx, obj, "-E", (nstr)pre.chr, (nstr)obj->dep.chr, &cmd);
+  } else {
+    obj->stage = STAGE_COMPILE;
+    generate_build_command (ctx, obj, &cmd);
+    print_status (ctx, "Compiling", relative_to_awd (ctx, &obj->src));
+  }
+
+  object_trace_start (ctx, obj, &cmd);
+  spawn_command (ctx, rn, &cmd, tag);
+}
+
+static void object_prepare (BuildGraph* g, BuildObject* obj) {
+  ScopedVector_ (String) cmd = z3_vec (String);
+  generate_build_command (g->ctx, obj, &cmd);
+  obj->cmd_hash = command_hash (cmd);
+  obj->record = state_find (&g->state, (nstr)obj->obj.chr);
+}
+
+// Spawn the next dependency scan of a unity build, false if none has to run now.
+// Sources are still found from the dependencies, only nothing is compiled yet
+static bool unit_scan_next (BuildGraph* g, Runner* rn, usize unit, usize count) {
+  BuildContext* ctx = g->ctx;
+  while (g->next_obj < g->objects.len) {
+    usize idx = g->next_obj++;
+    BuildObject* obj = z3_get (g->objects, idx);
+    obj->stage = STAGE_SCAN;
+
+    ScopedString scan = scan_path (obj);
+    ScopedVector_ (String) cmd = z3_vec (String);
+    generate_scan_command (ctx, obj, &cmd);
+    obj->cmd_hash = command_hash (cmd);
+    obj->record = state_find (&g->state, (nstr)scan.chr);
+
+    if (!ctx->rebuild && obj->record) {
+      if (state_record_fresh (&g->state, obj->record, obj->cmd_hash)) {
+        object_finished (g, obj, false);
+        continue;
+      }
+      // edited since the last build, the edit loop is likely on it
+      obj->hot = state_dep_changed (&g->state, obj->record, (nstr)obj->src.chr);
+    }
+
+    create_parent_dirs (&scan);
+    object_trace_start (ctx, obj, &cmd);
+    spawn_command (ctx, rn, &cmd, idx * count + unit);
+    return true;
+  }
+  return false;
+}
+
+// A source of a unity build and the bundle it goes into
+typedef struct {
+  usize bundle;
+  nstr src;
+} UnityMember;
+
+static int unity_member_order (const void* a, const void* b) {
+  const UnityMember* x = a;
+  const UnityMember* y = b;
+  if (x->bundle != y->bundle) return x->bundle < y->bundle ? -1 : 1;
+  return strcmp (x->src, y->src);
+}
+
+// Write `data` to `path` unless it already holds it, so its mtime only moves on changes
+static bool write_if_changed (String* path, const String* data) {
+  ScopedString old = z3_str (data->len + 1);
+  if (z3_read_file ((nstr)path->chr, &old) && old.len == data->len &&
+      memcmp (old.chr, data->chr, data->len) == 0)
+    return true;
+
+  create_parent_dirs (path);
+  return z3_write_atomic ((nstr)path->chr, data);
+}
+
+// Whether source `i` of a unity build is compiled on its own: main, which usually has
+// the `*_IMPL` of single-header libraries, and hot sources. A source stays hot while its
+// own object is in the state, `--rebuild` bundles them all again
+static bool unity_alone (BuildGraph* g, usize i) {
+  if (i == 0) return true;
+  if (g->ctx->rebuild) return false;
+
+  BuildObject* obj = z3_get (g->objects, i);
+  return obj->hot || state_find (&g->state, (nstr)obj->obj.chr) != nullptr;
+}
+
+static void unity_push_alone (BuildGraph* g, const BuildObject* src) {
+  BuildObject obj = {.src = z3_strdup (&src->src), .obj = z3_strdup (&src->obj)};
+  obj.dep = z3_strdup (&src->dep);
+  z3_push (g->bundles, obj);
+}
+
+// Group the scanned sources of a unity build into its bundles, by a hash of their path
+// so a new source leaves the others where they were
+static void unit_plan (BuildGraph* g) {
+  BuildContext* ctx = g->ctx;
+  g->planned = true;
+  g->compile = &g->bundles;
+  g->next_obj = 0;
+
+  ScopedVector members = z3_vec (UnityMember);
+  z3_vec_init_capacity (members, g->objects.len);
+  for (usize i = 0; i < g->objects.len; i++) {
+    BuildObject* obj = z3_get (g->objects, i);
+    if (unity_alone (g, i)) continue;
+
+    nstr rel = relative_to_awd (ctx, &obj->src);
+    // z3_hash_bytes is stable, a new anvil does not reshuffle every bundle
+    u64 h = z3_hash_bytes (Z3_HASH_SEED, rel, strlen (rel));
+    UnityMember m = {.bundle = h % ctx->unity};
+    m.src = (nstr)obj->src.chr;
+    z3_push (members, m);
+  }
+  qsort (members.val, members.len, sizeof (UnityMember), unity_member_order);
+
+  // bundles first, the longest compiles start before the small ones
+  ScopedString text = z3_str (256);  // NOLINT (readability-magic-numbers)
+  for (usize i = 0; i < members.len;) {
+    UnityMember* first = z3_get (members, i);
+    text.len = 0;
+    z3_pushlit (&text, "// unity bundle generated by anvil, edits are overwritten\n");
+    for (; i < members.len; i++) {
+      UnityMember* m = z3_get (members, i);
+      if (m->bundle != first->bundle) break;
+      z3_pushf (&text, "#include \"%s\"\n", m->src);
+    }
+
+    BuildObject bundle = {.src = z3_strdup (&ctx->obj_dir)};
+    z3_pushf (&bundle.src, "/unity/%zu.c", first->bundle);
+    bundle.obj = z3_strdup (&bundle.src);
+    bundle.obj.chr[--bundle.obj.len] = 0;  // without the `c`
+    bundle.dep = z3_strdup (&bundle.obj);
+    z3_pushc (&bundle.obj, 'o');
+    z3_pushc (&bundle.dep, 'd');
+
+    if (!write_if_changed (&bundle.src, &text))
+      // NOLINTNEXTLINE (concurrency-mt-unsafe)
+      die ("could not write '%s': %s\n", bundle.src.chr, strerror (errno));
+    state_forget (&g->state, (nstr)bundle.src.chr);
+    z3_push (g->bundles, bundle);
+  }
+
+  for (usize i = 0; i < g->objects.len; i++) {
+    if (unity_alone (g, i)) unity_push_alone (g, z3_get (g->objects, i));
+  }
+}
+
+// Raw profiles (String) the runs of the instrumented binary left in `pgo_dir`, true if
+// one is newer than `profdata` (or there is no `profdata` yet)
+static bool pgo_raw_profiles (BuildContext* ctx, Vector* raws) {
+  struct stat st = {0};
+  bool merged = stat ((nstr)ctx->profdata.chr, &st) == 0;
+  struct timespec then = st.st_mtim;
+  bool newer = !merged;
+
+  DIR* d = opendir ((nstr)ctx->pgo_dir.chr);
+  if (!d) return newer;
+
+  usize ext = strlen (".profraw");
+  struct dirent* ent = nullptr;
+  while ((ent = readdir (d))) {  // NOLINT (concurrency-mt-unsafe)
+    usize len = strlen (ent->d_name);
+    if (len <= ext || strcmp (ent->d_name + len - ext, ".profraw") != 0) continue;
+
+    String path = z3_strdup (&ctx->pgo_dir);
+    z3_pushc (&path, '/');
+    z3_pushl (&path, ent->d_name, len);
+    if (merged && stat ((nstr)path.chr, &st) == 0) {
+      struct timespec at = st.st_mtim;
+      if (at.tv_sec > then.tv_sec || (at.tv_sec == then.tv_sec && at.tv_nsec > then.tv_nsec))
+        newer = true;
+    }
+    z3_push_String (raws, path);
+  }
+  closedir (d);
+  return newer;
+}
+
+// `--pgo use`: merge the raw profiles into `profdata` when a run left a newer one, every
+// object depends on it so they are compiled again only then
+static void pgo_merge (BuildContext* ctx) {
+  ScopedVector_ (String) raws = z3_vec (String);
+  bool newer = pgo_raw_profiles (ctx, &raws);
+  nstr name = (nstr)ctx->target->name;
+
+  if (raws.len > 0 && newer) {
+    print_status (ctx, "Merging", relative_to_awd (ctx, &ctx->profdata));
+    nstr tool = getenv ("LLVM_PROFDATA");  // NOLINT (concurrency-mt-unsafe)
+    if (!tool || !*tool) tool = DEFAULT_PROFDATA;
+    // per process, like z3_write_atomic, so builds sharing the tree don't swap half files
+    ScopedString tmp = z3_strdup (&ctx->profdata);
+    z3_pushf (&tmp, ".%d", (int)getpid ());
+
+    usize size = sizeof (nstr) * (raws.len + 5);  // NOLINT (readability-magic-numbers)
+    nstr* argv = malloc (size);
+    if (argv == nullptr) die ("Out of memory allocating %zu bytes\n", size);
+    argv[0] = tool;
+    argv[1] = "merge";
+    argv[2] = "-o";
+    argv[3] = (nstr)tmp.chr;
+    for (usize i = 0; i < raws.len; i++) argv[4 + i] = (nstr)z3_at_String (&raws, i)->chr;
+    argv[4 + raws.len] = nullptr;
+
+    i32 status = runner_run (argv, nullptr);
+    free ((void*)argv);
+    if (status != 0 || rename ((nstr)tmp.chr, (nstr)ctx->profdata.chr) != 0) {
+      unlink ((nstr)tmp.chr);
+      die (
+        "target '%s': could not merge the profiles in '%s' (exit %d)\n", name,
+        relative_to_awd (ctx, &ctx->pgo_dir), status
+      );
+    }
+  }
+
+  if (access ((nstr)ctx->profdata.chr, R_OK) != 0) {
+    die (
+      "target '%s': no profile in '%s', build with --pgo generate and run it first\n", name,
+      relative_to_awd (ctx, &ctx->pgo_dir)
+    );
+  }
+  if (!ctx->content_cache) return;
+
+  Hasher128 h = {0};
+  z3_hash128_init (&h, Z3_HASH_SEED);
+  if (!cache_hash_file ((nstr)ctx->profdata.chr, &h))
+    die ("target '%s': could not read '%s'\n", name, ctx->profdata.chr);
+  ctx->profdata_id = z3_hash128_final (&h).lo;
+}
+
+// A new instrumented binary, the profiles of the last one don't match it
+static void pgo_clear_raw (BuildContext* ctx) {
+  ScopedVector_ (String) raws = z3_vec (String);
+  pgo_raw_profiles (ctx, &raws);
+  for (usize i = 0; i < raws.len; i++) unlink ((nstr)z3_at_String (&raws, i)->chr);
+}
+
+static void unit_init (BuildGraph* g, BuildContext* ctx) {
+  if (ctx->pgo == PGO_USE) pgo_merge (ctx);
+
+  *g = (BuildGraph) {.ctx = ctx, .objects = z3_vec (BuildObject), .misses = z3_vec (usize)};
+  g->bundles = z3_vec (BuildObject);
+  g->compile = &g->objects;
+  g->seen = z3_hashmap_create ();
+
+  g->pch.stage = STAGE_DONE;
+  if (ctx->pch.len > 0) {
+    g->pch = (BuildObject) {.src = z3_strdup (&ctx->pch), .header = true};
+    g->pch.obj = z3_strdup (&ctx->pch_out);
+    g->pch.dep = z3_strdup (&ctx->pch_out);
+    z3_pushlit (&g->pch.dep, ".d");
+  }
+
+  g->state_path = z3_strdup (&ctx->obj_dir);
+  z3_pushc (&g->state_path, '/');
+  z3_pushlit (&g->state_path, STATE_FILE_NAME);
+
+  state_load (&g->state, &g->state_path);
+  g->state.memo = ctx->stat_memo;
+  state_writer_init (&g->next);
+  add_object (ctx, &g->objects, g->seen, (nstr)ctx->main.chr, 0);
+}
+
+// Save what the unit got to do and free it
+static void unit_drop (BuildGraph* g) {
+  // what this build didn't get to is still as it was left by the last one
+  for (usize i = 0; i < g->compile->len; i++) {
+    BuildObject* obj = z3_get (*g->compile, i);
+    if (obj->stage == STAGE_DONE) continue;
+
+    const StateRecord* rec = state_find (&g->state, (nstr)obj->obj.chr);
+    if (rec) state_writer_keep (&g->next, &g->state, rec);
+  }
+  for (usize i = 0; g->ctx->unity > 0 && i < g->objects.len; i++) {
+    BuildObject* obj = z3_get (g->objects, i);
+    const StateRecord* rec = nullptr;
+    if (obj->stage != STAGE_DONE) {
+      ScopedString scan = scan_path (obj);
+      rec = state_find (&g->state, (nstr)scan.chr);
+    } else if (!g->planned) {
+      // sources compiled alone stay so, the loop above had the unscanned ones
+      rec = state_find (&g->state, (nstr)obj->obj.chr);
+    }
+    if (rec) state_writer_keep (&g->next, &g->state, rec);
+  }
+  if (!g->done) {
+    const StateRecord* rec = state_find (&g->state, (nstr)g->ctx->bin.chr);
+    if (rec) state_writer_keep (&g->next, &g->state, rec);
+  }
+  if (g->pch.stage != STAGE_DONE) {
+    const StateRecord* rec = state_find (&g->state, (nstr)g->pch.obj.chr);
+    if (rec) state_writer_keep (&g->next, &g->state, rec);
+  }
+
+  if (!state_writer_save (&g->next, &g->state_path))
+    errpfmt ("could not write the build state to '%s'\n", g->state_path.chr);
+
+  state_writer_drop (&g->next);
+  state_drop (&g->state);
+  z3_drops (&g->state_path);
+  z3_vec_drop_BuildObject (&g->objects);
+  z3_vec_drop_BuildObject (&g->bundles);
+  drop_object (&g->pch);
+  z3_drop_vec (g->misses);
+  z3_hashmap_drop_shallow (g->seen);
+}
+
+// Build the precompiled header unless it is as the last build left it, true if spawned
+static bool pch_start (BuildGraph* g, Runner* rn, usize tag) {
+  BuildContext* ctx = g->ctx;
+  BuildObject* pch = &g->pch;
+
+  object_prepare (g, pch);
+  if (!ctx->rebuild && object_is_fresh (ctx, &g->state, pch)) {
+    object_finished (g, pch, false);
+    return false;
+  }
+
+  create_parent_dirs (&pch->obj);
+  pch->stage = STAGE_COMPILE;
+
+  ScopedVector_ (String) cmd = z3_vec (String);
+  generate_build_command (ctx, pch, &cmd);
+  print_status (ctx, "Precompiling", relative_to_awd (ctx, &pch->src));
+  object_trace_start (ctx, pch, &cmd);
+  spawn_command (ctx, rn, &cmd, tag);
+  return true;
+}
+
+static bool pch_finished (BuildGraph* g, i32 status) {
+  BuildContext* ctx = g->ctx;
+  object_trace_end (ctx, &g->pch);
+  if (status != 0) {
+    nstr rel = relative_to_awd (ctx, &g->pch.src);
+    nstr sep = ctx->triple ? " for " : "";
+    nstr triple = ctx->triple ? ctx->triple : "";
+    errpfmt ("could not precompile '%s'%s%s (exit %d)\n", rel, sep, triple, status);
+    return false;
+  }
+
+  // headers it includes may have sources of their own, they're found here
+  object_finished (g, &g->pch, true);
+  return true;
+}
+
+// Link the objects unless the binary is as the last link left it, true if spawned
+static bool link_start (BuildGraph* g, Runner* rn, usize tag) {
+  BuildContext* ctx = g->ctx;
+  ScopedVector_ (String) cmd = z3_vec (String);
+  generate_link_command (ctx, *g->compile, &cmd);
+  g->link_hash = command_hash (cmd);
+
+  const StateRecord* rec = state_find (&g->state, (nstr)ctx->bin.chr);
+  if (g->compiled == 0 && rec && state_record_fresh (&g->state, rec, g->link_hash)) {
+    state_writer_keep (&g->next, &g->state, rec);
+    print_status (ctx, "Fresh", relative_to_awd (ctx, &ctx->bin));
+    g->done = true;
+    return false;
+  }
+
+  // after the hash, how many jobs ThinLTO runs doesn't change the binary
+  if (ctx->thin_lto) {
+    ScopedString lto_jobs = z3_str (32);  // NOLINT (readability-magic-numbers)
+    usize jobs = ctx->jobs == 0 ? runner_default_jobs () : ctx->jobs;
+    z3_pushf (&lto_jobs, "-flto-jobs=%zu", jobs);
+    cmd_push (&cmd, (nstr)lto_jobs.chr);
+  }
+
+  print_status (ctx, "Linking", relative_to_awd (ctx, &ctx->bin));
+  g->link_started = trace_now (ctx->trace);
+  g->link_lane = trace_lane (ctx->trace);
+  spawn_command (ctx, rn, &cmd, tag);
+  g->linking = true;
+  return true;
+}
+
+static bool link_finished (BuildGraph* g, i32 status) {
+  BuildContext* ctx = g->ctx;
+  g->linking = false;
+  if (ctx->trace) {
+    ScopedString name = span_name (ctx, &ctx->bin);
+    nstr n = (nstr)name.chr;
+    g->link_span = trace_proc (ctx->trace, "link", n, g->link_started, g->link_lane);
+  }
+  if (status != 0) {
+    errpfmt ("could not link '%s' (exit %d)\n", relative_to_awd (ctx, &ctx->bin), status);
+    return false;
+  }
+  if (ctx->pgo == PGO_GENERATE) pgo_clear_raw (ctx);
+
+  ScopedVector_ (String) objs = z3_vec (String);
+  z3_vec_init_capacity (objs, g->compile->len);
+  for (usize i = 0; i < g->compile->len; i++)
+    z3_push_String (&objs, z3_strdup (&((BuildObject*)z3_get (*g->compile, i))->obj));
+  state_writer_add (&g->next, &g->state, (nstr)ctx->bin.chr, g->link_hash, objs);
+  g->done = true;
+  return true;
+}
+
+// Spawn the next process of a unit, skipping fresh objects, false if it has none now.
+// Tags are `index * count + unit`, the link uses the index past the last object
+static bool unit_spawn_next (BuildGraph* g, Runner* rn, usize unit, usize count) {
+  BuildContext* ctx = g->ctx;
+  // every object is compiled with the PCH, none starts before it is built
+  if (g->pch.stage == STAGE_COMPILE) return false;
+  if (g->pch.stage == STAGE_PENDING && pch_start (g, rn, unit)) {
+    g->running++;
+    return true;
+  }
+
+  if (ctx->unity > 0 && !g->planned) {
+    if (unit_scan_next (g, rn, unit, count)) {
+      g->running++;
+      return true;
+    }
+    // bundles need every source, known once the last scan is back
+    if (g->running > 0) return false;
+    unit_plan (g);
+  }
+
+  while (true) {
+    usize idx = 0;
+    if (g->misses.len > 0) {
+      idx = *(usize*)z3_get (g->misses, --g->misses.len);
+    } else if (g->next_obj < g->compile->len) {
+      idx = g->next_obj++;
+
+      BuildObject* obj = z3_get (*g->compile, idx);
+      object_prepare (g, obj);
+      if (!ctx->rebuild && object_is_fresh (ctx, &g->state, obj)) {
+        object_finished (g, obj, false);
+        continue;
+      }
+      create_parent_dirs (&obj->obj);
+    } else if (g->running == 0 && !g->linking && !g->done) {
+      if (!link_start (g, rn, g->compile->len * count + unit)) return false;
+      g->running++;
+      return true;
+    } else {
+      return false;
+    }
+
+    BuildObject* obj = z3_get (*g->compile, idx);
+    object_spawn (ctx, rn, obj, idx * count + unit);
+    if (obj->stage == STAGE_COMPILE) g->compiled++;
+    g->running++;
+    return true;
+  }
+}
+
+// A process of the unit exited, false if it failed
+static bool unit_reaped (BuildGraph* g, usize idx, i32 status) {
+  BuildContext* ctx = g->ctx;
+  g->running--;
+  if (g->pch.stage == STAGE_COMPILE) return pch_finished (g, status);
+  if (g->linking) return link_finished (g, status);
+
+  BuildObject* obj = z3_get (*g->compile, idx);
+  object_trace_end (ctx, obj);
+  if (status != 0) {
+    nstr what = obj->stage == STAGE_COMPILE ? "compile" : "preprocess";
+    nstr rel = relative_to_awd (ctx, &obj->src);
+    nstr sep = ctx->triple ? " for " : "";
+    nstr triple = ctx->triple ? ctx->triple : "";
+    errpfmt ("could not %s '%s'%s%s (exit %d)\n", what, rel, sep, triple, status);
+    return false;
+  }
+
+  if (obj->stage == STAGE_SCAN) {
+    object_finished (g, obj, true);
+    return true;
+  }
+
+  if (obj->stage == STAGE_PREPROCESS) {
+    if (!object_cache_lookup (ctx, obj)) {
+      z3_push (g->misses, idx);
+      return true;
+    }
+    print_status (ctx, "Cached", relative_to_awd (ctx, &obj->src));
+    g->compiled++;
+  } else if (ctx->content_cache && obj->keyed) {
+    cache_store (&ctx->cache_dir, obj->key, &obj->obj);
+  }
+
+  object_finished (g, obj, true);
+  return true;
+}
+
+bool build_targets (BuildContext* units, usize count) {
+  usize size = sizeof (BuildGraph) * count;
+  BuildGraph* graphs = malloc (size);
+  if (graphs == nullptr) die ("Out of memory allocating %zu bytes\n", size);
+
+  // every unit shares the compiler, hash it once
+  u64 compiler_id = units[0].content_cache ? cache_compiler_id (units[0].compiler) : 0;
+  for (usize u = 0; u < count; u++) {
+    units[u].compiler_id = compiler_id;
+    unit_init (&graphs[u], &units[u]);
+  }
+
+  Runner rn;
+  runner_init (&rn, units[0].jobs, units[0].js);
+
+  // sources are discovered from the dependencies of finished compiles (or of
+  // objects already up to date), so the queues grow while they are consumed
+  bool failed = false;
+  while (true) {
+    // one process per unit and round, so every triple makes progress
+    bool spawned = true;
+    while (!failed && spawned && runner_has_slot (&rn)) {
+      spawned = false;
+      for (usize u = 0; u < count && runner_has_slot (&rn); u++) {
+        if (unit_spawn_next (&graphs[u], &rn, u, count)) spawned = true;
+      }
+    }
+
+    usize tag = 0;
+    i32 status = 0;
+    if (!runner_reap (&rn, &tag, &status)) break;
+    if (tag == RUNNER_TOKEN) continue;
+
+    if (!unit_reaped (&graphs[tag % count], tag / count, status)) failed = true;
+  }
+
+  for (usize u = 0; u < count; u++) {
+    if (!graphs[u].done) failed = true;
+    unit_trace_path (&graphs[u]);
+    unit_drop (&graphs[u]);
+  }
+
+  free (graphs);
+  runner_drop (&rn);
+  return !failed;
+}
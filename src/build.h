@@ -1,14 +1,148 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // Copyright (c) 2025-present Klapptnot
 
+#pragma once
+
+#include <notrust.h>
 #include <z3_string.h>
 #include <z3_vector.h>
 
 #include "config.h"
+#include "hooks.h"
+#include "jobserver.h"
+#include "state.h"
+#include "trace.h"
+
+// Vector of String, for command lines and path lists
+z3_vec_drop_fn (String, z3_drops);
+Z3_VEC_DEFINE (String);
+
+#define DEFAULT_COMPILER "clang"
+#define DEFAULT_CSTD     "c23"
+#define DEFAULT_PROFILE  "release"
+#define DEFAULT_PROFDATA "llvm-profdata"  // merges raw profiles, `$LLVM_PROFDATA` overrides it
+#define PGO_DIR_NAME     ".pgo"           // in the output folder of each profile and triple
+#define THINLTO_DIR_NAME ".thinlto"       // in workspace.build
+
+// `--pgo`, which half of a profile guided build this is
+typedef enum {
+  PGO_NONE = 0,
+  PGO_GENERATE,  // instrumented, its runs write raw profiles to `pgo_dir`
+  PGO_USE,       // optimized for the raw profiles, merged into `profdata` first
+} BuildPgo;
+
+// Options given on the command line for a build
+typedef struct {
+  nstr target;       // target name or index, nullptr -> index 0
+  nstr profile;      // profile name, nullptr -> DEFAULT_PROFILE
+  nstr triple;       // only this triple, nullptr -> every entry of `for`
+  bool all_triples;  // `run` builds every triple, not only the host one
+  bool rebuild;      // compile every object, even when up to date
+  BuildPgo pgo;      // `--pgo generate|use`, PGO_NONE without it
+  Trace* trace;      // `--timings`, where the build is traced, nullptr otherwise
+  Jobserver* js;     // tokens shared with the whole process tree, nullptr -> no jobserver
+} BuildOptions;
 
+// Everything resolved to build a single target for a single triple
+typedef struct {
+  AnvilConfig* config;
+  TargetConfig* target;
+  ProfileConfig* profile;  // profile flags, owned by config
+  nstr profile_name;       // profile name, owned by config
+  nstr compiler;           // compiler executable, owned by config
+  nstr triple;             // `--target=` of the compiler, owned by config, nullptr -> host
+  String awd;              // Anvil Work Dir (project root)
+  String libs;             // expanded workspace.libs
+  String main;             // expanded and resolved target main
+  String pch;              // expanded and resolved target pch, empty if there is none
+  String manifest;         // <awd>/anvil.yaml
+  String build_dir;        // expanded workspace.build
+  String out_dir;          // <build>[/<triple>]/<profile>
+  String obj_dir;          // <out_dir>/.obj/<target>
+  String bin;              // <out_dir>/<target>
+  String pch_out;          // <obj_dir>/<pch>.pch, empty without a pch
+  String cache_dir;        // <build>/.cache, shared by every profile and triple
+  String pgo_dir;          // <out_dir>/.pgo/<target>, raw profiles, empty without --pgo
+  String profdata;         // <pgo_dir>.profdata, what `--pgo use` merged them into
+  String lto_cache;        // <build>/.thinlto, kept by the linker, empty unless `lto: 'thin'`
+  Vector defines;          // `-DKEY=value` (String) of every macro, expanded once
+  Vector dep_cflags;       // String, `-I<libs>/<name>` of folder deps and pkg-config `--cflags`
+  Vector dep_libs;         // String, pkg-config `--libs`, given to the link
+  Hooks* hooks;            // `#{arg:...}` and `#{hook:...}`, only while expanding macros
+  Trace* trace;            // from the options, nullptr when not tracing
+  Jobserver* js;           // from the options, bounds `jobs` with the rest of the tree
+  HashMap* stat_memo;      // `watch`, stats kept from one build to the next, nullptr otherwise
+  usize jobs;              // processes in flight (0 -> auto)
+  usize unity;             // bundles of a unity build, 0 compiles each source alone
+  u64 compiler_id;         // hash of the compiler executable (content cache)
+  u64 profdata_id;         // hash of `profdata` with `--pgo use` (content cache)
+  BuildPgo pgo;            // from the options
+  bool thin_lto;           // `lto: 'thin'`, bitcode objects optimized again when linked
+  bool rebuild;            // ignore up to date objects
+  bool content_cache;      // `build.cache: 'content'`, objects keyed by content
+  bool color;              // -fdiagnostics-color=always, see compiler_color in build.c
+  bool time_trace;         // -ftime-trace on compiles, only with --timings and clang
+} BuildContext;
+
+// Where an object is in the build
+typedef enum {
+  STAGE_PENDING,     // not looked at yet
+  STAGE_SCAN,        // preprocessing for its dependencies only, unity builds
+  STAGE_PREPROCESS,  // preprocessing, to get its content cache key
+  STAGE_COMPILE,     // compiling
+  STAGE_DONE,        // up to date
+} BuildStage;
+
+// A translation unit compiled to its own object
+typedef struct {
+  String src;                 // source file, absolute
+  String obj;                 // object file
+  String dep;                 // make-style depfile written by the compiler
+  Hash128 key;                // content cache key, if `keyed`
+  bool keyed;                 // preprocessed and hashed, stored in the cache once compiled
+  u64 cmd_hash;               // hash of the compile command
+  BuildStage stage;           // progress of the object
+  const StateRecord* record;  // last build of the object, nullptr if unknown
+  bool header;                // the precompiled header of the target, not linked
+  bool hot;                   // edited since the last build, unity builds compile it alone
+  usize parent;               // index + 1 of the object it was found from, 0 if none
+  u64 started;                // trace_now () when its process was spawned
+  u32 lane;                   // trace lane of its process
+  usize span;                 // index + 1 of its compile in the trace, 0 if none
+} BuildObject;
+
+// Whether `target` is missing, or older than any of `deps` (Vector of String)
 bool target_needs_rebuild (String* target, Vector deps);
 void parse_dependencies (String* rule_str, Vector* deps);
-void get_make_dependencies (BuildConfig* config, Vector* deps);
-void generate_build_command (BuildConfig* config, Vector* cmd);
-void create_object_file (String* target);
-void build_target (AnvilConfig* config, String* target, Vector deps);
+
+// Read a make-style depfile into `deps`, false if it can't be read
+bool get_make_dependencies (String* depfile, Vector* deps);
+
+// Fill `cmd` (Vector of String) with the compile command of an object
+void generate_build_command (BuildContext* ctx, BuildObject* obj, Vector* cmd);
+
+// Create every missing parent directory of `path`
+void create_parent_dirs (String* path);
+
+// Expand `#{...}` placeholders of a config value
+String build_expand (BuildContext* ctx, cstr tmpl);
+
+// Resolve the selected target, profile, macros and host output paths
+void build_context_init (BuildContext* ctx, AnvilConfig* config, const BuildOptions* opts);
+
+// Copy of `base` building for `triple` (nullptr -> host), with its own output paths
+void build_context_for_triple (BuildContext* ctx, const BuildContext* base, nstr triple);
+
+// Entry of `for` matching the machine anvil runs on, else the first, nullptr if none
+nstr build_host_triple (const BuildContext* ctx);
+
+// One context per triple to build: `triple` alone, or every entry of `for`
+BuildContext* build_units_init (BuildContext* base, nstr triple, usize* count);
+void build_units_drop (BuildContext* units, usize count);
+
+// Free everything owned by the build context
+void build_context_drop (BuildContext* ctx);
+
+// Compile every out of date translation unit of every unit on a single job pool,
+// then link each of them
+bool build_targets (BuildContext* units, usize count);
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+
+#define CACHE_READ_SIZE (1 << 16)  // 64 KB
+
+u64 cache_compiler_id (nstr compiler) {
+  ScopedString path = z3_str (PATH_MAX);
+  struct stat st = {0};
+  bool found = false;
+
+  if (strchr (compiler, '/')) {
+    z3_pushl (&path, compiler, strlen (compiler));
+    found = stat ((nstr)path.chr, &st) == 0;
+  } else {
+    nstr dirs = getenv ("PATH");  // NOLINT (concurrency-mt-unsafe)
+    while (dirs && *dirs && !found) {
+      nstr end = strchr (dirs, ':');
+      usize dlen = end ? (usize)(end - dirs) : strlen (dirs);
+
+      path.len = 0;
+      z3_pushl (&path, dirs, dlen);
+      z3_pushc (&path, '/');
+      z3_pushl (&path, compiler, strlen (compiler));
+      found = stat ((nstr)path.chr, &st) == 0 && S_ISREG (st.st_mode);
+
+      dirs = end ? end + 1 : nullptr;
+    }
+  }
+
+  // an unknown compiler still gets a stable id, the compile will fail anyway
+  u64 id = z3_hash_bytes (Z3_HASH_SEED, path.chr, path.len);
+  if (!found) return id;
+
+  id = z3_hash_bytes (id, &st.st_size, sizeof (st.st_size));
+  id = z3_hash_bytes (id, &st.st_mtim.tv_sec, sizeof (st.st_mtim.tv_sec));
+  return z3_hash_bytes (id, &st.st_mtim.tv_nsec, sizeof (st.st_mtim.tv_nsec));
+}
+
+bool cache_hash_file (nstr path, Hasher128* h) {
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return false;
+
+  u8 buf[CACHE_READ_SIZE];
+  while (true) {
+    isize n = read (fd, buf, sizeof (buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      close (fd);
+      return false;
+    }
+    if (n == 0) break;
+    z3_hash128_update (h, buf, (usize)n);
+  }
+
+  close (fd);
+  return true;
+}
+
+bool cache_object_key (String* preprocessed, Vector cmd, u64 compiler_id, Hash128* key) {
+  Hasher128 h = {0};
+  z3_hash128_init (&h, compiler_id);
+
+  // flags (including the target triple), minus outputs and the compile mode
+  for (usize i = 0; i < cmd.len; i++) {
+    String* arg = z3_get (cmd, i);
+    if (strcmp ((nstr)arg->chr, "-o") == 0 || strcmp ((nstr)arg->chr, "-MF") == 0) {
+      i++;
+      continue;
+    }
+    if (strcmp ((nstr)arg->chr, "-c") == 0 || strcmp ((nstr)arg->chr, "-E") == 0) continue;
+
+    // NUL included, so `-a -b` and `-a-b` differ
+    z3_hash128_update (&h, arg->chr, arg->len + 1);
+  }
+
+  if (!cache_hash_file ((nstr)preprocessed->chr, &h)) return false;
+  *key = z3_hash128_final (&h);
+  return true;
+}
+
+static void cache_entry_path (String* cache_dir, Hash128 key, String* entry) {
+  z3_pushl (entry, (nstr)cache_dir->chr, cache_dir->len);
+  z3_pushf (
+    // NOLINTNEXTLINE (readability-magic-numbers) first byte picks the folder
+    entry, "/%02x/%016llx%016llx.o", (u8)(key.hi >> 56), (unsigned long long)key.hi,
+    (unsigned long long)key.lo
+  );
+}
+
+static bool copy_file (nstr from, nstr to) {
+  int in = open (from, O_RDONLY);
+  if (in < 0) return false;
+
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  int out = open (to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    close (in);
+    return false;
+  }
+
+  u8 buf[CACHE_READ_SIZE];
+  bool ok = true;
+  while (ok) {
+    isize n = read (in, buf, sizeof (buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    ok = write (out, buf, (usize)n) == n;
+  }
+
+  close (in);
+  close (out);
+  return ok;
+}
+
+bool cache_link_or_copy (nstr from, nstr to) {
+  if (link (from, to) == 0) return true;
+  return errno == EXDEV && copy_file (from, to);
+}
+
+bool cache_fetch (String* cache_dir, Hash128 key, String* obj) {
+  ScopedString entry = z3_str (cache_dir->len + 48);  // NOLINT (readability-magic-numbers)
+  cache_entry_path (cache_dir, key, &entry);
+
+  if (access ((nstr)entry.chr, F_OK) != 0) return false;
+
+  unlink ((nstr)obj->chr);
+  if (!cache_link_or_copy ((nstr)entry.chr, (nstr)obj->chr)) return false;
+
+  // hardlinks share the mtime, bring it past the sources again
+  utimensat (AT_FDCWD, (nstr)obj->chr, nullptr, 0);
+  return true;
+}
+
+void cache_store (String* cache_dir, Hash128 key, String* obj) {
+  ScopedString entry = z3_str (cache_dir->len + 48);  // NOLINT (readability-magic-numbers)
+  cache_entry_path (cache_dir, key, &entry);
+  create_parent_dirs (&entry);
+
+  // link under a private name first, other anvil processes may share the cache
+  ScopedString tmp = z3_strdup (&entry);
+  z3_pushf (&tmp, ".%d", (int)getpid ());
+
+  unlink ((nstr)tmp.chr);
+  if (!cache_link_or_copy ((nstr)obj->chr, (nstr)tmp.chr)) return;
+  if (rename ((nstr)tmp.chr, (nstr)entry.chr) != 0) unlink ((nstr)tmp.chr);
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#define CACHE_DIR_NAME ".cache"
+
+// Identity of a compiler executable, from its resolved path, size and mtime
+u64 cache_compiler_id (nstr compiler);
+
+// Hash the content of a file into `h`, false if it can't be read
+bool cache_hash_file (nstr path, Hasher128* h);
+
+// Hardlink `from` at `to`, copied when they are on different filesystems
+bool cache_link_or_copy (nstr from, nstr to);
+
+// Key of an object from its preprocessed source, compile command and compiler,
+// output paths are left out so identical compiles share one entry
+bool cache_object_key (String* preprocessed, Vector cmd, u64 compiler_id, Hash128* key);
+
+// Place the object cached under `key` at `obj`, false on a miss
+bool cache_fetch (String* cache_dir, Hash128 key, String* obj);
+
+// Store a freshly compiled `obj` under `key`
+void cache_store (String* cache_dir, Hash128 key, String* obj);
@@ -10,307 +10,613 @@
 #include <string.h>
 #include <unistd.h>
 #include <yaml.h>
+#include <z3_arena.h>
 #include <z3_hashmap.h>
 #include <z3_vector.h>
 #include "z3_toys.h"
 
-void dset_argument_config (ArgumentConfig* acon, Node* node) {
-  if (!node || node->kind != NODE_MAP) return;
-
-  Node* vstr = map_get_node (node, "validation");
-  acon->validation = (vstr && vstr->kind == NODE_STRING) ? vstr->string : nullptr;
+// What a value is lowered into, and what the `dest` it is lowered to points at
+typedef enum {
+  LOWER_SKIP,       // nothing, with everything it holds
+  LOWER_ROOT,       // AnvilConfig
+  LOWER_STRING,     // cstr, set when the value is a string
+  LOWER_NUMBER,     // usize, set when the value is a number
+  LOWER_WORKSPACE,  // WorkspaceConfig*, allocated when the value is a map
+  LOWER_TARGETS,    // BuildTarget*, allocated when the sequence ends
+  LOWER_TARGET,     // TargetConfig, an item of `targets`
+  LOWER_FOR,        // TargetConfig, triples of its `for`
+  LOWER_BUILD,      // BuildConfig*, allocated when the value is a map
+  LOWER_MACROS,     // HashMap*, name -> string, created when the map ends
+  LOWER_ARGUMENTS,  // HashMap*, name -> ArgumentConfig, created when the map ends
+  LOWER_ARGUMENT,   // LowerArgument, an entry of `arguments` or `hooks`
+  LOWER_COMMAND,    // ArgumentConfig, strings of its `command`
+  LOWER_DEPS,       // BuildConfig, items of its `deps`
+  LOWER_DEP,        // DependencyConfig, an item of `deps`
+  LOWER_PROFILES,   // HashMap*, name -> ProfileConfig, created when the map ends
+  LOWER_FLAGS,      // LowerProfile, an entry of `profiles`
+} LowerKind;
+
+// Key of a known map, and what its value is lowered into
+typedef struct {
+  LowerKind in;    // the map it belongs to
+  nstr key;        // its name
+  LowerKind kind;  // what the value is lowered into
+  usize field;     // offset of the field it is lowered to, 0 for the ones taking the whole map
+  nstr fallback;   // a string field when the value is not a string, nullptr by default
+} LowerField;
+
+static const LowerField lower_fields[] = {
+  {LOWER_ROOT, "package", LOWER_STRING, offsetof (AnvilConfig, package), nullptr},
+  {LOWER_ROOT, "version", LOWER_STRING, offsetof (AnvilConfig, version), nullptr},
+  {LOWER_ROOT, "author", LOWER_STRING, offsetof (AnvilConfig, author), nullptr},
+  {LOWER_ROOT, "description", LOWER_STRING, offsetof (AnvilConfig, description), nullptr},
+  {LOWER_ROOT, "workspace", LOWER_WORKSPACE, offsetof (AnvilConfig, workspace), nullptr},
+  {LOWER_ROOT, "targets", LOWER_TARGETS, offsetof (AnvilConfig, targets), nullptr},
+  {LOWER_ROOT, "build", LOWER_BUILD, offsetof (AnvilConfig, build), nullptr},
+  {LOWER_ROOT, "profiles", LOWER_PROFILES, offsetof (AnvilConfig, profiles), nullptr},
+
+  {LOWER_WORKSPACE, "libs", LOWER_STRING, offsetof (WorkspaceConfig, libs), DEFAULT_LIBS_PATH},
+  {LOWER_WORKSPACE, "build", LOWER_STRING, offsetof (WorkspaceConfig, build),
+   DEFAULT_TARGET_PATH},
+
+  {LOWER_TARGET, "name", LOWER_STRING, offsetof (TargetConfig, name), nullptr},
+  {LOWER_TARGET, "type", LOWER_STRING, offsetof (TargetConfig, type), nullptr},
+  {LOWER_TARGET, "main", LOWER_STRING, offsetof (TargetConfig, main), nullptr},
+  {LOWER_TARGET, "pch", LOWER_STRING, offsetof (TargetConfig, pch), nullptr},
+  {LOWER_TARGET, "lto", LOWER_STRING, offsetof (TargetConfig, lto), nullptr},
+  {LOWER_TARGET, "unity", LOWER_NUMBER, offsetof (TargetConfig, unity), nullptr},
+  {LOWER_TARGET, "macros", LOWER_MACROS, offsetof (TargetConfig, macros), nullptr},
+  {LOWER_TARGET, "for", LOWER_FOR, 0, nullptr},
+
+  {LOWER_BUILD, "compiler", LOWER_STRING, offsetof (BuildConfig, compiler), nullptr},
+  {LOWER_BUILD, "cstd", LOWER_STRING, offsetof (BuildConfig, cstd), nullptr},
+  {LOWER_BUILD, "cache", LOWER_STRING, offsetof (BuildConfig, cache), nullptr},
+  {LOWER_BUILD, "jobs", LOWER_NUMBER, offsetof (BuildConfig, jobs), nullptr},
+  {LOWER_BUILD, "macros", LOWER_MACROS, offsetof (BuildConfig, macros), nullptr},
+  {LOWER_BUILD, "arguments", LOWER_ARGUMENTS, offsetof (BuildConfig, arguments), nullptr},
+  {LOWER_BUILD, "hooks", LOWER_ARGUMENTS, offsetof (BuildConfig, hooks), nullptr},
+  {LOWER_BUILD, "deps", LOWER_DEPS, 0, nullptr},
+
+  {LOWER_ARGUMENT, "validation", LOWER_STRING, offsetof (ArgumentConfig, validation), nullptr},
+  {LOWER_ARGUMENT, "cache_policy", LOWER_STRING, offsetof (ArgumentConfig, cache_policy),
+   nullptr},
+  {LOWER_ARGUMENT, "command", LOWER_COMMAND, 0, nullptr},
+
+  {LOWER_DEP, "name", LOWER_STRING, offsetof (DependencyConfig, name), nullptr},
+  {LOWER_DEP, "type", LOWER_STRING, offsetof (DependencyConfig, type), nullptr},
+  {LOWER_DEP, "repo", LOWER_STRING, offsetof (DependencyConfig, repo), nullptr},
+  {LOWER_DEP, "path", LOWER_STRING, offsetof (DependencyConfig, path), nullptr},
+  {LOWER_DEP, "ref", LOWER_STRING, offsetof (DependencyConfig, ref), nullptr},
+};
+
+// Open map or sequence
+typedef struct {
+  LowerKind kind;   // what it is lowered into
+  void* dest;       // and where to
+  usize keys;       // its first key in Lowering::keys
+  LowerKind next;   // what the value of its last key is lowered into
+  void* next_dest;  // and where to
+} LowerFrame;
+
+// Key seen in an open map, to handle a redefinition the way map_put does
+typedef struct {
+  cstr key;     // interned, equal keys are the same pointer
+  bool merged;  // from `<<`, an explicit key replaces it
+  usize item;   // its entry in the vector of a map of names
+} LowerKey;
+
+typedef struct {
+  cstr key;
+  cstr value;  // nullptr unless it is a string
+} LowerMacro;
+
+typedef struct {
+  cstr key;
+  ArgumentConfig conf;
+  bool map;  // the value is a map, others are not kept
+} LowerArgument;
+
+typedef struct {
+  cstr key;
+  usize start;  // its flags in Lowering::flags
+  usize count;
+  bool list;  // the value is a sequence, others are not kept
+} LowerProfile;
+
+Z3_VEC_DEFINE (LowerFrame);
+Z3_VEC_DEFINE (LowerKey);
+Z3_VEC_DEFINE (LowerMacro);
+Z3_VEC_DEFINE (LowerArgument);
+Z3_VEC_DEFINE (LowerProfile);
+Z3_VEC_DEFINE (TargetConfig);
+Z3_VEC_DEFINE (DependencyConfig);
+Z3_VEC_DEFINE (cstr);
+Z3_VEC_DEFINE (usize);
+
+// None of the maps of names or the sequences nest, so the open one has its vector to itself,
+// and each is copied to the arena with the exact size once it ends
+typedef struct {
+  Arena* arena;       // of the store, for everything the config keeps
+  AnvilConfig* conf;  // nullptr until the document turns out to be a map
+  Vector frames;      // LowerFrame of the open containers, the innermost one last
+  Vector keys;        // LowerKey of the open maps
+  Vector targets;     // TargetConfig of `targets`
+  Vector target_for;  // usize, where the `for` of each target starts in `triples`
+  Vector triples;     // cstr of every `for`
+  Vector deps;        // DependencyConfig of `deps`
+  Vector command;     // cstr of a `command`
+  Vector macros;      // LowerMacro of a `macros`
+  Vector args;        // LowerArgument of `arguments` or `hooks`
+  Vector profiles;    // LowerProfile of `profiles`
+  Vector flags;       // cstr of every profile
+} Lowering;
+
+// The items of `vec` copied to the arena, nullptr if there are none
+static void* lower_copy (Lowering* lw, const Vector* vec) {
+  if (vec->len == 0) return nullptr;
+  void* copy = z3_alloc (lw->arena, vec->esz * vec->len);
+  memcpy (copy, vec->val, vec->esz * vec->len);
+  return copy;
+}
 
-  Node* cpol = map_get_node (node, "cache_policy");
-  acon->cache_policy = (cpol && cpol->kind == NODE_STRING) ? cpol->string : nullptr;
+static void lower_drop_map (HashMap** map) {
+  if (*map) z3_hashmap_drop_shallow (*map);
+  *map = nullptr;
+}
 
-  Node* cmds = map_get_node (node, "command");
-  if (cmds && cmds->kind == NODE_LIST) {
-    acon->command_len = cmds->list.size;
-    acon->command = (const u8**)malloc (sizeof (char*) * acon->command_len);
-    for (size_t i = 0; i < acon->command_len; i++) {
-      Node* item = cmds->list.items[i];
-      acon->command[i] = (item && item->kind == NODE_STRING) ? item->string : nullptr;
+// Forget what `dest` was lowered to, for a key that is (re)defined
+static void lower_reset (Lowering* lw, LowerKind kind, void* dest, nstr fallback) {
+  switch (kind) {
+    case LOWER_STRING:
+      *(cstr*)dest = (cstr)fallback;
+      break;
+    case LOWER_NUMBER:
+      *(usize*)dest = 0;
+      break;
+    case LOWER_WORKSPACE:
+      *(WorkspaceConfig**)dest = nullptr;
+      break;
+    case LOWER_TARGETS:
+      free_target_config (*(BuildTarget**)dest);
+      *(BuildTarget**)dest = nullptr;
+      break;
+    case LOWER_BUILD:
+      free_build_config (*(BuildConfig**)dest);
+      *(BuildConfig**)dest = nullptr;
+      break;
+    case LOWER_MACROS:
+    case LOWER_ARGUMENTS:
+    case LOWER_PROFILES:
+      lower_drop_map (dest);
+      break;
+    case LOWER_FOR: {
+      TargetConfig* tari = dest;
+      lw->triples.len = *z3_at_usize (&lw->target_for, tari - (TargetConfig*)lw->targets.val);
+      tari->target_count = 0;
+      break;
     }
-  } else {
-    acon->command = nullptr;
-    acon->command_len = 0;
+    case LOWER_COMMAND:
+      ((ArgumentConfig*)dest)->command = nullptr;
+      ((ArgumentConfig*)dest)->command_len = 0;
+      break;
+    case LOWER_DEPS:
+      ((BuildConfig*)dest)->deps = nullptr;
+      ((BuildConfig*)dest)->deps_count = 0;
+      break;
+    case LOWER_ARGUMENT:
+      ((LowerArgument*)dest)->conf = (ArgumentConfig) {0};
+      ((LowerArgument*)dest)->map = false;
+      break;
+    case LOWER_FLAGS:
+      ((LowerProfile*)dest)->count = 0;
+      ((LowerProfile*)dest)->list = false;
+      break;
+    default:
+      break;
   }
 }
 
-void dset_dependency_config (DependencyConfig* dcon, Node* node) {
-  if (!node || node->kind != NODE_MAP) return;
-
-  Node* name = map_get_node (node, "name");
-  dcon->name = (name && name->kind == NODE_STRING) ? name->string : nullptr;
-
-  Node* type = map_get_node (node, "type");
-  dcon->type = (type && type->kind == NODE_STRING) ? type->string : nullptr;
-
-  Node* repo = map_get_node (node, "repo");
-  dcon->repo = (repo && repo->kind == NODE_STRING) ? repo->string : nullptr;
+// What the value of `key` in `map` is lowered into. An entry of a map of names is added to
+// its vector, or its `item` is reused when an explicit key replaces a merged one
+static void lower_route (Lowering* lw, LowerFrame* map, cstr key, bool seen, usize item) {
+  map->next = LOWER_SKIP;
+  map->next_dest = nullptr;
+  nstr fallback = nullptr;
+
+  switch (map->kind) {
+    case LOWER_MACROS:
+      if (!seen) z3_push_LowerMacro (&lw->macros, (LowerMacro) {.key = key});
+      map->next = LOWER_STRING;
+      map->next_dest = &z3_at_LowerMacro (&lw->macros, item)->value;
+      break;
+
+    case LOWER_ARGUMENTS:
+      if (!seen) z3_push_LowerArgument (&lw->args, (LowerArgument) {.key = key});
+      map->next = LOWER_ARGUMENT;
+      map->next_dest = z3_at_LowerArgument (&lw->args, item);
+      break;
+
+    case LOWER_PROFILES:
+      if (!seen) z3_push_LowerProfile (&lw->profiles, (LowerProfile) {.key = key});
+      map->next = LOWER_FLAGS;
+      map->next_dest = z3_at_LowerProfile (&lw->profiles, item);
+      break;
+
+    default:
+      for (usize i = 0; i < sizeof (lower_fields) / sizeof (*lower_fields); i++) {
+        const LowerField* field = &lower_fields[i];
+        if (field->in != map->kind || strcmp (field->key, (nstr)key) != 0) continue;
+        map->next = field->kind;
+        map->next_dest = (u8*)map->dest + field->field;
+        fallback = field->fallback;
+        break;
+      }
+      break;
+  }
 
-  Node* path = map_get_node (node, "path");
-  dcon->path = (path && path->kind == NODE_STRING) ? path->string : nullptr;
+  lower_reset (lw, map->next, map->next_dest, fallback);
 }
 
-void dset_workspace_config (WorkspaceConfig* wconf, Node* node) {
-  if (!node || node->kind != NODE_MAP) return;
+static LowerFrame* lower_top (Lowering* lw) {
+  return lw->frames.len ? z3_at_LowerFrame (&lw->frames, lw->frames.len - 1) : nullptr;
+}
 
-  Node* wlibs = map_get_node (node, "libs");
-  if (wlibs && wlibs->kind == NODE_STRING) {
-    wconf->libs = wlibs->string;
-  } else {
-    wconf->libs = (cstr)DEFAULT_LIBS_PATH;
+// What the next value is lowered into, and where to. An item of the open sequence is added
+// to it here, `scalar` is nullptr for a map or a sequence
+static LowerKind lower_next (Lowering* lw, const Node* scalar, void** dest) {
+  LowerFrame* top = lower_top (lw);
+  *dest = nullptr;
+  if (top == nullptr) return LOWER_ROOT;
+
+  cstr str = (scalar && scalar->kind == NODE_STRING) ? scalar->string : nullptr;
+  switch (top->kind) {
+    case LOWER_TARGETS:
+      // every item is a target, the ones that are not a map have no fields
+      z3_push_TargetConfig (&lw->targets, (TargetConfig) {0});
+      z3_push_usize (&lw->target_for, lw->triples.len);
+      *dest = z3_at_TargetConfig (&lw->targets, lw->targets.len - 1);
+      return LOWER_TARGET;
+
+    case LOWER_DEPS:
+      z3_push_DependencyConfig (&lw->deps, (DependencyConfig) {0});
+      *dest = z3_at_DependencyConfig (&lw->deps, lw->deps.len - 1);
+      return LOWER_DEP;
+
+    case LOWER_FOR:  // non-string items are kept as nullptr
+      z3_push_cstr (&lw->triples, str);
+      return LOWER_SKIP;
+
+    case LOWER_COMMAND:
+      z3_push_cstr (&lw->command, str);
+      return LOWER_SKIP;
+
+    case LOWER_FLAGS:  // non-string items are left out
+      if (str) z3_push_cstr (&lw->flags, str);
+      return LOWER_SKIP;
+
+    default:
+      *dest = top->next_dest;
+      return top->next;
   }
+}
 
-  Node* wtarget = map_get_node (node, "build");
-  if (wtarget && wtarget->kind == NODE_STRING) {
-    wconf->build = wtarget->string;
-  } else {
-    wconf->build = (cstr)DEFAULT_TARGET_PATH;
+// Whether a map, or a sequence, can be lowered into `kind`
+static bool lower_takes (LowerKind kind, bool map) {
+  switch (kind) {
+    case LOWER_SKIP:
+      return true;
+    case LOWER_TARGETS:
+    case LOWER_FOR:
+    case LOWER_COMMAND:
+    case LOWER_DEPS:
+    case LOWER_FLAGS:
+      return !map;
+    case LOWER_STRING:
+    case LOWER_NUMBER:
+      return false;
+    default:
+      return map;
   }
 }
 
-void dset_profile_config (HashMap* pconf, Node* node) {
-  if (!node || node->kind != NODE_MAP) return;
+static void lower_open (Lowering* lw, bool map) {
+  void* dest = nullptr;
+  LowerKind kind = lower_next (lw, nullptr, &dest);
+  if (!lower_takes (kind, map)) kind = LOWER_SKIP;
+
+  switch (kind) {
+    case LOWER_ROOT:
+      lw->conf = z3_alloc (lw->arena, sizeof (AnvilConfig));
+      *lw->conf = (AnvilConfig) {0};
+      dest = lw->conf;
+      break;
+
+    case LOWER_WORKSPACE: {
+      WorkspaceConfig* wconf = z3_alloc (lw->arena, sizeof (WorkspaceConfig));
+      *wconf = (WorkspaceConfig) {
+        .libs = (cstr)DEFAULT_LIBS_PATH,
+        .build = (cstr)DEFAULT_TARGET_PATH,
+      };
+      *(WorkspaceConfig**)dest = wconf;
+      dest = wconf;
+      break;
+    }
 
-  for (size_t i = 0; i < node->map.size; ++i) {
-    cstr key = node->map.entries[i].key;
-    Node* val = node->map.entries[i].val;
+    case LOWER_BUILD: {
+      BuildConfig* bconf = z3_alloc (lw->arena, sizeof (BuildConfig));
+      *bconf = (BuildConfig) {0};
+      *(BuildConfig**)dest = bconf;
+      dest = bconf;
+      break;
+    }
 
-    if (!key || !val || val->kind != NODE_LIST) continue;
+    case LOWER_ARGUMENT:
+      ((LowerArgument*)dest)->map = true;
+      dest = &((LowerArgument*)dest)->conf;
+      break;
 
-    Vector* flags = calloc (1, sizeof (Vector));
-    flags->esz = sizeof (char*);
-    z3_vec_init_capacity (*flags, 16);
-    for (size_t j = 0; j < val->list.size; j++) {
-      Node* vi = val->list.items[j];
-      if (vi && vi->kind == NODE_STRING) {
-        z3_push (*flags, vi->string);
-      }
-    }
+    case LOWER_FLAGS:
+      ((LowerProfile*)dest)->list = true;
+      ((LowerProfile*)dest)->start = lw->flags.len;
+      break;
 
-    z3_hashmap_put (pconf, (nstr)key, flags);
+    default:
+      break;
   }
+
+  LowerFrame frame = {.kind = kind, .dest = dest, .keys = lw->keys.len, .next = LOWER_SKIP};
+  z3_push_LowerFrame (&lw->frames, frame);
 }
 
-void dset_target_config (BuildTarget* tconf, Node* node) {
-  if (!node || node->kind != NODE_LIST) return;
-  if (node->list.size == 0) {
-    tconf->count = 0;
-    tconf->target = nullptr;
-    return;
-  }
+static void lower_open_map (void* ctx) {
+  lower_open (ctx, true);
+}
 
-  tconf->count = node->list.size;
-  tconf->target = (TargetConfig**)malloc (sizeof (TargetConfig) * node->list.size);
-  for (size_t i = 0; i < node->list.size; i++) {
-    TargetConfig* tari = malloc (sizeof (TargetConfig));
-    Node* tnode = node->list.items[i];
-    Node* name = map_get_node (tnode, "name");
-    tari->name = (name && name->kind == NODE_STRING) ? name->string : nullptr;
-
-    Node* type = map_get_node (tnode, "type");
-    tari->type = (type && type->kind == NODE_STRING) ? type->string : nullptr;
-
-    Node* main = map_get_node (tnode, "main");
-    tari->main = (main && main->kind == NODE_STRING) ? main->string : nullptr;
-
-    tnode = map_get_node (tnode, "for");
-    if (tnode && tnode->kind == NODE_LIST) {
-      tari->target_count = tnode->list.size;
-      tari->target = (const u8**)malloc (sizeof (char*) * tnode->list.size);
-      for (size_t j = 0; j < tnode->list.size; ++j) {
-        Node* elem = tnode->list.items[j];
-        tari->target[j] = (elem && elem->kind == NODE_STRING) ? elem->string : nullptr;
-      }
-    } else {
-      tari->target = nullptr;
-      tari->target_count = 0;
-    }
-    tconf->target[i] = tari;
+static void lower_open_seq (void* ctx) {
+  lower_open (ctx, false);
+}
+
+static void lower_targets (Lowering* lw, BuildTarget** dest) {
+  BuildTarget* tconf = z3_alloc (lw->arena, sizeof (BuildTarget));
+  *tconf = (BuildTarget) {
+    .count = lw->targets.len,
+    .target = lower_copy (lw, &lw->targets),
+    .triples = lower_copy (lw, &lw->triples),
+    .triples_count = lw->triples.len,
+  };
+
+  // `for` of every target, as a slice of the triples
+  for (usize i = 0; i < tconf->count; i++) {
+    TargetConfig* tari = &tconf->target[i];
+    tari->target = nullptr;
+    if (tari->target_count) tari->target = tconf->triples + *z3_at_usize (&lw->target_for, i);
   }
+
+  lw->targets.len = 0;
+  lw->target_for.len = 0;
+  lw->triples.len = 0;
+  *dest = tconf;
 }
 
-void dset_build_config (BuildConfig* bconf, Node* node) {
-  Node* comp = map_get_node (node, "compiler");
-  bconf->compiler = (comp && comp->kind == NODE_STRING) ? comp->string : nullptr;
-
-  Node* std = map_get_node (node, "cstd");
-  bconf->cstd = (std && std->kind == NODE_STRING) ? std->string : nullptr;
-
-  Node* jobs = map_get_node (node, "jobs");
-  bconf->jobs = (jobs && jobs->kind == NODE_NUMBER) ? (size_t)jobs->number : 0;
-
-  // --- macros hashmap ---
-  Node* macros = map_get_node (node, "macros");
-  if (macros && macros->kind == NODE_MAP) {
-    bconf->macros = z3_hashmap_create ();
-    for (size_t i = 0; i < macros->map.size; ++i) {
-      cstr key = macros->map.entries[i].key;
-      Node* val = macros->map.entries[i].val;
-      if (key && val && val->kind == NODE_STRING) {
-        z3_hashmap_put (bconf->macros, (nstr)key, KILL_CAST_QUAL ((void*)val->string));
-      }
-    }
+static void lower_macros (Lowering* lw, HashMap** dest) {
+  *dest = z3_hashmap_create ();
+  for (usize i = 0; i < lw->macros.len; i++) {
+    LowerMacro* macro = z3_at_LowerMacro (&lw->macros, i);
+    if (!macro->value) continue;
+    z3_hashmap_put (*dest, (nstr)macro->key, KILL_CAST_QUAL ((void*)macro->value));
   }
+  lw->macros.len = 0;
+}
 
-  // --- arguments hashmap ---
-  Node* args = map_get_node (node, "arguments");
-  if (args && args->kind == NODE_MAP) {
-    bconf->arguments = z3_hashmap_create ();
-    for (size_t i = 0; i < args->map.size; ++i) {
-      cstr key = args->map.entries[i].key;
-      Node* val = args->map.entries[i].val;
-      if (key && val && val->kind == NODE_MAP) {
-        ArgumentConfig* argconf = malloc (sizeof (ArgumentConfig));
-        dset_argument_config (argconf, val);
-        z3_hashmap_put (bconf->arguments, (nstr)key, (void*)argconf);
-      }
-    }
+static void lower_arguments (Lowering* lw, HashMap** dest) {
+  // one array for all of them, the map only points into it
+  ArgumentConfig* confs = nullptr;
+  if (lw->args.len) confs = z3_alloc (lw->arena, sizeof (ArgumentConfig) * lw->args.len);
+
+  *dest = z3_hashmap_create ();
+  for (usize i = 0; i < lw->args.len; i++) {
+    LowerArgument* arg = z3_at_LowerArgument (&lw->args, i);
+    if (!arg->map) continue;
+    confs[i] = arg->conf;
+    z3_hashmap_put (*dest, (nstr)arg->key, &confs[i]);
   }
+  lw->args.len = 0;
+}
 
-  // --- deps ---
-  Node* deps = map_get_node (node, "deps");
-  if (deps && deps->kind == NODE_LIST) {
-    bconf->deps_count = deps->list.size;
-    bconf->deps = malloc (sizeof (DependencyConfig) * bconf->deps_count);
-    for (size_t i = 0; i < bconf->deps_count; ++i) {
-      dset_dependency_config (&bconf->deps[i], deps->list.items[i]);
-    }
-  } else {
-    bconf->deps = nullptr;
-    bconf->deps_count = 0;
+static void lower_profiles (Lowering* lw, HashMap** dest) {
+  // the flags of every profile in one pool, each profile is a slice of it
+  const u8** pool = lower_copy (lw, &lw->flags);
+  ProfileConfig* profs = nullptr;
+  if (lw->profiles.len) profs = z3_alloc (lw->arena, sizeof (ProfileConfig) * lw->profiles.len);
+
+  *dest = z3_hashmap_create ();
+  for (usize i = 0; i < lw->profiles.len; i++) {
+    LowerProfile* prof = z3_at_LowerProfile (&lw->profiles, i);
+    if (!prof->list) continue;
+    profs[i] = (ProfileConfig) {
+      .flags = prof->count ? pool + prof->start : nullptr,
+      .flags_count = prof->count,
+    };
+    z3_hashmap_put (*dest, (nstr)prof->key, &profs[i]);
   }
+  lw->profiles.len = 0;
+  lw->flags.len = 0;
 }
 
-void dset_anvil_config (AnvilConfig* conf, Node* node) {
-  if (!node || node->kind != NODE_MAP) return;
+static void lower_close (void* ctx) {
+  Lowering* lw = ctx;
+  LowerFrame frame = *lower_top (lw);
+  lw->frames.len--;
+  lw->keys.len = frame.keys;
+
+  switch (frame.kind) {
+    case LOWER_TARGETS:
+      lower_targets (lw, frame.dest);
+      break;
+
+    case LOWER_FOR: {
+      TargetConfig* tari = frame.dest;
+      usize start = *z3_at_usize (&lw->target_for, tari - (TargetConfig*)lw->targets.val);
+      tari->target_count = lw->triples.len - start;
+      break;
+    }
+
+    case LOWER_MACROS:
+      lower_macros (lw, frame.dest);
+      break;
 
-  Node* pkg = map_get_node (node, "package");
-  conf->package = (pkg && pkg->kind == NODE_STRING) ? pkg->string : nullptr;
+    case LOWER_ARGUMENTS:
+      lower_arguments (lw, frame.dest);
+      break;
+
+    case LOWER_COMMAND: {
+      ArgumentConfig* acon = frame.dest;
+      acon->command = lower_copy (lw, &lw->command);
+      acon->command_len = lw->command.len;
+      lw->command.len = 0;
+      break;
+    }
 
-  Node* ver = map_get_node (node, "version");
-  conf->version = (ver && ver->kind == NODE_STRING) ? ver->string : nullptr;
+    case LOWER_DEPS: {
+      BuildConfig* bconf = frame.dest;
+      bconf->deps = lower_copy (lw, &lw->deps);
+      bconf->deps_count = lw->deps.len;
+      lw->deps.len = 0;
+      break;
+    }
 
-  Node* auth = map_get_node (node, "author");
-  conf->author = (auth && auth->kind == NODE_STRING) ? auth->string : nullptr;
+    case LOWER_PROFILES:
+      lower_profiles (lw, frame.dest);
+      break;
 
-  Node* desc = map_get_node (node, "description");
-  conf->description = (desc && desc->kind == NODE_STRING) ? desc->string : nullptr;
+    case LOWER_FLAGS: {
+      LowerProfile* prof = frame.dest;
+      prof->count = lw->flags.len - prof->start;
+      break;
+    }
 
-  // --- Workspace ---
-  Node* workspc = map_get_node (node, "workspace");
-  if (nullptr != workspc && workspc->kind == NODE_MAP) {
-    conf->workspace = malloc (sizeof (WorkspaceConfig));
-    dset_workspace_config (conf->workspace, workspc);
-  } else {
-    conf->workspace = nullptr;
+    default:
+      break;
   }
+}
 
-  // --- Targets ---
-  Node* targets_node = map_get_node (node, "targets");
-  if (targets_node && targets_node->kind == NODE_LIST) {
-    conf->targets = malloc (sizeof (BuildTarget));
-    dset_target_config (conf->targets, targets_node);
-  } else {
-    conf->targets = nullptr;
+// Same as map_put: an explicit key replaces a merged one, a merged one is skipped when the
+// key is there already, and an explicit one there already fails the parse
+static bool lower_key (void* ctx, const YamlMapEntry* key) {
+  Lowering* lw = ctx;
+  LowerFrame* map = lower_top (lw);
+
+  // maps of a manifest are small, a scan of the keys is enough
+  LowerKey* seen = nullptr;
+  for (usize i = map->keys; i < lw->keys.len && !seen; i++) {
+    LowerKey* other = z3_at_LowerKey (&lw->keys, i);
+    if (other->key == key->key) seen = other;
   }
 
-  // --- Build Config ---
-  Node* build_node = map_get_node (node, "build");
-  if (build_node && build_node->kind == NODE_MAP) {
-    conf->build = malloc (sizeof (BuildConfig));
-    dset_build_config (conf->build, build_node);
-  } else {
-    conf->build = nullptr;
+  if (seen) {
+    if (key->merged) {
+      map->next = LOWER_SKIP;
+      return true;
+    }
+    if (!seen->merged) return false;
+    seen->merged = false;
+    lower_route (lw, map, key->key, true, seen->item);
+    return true;
   }
 
-  // --- Profiles ---
-  Node* profiles_node = map_get_node (node, "profiles");
-  if (profiles_node && profiles_node->kind == NODE_MAP) {
-    conf->profiles = z3_hashmap_create ();
-    dset_profile_config (conf->profiles, profiles_node);
-  } else {
-    conf->profiles = nullptr;
+  // the entry a map of names is about to add, unused by other maps
+  usize item = 0;
+  if (map->kind == LOWER_MACROS) item = lw->macros.len;
+  if (map->kind == LOWER_ARGUMENTS) item = lw->args.len;
+  if (map->kind == LOWER_PROFILES) item = lw->profiles.len;
+
+  LowerKey entry = {.key = key->key, .merged = key->merged, .item = item};
+  z3_push_LowerKey (&lw->keys, entry);
+  lower_route (lw, map, key->key, false, item);
+  return true;
+}
+
+static void lower_scalar (void* ctx, const Node* scalar) {
+  void* dest = nullptr;
+  LowerKind kind = lower_next (ctx, scalar, &dest);
+  if (kind == LOWER_STRING && scalar->kind == NODE_STRING) *(cstr*)dest = scalar->string;
+  if (kind == LOWER_NUMBER && scalar->kind == NODE_NUMBER) {
+    *(usize*)dest = (usize)scalar->number;
   }
 }
 
+AnvilConfig* lower_anvil_config (nstr manifest, YamlStore* store) {
+  Lowering lw = {
+    .arena = &store->arena,
+    .conf = nullptr,
+    .frames = z3_vec (LowerFrame),
+    .keys = z3_vec (LowerKey),
+    .targets = z3_vec (TargetConfig),
+    .target_for = z3_vec (usize),
+    .triples = z3_vec (cstr),
+    .deps = z3_vec (DependencyConfig),
+    .command = z3_vec (cstr),
+    .macros = z3_vec (LowerMacro),
+    .args = z3_vec (LowerArgument),
+    .profiles = z3_vec (LowerProfile),
+    .flags = z3_vec (cstr),
+  };
+
+  // anchored values are walked as events too, so every value takes the same path
+  YamlHandler handler = {
+    .ctx = &lw,
+    .on_map_start = lower_open_map,
+    .on_map_end = lower_close,
+    .on_key = lower_key,
+    .on_seq_start = lower_open_seq,
+    .on_seq_end = lower_close,
+    .on_scalar = lower_scalar,
+    .on_node = nullptr,
+  };
+  parse_yaml_events (manifest, store, &handler);
+
+  z3_drop_vec (lw.frames);
+  z3_drop_vec (lw.keys);
+  z3_drop_vec (lw.targets);
+  z3_drop_vec (lw.target_for);
+  z3_drop_vec (lw.triples);
+  z3_drop_vec (lw.deps);
+  z3_drop_vec (lw.command);
+  z3_drop_vec (lw.macros);
+  z3_drop_vec (lw.args);
+  z3_drop_vec (lw.profiles);
+  z3_drop_vec (lw.flags);
+  return lw.conf;
+}
+
 void free_target_config (BuildTarget* tconf) {
   if (!tconf) return;
 
-  if (tconf->target) {
-    for (size_t i = 0; i < tconf->count; i++) {
-      TargetConfig* tari = tconf->target[i];
-      if (tari) {
-        // name, type, main are owned by Node tree
-        if (tari->target) {
-          // target array elements are owned by Node tree
-          free ((void*)tari->target);
-        }
-        free (tari);
-      }
-    }
-    free ((void*)tconf->target);
+  // Hashmap values are owned by Node tree
+  for (size_t i = 0; i < tconf->count; i++) {
+    if (tconf->target[i].macros) z3_hashmap_drop_shallow (tconf->target[i].macros);
   }
-
-  free (tconf);
 }
 
 void free_profile_config (HashMap* pconf) {
-  if (!pconf) return;
-
-  // Iterate through hashmap and free each Vector
-  HashMapIterator it = z3_hashmap_iterator (pconf);
-  while (z3_hashmap_iter_next (&it)) {
-    Vector* flags = (Vector*)it.val;
-    // Vector elements are owned by Node tree
-    if (flags) z3_drop_vec (*flags);
-  }
-
-  z3_hashmap_drop (pconf);
+  // ProfileConfig values are in the arena
+  if (pconf) z3_hashmap_drop_shallow (pconf);
 }
 
 void free_build_config (BuildConfig* bconf) {
   if (!bconf) return;
 
-  // compiler and cstd are owned by Node tree
-
-  if (bconf->macros) {
-    // Hashmap values are owned by Node tree
-    z3_hashmap_drop_shallow (bconf->macros);
-  }
-
-  if (bconf->arguments) {
-    HashMapIterator it = z3_hashmap_iterator (bconf->arguments);
-    while (z3_hashmap_iter_next (&it)) {
-      ArgumentConfig* argconf = (ArgumentConfig*)it.val;
-      if (argconf) {
-        free ((void*)argconf->command);
-      }
-    }
-    z3_hashmap_drop (bconf->arguments);
-  }
-
-  // All string fields are owned by the Node tree, drop the map
-  if (bconf->deps) free (bconf->deps);
-
-  free (bconf);
+  // Hashmap values are owned by Node tree, or in the arena
+  if (bconf->macros) z3_hashmap_drop_shallow (bconf->macros);
+  if (bconf->arguments) z3_hashmap_drop_shallow (bconf->arguments);
+  if (bconf->hooks) z3_hashmap_drop_shallow (bconf->hooks);
 }
 
-// Free config tree, all values are owned by Node tree
+// Drop the hash maps of the config, the rest goes with the arena it was lowered into
 void free_anvil_config (AnvilConfig* conf) {
   if (!conf) return;
 
-  // package, version, author, description are owned by Node tree
-
-  if (conf->workspace) free (conf->workspace);
-
-  if (conf->targets) free_target_config (conf->targets);
-
-  if (conf->build) free_build_config (conf->build);
-
-  if (conf->profiles) free_profile_config (conf->profiles);
-
-  free (conf);
+  free_target_config (conf->targets);
+  free_build_config (conf->build);
+  free_profile_config (conf->profiles);
 }
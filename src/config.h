@@ -4,10 +4,12 @@
 #pragma once
 #include <notrust.h>
 #include <stddef.h>
+#include <z3_arena.h>
 #include <z3_hashmap.h>
 
 #include "yaml.h"
 
+#define ANVIL_MANIFEST      "anvil.yaml"
 #define DEFAULT_LIBS_PATH   "#{AWD}/src/libs"
 #define DEFAULT_TARGET_PATH "#{AWD}/target"
 
@@ -23,14 +25,17 @@ typedef struct {
   cstr type;
   cstr repo;
   cstr path;
+  cstr ref;  // branch, tag or commit of a `github` dependency, nullptr -> HEAD
 } DependencyConfig;
 
 typedef struct {
   cstr compiler;
   cstr cstd;
+  cstr cache;  // `mtime` (default) or `content`
   usize jobs;
   HashMap* macros;
   HashMap* arguments;
+  HashMap* hooks;  // hook name -> ArgumentConfig, `command` is unused
   DependencyConfig* deps;
   usize deps_count;
 } BuildConfig;
@@ -41,7 +46,7 @@ typedef struct {
 } WorkspaceConfig;
 
 typedef struct {
-  const u8** flags;
+  const u8** flags;  // a slice of the flags pool shared by every profile
   usize flags_count;
 } ProfileConfig;
 
@@ -49,14 +54,19 @@ typedef struct {
   cstr name;
   cstr type;
   cstr main;
-  const u8** target;
-  // HashMap* macros; // TODO
+  cstr pch;           // header precompiled once per profile and triple, nullptr if none
+  cstr lto;           // 'thin' compiles and links with ThinLTO, nullptr if none
+  const u8** target;  // `for`, a slice of BuildTarget::triples
+  HashMap* macros;
   usize target_count;
+  usize unity;  // sources grouped into this many bundles to compile, 0 compiles each alone
 } TargetConfig;
 
 typedef struct {
   usize count;
-  TargetConfig** target;
+  TargetConfig* target;  // `count` targets, one after the other
+  const u8** triples;    // `for` of every target, in order
+  usize triples_count;
 } BuildTarget;
 
 typedef struct {
@@ -67,29 +77,16 @@ typedef struct {
   WorkspaceConfig* workspace;
   BuildTarget* targets;
   BuildConfig* build;
-  HashMap* profiles;
+  HashMap* profiles;  // profile name -> ProfileConfig
 } AnvilConfig;
 
-// Sets up an ArgumentConfig structure based on the provided YAML node.
-void dset_argument_config (ArgumentConfig* acon, Node* node);
-
-// Sets up a DependencyConfig structure based on the provided YAML node.
-void dset_dependency_config (DependencyConfig* dcon, Node* node);
-
-// Sets up a WorkspaceConfig structure based on the provided YAML node.
-void dset_workspace_config (WorkspaceConfig* wconf, Node* node);
-
-// Sets up a ProfileConfig structure based on the provided YAML node.
-void dset_profile_config (HashMap* pconf, Node* node);
-
-// Sets up a TargetConfig structure based on the provided YAML node.
-void dset_target_config (BuildTarget* tconf, Node* node);
-
-// Sets up a BuildConfig structure based on the provided YAML node.
-void dset_build_config (BuildConfig* bconf, Node* node);
+// Lowering points every string into the YamlStore the manifest is parsed into and allocates
+// every struct and array from its arena. They are released with it, the free_* functions
+// only drop the hash maps
 
-// Sets up an AnvilConfig structure based on the provided YAML node.
-void dset_anvil_config (AnvilConfig* conf, Node* node);
+// Parse `manifest` into `store` and lower it into an AnvilConfig from the events of the
+// parser, no YAML tree is built. nullptr if the document is not a map
+AnvilConfig* lower_anvil_config (nstr manifest, YamlStore* store);
 
 void free_profile_config (HashMap* pconf);
 void free_target_config (BuildTarget* tconf);
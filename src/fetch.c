@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "fetch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_sha256.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+#include "cache.h"
+#include "runner.h"
+
+#define FETCH_LINE_SIZE 4096     // a manifest line, hash and relative path
+#define FETCH_READ_SIZE (1 << 14)  // 16 KB, files are hashed and compared in chunks
+
+// A single commit of one folder, blobs outside of it are never downloaded
+// $1 checkout, $2 remote, $3 ref, $4 folder (empty for the whole repo)
+static const char FETCH_SPARSE_SCRIPT[] =
+  "set -e\n"
+  "git init -q \"$1\"\n"
+  "cd \"$1\"\n"
+  "git remote add origin \"$2\"\n"
+  "if [ -n \"$4\" ]; then git sparse-checkout set \"$4\"; fi\n"
+  "git fetch -q --depth 1 --filter=blob:none origin \"$3\"\n"
+  "git checkout -q FETCH_HEAD\n";
+
+// A `github` dependency, as it is looked up in the user cache
+typedef struct {
+  const DependencyConfig* dep;
+  nstr ref;         // dep->ref, FETCH_DEFAULT_REF if unset
+  nstr path;        // dep->path without a leading `/`
+  String folder;    // path of a folder dependency without the trailing `/`
+  bool is_folder;   // path ends with `/`, checked out under <libs>/<name>
+  bool pinned;      // has a `ref`, its manifest is kept; HEAD moves, so it is not
+  bool fetched;     // downloaded and stored in the cache
+  String manifest;  // <root>/refs/<key>, `<sha-256>\t<relative path>` per file
+  String listing;   // what the manifest has, for a download of this run
+  String tmp;       // <root>/tmp/<key>.<pid>, the download or the checkout
+  u64 started;      // trace_now () when its process was spawned
+  u32 lane;         // trace lane of its process
+} FetchDep;
+
+static void drop_dep (FetchDep* fd) {
+  z3_drops (&fd->folder);
+  z3_drops (&fd->manifest);
+  z3_drops (&fd->listing);
+  z3_drops (&fd->tmp);
+}
+
+z3_vec_drop_fn (FetchDep, drop_dep);
+
+// $XDG_CACHE_HOME/anvil, or ~/.cache/anvil
+static void fetch_root (String* root) {
+  nstr xdg = getenv ("XDG_CACHE_HOME");  // NOLINT (concurrency-mt-unsafe)
+  nstr home = getenv ("HOME");           // NOLINT (concurrency-mt-unsafe)
+  if (xdg && xdg[0] == '/') {
+    z3_pushl (root, xdg, strlen (xdg));
+  } else if (home && home[0] != '\0') {
+    z3_pushl (root, home, strlen (home));
+    z3_pushlit (root, "/.cache");
+  } else {
+    die ("no user cache for dependencies, set XDG_CACHE_HOME or HOME\n");
+  }
+  z3_pushlit (root, "/" FETCH_DIR_NAME);
+}
+
+// SHA-256 of a whole file, false if it can't be read
+static bool digest_file (nstr path, u8 digest[Z3_SHA256_SIZE]) {
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return false;
+
+  Sha256 sha;
+  z3_sha256_init (&sha);
+  u8 buf[FETCH_READ_SIZE];
+  isize n = 0;
+  while ((n = read (fd, buf, sizeof (buf))) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    z3_sha256_update (&sha, buf, (usize)n);
+  }
+  close (fd);
+  z3_sha256_final (&sha, digest);
+  return n == 0;
+}
+
+// Whether two files have the same bytes, a digest alone is not trusted for what others
+// may have put in the cache
+static bool same_content (nstr a, nstr b) {
+  int fa = open (a, O_RDONLY);
+  int fb = fa < 0 ? -1 : open (b, O_RDONLY);
+  bool same = fa >= 0 && fb >= 0;
+
+  u8 ba[FETCH_READ_SIZE];
+  u8 bb[FETCH_READ_SIZE];
+  while (same) {
+    isize na = read (fa, ba, sizeof (ba));
+    if (na < 0 && errno == EINTR) continue;
+    if (na <= 0) {
+      // at the end of `a`, the end of `b` too
+      same = na == 0 && read (fb, bb, 1) == 0;
+      break;
+    }
+
+    // files may read short, fill as much of `b`
+    isize nb = 0;
+    while (nb < na) {
+      isize got = read (fb, bb + nb, (usize)(na - nb));
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) break;
+      nb += got;
+    }
+    same = nb == na && memcmp (ba, bb, (usize)na) == 0;
+  }
+
+  if (fa >= 0) close (fa);
+  if (fb >= 0) close (fb);
+  return same;
+}
+
+static String blob_path (const String* root, const u8 digest[Z3_SHA256_SIZE]) {
+  char hex[Z3_SHA256_HEX];
+  z3_sha256_hex (digest, hex);
+  String path = z3_strdup (root);
+  // first byte picks the folder
+  z3_pushf (&path, "/blobs/%.2s/%s", hex, hex);
+  return path;
+}
+
+static FetchDep fetch_dep_init (const DependencyConfig* dep, const String* root) {
+  FetchDep fd = {.dep = dep, .ref = dep->ref ? (nstr)dep->ref : FETCH_DEFAULT_REF};
+  fd.pinned = dep->ref != nullptr;
+  fd.path = (nstr)dep->path;
+  while (fd.path[0] == '/') fd.path++;
+
+  usize plen = strlen (fd.path);
+  fd.is_folder = plen == 0 || dep->path[strlen ((nstr)dep->path) - 1] == '/';
+  fd.folder = z3_str (plen + 1);
+  if (fd.is_folder) {
+    while (plen > 0 && fd.path[plen - 1] == '/') plen--;
+    z3_pushl (&fd.folder, fd.path, plen);
+  }
+
+  // NUL included, so `a` + `bc` and `ab` + `c` differ
+  Sha256 sha;
+  z3_sha256_init (&sha);
+  z3_sha256_update (&sha, dep->repo, strlen ((nstr)dep->repo) + 1);
+  z3_sha256_update (&sha, fd.ref, strlen (fd.ref) + 1);
+  z3_sha256_update (&sha, fd.path, strlen (fd.path) + 1);
+  u8 key[Z3_SHA256_SIZE];
+  z3_sha256_final (&sha, key);
+  char hex[Z3_SHA256_HEX];
+  z3_sha256_hex (key, hex);
+
+  fd.manifest = z3_strdup (root);
+  z3_pushf (&fd.manifest, "/refs/%s", hex);
+  fd.listing = z3_str (0);
+  fd.tmp = z3_strdup (root);
+  z3_pushf (&fd.tmp, "/tmp/%s.%d", hex, (int)getpid ());
+  return fd;
+}
+
+// Link a cached file at `dest`, unless it is already there
+static bool fetch_place (String* blob, String* dest) {
+  struct stat bs = {0};
+  if (stat ((nstr)blob->chr, &bs) != 0) return false;
+
+  struct stat ds = {0};
+  if (stat ((nstr)dest->chr, &ds) == 0) {
+    if (ds.st_dev == bs.st_dev && ds.st_ino == bs.st_ino) return true;
+
+    // a copy, the cache is on another filesystem
+    if (ds.st_size == bs.st_size && same_content ((nstr)dest->chr, (nstr)blob->chr))
+      return true;
+    unlink ((nstr)dest->chr);
+  }
+
+  create_parent_dirs (dest);
+  return cache_link_or_copy ((nstr)blob->chr, (nstr)dest->chr);
+}
+
+// Place every file of `listing` (as in a manifest) in `libs`, false if any is not cached
+static bool fetch_install (
+  const FetchDep* fd, const String* root, const String* libs, const String* listing
+) {
+  usize files = 0;
+  bool ok = true;
+  for (nstr line = (nstr)listing->chr; ok && *line;) {
+    nstr end = strchr (line, '\n');
+    usize len = end ? (usize)(end - line) : strlen (line);
+
+    u8 digest[Z3_SHA256_SIZE];
+    usize hex = Z3_SHA256_SIZE * 2;
+    if (len <= hex + 1 || line[hex] != '\t' || !z3_sha256_parse (line, digest)) {
+      ok = false;
+      break;
+    }
+
+    ScopedString blob = blob_path (root, digest);
+    ScopedString dest = z3_strdup (libs);
+    z3_pushc (&dest, '/');
+    if (fd->is_folder) {
+      z3_pushl (&dest, (nstr)fd->dep->name, strlen ((nstr)fd->dep->name));
+      z3_pushc (&dest, '/');
+    }
+    z3_pushl (&dest, line + hex + 1, len - hex - 1);
+    ok = fetch_place (&blob, &dest);
+    files++;
+    line = end ? end + 1 : line + len;
+  }
+  return ok && files > 0;
+}
+
+// Place a dependency from its cached manifest, false if it isn't fully cached
+static bool fetch_install_cached (const FetchDep* fd, const String* root, const String* libs) {
+  FILE* f = fopen ((nstr)fd->manifest.chr, "r");
+  if (!f) return false;
+
+  ScopedString listing = z3_str (FETCH_LINE_SIZE);
+  char line[FETCH_LINE_SIZE];
+  while (fgets (line, sizeof (line), f)) z3_pushl (&listing, line, strlen (line));
+  fclose (f);  // NOLINT (cert-err33-c)
+  return fetch_install (fd, root, libs, &listing);
+}
+
+// Whether a dependency without `ref` was placed in `libs` by an earlier run
+static bool fetch_placed (const FetchDep* fd, const String* libs) {
+  ScopedString dest = z3_strdup (libs);
+  z3_pushc (&dest, '/');
+  if (fd->is_folder) {
+    z3_pushl (&dest, (nstr)fd->dep->name, strlen ((nstr)fd->dep->name));
+  } else {
+    nstr base = strrchr (fd->path, '/');
+    base = base ? base + 1 : fd->path;
+    z3_pushl (&dest, base, strlen (base));
+  }
+
+  struct stat st = {0};
+  return stat ((nstr)dest.chr, &st) == 0 && S_ISDIR (st.st_mode) == fd->is_folder;
+}
+
+// Move a downloaded file into the blobs, named after its content and read only, since
+// every workspace has it hardlinked
+static bool fetch_store (const String* root, String* file, u8 digest[Z3_SHA256_SIZE]) {
+  if (!digest_file ((nstr)file->chr, digest)) return false;
+
+  ScopedString blob = blob_path (root, digest);
+  if (access ((nstr)blob.chr, F_OK) == 0) {
+    if (same_content ((nstr)file->chr, (nstr)blob.chr)) return true;
+    errpfmt ("'%s' in the dependency cache does not match its name, remove it\n", blob.chr);
+    return false;
+  }
+
+  create_parent_dirs (&blob);
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  chmod ((nstr)file->chr, 0444);
+  return rename ((nstr)file->chr, (nstr)blob.chr) == 0;
+}
+
+// Store every regular file under `dir`, listed in `manifest` relative to its first `base`
+// bytes; git metadata and symlinks are left out
+static bool fetch_store_dir (const String* root, String* dir, usize base, String* manifest) {
+  DIR* d = opendir ((nstr)dir->chr);
+  if (!d) return false;
+
+  usize len = dir->len;
+  bool ok = true;
+  struct dirent* ent = nullptr;
+  while (ok && (ent = readdir (d))) {  // NOLINT (concurrency-mt-unsafe)
+    nstr name = ent->d_name;
+    if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0 || strcmp (name, ".git") == 0)
+      continue;
+
+    dir->len = len;
+    z3_pushc (dir, '/');
+    z3_pushl (dir, name, strlen (name));
+
+    struct stat st = {0};
+    if (lstat ((nstr)dir->chr, &st) != 0) {
+      ok = false;
+    } else if (S_ISDIR (st.st_mode)) {
+      ok = fetch_store_dir (root, dir, base, manifest);
+    } else if (S_ISREG (st.st_mode)) {
+      u8 digest[Z3_SHA256_SIZE];
+      ok = fetch_store (root, dir, digest);
+      if (!ok) break;  // `digest` is only set on success
+
+      char hex[Z3_SHA256_HEX];
+      z3_sha256_hex (digest, hex);
+      z3_pushf (manifest, "%s\t%s\n", hex, dir->chr + base + 1);
+    }
+  }
+
+  dir->len = len;
+  dir->chr[len] = '\0';
+  closedir (d);  // NOLINT (cert-err33-c)
+  return ok;
+}
+
+static void remove_tree (String* path) {
+  struct stat st = {0};
+  if (lstat ((nstr)path->chr, &st) != 0) return;
+  if (!S_ISDIR (st.st_mode)) {
+    unlink ((nstr)path->chr);
+    return;
+  }
+
+  DIR* d = opendir ((nstr)path->chr);
+  if (d) {
+    usize len = path->len;
+    struct dirent* ent = nullptr;
+    while ((ent = readdir (d))) {  // NOLINT (concurrency-mt-unsafe)
+      if (strcmp (ent->d_name, ".") == 0 || strcmp (ent->d_name, "..") == 0) continue;
+      z3_pushc (path, '/');
+      z3_pushl (path, ent->d_name, strlen (ent->d_name));
+      remove_tree (path);
+      path->len = len;
+      path->chr[len] = '\0';
+    }
+    closedir (d);  // NOLINT (cert-err33-c)
+  }
+  rmdir ((nstr)path->chr);
+}
+
+// Store a finished download in the cache, the manifest is written last (and only with a
+// `ref`, what HEAD is changes)
+static bool fetch_finish (FetchDep* fd, const String* root) {
+  String* manifest = &fd->listing;
+  bool ok = false;
+
+  if (fd->is_folder) {
+    ScopedString dir = z3_strdup (&fd->tmp);
+    if (fd->folder.len > 0) {
+      z3_pushc (&dir, '/');
+      z3_pushl (&dir, (nstr)fd->folder.chr, fd->folder.len);
+    }
+
+    struct stat st = {0};
+    if (stat ((nstr)dir.chr, &st) != 0 || !S_ISDIR (st.st_mode)) {
+      errpfmt ("dependency '%s': %s has no folder '%s'\n", fd->dep->name, fd->dep->repo,
+               fd->folder.chr);
+    } else {
+      ok = fetch_store_dir (root, &dir, dir.len, manifest);
+    }
+  } else {
+    u8 digest[Z3_SHA256_SIZE];
+    char hex[Z3_SHA256_HEX];
+    nstr base = strrchr (fd->path, '/');
+    base = base ? base + 1 : fd->path;
+    ok = fetch_store (root, &fd->tmp, digest);
+    z3_sha256_hex (digest, hex);
+    if (ok) z3_pushf (manifest, "%s\t%s\n", hex, base);
+  }
+
+  ok = ok && manifest->len > 0;
+  if (ok && fd->pinned) {
+    create_parent_dirs (&fd->manifest);
+    ok = z3_write_atomic ((nstr)fd->manifest.chr, manifest);
+  }
+  remove_tree (&fd->tmp);
+  return ok;
+}
+
+// A single file from raw.githubusercontent.com, or a sparse checkout of a folder
+static void fetch_spawn (Runner* rn, FetchDep* fd, usize tag) {
+  const DependencyConfig* dep = fd->dep;
+  remove_tree (&fd->tmp);  // left over from an interrupted run
+  create_parent_dirs (&fd->tmp);
+
+  printf ("%12s %s (%s, %s)\n", "Fetching", dep->name, dep->repo, fd->ref);
+  fflush (stdout);  // NOLINT (cert-err33-c)
+
+  ScopedString url = z3_str (PATH_MAX);
+  if (fd->is_folder) {
+    z3_pushf (&url, "https://github.com/%s.git", dep->repo);
+    nstr argv[] = {"sh", "-c", FETCH_SPARSE_SCRIPT, "anvil-fetch", (nstr)fd->tmp.chr,
+                   (nstr)url.chr, fd->ref, (nstr)fd->folder.chr, nullptr};
+    runner_spawn (rn, argv, tag, nullptr);
+    return;
+  }
+
+  z3_pushf (&url, "https://raw.githubusercontent.com/%s/%s/%s", dep->repo, fd->ref, fd->path);
+  nstr argv[] = {"curl", "-fsSL", "--retry", "2", "-o", (nstr)fd->tmp.chr, (nstr)url.chr,
+                 nullptr};
+  runner_spawn (rn, argv, tag, nullptr);
+}
+
+// Download every dependency at once, each is stored as soon as it finishes
+static void fetch_run (Vector* deps, const String* root, Trace* tr) {
+  Runner rn;
+  // waiting on the network, not on a CPU, so no jobserver tokens
+  runner_init (&rn, deps->len < FETCH_MAX_JOBS ? deps->len : FETCH_MAX_JOBS, nullptr);
+
+  usize next = 0;
+  while (next < deps->len || rn.running > 0) {
+    while (next < deps->len && runner_has_slot (&rn)) {
+      FetchDep* fd = z3_get (*deps, next);
+      fd->started = trace_now (tr);
+      fd->lane = trace_lane (tr);
+      fetch_spawn (&rn, fd, next++);
+    }
+
+    usize tag = 0;
+    i32 status = 0;
+    if (!runner_reap (&rn, &tag, &status)) break;
+
+    FetchDep* fd = z3_get (*deps, tag);
+    trace_proc (tr, "fetch", (nstr)fd->dep->name, fd->started, fd->lane);
+    if (status != 0) {
+      errpfmt ("could not fetch '%s' from %s (exit %d)\n", fd->dep->name, fd->dep->repo,
+               status);
+      remove_tree (&fd->tmp);
+      continue;
+    }
+    fd->fetched = fetch_finish (fd, root);
+  }
+  runner_drop (&rn);
+}
+
+bool fetch_deps (const BuildConfig* bconf, const String* libs, Trace* tr, Vector* includes) {
+  if (!bconf || bconf->deps_count == 0) return true;
+
+  ScopedString root = {0};
+  ScopedVector_ (FetchDep) missing = z3_vec (FetchDep);
+  bool ok = true;
+
+  for (usize i = 0; i < bconf->deps_count; i++) {
+    const DependencyConfig* dep = &bconf->deps[i];
+    if (!dep->type || strcmp ((nstr)dep->type, "github") != 0) continue;
+
+    if (!dep->name || !dep->repo || !dep->path) {
+      errpfmt ("dependency '%s': `github` needs `name`, `repo` and `path`\n",
+               dep->name ? (nstr)dep->name : "?");
+      ok = false;
+      continue;
+    }
+    if (strchr ((nstr)dep->name, '/') || strcmp ((nstr)dep->name, "..") == 0) {
+      errpfmt ("dependency '%s': `name` must not be a path\n", dep->name);
+      ok = false;
+      continue;
+    }
+
+    if (root.len == 0) fetch_root (&root);
+    FetchDep fd = fetch_dep_init (dep, &root);
+    if (fd.is_folder) {
+      String inc = z3_strcpy ((cstr) "-I");
+      z3_pushl (&inc, (nstr)libs->chr, libs->len);
+      z3_pushc (&inc, '/');
+      z3_pushl (&inc, (nstr)dep->name, strlen ((nstr)dep->name));
+      z3_push (*includes, inc);
+    }
+
+    // once in the cache a `ref` is never downloaded again, a new one is a new entry. HEAD
+    // is fetched again only when it is gone from `libs`
+    bool placed = fd.pinned ? fetch_install_cached (&fd, &root, libs)
+                            : fetch_placed (&fd, libs);
+    if (placed) {
+      drop_dep (&fd);
+      continue;
+    }
+    z3_push (missing, fd);
+  }
+  if (missing.len == 0) return ok;
+
+  fetch_run (&missing, &root, tr);
+
+  for (usize i = 0; i < missing.len; i++) {
+    FetchDep* fd = z3_get (missing, i);
+    if (fd->fetched && fetch_install (fd, &root, libs, &fd->listing)) continue;
+    if (fd->fetched) errpfmt ("dependency '%s': could not place it in '%s'\n", fd->dep->name,
+                              libs->chr);
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define FETCH_DIR_NAME    "anvil"  // user cache, in $XDG_CACHE_HOME or ~/.cache
+#define FETCH_DEFAULT_REF "HEAD"   // `ref` of a dependency without one
+#define FETCH_MAX_JOBS    16       // downloads in flight
+
+// Place every `github` dependency of `bconf` in `libs`, the ones missing from the user cache
+// are downloaded all at once first. A folder dependency pushes its `-I` (String) to
+// `includes`, false if any dependency could not be fetched
+bool fetch_deps (const BuildConfig* bconf, const String* libs, Trace* tr, Vector* includes);
@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "hooks.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+#include "runner.h"
+
+#define HOOKS_ARG_PREFIX  "arg:"
+#define HOOKS_HOOK_PREFIX "hook:"
+#define HOOKS_READ_SIZE   4096
+
+// Entry of the cache file, followed by the name and the value
+typedef struct {
+  u64 fingerprint;
+  u32 name_len;
+  u32 value_len;
+} HookRecord;
+
+static void drop_entry (HookEntry* entry) {
+  z3_drops (&entry->value);
+  free (entry);
+}
+
+// Cache `next` under `name`, over `old` in place when there is one (taking `next.value`)
+static void hooks_put (Hooks* hk, nstr name, HookEntry* old, HookEntry next) {
+  if (old) {
+    z3_drops (&old->value);
+    *old = next;
+    return;
+  }
+
+  HookEntry* entry = malloc (sizeof (HookEntry));
+  if (entry == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (HookEntry));
+  *entry = next;
+  z3_hashmap_put (hk->cache, name, entry);
+}
+
+static void drop_hook (RuntimeHook* hook) {
+  z3_drops (&hook->name);
+  z3_drops (&hook->script);
+  z3_drop_vec (hook->argv);
+  free (hook);
+}
+
+static void hooks_load (Hooks* hk) {
+  ScopedString data = z3_str (HOOKS_READ_SIZE);
+  if (!z3_read_file ((nstr)hk->cache_path.chr, &data)) return;
+
+  u32 head[4];  // magic, version, count, padding
+  if (data.len < sizeof (head)) return;
+  memcpy (head, data.chr, sizeof (head));
+  if (head[0] != HOOKS_MAGIC || head[1] != HOOKS_VERSION) return;
+
+  usize pos = sizeof (head);
+  for (u32 i = 0; i < head[2]; i++) {
+    HookRecord rec;
+    if (data.len - pos < sizeof (rec)) return;
+    memcpy (&rec, data.chr + pos, sizeof (rec));
+    pos += sizeof (rec);
+
+    // truncated, keep what was read so far
+    if (data.len - pos < (usize)rec.name_len + rec.value_len) return;
+
+    ScopedString name = z3_str (rec.name_len + 1);
+    z3_pushl (&name, (nstr)data.chr + pos, rec.name_len);
+    pos += rec.name_len;
+
+    String value = z3_str (rec.value_len + 1);
+    z3_pushl (&value, (nstr)data.chr + pos, rec.value_len);
+    pos += rec.value_len;
+
+    // a later record of the same name wins
+    HookEntry next = {.value = value, .fingerprint = rec.fingerprint, .persist = true};
+    hooks_put (hk, (nstr)name.chr, z3_hashmap_get (hk->cache, (nstr)name.chr), next);
+  }
+}
+
+static bool hooks_save (Hooks* hk) {
+  ScopedString data = z3_str (HOOKS_READ_SIZE);
+  u32 head[4] = {HOOKS_MAGIC, HOOKS_VERSION, 0, 0};
+  z3_pushl (&data, (nstr)head, sizeof (head));
+
+  HashMapIterator it = z3_hashmap_iterator (hk->cache);
+  while (z3_hashmap_iter_next (&it)) {
+    HookEntry* entry = it.val;
+    if (!entry->persist) continue;
+
+    HookRecord rec = {
+      .fingerprint = entry->fingerprint,
+      .name_len = (u32)strlen (it.key),
+      .value_len = (u32)entry->value.len,
+    };
+    z3_pushl (&data, (nstr)&rec, sizeof (rec));
+    z3_pushl (&data, it.key, rec.name_len);
+    z3_pushl (&data, (nstr)entry->value.chr, entry->value.len);
+    head[2]++;
+  }
+  memcpy (data.chr, head, sizeof (head));
+
+  create_parent_dirs (&hk->cache_path);
+  return z3_write_atomic ((nstr)hk->cache_path.chr, &data);
+}
+
+void hooks_init (
+  Hooks* hk, AnvilConfig* config, const String* awd, const String* build_dir, bool fresh
+) {
+  *hk = (Hooks) {.config = config, .awd = z3_strdup (awd)};
+  hk->hooks = z3_hashmap_create ();
+  hk->cache = z3_hashmap_create ();
+
+  hk->cache_path = z3_strdup (build_dir);
+  z3_pushc (&hk->cache_path, '/');
+  z3_pushlit (&hk->cache_path, HOOKS_CACHE_NAME);
+
+  // values computed by this build still get saved
+  if (!fresh) hooks_load (hk);
+}
+
+void hooks_drop (Hooks* hk) {
+  if (hk->dirty && !hooks_save (hk))
+    errpfmt ("could not write the hook cache to '%s'\n", hk->cache_path.chr);
+
+  HashMapIterator it = z3_hashmap_iterator (hk->hooks);
+  while (z3_hashmap_iter_next (&it)) drop_hook (it.val);
+  z3_hashmap_drop_shallow (hk->hooks);
+
+  it = z3_hashmap_iterator (hk->cache);
+  while (z3_hashmap_iter_next (&it)) drop_entry (it.val);
+  z3_hashmap_drop_shallow (hk->cache);
+
+  z3_drops (&hk->awd);
+  z3_drops (&hk->cache_path);
+}
+
+static CachePolicy parse_cache_policy (nstr name, cstr value) {
+  if (!value || strcmp ((nstr)value, "never") == 0) return CACHE_POLICY_NEVER;
+  if (strcmp ((nstr)value, "memoize") == 0) return CACHE_POLICY_MEMOIZE;
+  if (strcmp ((nstr)value, "always") == 0) return CACHE_POLICY_ALWAYS;
+  die ("%s: unknown cache_policy '%s', expected never, memoize or always\n", name, value);
+}
+
+static ValidateStr parse_validation (nstr name, cstr value) {
+  if (!value || strcmp ((nstr)value, "none") == 0) return VALIDATE_STR_OFF;
+  if (strcmp ((nstr)value, "status") == 0) return VALIDATE_STR_COMPACT;
+  if (strcmp ((nstr)value, "content") == 0) return VALIDATE_STR_CONTENT;
+  if (strcmp ((nstr)value, "all") == 0) return VALIDATE_STR_STRICT;
+  die ("%s: unknown validation '%s', expected none, status, content or all\n", name, value);
+}
+
+static ArgumentConfig* find_argument_config (HashMap* map, nstr name) {
+  return map ? z3_hashmap_get (map, name) : nullptr;
+}
+
+static void hook_set_policy (RuntimeHook* hook, ArgumentConfig* conf) {
+  nstr name = (nstr)hook->name.chr;
+  hook->cache = parse_cache_policy (name, conf ? conf->cache_policy : nullptr);
+  hook->valid = parse_validation (name, conf ? conf->validation : nullptr);
+}
+
+RuntimeHook* hooks_get (Hooks* hk, cstr ref, usize len) {
+  u64 hash = z3_hash_key (ref, len);
+  RuntimeHook* hook = z3_hashmap_get_hashed (hk->hooks, (nstr)ref, len, hash);
+  if (hook) return hook;
+
+  ScopedString name = z3_str (len + 1);
+  z3_pushl (&name, (nstr)ref, len);
+
+  usize alen = sizeof (HOOKS_ARG_PREFIX) - 1;
+  usize hlen = sizeof (HOOKS_HOOK_PREFIX) - 1;
+  bool is_arg = len > alen && memcmp (ref, HOOKS_ARG_PREFIX, alen) == 0;
+  bool is_hook = len > hlen && memcmp (ref, HOOKS_HOOK_PREFIX, hlen) == 0;
+  if (!is_arg && !is_hook) return nullptr;
+
+  hook = malloc (sizeof (RuntimeHook));
+  if (hook == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (RuntimeHook));
+  *hook = (RuntimeHook) {.name = z3_strdup (&name), .hash = hash, .argv = z3_vec (nstr)};
+
+  BuildConfig* bconf = hk->config->build;
+  nstr null = nullptr;
+  if (is_arg) {
+    nstr key = (nstr)name.chr + alen;
+    ArgumentConfig* conf = find_argument_config (bconf ? bconf->arguments : nullptr, key);
+    if (!conf || conf->command_len == 0) die ("argument '%s' has no `command`\n", key);
+
+    hook_set_policy (hook, conf);
+    for (usize i = 0; i < conf->command_len; i++) {
+      nstr arg = (nstr)conf->command[i];
+      if (!arg) die ("argument '%s': every `command` item must be a string\n", key);
+      z3_push (hook->argv, arg);
+    }
+  } else {
+    nstr key = (nstr)name.chr + hlen;
+    hook_set_policy (hook, find_argument_config (bconf ? bconf->hooks : nullptr, key));
+
+    hook->script = z3_strdup (&hk->awd);
+    z3_pushlit (&hook->script, "/" HOOKS_DIR_NAME "/");
+    z3_pushl (&hook->script, key, strlen (key));
+    // NOLINTNEXTLINE (concurrency-mt-unsafe)
+    if (access ((nstr)hook->script.chr, R_OK) != 0)
+      die ("hook '%s': %s: %s\n", key, hook->script.chr, strerror (errno));
+
+    // scripts don't need to be executable
+    if (access ((nstr)hook->script.chr, X_OK) != 0) {
+      nstr shell = "bash";
+      z3_push (hook->argv, shell);
+    }
+    nstr script = (nstr)hook->script.chr;
+    z3_push (hook->argv, script);
+  }
+  z3_push (hook->argv, null);
+
+  z3_hashmap_put (hk->hooks, (nstr)name.chr, hook);
+  return hook;
+}
+
+// A value, not a line
+static void trim_value (String* out) {
+  while (out->len > 0 && (out->chr[out->len - 1] == '\n' || out->chr[out->len - 1] == '\r'))
+    out->len--;
+  if (out->chr) out->chr[out->len] = '\0';
+}
+
+bool hooks_run (Hooks* hk, RuntimeHook* hook, String* out) {
+  RunnerSpawn how = {.dir = (nstr)hk->awd.chr, .out = out};
+  bool ok = runner_run (hook->argv.val, &how) == 0;
+  trim_value (out);
+  return ok;
+}
+
+// `<awd>/.git`, or where a `.git` file (worktrees, submodules) points to
+static void git_dir (Hooks* hk, String* dir) {
+  z3_pushl (dir, (nstr)hk->awd.chr, hk->awd.len);
+  z3_pushlit (dir, "/.git");
+
+  struct stat st;
+  if (stat ((nstr)dir->chr, &st) != 0 || S_ISDIR (st.st_mode)) return;
+
+  ScopedString link = z3_str (PATH_MAX);
+  if (!z3_read_file ((nstr)dir->chr, &link) || strncmp ((nstr)link.chr, "gitdir: ", 8) != 0)
+    return;
+  while (link.len > 0 && (link.chr[link.len - 1] == '\n' || link.chr[link.len - 1] == '\r'))
+    link.len--;
+
+  nstr target = (nstr)link.chr + 8;  // NOLINT (readability-magic-numbers)
+  usize tlen = link.len - 8;         // NOLINT (readability-magic-numbers)
+  dir->len = 0;
+  if (target[0] != '/') {
+    z3_pushl (dir, (nstr)hk->awd.chr, hk->awd.len);
+    z3_pushc (dir, '/');
+  }
+  z3_pushl (dir, target, tlen);
+}
+
+static u64 hash_stat (u64 h, const String* path) {
+  struct stat st;
+  if (stat ((nstr)path->chr, &st) != 0) return z3_hash_bytes (h, "-", 1);
+
+  h = z3_hash_bytes (h, &st.st_ino, sizeof (st.st_ino));
+  h = z3_hash_bytes (h, &st.st_size, sizeof (st.st_size));
+  h = z3_hash_bytes (h, &st.st_mtim.tv_sec, sizeof (st.st_mtim.tv_sec));
+  return z3_hash_bytes (h, &st.st_mtim.tv_nsec, sizeof (st.st_mtim.tv_nsec));
+}
+
+static void git_path (String* path, const String* dir, nstr name) {
+  path->len = 0;
+  z3_pushl (path, (nstr)dir->chr, dir->len);
+  z3_pushc (path, '/');
+  z3_pushl (path, name, strlen (name));
+}
+
+// stat of .git/HEAD and .git/index: commits, checkouts and staging
+static u64 git_status_id (Hooks* hk) {
+  if (hk->status_id != 0) return hk->status_id;
+
+  ScopedString dir = z3_str (PATH_MAX);
+  ScopedString path = z3_str (PATH_MAX);
+  git_dir (hk, &dir);
+
+  git_path (&path, &dir, "HEAD");
+  u64 h = hash_stat (Z3_HASH_SEED, &path);
+  git_path (&path, &dir, "index");
+  h = hash_stat (h, &path);
+
+  hk->status_id = h == 0 ? 1 : h;
+  return hk->status_id;
+}
+
+// What HEAD points to: the branch, and the commit it is at
+static u64 git_content_id (Hooks* hk) {
+  if (hk->content_id != 0) return hk->content_id;
+
+  ScopedString dir = z3_str (PATH_MAX);
+  ScopedString path = z3_str (PATH_MAX);
+  ScopedString head = z3_str (PATH_MAX);
+  git_dir (hk, &dir);
+
+  git_path (&path, &dir, "HEAD");
+  z3_read_file ((nstr)path.chr, &head);
+  u64 h = z3_hash_bytes (Z3_HASH_SEED, head.chr, head.len);
+
+  // a branch, its commit is in a loose ref or in packed-refs
+  if (strncmp ((nstr)head.chr, "ref: ", 5) == 0) {
+    while (head.len > 0 && (head.chr[head.len - 1] == '\n' || head.chr[head.len - 1] == '\r'))
+      head.chr[--head.len] = '\0';
+
+    ScopedString ref = z3_str (PATH_MAX);
+    git_path (&path, &dir, (nstr)head.chr + 5);  // NOLINT (readability-magic-numbers)
+    if (!z3_read_file ((nstr)path.chr, &ref)) {
+      git_path (&path, &dir, "packed-refs");
+      z3_read_file ((nstr)path.chr, &ref);
+    }
+    h = z3_hash_bytes (h, ref.chr, ref.len);
+  }
+
+  hk->content_id = h == 0 ? 1 : h;
+  return hk->content_id;
+}
+
+// The command (or hook script) and the validation inputs of a hook
+static u64 hooks_fingerprint (Hooks* hk, RuntimeHook* hook) {
+  u64 h = Z3_HASH_SEED;
+  for (usize i = 0; i + 1 < hook->argv.len; i++) {
+    nstr arg = *(nstr*)z3_get (hook->argv, i);
+    // NUL included, so `a b` and `ab` differ
+    h = z3_hash_bytes (h, arg, strlen (arg) + 1);
+  }
+  if (hook->script.chr) h = hash_stat (h, &hook->script);
+
+  if (hook->valid == VALIDATE_STR_COMPACT || hook->valid == VALIDATE_STR_STRICT) {
+    u64 id = git_status_id (hk);
+    h = z3_hash_bytes (h, &id, sizeof (id));
+  }
+  if (hook->valid == VALIDATE_STR_CONTENT || hook->valid == VALIDATE_STR_STRICT) {
+    u64 id = git_content_id (hk);
+    h = z3_hash_bytes (h, &id, sizeof (id));
+  }
+
+  return h;
+}
+
+// Entry of a hook in the cache, its name is hashed once for every lookup
+static HookEntry* hooks_cached (Hooks* hk, const RuntimeHook* hook) {
+  nstr name = (nstr)hook->name.chr;
+  return z3_hashmap_get_hashed (hk->cache, name, hook->name.len, hook->hash);
+}
+
+bool hooks_validate (Hooks* hk, RuntimeHook* hook) {
+  HookEntry* entry = hooks_cached (hk, hook);
+  if (!entry) return false;
+
+  // computed by this build
+  if (!entry->persist) return true;
+
+  switch (hook->cache) {
+    case CACHE_POLICY_NEVER:
+      return false;
+    case CACHE_POLICY_ALWAYS:
+      return true;
+    default:
+      return entry->fingerprint == hooks_fingerprint (hk, hook);
+  }
+}
+
+const String* hooks_get_cache (Hooks* hk, RuntimeHook* hook) {
+  if (!hooks_validate (hk, hook)) return nullptr;
+
+  HookEntry* entry = hooks_cached (hk, hook);
+  return &entry->value;
+}
+
+// `persist` false keeps the value for this build only
+static void hooks_store (Hooks* hk, RuntimeHook* hook, const String* value, bool persist) {
+  HookEntry next = {.value = z3_strdup (value), .persist = persist};
+  if (persist) next.fingerprint = hooks_fingerprint (hk, hook);
+
+  HookEntry* old = hooks_cached (hk, hook);
+  if (persist || old) hk->dirty = true;
+  hooks_put (hk, (nstr)hook->name.chr, old, next);
+}
+
+void hooks_set_cache (Hooks* hk, RuntimeHook* hook, const String* value) {
+  hooks_store (hk, hook, value, hook->cache != CACHE_POLICY_NEVER);
+}
+
+void hooks_drop_cache (Hooks* hk, RuntimeHook* hook) {
+  HookEntry* entry = hooks_cached (hk, hook);
+  if (!entry) return;
+
+  // the map frees the entry itself
+  z3_drops (&entry->value);
+  z3_hashmap_remove (hk->cache, (nstr)hook->name.chr);
+  hk->dirty = true;
+}
+
+// Cache the output of a hook that ran, an empty value for this build only if it failed
+static void hook_finish (Hooks* hk, RuntimeHook* hook, String* value, bool ok) {
+  if (ok) {
+    hooks_set_cache (hk, hook, value);
+    return;
+  }
+
+  errpfmt ("%s failed, its value is empty\n", hook->name.chr);
+  value->len = 0;
+  value->chr[0] = '\0';
+  // don't keep a failure for the next build
+  hooks_store (hk, hook, value, false);
+}
+
+bool hooks_eval (Hooks* hk, cstr ref, usize len, String* out) {
+  RuntimeHook* hook = hooks_get (hk, ref, len);
+  if (!hook) return false;
+
+  const String* cached = hooks_get_cache (hk, hook);
+  if (!cached) {
+    ScopedString value = z3_str (HOOKS_READ_SIZE);
+    u64 started = trace_now (hk->trace);
+    u32 lane = trace_lane (hk->trace);
+    hook_finish (hk, hook, &value, hooks_run (hk, hook, &value));
+    trace_proc (hk->trace, "hooks", (nstr)hook->name.chr, started, lane);
+    cached = hooks_get_cache (hk, hook);
+  }
+
+  z3_pushl (out, (nstr)cached->chr, cached->len);
+  return true;
+}
+
+void hooks_collect (Hooks* hk, const Template* tmpl) {
+  for (usize i = 0; i < tmpl->count; i++) {
+    const TemplatePart* part = &tmpl->parts[i];
+    if (part->placeholder) hooks_get (hk, part->text.chr, part->text.len);
+  }
+}
+
+// A hook of the batch, while it runs
+typedef struct {
+  RuntimeHook* hook;
+  String out;   // stdout so far
+  u64 started;  // trace_now () at spawn
+  u32 lane;     // trace lane while it runs
+  bool ok;      // exited with 0
+} HookJob;
+
+void hooks_run_pending (Hooks* hk) {
+  ScopedVector jobs = z3_vec (HookJob);
+  HashMapIterator it = z3_hashmap_iterator (hk->hooks);
+  while (z3_hashmap_iter_next (&it)) {
+    RuntimeHook* hook = it.val;
+    if (hooks_validate (hk, hook)) continue;
+
+    HookJob job = {.hook = hook, .out = z3_str (HOOKS_READ_SIZE)};
+    z3_push (jobs, job);
+  }
+  if (jobs.len == 0) return;
+
+  // all at once, the batch takes as long as the slowest hook
+  Runner rn;
+  runner_init (&rn, jobs.len, nullptr);
+  for (usize i = 0; i < jobs.len; i++) {
+    HookJob* job = z3_get (jobs, i);
+    job->started = trace_now (hk->trace);
+    job->lane = trace_lane (hk->trace);
+    RunnerSpawn how = {.dir = (nstr)hk->awd.chr, .out = &job->out};
+    runner_spawn (&rn, job->hook->argv.val, i, &how);
+  }
+
+  usize tag = 0;
+  i32 status = 0;
+  while (runner_reap (&rn, &tag, &status)) {
+    HookJob* job = z3_get (jobs, tag);
+    trace_proc (hk->trace, "hooks", (nstr)job->hook->name.chr, job->started, job->lane);
+    job->ok = status == 0;
+  }
+  runner_drop (&rn);
+
+  for (usize i = 0; i < jobs.len; i++) {
+    HookJob* job = z3_get (jobs, i);
+    trim_value (&job->out);
+    hook_finish (hk, job->hook, &job->out, job->ok);
+    z3_drops (&job->out);
+  }
+}
@@ -5,63 +5,95 @@
 
 #include <notrust.h>
 #include <stdint.h>
+#include <z3_hashmap.h>
 #include <z3_string.h>
 #include <z3_toys.h>
 #include <z3_vector.h>
 
 #include "config.h"
+#include "trace.h"
 
+#define HOOKS_DIR_NAME   "hooks"
+#define HOOKS_CACHE_NAME ".hooks"
+#define HOOKS_MAGIC      0x4B4F4F48  // "HOOK"
+#define HOOKS_VERSION    1
+
+// What invalidates a cached value, besides the command itself
 typedef enum {
-  VALIDATE_STR_OFF,
-  VALIDATE_STR_COMPACT,
-  VALIDATE_STR_CONTENT,
-  VALIDATE_STR_STRICT
+  VALIDATE_STR_OFF,      // `none`, nothing
+  VALIDATE_STR_COMPACT,  // `status`, stat of .git/HEAD and .git/index
+  VALIDATE_STR_CONTENT,  // `content`, the commit HEAD points to
+  VALIDATE_STR_STRICT    // `all`, both of the above
 } ValidateStr;
 
 typedef enum {
-  CACHE_POLICY_NEVER,
-  CACHE_POLICY_MEMOIZE,
-  CACHE_POLICY_ALWAYS
+  CACHE_POLICY_NEVER,    // run on every build
+  CACHE_POLICY_MEMOIZE,  // reuse the last value while it validates
+  CACHE_POLICY_ALWAYS    // reuse the last value, no matter what
 } CachePolicy;
 
+// An argument or hook referenced from the config
 typedef struct {
-  String name;
-  ValidateStr valid;
-  CachePolicy cache;
+  String name;        // `arg:<name>` or `hook:<name>`, as written in `#{...}`
+  u64 hash;           // z3_hash_key of `name`, the key in `hooks` and `cache`
+  ValidateStr valid;  // from `validation`
+  CachePolicy cache;  // from `cache_policy`
+  Vector argv;        // nstr, nullptr terminated command
+  String script;      // hooks/<name>, empty for arguments
 } RuntimeHook;
 
+// Value of a hook, as stored in the cache file
 typedef struct {
-  RuntimeHook* value;
-  Vector* chest;
-} HashItem;
+  u64 fingerprint;  // what the value was computed from
+  String value;     // stdout, without the trailing newline
+  bool persist;     // written back to disk (not for CACHE_POLICY_NEVER)
+} HookEntry;
 
-// linked list of collitions
+// Hooks of a build, and their cache
 typedef struct {
-  usize val;   // points to the value
-  usize next;  // next item
-  bool leaf;   // if there is a next item
-} CollidedItem;
+  AnvilConfig* config;
+  String awd;         // project root, where hooks run
+  String cache_path;  // <build>/HOOKS_CACHE_NAME
+  HashMap* hooks;     // name -> RuntimeHook*
+  HashMap* cache;     // name -> HookEntry*
+  u64 status_id;      // VALIDATE_STR_COMPACT inputs, 0 until computed
+  u64 content_id;     // VALIDATE_STR_CONTENT inputs, 0 until computed
+  bool dirty;         // cache changed since it was loaded
+  Trace* trace;       // where hook runs are traced, nullptr when not tracing
+} Hooks;
+
+// Load the hook cache of `build_dir`, `fresh` ignores every cached value
+void hooks_init (
+  Hooks* hk, AnvilConfig* config, const String* awd, const String* build_dir, bool fresh
+);
+
+// Write the cache back if it changed and free everything
+void hooks_drop (Hooks* hk);
+
+// Resolve `arg:<name>` or `hook:<name>`, nullptr if it is neither
+RuntimeHook* hooks_get (Hooks* hk, cstr ref, usize len);
 
-// Load all hooks from folder and config
-Vector hooks_get_list (AnvilConfig config);
+// Run a hook and capture its stdout, false if it can't be run or fails
+bool hooks_run (Hooks* hk, RuntimeHook* hook, String* out);
 
-// Run and get result of a hook by its name.
-String hooks_run (String name);
+// Cached value of a hook, nullptr if there is none or it doesn't validate
+const String* hooks_get_cache (Hooks* hk, RuntimeHook* hook);
 
-// Get the cached result of a hook by its name.
-String hooks_get_cache (String name);
+// Set or update the cache for a hook
+void hooks_set_cache (Hooks* hk, RuntimeHook* hook, const String* value);
 
-// Set or update the cache for a specific hook.
-void hooks_set_cache (String name, String value);
+// Whether the cached value of a hook is still valid under its policy and validation
+bool hooks_validate (Hooks* hk, RuntimeHook* hook);
 
-// Get the error message associated with a specific hook.
-String hooks_get_error_message (String name);
+// Drop the cached value of a hook
+void hooks_drop_cache (Hooks* hk, RuntimeHook* hook);
 
-// Validate the configuration or state of a hook.
-bool hooks_validate (String name);
+// Value of `#{arg:...}` or `#{hook:...}`, from the cache or by running it
+bool hooks_eval (Hooks* hk, cstr ref, usize len, String* out);
 
-// Drop the cache for a specific hook (if invalid or no longer needed).
-void hooks_drop_cache (String name);
+// Resolve every `#{arg:...}` and `#{hook:...}` of a compiled template, for hooks_run_pending
+void hooks_collect (Hooks* hk, const Template* tmpl);
 
-// Clear the entire list of hooks (resets all hooks).
-void hooks_clear_list (void);
+// Run every resolved hook without a valid cached value at once and cache their
+// results, stdout of each is read through a pipe in a single poll() loop
+void hooks_run_pending (Hooks* hk);
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+
+#include "runner.h"
+
+#define JOBSERVER_AUTH     "--jobserver-auth="
+#define JOBSERVER_FDS      "--jobserver-fds="  // make before 4.2
+#define JOBSERVER_FIFO     "fifo:"
+#define JOBSERVER_FD_PATH  64
+
+// The value of the last jobserver option in `flags` (make uses the last one), nullptr if
+// there is none. `len` is its length, the words of MAKEFLAGS are space separated
+static nstr find_auth (nstr flags, usize* len) {
+  nstr found = nullptr;
+  for (nstr at = flags; *at;) {
+    while (*at == ' ') at++;
+    nstr end = at;
+    while (*end && *end != ' ') end++;
+
+    usize wlen = (usize)(end - at);
+    usize auth = strlen (JOBSERVER_AUTH);
+    usize fds = strlen (JOBSERVER_FDS);
+    if (wlen > auth && strncmp (at, JOBSERVER_AUTH, auth) == 0) {
+      found = at + auth;
+      *len = wlen - auth;
+    } else if (wlen > fds && strncmp (at, JOBSERVER_FDS, fds) == 0) {
+      found = at + fds;
+      *len = wlen - fds;
+    }
+    at = end;
+  }
+  return found;
+}
+
+// A descriptor of its own for the pipe behind `fd`, non-blocking without changing the
+// one every other process of the tree shares (and may block on). -1 on failure
+static int open_private (int fd) {
+  char path[JOBSERVER_FD_PATH];
+  snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);  // NOLINT (cert-err33-c)
+  return open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+// An inherited descriptor that is still the jobserver pipe, make closes them (and they may
+// be reused) for commands it does not consider recursive
+static bool is_pipe (int fd) {
+  struct stat st;
+  return fd >= 0 && fstat (fd, &st) == 0 && S_ISFIFO (st.st_mode);
+}
+
+static bool join (Jobserver* js, nstr auth, usize len) {
+  ScopedString value = z3_str (len + 1);
+  z3_pushl (&value, auth, len);
+  nstr text = (nstr)value.chr;
+
+  usize fifo = strlen (JOBSERVER_FIFO);
+  if (strncmp (text, JOBSERVER_FIFO, fifo) == 0) {
+    // read and write on one descriptor, a write only open would need a reader already
+    int fd = open (text + fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return false;
+    js->rfd = fd;
+    js->wfd = fd;
+    return true;
+  }
+
+  int rfd = -1;
+  int wfd = -1;
+  if (sscanf (text, "%d,%d", &rfd, &wfd) != 2) return false;
+  if (!is_pipe (rfd) || !is_pipe (wfd)) return false;
+
+  js->rfd = open_private (rfd);
+  js->wfd = wfd;
+  return js->rfd >= 0;
+}
+
+static void serve (Jobserver* js, usize jobs) {
+  if (jobs == 0) jobs = runner_default_jobs ();
+  // not close on exec, children find them from MAKEFLAGS
+  if (pipe (js->pipe) != 0) return;
+
+  js->rfd = open_private (js->pipe[0]);
+  if (js->rfd < 0) {
+    close (js->pipe[0]);
+    close (js->pipe[1]);
+    js->pipe[0] = -1;
+    js->pipe[1] = -1;
+    return;
+  }
+  js->wfd = js->pipe[1];
+  js->owned = true;
+
+  // every process has a job for free, this one included
+  u8 token = JOBSERVER_TOKEN;
+  for (usize i = 1; i < jobs; i++) {
+    while (write (js->wfd, &token, 1) < 0 && errno == EINTR);
+  }
+
+  nstr before = getenv ("MAKEFLAGS");  // NOLINT (concurrency-mt-unsafe)
+  js->had_flags = before != nullptr;
+  js->makeflags = z3_strcpy ((cstr)(before ? before : ""));
+
+  ScopedString flags = z3_strdup (&js->makeflags);
+  if (flags.len > 0) z3_pushc (&flags, ' ');
+  z3_pushf (&flags, "-j%zu " JOBSERVER_AUTH "%d,%d", jobs, js->pipe[0], js->pipe[1]);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (setenv ("MAKEFLAGS", (nstr)flags.chr, 1) != 0) die ("could not set MAKEFLAGS\n");
+}
+
+void jobserver_init (Jobserver* js, usize jobs) {
+  *js = (Jobserver) {.rfd = -1, .wfd = -1, .pipe = {-1, -1}};
+
+  nstr flags = getenv ("MAKEFLAGS");  // NOLINT (concurrency-mt-unsafe)
+  usize len = 0;
+  nstr auth = flags ? find_auth (flags, &len) : nullptr;
+  if (auth && join (js, auth, len)) return;
+  if (auth) errpfmt ("the jobserver in MAKEFLAGS can't be used, serving one instead\n");
+
+  serve (js, jobs);
+}
+
+void jobserver_drop (Jobserver* js) {
+  if (js->rfd >= 0) close (js->rfd);
+  if (js->owned) {
+    close (js->pipe[0]);
+    close (js->pipe[1]);
+    if (js->had_flags)
+      setenv ("MAKEFLAGS", (nstr)js->makeflags.chr, 1);  // NOLINT (concurrency-mt-unsafe)
+    else
+      unsetenv ("MAKEFLAGS");  // NOLINT (concurrency-mt-unsafe)
+  }
+  z3_drops (&js->makeflags);
+  *js = (Jobserver) {.rfd = -1, .wfd = -1, .pipe = {-1, -1}};
+}
+
+bool jobserver_take (Jobserver* js, u8* token) {
+  if (js->rfd < 0) return false;
+  while (true) {
+    isize n = read (js->rfd, token, 1);
+    if (n == 1) return true;
+    if (n < 0 && errno == EINTR) continue;
+    return false;
+  }
+}
+
+void jobserver_give (Jobserver* js, u8 token) {
+  if (js->wfd < 0) return;
+  while (write (js->wfd, &token, 1) < 0 && errno == EINTR);
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_string.h>
+
+#define JOBSERVER_TOKEN '+'  // what GNU make puts in the pipe, any byte is given back as read
+
+// GNU make's jobserver: a pipe of tokens, one per job the whole process tree may run on
+// top of the one every process has for free. Joined from `--jobserver-auth` in MAKEFLAGS
+// (`R,W` inherited descriptors or `fifo:PATH`), or created and exported there, so nested
+// anvil and make runs in hooks and scripts take their jobs from the same budget
+typedef struct {
+  int rfd;           // private non-blocking descriptor tokens are taken from, -1 if none
+  int wfd;           // where tokens are given back
+  int pipe[2];       // the pipe children inherit, when this process serves it
+  bool owned;        // created here and exported in MAKEFLAGS
+  String makeflags;  // MAKEFLAGS before it was exported, given back by jobserver_drop
+  bool had_flags;    // MAKEFLAGS was set at all
+} Jobserver;
+
+// Join the jobserver of MAKEFLAGS, or serve one with `jobs` (0 -> one per CPU) for the
+// whole tree. Falls back to no jobserver (each pool only bounds itself) if neither works
+void jobserver_init (Jobserver* js, usize jobs);
+
+// Stop serving (MAKEFLAGS is restored) or leave a joined one
+void jobserver_drop (Jobserver* js);
+
+// Take a token without waiting for one, false if there is none free
+bool jobserver_take (Jobserver* js, u8* token);
+
+// Give back a token taken with jobserver_take
+void jobserver_give (Jobserver* js, u8 token);
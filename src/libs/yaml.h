@@ -21,8 +21,10 @@
  * - Tokenizing YAML input.
  * - Parsing YAML maps, sequences, strings, numbers, and booleans.
  * - Error handling with detailed messages for common YAML issues.
+ * - Streaming the same document as events (`YamlHandler`), without building the tree.
  *
- * The end result is a tree of nodes that represents the structured YAML data.
+ * The end result is a tree of nodes that represents the structured YAML data, built by the
+ * parser itself out of those events.
  */
 #pragma once
 
@@ -33,6 +35,7 @@
 #endif
 
 #include <notrust.h>
+#include <z3_arena.h>
 #include <z3_vector.h>
 
 #ifdef _YAML_TEST
@@ -44,6 +47,8 @@
 #define HEAP_VALUE_MIN_SIZE   8          // small values: keys, booleans
 #define STR_ALLOC_SIZE_BASE   512        // base string length, pools
 #define NODE_INITIAL_CAPACITY 8          // typical YAML node child count
+#define YAML_MAP_INDEX_MIN    16         // maps this big get a hash index
+#define YAML_INTERN_CAPACITY  64         // initial slots of the intern table
 #define YAML_CHUNK_SIZE       (1 << 12)  // 4 KB (page-aligned I/O)
 
 // Single characters with specific meanings in YAML syntax
@@ -133,8 +138,10 @@ typedef struct {
 
 // Map entry with key-value pair
 typedef struct {
-  cstr key;   // Key string
-  Node* val;  // Associated value node
+  cstr key;     // Key string
+  Node* val;    // Associated value node
+  u32 hash;     // FNV-1a of the key, truncated
+  bool merged;  // from `<<`, an explicit key replaces it
 } YamlMapEntry;
 
 // Map (object) representation
@@ -142,65 +149,95 @@ typedef struct {
   usize size;             // Current number of entries
   usize capacity;         // Allocated capacity
   YamlMapEntry* entries;  // Array of map entries
+  u32* index;             // entry index + 1 by hash, nullptr under YAML_MAP_INDEX_MIN
+  usize index_cap;        // slots in the index, a power of 2, at most half of them used
 } YamlMap;
 
+// Aliases share the node, every node is freed at once with the store arena
 struct Node {
-  NodeKind kind;        // Type of node
-  unsigned int rcount;  // Reference count (for &name -> *name)
+  NodeKind kind;    // Type of node
   union {
-    cstr string;        // String node value
-    f64 number;         // Numeric node value
-    bool boolean;       // Boolean node value
-    YamlList list;      // Sequence node value
-    YamlMap map;        // Map node value
+    cstr string;    // String node value
+    f64 number;     // Numeric node value
+    bool boolean;   // Boolean node value
+    YamlList list;  // Sequence node value
+    YamlMap map;    // Map node value
   };
 };
 
-// Alias/anchor representation
+// Interned key or anchor name, equal strings share one copy
 typedef struct {
-  cstr name;    // Anchor name
-  Node* value;  // Referenced node
-} YamlAlias;
-
-// List of defined aliases
-typedef struct {
-  YamlAlias* items;  // Array of aliases
-  usize length;      // Number of aliases
-} YamlAliasList;
+  cstr str;      // Shared copy, NUL terminated, nullptr for a free slot
+  u32 hash;      // FNV-1a of the string, truncated
+  u32 len;       // String length
+  Node* anchor;  // Node of `&str`, nullptr if there is no such anchor (yet)
+} YamlIntern;
 
 // Token representation with detailed metadata
 typedef struct {
   TokenKind kind;  // Type of token
   u32 length;      // Token length
-  cstr raw;        // Starting position in input
+  cstr raw;        // Starting position in input, interned for keys, anchors and aliases
+  u32 hash;        // Hash of raw, for interned tokens
 } Token;
 
 typedef struct {
   Vector str_pools;
   Vector owned_strs;
+  ustr map;             // file mapping of parse_yaml_mmap, nullptr otherwise
+  usize map_len;        // length of the mapping, including the trailing NUL
+  Arena arena;          // nodes, map entries and list items
+  YamlIntern* interns;  // open addressing table of keys and anchor names
+  usize intern_len;     // used slots
+  usize intern_cap;     // slots, a power of 2
 } YamlStore;
 
-// Tokenizer state tracking for parsing (weird sized for padding sense, todo)
+// Tokenizer state tracking for parsing
 typedef struct {
-  i32 iffd;          // Input YAML file descriptor
-  u16 blen;          // Buffer len
-  u16 reof;          // EOF reached boolean-ish
-  u16 cpos;          // Current buffer position
-  u16 lpos;          // Current pos in line
-  u16 line;          // Current line number
+  i32 iffd;          // Input YAML file descriptor, -1 when mapped
+  u32 line;          // Current line number
+  u32 lpos;          // Current pos in line
   u16 root_mark;     // Levels of indentation + rules
+  bool reof;         // EOF reached
+  bool mapped;       // chunk is the whole file, tokens are slices of it
+  bool replay;       // next_token returns cur_token once more
+  usize blen;        // Buffer len
+  usize cpos;        // Current buffer position
   ustr chunk;        // Current content buffer
   YamlStore* store;  // All buffers for strings are here
-  Vector aliases;    // Tracked aliases
   Token cur_token;   // Most recently parsed token
 } YamlParser;
 
+// Callbacks of parse_yaml_events, any of them can be nullptr to ignore that event.
+// Strings and nodes handed to them live in the store until free_yaml
+typedef struct {
+  void* ctx;                                            // passed as is to every callback
+  void (*on_map_start) (void* ctx);                     // `{`, or a top level map
+  void (*on_map_end) (void* ctx);                       // `}`, or EOF of a top level map
+  bool (*on_key) (void* ctx, const YamlMapEntry* key);  // key of the next value, ignore `val`
+  void (*on_seq_start) (void* ctx);                     // `[`
+  void (*on_seq_end) (void* ctx);                       // `]`
+  void (*on_scalar) (void* ctx, const Node* scalar);    // string, number or boolean
+  void (*on_node) (void* ctx, Node* node);              // anchored or aliased value
+} YamlHandler;
+
 // Top-level function to parse an entire YAML input string
 Node* parse_yaml (nstr filepath, YamlStore* store)
   __attribute__ ((ownership_holds (malloc, 1)));
 
-// Free all resources associated with a parsed YAML node
-void free_yaml (Node* node);
+// Same as parse_yaml, but maps the file and points tokens into the mapping,
+// only strings that need unescaping are copied to the store
+Node* parse_yaml_mmap (nstr filepath, YamlStore* store)
+  __attribute__ ((ownership_holds (malloc, 1)));
+
+// Same as parse_yaml_mmap, but reports each value to `handler` instead of building a tree.
+// Only anchored values are kept as nodes, so they can be replayed by their aliases, without
+// `on_node` those are walked as events too. Keys from `<<` are reported with `merged` set,
+// and redefined keys are left to the handler, `on_key` returns false to fail at one
+void parse_yaml_events (nstr filepath, YamlStore* store, const YamlHandler* handler);
+
+// Free all resources of a parsed YAML: its nodes, strings and mapping if any
+void free_yaml (YamlStore* store);
 
 // Retrieve an arbitrary node from a map by its key
 Node* map_get_node (Node* node, nstr key);
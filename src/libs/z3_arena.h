@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+/**
+ * z3_arena.h
+ *
+ * Description:
+ *   A bump allocator, everything allocated from an arena is released at once.
+ *
+ * Features:
+ *   - Chained blocks, allocations never move
+ *   - The most recent allocation grows in place
+ *   - Scoped resource cleanup for arenas
+ *
+ * Requires:
+ *   - C23 Standard (Use -std=c23).
+ *   - z3_toys.h
+ */
+#pragma once
+
+#include <notrust.h>
+#include <stddef.h>
+#include <z3_toys.h>
+
+#define Z3_ARENA_BLOCK_SIZE (1 << 16)  // 64 KB, bigger requests get their own block
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+  ArenaBlock* prev;  // block filled before this one
+  usize len;         // bytes handed out
+  usize max;         // bytes in `mem`
+  alignas (max_align_t) u8 mem[];
+};
+
+//~ Bump allocator, zero initialized is an empty arena
+typedef struct {
+  ArenaBlock* head;  // block allocations come from
+  usize count;       // allocations made, for stats
+} Arena;
+
+//~ Initialize an empty arena, the first block is allocated on demand
+#define z3_arena()              \
+  (Arena) {                     \
+    .head = nullptr, .count = 0 \
+  }
+
+//~ Allocate `size` bytes aligned to max_align_t, not initialized
+void* z3_alloc (Arena* arena, usize size);
+
+//~ Resize an allocation of `old` bytes, in place when it is the most recent one
+//! Otherwise the contents are copied, the old bytes are only released with the arena
+void* z3_resize (Arena* arena, void* ptr, usize old, usize size);
+
+//~ Release every block of the arena
+void z3_drop_arena (Arena* arena);
+
+//~ Define an Arena with automatic cleanup
+#define ScopedArena __attribute__ ((cleanup (z3_drop_arena))) Arena
+
+#ifdef Z3_ARENA_IMPL
+#include <stdlib.h>
+#include <string.h>
+
+#define z3_arena__align(n) (((n) + alignof (max_align_t) - 1) & ~(alignof (max_align_t) - 1))
+
+void* z3_alloc (Arena* arena, usize size) {
+  size = z3_arena__align (size);
+
+  ArenaBlock* head = arena->head;
+  if (!head || head->max - head->len < size) {
+    usize max = size > Z3_ARENA_BLOCK_SIZE ? size : Z3_ARENA_BLOCK_SIZE;
+    ArenaBlock* block = malloc (sizeof (ArenaBlock) + max);
+    if (block == nullptr) die ("Arena alloc: requested %zu bytes\n", max);
+
+    block->prev = head;
+    block->len = 0;
+    block->max = max;
+    arena->head = head = block;
+  }
+
+  void* ptr = head->mem + head->len;
+  head->len += size;
+  arena->count++;
+  return ptr;
+}
+
+void* z3_resize (Arena* arena, void* ptr, usize old, usize size) {
+  if (ptr == nullptr) return z3_alloc (arena, size);
+
+  ArenaBlock* head = arena->head;
+  u8* at = ptr;
+  bool last = head && at >= head->mem && at + z3_arena__align (old) == head->mem + head->len;
+
+  if (last && (usize)(at - head->mem) + z3_arena__align (size) <= head->max) {
+    head->len = (usize)(at - head->mem) + z3_arena__align (size);
+    return ptr;
+  }
+
+  void* nptr = z3_alloc (arena, size);
+  memcpy (nptr, ptr, old < size ? old : size);
+  return nptr;
+}
+
+void z3_drop_arena (Arena* arena) {
+  ArenaBlock* block = arena->head;
+  while (block) {
+    ArenaBlock* prev = block->prev;
+    free (block);
+    block = prev;
+  }
+  arena->head = nullptr;
+  arena->count = 0;
+}
+
+#endif  // Z3_ARENA_IMPL
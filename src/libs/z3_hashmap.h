@@ -9,9 +9,10 @@
  *
  * Features:
  *   - String key to string value mapping
- *   - FNV-1a hashing algorithm
- *   - Linear probing for collision resolution
- *   - Bit-packed occupation tracking
+ *   - Word at a time key hashing, stored hash and length checked before any byte
+ *   - Streaming 128-bit hash, 32 bytes per step, to name content on disk
+ *   - Robin Hood probing over a power of 2 table, with stored probe distances
+ *   - Backward shift deletion, no tombstones left behind
  *   - Automatic memory management for keys and values
  *
  * Requires:
@@ -27,7 +28,8 @@
 #include <z3_toys.h>
 
 typedef struct {
-  u64 hash;
+  u32 hash;  // z3_hash_key of the key, truncated
+  u32 len;   // key length
   nstr key;
   void* val;
 } HashMapEntry;
@@ -35,9 +37,9 @@ typedef struct {
 //~ Auto-growing HashMap<String, &T>
 typedef struct {
   HashMapEntry* beds;
-  usize max;
-  usize len;
-  usize* bfs;
+  usize max;  // slots, a power of 2
+  usize len;  // entries
+  u8* dist;   // probe distance + 1 of each slot, 0 if it is empty
 } HashMap;
 
 typedef struct {
@@ -52,6 +54,45 @@ typedef struct {
     .map = (m), .idx = 0, .key = nullptr, .val = nullptr \
   }
 
+//~ Starting state of z3_hash_bytes (FNV-1a offset basis)
+#define Z3_HASH_SEED 14695981039346656037ULL
+
+//~ FNV-1a hash of `len` bytes, continuing from `seed`
+//! Chain calls to hash data that is not contiguous, start with Z3_HASH_SEED
+u64 z3_hash_bytes (u64 seed, const void* data, usize len);
+
+//~ Version of z3_hash_key, bumped whenever its output changes
+#define Z3_HASH_KEY_VERSION 1
+
+//~ 128-bit hash, wide enough to name content that is never compared byte for byte
+typedef struct {
+  u64 lo;
+  u64 hi;
+} Hash128;
+
+#define Z3_HASH128_STRIPE 32  // bytes per step of z3_hash128_update
+
+//~ Hash in progress, started by z3_hash128_init
+typedef struct {
+  u64 acc[4];
+  u64 total;                     // bytes hashed so far
+  u8 stripe[Z3_HASH128_STRIPE];  // bytes waiting for a full stripe
+  usize len;                     // bytes in `stripe`
+} Hasher128;
+
+//~ Start a new 128-bit hash from `seed`
+void z3_hash128_init (Hasher128* h, u64 seed);
+
+//~ Hash `len` more bytes, the result only depends on the bytes, not on how they are split
+void z3_hash128_update (Hasher128* h, const void* data, usize len);
+
+//~ Finish the hash, `h` has to be initialized again to be reused
+Hash128 z3_hash128_final (Hasher128* h);
+
+//~ Hash of a map key of `len` bytes, 8 bytes at a time
+//! Maps keep it in their entries, so anything storing a map has to record Z3_HASH_KEY_VERSION
+u64 z3_hash_key (const void* data, usize len);
+
 //~ Create a new empty hashmap with default capacity
 HashMap* z3_hashmap_create (void);
 
@@ -64,6 +105,13 @@ void z3_hashmap_put (HashMap* map, nstr key, void* value);
 //! Returns NULL if key doesn't exist
 void* z3_hashmap_get (HashMap* map, nstr key);
 
+//~ Retrieve a value by the first `len` bytes of `key`, no NUL terminator needed
+void* z3_hashmap_get_n (HashMap* map, nstr key, usize len);
+
+//~ Same as z3_hashmap_get_n, with `hash` from z3_hash_key (key, len)
+//! For keys looked up in more than once, or in more than one map
+void* z3_hashmap_get_hashed (HashMap* map, nstr key, usize len, u64 hash);
+
 //~ Remove a key-value pair from the hashmap
 void z3_hashmap_remove (HashMap* map, nstr key);
 
@@ -92,146 +140,255 @@ bool z3_hashmap_iter_next (HashMapIterator* it);
 #include <stdlib.h>
 #include <string.h>
 
-#define Z3_HASHMAP_INITIAL_CAPACITY 32
-#define Z3_HASHMAP_BITFLAG_CAPACITY (sizeof (usize) * 8)  // bit size
-#define Z3_HASHMAP_BITFLAG_SIZE     sizeof (usize)
+#define Z3_HASHMAP_INITIAL_CAPACITY 32                // a power of 2
+#define Z3_HASHMAP_MAX_DIST         UINT8_MAX         // grow before a distance overflows
+#define Z3_HASH_PRIME               1099511628211ULL  // FNV-1a 64-bit prime
 
-static u64 z3_hashmap__hash_str (nstr str) {
-  // FNV-1a hash
-  u64 hash = 14695981039346656037ULL;  // NOLINT (readability-magic-numbers)
-  while (*str) {
-    hash ^= (u8)(*str++);
-    hash *= 1099511628211ULL;  // NOLINT (readability-magic-numbers)
+u64 z3_hash_bytes (u64 seed, const void* data, usize len) {
+  const u8* bytes = data;
+  u64 hash = seed;
+  for (usize i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= Z3_HASH_PRIME;
   }
   return hash;
 }
 
-static usize z3_hashmap__probe (u64 hash, usize i, usize cap) {
-  return (hash + i) % cap;
+// NOLINTBEGIN (readability-magic-numbers)
+u64 z3_hash_key (const void* data, usize len) {
+  const u8* bytes = data;
+  u64 hash = Z3_HASH_SEED ^ len;
+  u64 word = 0;
+
+  // the shift folds the high half down, so masking low bits sees every byte
+  for (; len >= sizeof (word); len -= sizeof (word), bytes += sizeof (word)) {
+    memcpy (&word, bytes, sizeof (word));
+    hash = (hash ^ word) * Z3_HASH_PRIME;
+    hash ^= hash >> 32;
+  }
+
+  if (len > 0) {
+    word = 0;
+    for (usize i = 0; i < len; i++) word |= (u64)bytes[i] << (i * 8);
+    hash = (hash ^ word) * Z3_HASH_PRIME;
+  }
+
+  // murmur3 finalizer
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static const u64 z3_hash128__k[8] = {
+  0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+  0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL,
+};
+
+// 64x64 -> 128 multiply, both halves folded together
+[[clang::always_inline]]
+static inline u64 z3_hash128__mum (u64 a, u64 b) {
+  unsigned __int128 r = (unsigned __int128)a * b;
+  return (u64)r ^ (u64)(r >> 64);
+}
+
+[[clang::always_inline]]
+static inline u64 z3_hash128__fmix (u64 x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ (x >> 33);
+}
+
+// Each lane mixes two words, then the odd multiply keeps earlier stripes (and their order)
+static void z3_hash128__stripe (u64 acc[4], const u8* bytes) {
+  u64 w[4];
+  memcpy (w, bytes, sizeof (w));
+  for (usize i = 0; i < 4; i++) {
+    u64 m = z3_hash128__mum (w[i] ^ z3_hash128__k[i], w[i ^ 1] ^ z3_hash128__k[i + 4]);
+    u64 x = acc[i] ^ m;
+    acc[i] = ((x << 29) | (x >> 35)) * Z3_HASH_PRIME;
+  }
+}
+
+void z3_hash128_init (Hasher128* h, u64 seed) {
+  *h = (Hasher128) {0};
+  for (usize i = 0; i < 4; i++) h->acc[i] = seed ^ z3_hash128__k[i];
+}
+
+void z3_hash128_update (Hasher128* h, const void* data, usize len) {
+  const u8* bytes = data;
+  h->total += len;
+
+  if (h->len > 0) {
+    usize take = Z3_HASH128_STRIPE - h->len;
+    if (take > len) take = len;
+    memcpy (h->stripe + h->len, bytes, take);
+    h->len += take;
+    bytes += take;
+    len -= take;
+    if (h->len < Z3_HASH128_STRIPE) return;
+    z3_hash128__stripe (h->acc, h->stripe);
+    h->len = 0;
+  }
+
+  for (; len >= Z3_HASH128_STRIPE; len -= Z3_HASH128_STRIPE, bytes += Z3_HASH128_STRIPE)
+    z3_hash128__stripe (h->acc, bytes);
+
+  memcpy (h->stripe, bytes, len);
+  h->len = len;
+}
+
+Hash128 z3_hash128_final (Hasher128* h) {
+  // the zero padding is told apart by the length
+  if (h->len > 0) {
+    memset (h->stripe + h->len, 0, Z3_HASH128_STRIPE - h->len);
+    z3_hash128__stripe (h->acc, h->stripe);
+  }
+
+  u64* a = h->acc;
+  u64 lo = z3_hash128__mum (a[0] ^ h->total, a[1] ^ z3_hash128__k[0]) + a[2] + a[3];
+  u64 hi = z3_hash128__mum (a[2] ^ z3_hash128__k[1], a[3] ^ h->total) + a[0] + a[1];
+  return (Hash128) {.lo = z3_hash128__fmix (lo), .hi = z3_hash128__fmix (hi ^ lo)};
+}
+// NOLINTEND (readability-magic-numbers)
+
+static void z3_hashmap__alloc (HashMap* map, usize max) {
+  map->max = max;
+  map->beds = (HashMapEntry*)calloc (max, sizeof (HashMapEntry));
+  map->dist = calloc (max, 1);
+  if (map->beds == nullptr || map->dist == nullptr) die ("failed to allocate hashmap table\n");
+}
+
+// Slot of `key`, or map->max if it is not in the map
+static usize z3_hashmap__find (const HashMap* map, nstr key, usize len, u64 hash) {
+  usize mask = map->max - 1;
+  usize idx = hash & mask;
+
+  // an entry closer to its home than we are to ours ends the search
+  for (usize dist = 1; dist <= map->dist[idx]; dist++, idx = (idx + 1) & mask) {
+    const HashMapEntry* entry = &map->beds[idx];
+    if (dist != map->dist[idx] || entry->hash != (u32)hash || entry->len != len) continue;
+    if (memcmp (entry->key, key, len) == 0) return idx;
+  }
+  return map->max;
 }
 
-static bool z3_hashmap_pos_used (const usize* bf, usize pos) {
-  usize home = pos / Z3_HASHMAP_BITFLAG_CAPACITY;  // Which u64
-  u8 room = pos % Z3_HASHMAP_BITFLAG_CAPACITY;     // Which bit in that u64
+static void z3_hashmap__grow (HashMap* map);
+
+// Insert an entry known not to be in the map, taking the slots of richer entries
+static void z3_hashmap__place (HashMap* map, HashMapEntry entry) {
+  usize mask = map->max - 1;
+  usize idx = entry.hash & mask;
+  usize dist = 1;
+
+  while (map->dist[idx] != 0) {
+    if (map->dist[idx] < dist) {
+      HashMapEntry evicted = map->beds[idx];
+      usize evicted_dist = map->dist[idx];
+      map->beds[idx] = entry;
+      map->dist[idx] = (u8)dist;
+      entry = evicted;
+      dist = evicted_dist;
+    }
+
+    idx = (idx + 1) & mask;
+    if (++dist == Z3_HASHMAP_MAX_DIST) {
+      z3_hashmap__grow (map);  // the one being carried is placed in the new table
+      z3_hashmap__place (map, entry);
+      return;
+    }
+  }
 
-  return (bool)((bf[home] >> room) & 1);
+  map->beds[idx] = entry;
+  map->dist[idx] = (u8)dist;
+  map->len++;
 }
 
-static void z3_hashmap__set_used (usize* bf, usize pos) {
-  usize home = pos / Z3_HASHMAP_BITFLAG_CAPACITY;
-  u8 room = pos % Z3_HASHMAP_BITFLAG_CAPACITY;
+static void z3_hashmap__grow (HashMap* map) {
+  usize old_capacity = map->max;
+  HashMapEntry* old_beds = map->beds;
+  u8* old_dist = map->dist;
 
-  bf[home] |= (1ULL << room);
+  map->len = 0;
+  z3_hashmap__alloc (map, old_capacity * 2);
+
+  // hashes are stored, no key is hashed or compared again
+  for (usize i = 0; i < old_capacity; ++i) {
+    if (old_dist[i] != 0) z3_hashmap__place (map, old_beds[i]);
+  }
+  free (old_beds);
+  free (old_dist);
 }
 
 HashMap* z3_hashmap_create (void) {
   HashMap* map = (HashMap*)malloc (sizeof (HashMap));
-  map->max = Z3_HASHMAP_INITIAL_CAPACITY;
   map->len = 0;
-  map->beds = (HashMapEntry*)calloc (map->max, sizeof (HashMapEntry));
-  map->bfs = calloc (Z3_HASHMAP_BITFLAG_SIZE, 1);
+  z3_hashmap__alloc (map, Z3_HASHMAP_INITIAL_CAPACITY);
   return map;
 }
 
 void z3_hashmap_put (HashMap* map, nstr key, void* value) {
   if (!key || !value) return;
 
-  if (map->len >= map->max * 3 / 4) {
-    usize old_capacity = map->max;
-    HashMapEntry* old_beds = map->beds;
-    usize* exes = map->bfs;
-
-    map->len = 0;
-    map->max *= 2;
-    map->beds = (HashMapEntry*)calloc (map->max, sizeof (HashMapEntry));
-    usize new_cap = /* round up */
-      (map->max + (Z3_HASHMAP_BITFLAG_CAPACITY - 1)) / Z3_HASHMAP_BITFLAG_CAPACITY;
-
-    map->bfs = calloc (new_cap * Z3_HASHMAP_BITFLAG_SIZE, 1);
-    if (map->bfs == nullptr) die ("failed to allocate bitflag maps\n");
-
-    // rehash all existing entries
-    for (usize i = 0; i < old_capacity; ++i) {
-      if (old_beds[i].key != nullptr) {
-        u64 hash = old_beds[i].hash;
-        for (usize j = 0; j < map->max; ++j) {
-          usize idx = z3_hashmap__probe (hash, j, map->max);
-          if (!z3_hashmap_pos_used (map->bfs, idx)) {
-            HashMapEntry* entry = &map->beds[idx];
-
-            entry->key = old_beds[i].key;
-            entry->val = old_beds[i].val;
-            entry->hash = hash;
-            map->len++;
-
-            z3_hashmap__set_used (map->bfs, idx);
-            break;
-          }
-        }
-      }
-    }
-    free (old_beds);
-    free (exes);
-  }
-
-  u64 hash = z3_hashmap__hash_str (key);
-  for (usize i = 0; i < map->max; ++i) {
-    usize idx = z3_hashmap__probe (hash, i, map->max);
+  usize len = strlen (key);
+  u64 hash = z3_hash_key (key, len);
+  usize idx = z3_hashmap__find (map, key, len, hash);
+  if (idx != map->max) {
+    // key is the same if present
     HashMapEntry* entry = &map->beds[idx];
-    bool is_used = z3_hashmap_pos_used (map->bfs, idx);
-    if (!is_used || (entry->key && strcmp (entry->key, key) == 0)) {
-      z3_hashmap__set_used (map->bfs, idx);
-      if (!is_used) map->len++;
-
-      // key is the same if present
-      if (!entry->key) entry->key = strdup (key);
-      if (entry->val) free (entry->val);
-
-      entry->val = value;
-      entry->hash = hash;
-      return;
-    }
+    if (entry->val != value) free (entry->val);
+    entry->val = value;
+    return;
   }
+
+  if (map->len >= map->max * 3 / 4) z3_hashmap__grow (map);
+  HashMapEntry entry = {.hash = (u32)hash, .len = (u32)len, .key = strdup (key), .val = value};
+  z3_hashmap__place (map, entry);
 }
 
 void* z3_hashmap_get (HashMap* map, nstr key) {
   if (!key) return nullptr;
-  u64 hash = z3_hashmap__hash_str (key);
-  for (usize i = 0; i < map->max; ++i) {
-    usize idx = z3_hashmap__probe (hash, i, map->max);
+  return z3_hashmap_get_n (map, key, strlen (key));
+}
 
-    HashMapEntry* entry = &map->beds[idx];
-    bool is_used = z3_hashmap_pos_used (map->bfs, idx);
-    if ((i32)is_used && (entry->key && strcmp (entry->key, key) == 0)) {
-      return entry->val;
-    }
+void* z3_hashmap_get_n (HashMap* map, nstr key, usize len) {
+  if (!key) return nullptr;
+  return z3_hashmap_get_hashed (map, key, len, z3_hash_key (key, len));
+}
 
-    if (!is_used) break;
-  }
-  return nullptr;
+void* z3_hashmap_get_hashed (HashMap* map, nstr key, usize len, u64 hash) {
+  if (!key) return nullptr;
+  usize idx = z3_hashmap__find (map, key, len, hash);
+  return idx != map->max ? map->beds[idx].val : nullptr;
 }
 
 void z3_hashmap_remove (HashMap* map, nstr key) {
   if (!key) return;
-  u64 hash = z3_hashmap__hash_str (key);
-  for (usize i = 0; i < map->max; ++i) {
-    usize idx = z3_hashmap__probe (hash, i, map->max);
-    HashMapEntry* entry = &map->beds[idx];
-    bool is_used = z3_hashmap_pos_used (map->bfs, idx);
-    if ((i32)is_used && (entry->key && strcmp (entry->key, key) == 0)) {
-      // never setting deleted entry to false
-      // if (is_used && key == nullptr) /* was deleted, free tombstone */
-      // very few changes needed
-
-      KILL_CAST_QUAL (free ((void*)entry->key);)
-      free (entry->val);
-      entry->key = nullptr;
-      entry->val = nullptr;
-
-      map->len--;
-      return;
-    }
+  usize len = strlen (key);
+  usize idx = z3_hashmap__find (map, key, len, z3_hash_key (key, len));
+  if (idx == map->max) return;
+
+  HashMapEntry* entry = &map->beds[idx];
+  KILL_CAST_QUAL (free ((void*)entry->key);)
+  free (entry->val);
+
+  // pull the entries after it one slot closer to their home, until one is at home
+  usize mask = map->max - 1;
+  usize next = (idx + 1) & mask;
+  while (map->dist[next] > 1) {
+    map->beds[idx] = map->beds[next];
+    map->dist[idx] = (u8)(map->dist[next] - 1);
+    idx = next;
+    next = (next + 1) & mask;
   }
+
+  map->beds[idx] = (HashMapEntry) {0};
+  map->dist[idx] = 0;
+  map->len--;
 }
 
 bool z3_hashmap_has (HashMap* map, nstr key) {
@@ -249,7 +406,7 @@ bool z3_hashmap_iter_next (HashMapIterator* it) {
   while (it->idx < it->map->max) {
     usize i = it->idx++;
 
-    if (z3_hashmap_pos_used (it->map->bfs, i)) {
+    if (it->map->dist[i] != 0) {
       it->key = it->map->beds[i].key;
       it->val = it->map->beds[i].val;
       return true;
@@ -261,27 +418,27 @@ bool z3_hashmap_iter_next (HashMapIterator* it) {
 void z3_hashmap_drop (HashMap* map) {
   if (!map) return;
   for (usize i = 0; i < map->max; ++i) {
-    if (z3_hashmap_pos_used (map->bfs, i)) {
+    if (map->dist[i] != 0) {
       HashMapEntry* entry = &map->beds[i];
       KILL_CAST_QUAL (free ((void*)entry->key);)
       free (entry->val);
     }
   }
   free (map->beds);
-  free (map->bfs);
+  free (map->dist);
   free (map);
 }
 
 void z3_hashmap_drop_shallow (HashMap* map) {
   if (!map) return;
   for (usize i = 0; i < map->max; ++i) {
-    if (z3_hashmap_pos_used (map->bfs, i)) {
+    if (map->dist[i] != 0) {
       HashMapEntry* entry = &map->beds[i];
       KILL_CAST_QUAL (free ((void*)entry->key);)
     }
   }
   free (map->beds);
-  free (map->bfs);
+  free (map->dist);
   free (map);
 }
 
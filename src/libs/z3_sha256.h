@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+/**
+ * z3_sha256.h
+ *
+ * Description:
+ *   SHA-256 (FIPS 180-4), for content addressed storage that others can write to.
+ *
+ * Features:
+ *   - Incremental, data is hashed as it is read
+ *   - Hex form of a digest, for file names
+ *
+ * Requires:
+ *   - C23 Standard (Use -std=c23).
+ *   - z3_toys.h
+ */
+#pragma once
+
+#include <notrust.h>
+#include <stddef.h>
+#include <z3_toys.h>
+
+#define Z3_SHA256_SIZE  32                        // bytes of a digest
+#define Z3_SHA256_HEX   (Z3_SHA256_SIZE * 2 + 1)  // hex digest and its NUL
+#define Z3_SHA256_BLOCK 64                        // bytes per compression
+
+//~ Hash in progress, started by z3_sha256_init
+typedef struct {
+  u32 state[8];
+  u64 total;                  // bytes hashed so far
+  u8 block[Z3_SHA256_BLOCK];  // bytes waiting for a full block
+  usize len;                  // bytes in `block`
+} Sha256;
+
+//~ Start a new hash
+void z3_sha256_init (Sha256* sha);
+
+//~ Hash `len` more bytes
+void z3_sha256_update (Sha256* sha, const void* data, usize len);
+
+//~ Finish the hash into `digest`, `sha` has to be initialized again to be reused
+void z3_sha256_final (Sha256* sha, u8 digest[Z3_SHA256_SIZE]);
+
+//~ Lowercase hex of a digest, NUL terminated
+void z3_sha256_hex (const u8 digest[Z3_SHA256_SIZE], char hex[Z3_SHA256_HEX]);
+
+//~ Parse the hex of a digest, false unless `hex` starts with Z3_SHA256_SIZE * 2 hex digits
+bool z3_sha256_parse (nstr hex, u8 digest[Z3_SHA256_SIZE]);
+
+#ifdef Z3_SHA256_IMPL
+#include <string.h>
+
+// NOLINTBEGIN (readability-magic-numbers)
+static const u32 z3_sha256__k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+  0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+  0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+  0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+  0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+  0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+  0xc67178f2,
+};
+
+[[clang::always_inline]]
+static inline u32 z3_sha256__rotr (u32 x, u32 n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void z3_sha256__compress (u32 state[8], const u8* block) {
+  u32 w[64];
+  for (usize i = 0; i < 16; i++) {
+    w[i] = (u32)block[i * 4] << 24 | (u32)block[i * 4 + 1] << 16 |
+           (u32)block[i * 4 + 2] << 8 | (u32)block[i * 4 + 3];
+  }
+  for (usize i = 16; i < 64; i++) {
+    u32 s0 = z3_sha256__rotr (w[i - 15], 7) ^ z3_sha256__rotr (w[i - 15], 18) ^ w[i - 15] >> 3;
+    u32 s1 = z3_sha256__rotr (w[i - 2], 17) ^ z3_sha256__rotr (w[i - 2], 19) ^ w[i - 2] >> 10;
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  u32 a = state[0];
+  u32 b = state[1];
+  u32 c = state[2];
+  u32 d = state[3];
+  u32 e = state[4];
+  u32 f = state[5];
+  u32 g = state[6];
+  u32 h = state[7];
+  for (usize i = 0; i < 64; i++) {
+    u32 s1 = z3_sha256__rotr (e, 6) ^ z3_sha256__rotr (e, 11) ^ z3_sha256__rotr (e, 25);
+    u32 ch = (e & f) ^ (~e & g);
+    u32 t1 = h + s1 + ch + z3_sha256__k[i] + w[i];
+    u32 s0 = z3_sha256__rotr (a, 2) ^ z3_sha256__rotr (a, 13) ^ z3_sha256__rotr (a, 22);
+    u32 maj = (a & b) ^ (a & c) ^ (b & c);
+    u32 t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void z3_sha256_init (Sha256* sha) {
+  *sha = (Sha256) {
+    .state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+              0x1f83d9ab, 0x5be0cd19},
+  };
+}
+
+void z3_sha256_update (Sha256* sha, const void* data, usize len) {
+  const u8* bytes = data;
+  sha->total += len;
+
+  if (sha->len > 0) {
+    usize take = Z3_SHA256_BLOCK - sha->len;
+    if (take > len) take = len;
+    memcpy (sha->block + sha->len, bytes, take);
+    sha->len += take;
+    bytes += take;
+    len -= take;
+    if (sha->len < Z3_SHA256_BLOCK) return;
+    z3_sha256__compress (sha->state, sha->block);
+    sha->len = 0;
+  }
+
+  for (; len >= Z3_SHA256_BLOCK; len -= Z3_SHA256_BLOCK, bytes += Z3_SHA256_BLOCK)
+    z3_sha256__compress (sha->state, bytes);
+
+  memcpy (sha->block, bytes, len);
+  sha->len = len;
+}
+
+void z3_sha256_final (Sha256* sha, u8 digest[Z3_SHA256_SIZE]) {
+  u64 bits = sha->total * 8;
+  sha->block[sha->len++] = 0x80;
+  if (sha->len > Z3_SHA256_BLOCK - 8) {
+    memset (sha->block + sha->len, 0, Z3_SHA256_BLOCK - sha->len);
+    z3_sha256__compress (sha->state, sha->block);
+    sha->len = 0;
+  }
+  memset (sha->block + sha->len, 0, Z3_SHA256_BLOCK - 8 - sha->len);
+  for (usize i = 0; i < 8; i++) sha->block[Z3_SHA256_BLOCK - 1 - i] = (u8)(bits >> (i * 8));
+  z3_sha256__compress (sha->state, sha->block);
+
+  for (usize i = 0; i < 8; i++) {
+    digest[i * 4] = (u8)(sha->state[i] >> 24);
+    digest[i * 4 + 1] = (u8)(sha->state[i] >> 16);
+    digest[i * 4 + 2] = (u8)(sha->state[i] >> 8);
+    digest[i * 4 + 3] = (u8)sha->state[i];
+  }
+}
+
+void z3_sha256_hex (const u8 digest[Z3_SHA256_SIZE], char hex[Z3_SHA256_HEX]) {
+  static const char digits[] = "0123456789abcdef";
+  for (usize i = 0; i < Z3_SHA256_SIZE; i++) {
+    hex[i * 2] = digits[digest[i] >> 4];
+    hex[i * 2 + 1] = digits[digest[i] & 0xf];
+  }
+  hex[Z3_SHA256_SIZE * 2] = '\0';
+}
+
+static inline i32 z3_sha256__nibble (char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool z3_sha256_parse (nstr hex, u8 digest[Z3_SHA256_SIZE]) {
+  for (usize i = 0; i < Z3_SHA256_SIZE; i++) {
+    i32 hi = z3_sha256__nibble (hex[i * 2]);
+    i32 lo = hi < 0 ? -1 : z3_sha256__nibble (hex[i * 2 + 1]);
+    if (lo < 0) return false;
+    digest[i] = (u8)(hi << 4 | lo);
+  }
+  return true;
+}
+// NOLINTEND (readability-magic-numbers)
+
+#endif  // Z3_SHA256_IMPL
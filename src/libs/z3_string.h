@@ -8,9 +8,12 @@
  *   Provides heap-allocated string management with automatic memory handling.
  *
  * Features:
- *   - Growable heap-allocated strings
- *   - String interpolation
+ *   - Growable heap-allocated strings, grown in place with realloc
+ *   - Zero initialized is an empty string, nothing is allocated until the first push
+ *   - Formatted and bulk appends that reserve once
+ *   - String interpolation, single pass or from a template compiled once
  *   - String escape/unescape utilities
+ *   - Whole file reads, and writes that replace a file atomically (gathered or not)
  *   - Scoped resource cleanup for string memory
  *
  * Requires:
@@ -20,10 +23,16 @@
 #pragma once
 
 #include <notrust.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/uio.h>
 #include <z3_toys.h>
 
+#ifndef Z3_WRITE_IOV_MAX
+#define Z3_WRITE_IOV_MAX 16  // pieces per writev, the least IOV_MAX POSIX allows
+#endif
+
 //~ Heap-allocated growable string
 typedef struct {
   usize max; /**< Maximum capacity */
@@ -61,7 +70,18 @@ void z3_pushc (String* str, u8 c);
 //~ Append a C-style string to a String
 void z3_pushl (String* str, nstr s, usize l);
 
-//~ Ensure String has enough allocated memory
+//~ Append every slice of `parts`, reserving for all of them at once
+void z3_pushv (String* str, const StringSlice* parts, usize count);
+
+//~ Append printf-style formatted text, formatted in place
+//! The spare capacity is tried first, it is only formatted again if it didn't fit
+void z3_pushf (String* str, nstr fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+//~ Same as z3_pushf, with a va_list
+void z3_vpushf (String* str, nstr fmt, va_list args);
+
+//~ Ensure String has room for `additional` more bytes and the terminator
+//! The bytes after the terminator are not initialized
 void z3_reserve (String* str, usize additional);
 
 //~ Free the memory used by a String
@@ -73,39 +93,88 @@ String z3_escape (cstr input, usize len);
 //~ Unescape a string, converting escape sequences to their respective characters
 String z3_unescape (cstr input, usize len);
 
+//~ Append the whole file at `path` to `str`, false if it can't be read
+bool z3_read_file (nstr path, String* str);
+
+//~ Replace the file at `path` with `data`, readers see the old or the new one, never a mix
+//! Written to `<path>.<pid>` first, so processes sharing the file don't step on each other
+bool z3_write_atomic (nstr path, const String* data);
+
+//~ Same as z3_write_atomic, with the `count` pieces of `iov` in order, gathered by writev
+//! `iov` is used up as it is written, bases and lengths are not kept
+bool z3_write_atomicv (nstr path, struct iovec* iov, usize count);
+
 //~ Interpolate a template string with values from a filler function
 //
 //~ This function takes ctx and a template string containing placeholders in the format
-//  `#{<name>}`, and generates a new string by replacing those placeholders with
-//  corresponding values obtained from the provided `filler` function. The `filler` function
-//  gets the accumulated String, the placeholder (char*) and the context; true if something
-//  has been added or just want to remove the placeholder, returns false to add the
-//  whole placeholder back to the string.
+//  `#{<name>}` (alphanumeric, `_`, `-` and `:`), and generates a new string by replacing
+//  those placeholders with corresponding values obtained from the provided `filler`
+//  function. The `filler` function gets the accumulated String, the placeholder (char*)
+//  and the context; true if something has been added or just want to remove the
+//  placeholder, returns false to add the whole placeholder back to the string.
 //
 //~ Note: The original template string is not modified. A new `String` is created with the
 //  interpolated values.
 String z3_interp (const String* tmplt, bool (*filler) (String*, void*, cstr, usize), void* ctx);
 
+//~ Same as z3_interp, for `len` bytes of `tmplt`
+String z3_interpl (
+  cstr tmplt, usize len, bool (*filler) (String*, void*, cstr, usize), void* ctx
+);
+
+//~ Literal text of a template, or the name of one of its `#{<name>}` placeholders
+typedef struct {
+  StringSlice text;  // escapes already removed, placeholders without `#{` and `}`
+  bool placeholder;
+} TemplatePart;
+
+//~ A template split at its placeholders once, to be rendered any number of times
+//! Parts point into the template text, it has to outlive the Template
+typedef struct {
+  TemplatePart* parts;
+  usize count;
+  usize literal;  // bytes of literal text, reserved up front when rendering
+} Template;
+
+//~ Compile `len` bytes of `tmplt`, placeholders and escapes as in z3_interp
+Template z3_template (cstr tmplt, usize len);
+
+//~ Render a compiled template, same as z3_interp on the text it was compiled from
+String z3_render (
+  const Template* tmpl, bool (*filler) (String*, void*, cstr, usize), void* ctx
+);
+
+//~ Free the parts of a Template
+void z3_drop_template (Template* tmpl);
+
+//~ Define a Template with automatic cleanup
+#define ScopedTemplate __attribute__ ((cleanup (z3_drop_template))) Template
+
 //~ Define a String with automatic cleanup
 #define ScopedString __attribute__ ((cleanup (z3_drops))) String
 
 #ifdef Z3_STRING_IMPL
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void z3_reserve (String* str, usize additional) {
-  if (!str || !str->chr) return;
+  if (!str) return;
 
-  if (str->len + additional >= str->max) {
+  if (!str->chr || str->len + additional >= str->max) {
     usize new_max = next_power_of2 (str->len + additional + 1);
 
-    ustr new_chr = calloc (new_max, sizeof (c8));
+    // NOLINTNEXTLINE (bugprone-suspicious-realloc-usage) dies on failure
+    ustr new_chr = realloc (str->chr, new_max);
     if (new_chr == nullptr) die ("String reserve: requested %zu bytes\n", new_max);
 
-    memcpy (new_chr, str->chr, str->len);
-    free (str->chr);
-
+    // a zero initialized String had no terminator yet
+    if (!str->chr) new_chr[0] = '\0';
     str->chr = new_chr;
     str->max = new_max;
   }
@@ -125,12 +194,50 @@ void z3_pushl (String* str, nstr s, usize l) {
   str->chr[str->len] = '\0';
 }
 
+void z3_pushv (String* str, const StringSlice* parts, usize count) {
+  usize total = 0;
+  for (usize i = 0; i < count; i++) total += parts[i].len;
+
+  z3_reserve (str, total);
+  for (usize i = 0; i < count; i++) {
+    memcpy (str->chr + str->len, parts[i].chr, parts[i].len);
+    str->len += parts[i].len;
+  }
+  str->chr[str->len] = '\0';
+}
+
+void z3_vpushf (String* str, nstr fmt, va_list args) {
+  va_list again;
+  va_copy (again, args);
+
+  z3_reserve (str, 0);
+  usize spare = str->max - str->len;
+  // NOLINTNEXTLINE (clang-analyzer-valist.Uninitialized)
+  int n = vsnprintf ((rstr)str->chr + str->len, spare, fmt, args);
+  if (n < 0) die ("String format: invalid format '%s'\n", fmt);
+
+  if ((usize)n >= spare) {
+    z3_reserve (str, (usize)n);
+    vsnprintf ((rstr)str->chr + str->len, (usize)n + 1, fmt, again);
+  }
+  va_end (again);
+  str->len += (usize)n;
+}
+
+void z3_pushf (String* str, nstr fmt, ...) {
+  va_list args;
+  va_start (args, fmt);
+  z3_vpushf (str, fmt, args);
+  va_end (args);
+}
+
 String z3_str (usize min) {
   String str = {0};
-  str.max = next_power_of2 (min);  // Initial capacity
+  str.max = min > 1 ? next_power_of2 (min) : 1;  // Initial capacity
   str.len = 0;
-  str.chr = calloc (str.max, sizeof (c8));
+  str.chr = malloc (str.max);
   if (str.chr == nullptr) die ("String: requested %zu bytes", sizeof (c8) * str.max);
+  str.chr[0] = '\0';
   return str;
 }
 
@@ -139,10 +246,9 @@ String z3_strcpy (cstr s) {
   usize len = strlen ((nstr)s) + 1;
   str.max = ((len & (len - 1)) == 0) ? len : next_power_of2 (len);
   str.len = len - 1;
-  str.chr = calloc (str.max, sizeof (c8));
+  str.chr = malloc (str.max);
   if (str.chr == nullptr) die ("String: requested %zu bytes", sizeof (c8) * str.max);
-  memcpy (str.chr, s, len - 1);
-  str.chr[str.len] = '\0';
+  memcpy (str.chr, s, len);
   return str;
 }
 
@@ -152,7 +258,7 @@ String z3_strdup (const String* str) {
 
   s.max = str->max;
   s.len = str->len;
-  s.chr = calloc (s.max, sizeof (c8));
+  s.chr = malloc (s.max);
   if (s.chr == nullptr) die ("String: requested %zu bytes", sizeof (c8) * s.max);
 
   memcpy (s.chr, str->chr, str->len);
@@ -170,69 +276,185 @@ void z3_drops (String* str) {
   str->max = 0;
 }
 
-String z3_interp (
-  const String* tmplt, bool (*filler) (String*, void*, cstr, usize), void* ctx
-) {
-  String result = z3_str (32);  // NOLINT (readability-magic-numbers)
+#define Z3_STRING_READ_SIZE 4096  // reads past the size in fstat, files can grow
 
-  usize i = 0;
+bool z3_read_file (nstr path, String* str) {
+  int fd = open (path, O_RDONLY);
+  if (fd < 0) return false;
 
-  while (i < tmplt->len) {
-    if (tmplt->chr[i] == '\\') {
-      z3_pushc (&result, (i++, tmplt->chr[i++]));
-      continue;
-    }
+  struct stat st;
+  if (fstat (fd, &st) == 0 && st.st_size > 0) z3_reserve (str, (usize)st.st_size);
 
-    if (!(i + 1 < tmplt->len && tmplt->chr[i] == '#' && tmplt->chr[i + 1] == '{')) {
-      z3_pushc (&result, tmplt->chr[i]);
-      i++;
-      continue;
+  bool ok = true;
+  while (true) {
+    z3_reserve (str, Z3_STRING_READ_SIZE);
+    isize n = read (fd, str->chr + str->len, str->max - str->len - 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      ok = n == 0;
+      break;
     }
+    str->len += (usize)n;
+  }
+  str->chr[str->len] = '\0';
 
-    usize path_start = i + 2;  // Skip "#{"
-    usize path_end = path_start;
+  close (fd);
+  return ok;
+}
 
-    // Find the closing '}'
-    while (path_end < tmplt->len && tmplt->chr[path_end] != '}') {
-      if (!(isalnum (tmplt->chr[path_end]) || tmplt->chr[path_end] == '_' ||
-            tmplt->chr[path_end] == '-'))
-        break;
-      path_end++;
+bool z3_write_atomic (nstr path, const String* data) {
+  struct iovec iov = {.iov_base = data->chr, .iov_len = data->len};
+  return z3_write_atomicv (path, &iov, 1);
+}
+
+bool z3_write_atomicv (nstr path, struct iovec* iov, usize count) {
+  String tmp = z3_str (strlen (path) + 16);  // NOLINT (readability-magic-numbers)
+  z3_pushf (&tmp, "%s.%d", path, (int)getpid ());
+
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  int fd = open ((nstr)tmp.chr, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    z3_drops (&tmp);
+    return false;
+  }
+
+  usize done = 0;
+  while (true) {
+    // past what was written, the last piece of it may be only part way
+    while (count > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      count--;
     }
-    if (tmplt->chr[path_end] != '}' || path_end >= tmplt->len) {
-      // No closing '}' found, treat as literal text
-      usize path_len = path_end - path_start + 2;
-      ustr path = malloc (path_len + 1);
-      if (path) {
-        memcpy (path, tmplt->chr + path_start - 2, path_len);
-        path[path_len] = '\0';
-        z3_pushl (&result, (nstr)path, path_len);
-        free (path);
-      }
-      i += path_len;
+    if (count == 0) break;
+    iov->iov_base = (u8*)iov->iov_base + done;
+    iov->iov_len -= done;
+    done = 0;
+
+    isize n = writev (fd, iov, count < Z3_WRITE_IOV_MAX ? (int)count : Z3_WRITE_IOV_MAX);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done = (usize)n;
+  }
+
+  bool ok = close (fd) == 0 && count == 0;
+  if (ok) ok = rename ((nstr)tmp.chr, path) == 0;
+  if (!ok) unlink ((nstr)tmp.chr);
+  z3_drops (&tmp);
+  return ok;
+}
+
+static bool z3_template__name (u8 c) {
+  return isalnum (c) || c == '_' || c == '-' || c == ':';
+}
+
+// Next part of a template from `*at`, false at the end
+//! Unclosed `#{` is literal text, `\` makes the next byte literal
+static bool z3_template__next (cstr tmplt, usize len, usize* at, TemplatePart* part) {
+  usize i = *at;
+  if (i >= len) return false;
+
+  usize start = i;
+  if (tmplt[i] == '\\') {
+    start = i + 1;  // the escaped byte starts the run, whatever it is
+    i = start < len ? start + 1 : len;
+  }
+
+  while (i < len && tmplt[i] != '\\') {
+    if (tmplt[i] != '#' || i + 1 >= len || tmplt[i + 1] != '{') {
+      i++;
       continue;
     }
-    usize path_len = path_end - path_start;
-    ustr path = (tmplt->chr + path_start);
 
-    if (!filler (&result, ctx, path, path_len)) {
-      z3_pushl (&result, (nstr)(tmplt->chr + i), path_len + 3);  // push entire #{...}
+    usize end = i + 2;  // Skip "#{"
+    while (end < len && z3_template__name (tmplt[end])) end++;
+    if (end >= len || tmplt[end] != '}') {
+      i = end;  // No closing '}' found, treat as literal text
+      continue;
     }
 
-    // Move past the closing '}'
-    i = path_end + 1;
+    if (i > start) break;  // text before it first
+    *part = (TemplatePart) {.text = {end - i - 2, tmplt + i + 2}, .placeholder = true};
+    *at = end + 1;
+    return true;
+  }
+
+  *part = (TemplatePart) {.text = {i - start, tmplt + start}, .placeholder = false};
+  *at = i;
+  return true;
+}
+
+static void z3_template__fill (
+  String* res, const TemplatePart* part, bool (*filler) (String*, void*, cstr, usize), void* ctx
+) {
+  if (!part->placeholder) {
+    z3_pushl (res, (nstr)part->text.chr, part->text.len);
+  } else if (!filler (res, ctx, part->text.chr, part->text.len)) {
+    // push entire #{...}
+    z3_pushl (res, (nstr)part->text.chr - 2, part->text.len + 3);
   }
+}
+
+String z3_interpl (
+  cstr tmplt, usize len, bool (*filler) (String*, void*, cstr, usize), void* ctx
+) {
+  String result = z3_str (len + 1);
+
+  usize at = 0;
+  TemplatePart part;
+  while (z3_template__next (tmplt, len, &at, &part))
+    z3_template__fill (&result, &part, filler, ctx);
 
   return result;
 }
 
+String z3_interp (
+  const String* tmplt, bool (*filler) (String*, void*, cstr, usize), void* ctx
+) {
+  return z3_interpl (tmplt->chr, tmplt->len, filler, ctx);
+}
+
+Template z3_template (cstr tmplt, usize len) {
+  Template tmpl = {0};
+
+  usize at = 0;
+  TemplatePart part;
+  while (z3_template__next (tmplt, len, &at, &part)) tmpl.count++;
+  if (tmpl.count == 0) return tmpl;
+
+  tmpl.parts = malloc (tmpl.count * sizeof (TemplatePart));
+  if (tmpl.parts == nullptr) die ("Template: requested %zu parts\n", tmpl.count);
+
+  at = 0;
+  for (usize i = 0; z3_template__next (tmplt, len, &at, &tmpl.parts[i]); i++)
+    if (!tmpl.parts[i].placeholder) tmpl.literal += tmpl.parts[i].text.len;
+
+  return tmpl;
+}
+
+String z3_render (
+  const Template* tmpl, bool (*filler) (String*, void*, cstr, usize), void* ctx
+) {
+  String result = z3_str (tmpl->literal + 1);
+  for (usize i = 0; i < tmpl->count; i++)
+    z3_template__fill (&result, &tmpl->parts[i], filler, ctx);
+  return result;
+}
+
+void z3_drop_template (Template* tmpl) {
+  if (!tmpl) return;
+
+  free (tmpl->parts);
+  *tmpl = (Template) {0};
+}
+
 String z3_escape (cstr input, usize len) {
   u8 hex_digits[] = "0123456789abcdef";
   String s = z3_str (len);
-  usize l = 0;
+  cstr end = input + len;
 
-  // loop until `\0`, or until length
-  while (l < len && *input) {
+  // loop until `\0`, or until length (of input, escapes take more than one byte)
+  while (input < end && *input) {
     u8 c = *input;
     switch (c) {
       case '\a':
@@ -281,18 +503,17 @@ String z3_escape (cstr input, usize len) {
         break;
     }
     input++;
-    l++;
   }
   return s;
 }
 
 String z3_unescape (cstr input, usize len) {
   String s = z3_str (len);
-  usize l = 0;
+  cstr end = input + len;
 
-  // loop until `\0`, or until length
-  while (l < len && *input) {
-    if (*input == '\\') {
+  // loop until `\0`, or until length (of input, escapes take more than one byte)
+  while (input < end && *input) {
+    if (*input == '\\' && input + 1 < end) {
       input++;  // Skip the backslash
 
       switch (*input) {
@@ -334,7 +555,6 @@ String z3_unescape (cstr input, usize len) {
             z3_pushc (&s, *input++);
             break;
           }
-          l++;
           u8 byte_value = 0;
           u8 c = *input++;
 
@@ -369,7 +589,6 @@ String z3_unescape (cstr input, usize len) {
       z3_pushc (&s, *input);
     }
     input++;
-    l++;
   }
   return s;
 }
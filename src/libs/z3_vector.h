@@ -8,8 +8,9 @@
  *   Provides dynamic array operations with automatic resizing and memory management.
  *
  * Features:
- *   - Dynamic arrays with automatic resizing
- *   - Type-safe array manipulation macros
+ *   - Dynamic arrays with automatic resizing, amortized doubling or an exact reserve
+ *   - Bulk appends that grow once
+ *   - Type-safe array manipulation macros, and typed push functions (Z3_VEC_DEFINE)
  *   - Debug printing utilities
  *   - Scoped resource cleanup for dynamic arrays
  *
@@ -23,7 +24,9 @@
 #include <stddef.h>
 #include <z3_toys.h>
 
-#define Z3_VECTOR_INITIAL_CAPACITY 16
+#ifndef Z3_VECTOR_INITIAL_CAPACITY
+#define Z3_VECTOR_INITIAL_CAPACITY 16  // first allocation of a push, can be overridden
+#endif
 
 //~ Dynamic array structure with automatic resizing
 typedef struct {
@@ -39,13 +42,11 @@ typedef struct {
     .max = 0, .len = 0, .esz = sizeof (type), .val = nullptr \
   }
 
+//~ Make room for `additional` more items, at least doubling the capacity when it grows
+void z3_vec_reserve (Vector* vec, usize additional);
+
 //~ Initialize with a specific size, otherwise push will do it
-#define z3_vec_init_capacity(vec, cap)                                                  \
-  {                                                                                     \
-    /* NOLINTNEXTLINE(bugprone-suspicious-realloc-usage) */                             \
-    (vec).val = malloc ((vec).esz * (vec).max);                                         \
-    if ((vec).val == nullptr) die ("Vector realloc: requested %zu bytes\n", (vec).max); \
-  }
+#define z3_vec_init_capacity(vec, cap) z3_vec_reserve (&(vec), (cap))
 
 //~ Get a pointer to an element at a specific index
 #define z3_get(vec, idx) ((typeof ((vec).val))((char*)(vec).val + ((idx) * (vec).esz)))
@@ -72,19 +73,49 @@ typedef struct {
     printf ("}\n");                                                                \
   }
 
+//~ Room for one more item, Z3_VECTOR_INITIAL_CAPACITY on the first push
+#define z3_vec__grow(vec) \
+  z3_vec_reserve (&(vec), ((vec).max == 0) ? Z3_VECTOR_INITIAL_CAPACITY : 1)
+
 //~ Append an item to a dynamic array, resizing if necessary
-#define z3_push(vec, item)                                                                \
-  {                                                                                       \
-    if ((vec).len >= (vec).max) {                                                         \
-      (vec).max = (((vec).max == 0) ? Z3_VECTOR_INITIAL_CAPACITY : (vec).max * 2);        \
-      /* NOLINTNEXTLINE(bugprone-suspicious-realloc-usage) */                             \
-      (vec).val = realloc ((vec).val, (vec).esz * (vec).max);                             \
-      if ((vec).val == nullptr) die ("Vector realloc: requested %zu bytes\n", (vec).max); \
-    }                                                                                     \
-    memcpy (z3_get (vec, (vec).len), (void*)&(item), (vec).esz);                          \
-    (vec).len++;                                                                          \
+#define z3_push(vec, item)                                       \
+  {                                                              \
+    if ((vec).len >= (vec).max) z3_vec__grow (vec);              \
+    memcpy (z3_get (vec, (vec).len), (void*)&(item), (vec).esz); \
+    (vec).len++;                                                 \
+  }
+
+//~ Append `n` items from `items`, growing at most once
+#define z3_push_n(vec, items, n)                                             \
+  {                                                                          \
+    usize z3__n = (n);                                                       \
+    z3_vec_reserve (&(vec), z3__n);                                          \
+    if (z3__n) memcpy (z3_get (vec, (vec).len), (items), (vec).esz * z3__n); \
+    (vec).len += z3__n;                                                      \
   }
 
+//~ Append every item of `other`, both hold the same type
+#define z3_extend(vec, other) z3_push_n (vec, (other).val, (other).len)
+
+//~ Define inline typed accessors for a Vector of TYPE (one identifier, like z3_vec_drop_fn)
+//! z3_at_TYPE, z3_push_TYPE and z3_push_n_TYPE store whole TYPEs instead of `esz` bytes,
+//  so the compiler sees fixed-size copies it can inline and vectorize
+#define Z3_VEC_DEFINE(TYPE)                                                             \
+  static inline TYPE* z3_at_##TYPE (const Vector* vec, usize idx) {                     \
+    return (TYPE*)vec->val + idx;                                                       \
+  }                                                                                     \
+  static inline void z3_push_##TYPE (Vector* vec, TYPE item) {                          \
+    if (vec->len >= vec->max) z3_vec__grow (*vec);                                      \
+    ((TYPE*)vec->val)[vec->len++] = item;                                               \
+  }                                                                                     \
+  static inline void z3_push_n_##TYPE (Vector* vec, const TYPE* items, usize n) {       \
+    z3_vec_reserve (vec, n);                                                            \
+    TYPE* dst = (TYPE*)vec->val + vec->len;                                             \
+    for (usize i = 0; i < n; i++) dst[i] = items[i];                                    \
+    vec->len += n;                                                                      \
+  }                                                                                     \
+  static inline void z3_push_n_##TYPE (Vector* vec, const TYPE* items, usize n)
+
 //~ Free the memory used by a dynamic array
 #define z3_drop_vec(vec) \
   if ((vec).val) {       \
@@ -133,6 +164,21 @@ void z3_vec_drop (Vector* vec);
 #ifdef Z3_VECTOR_IMPL
 #include <stdlib.h>
 
+void z3_vec_reserve (Vector* vec, usize additional) {
+  usize need = vec->len + additional;
+  if (need <= vec->max) return;
+
+  usize max = vec->max * 2;
+  if (max < need) max = need;
+
+  // NOLINTNEXTLINE (bugprone-suspicious-realloc-usage) dies on failure
+  void* val = realloc (vec->val, vec->esz * max);
+  if (val == nullptr) die ("Vector realloc: requested %zu bytes\n", vec->esz * max);
+
+  vec->val = val;
+  vec->max = max;
+}
+
 //~ Cleanup function for generic Vector (used with attribute cleanup)
 inline void z3_vec_drop (Vector* vec) {
   if (!vec || !vec->val) return;
@@ -1,22 +1,33 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // Copyright (c) 2025-present Klapptnot
 
+#include <errno.h>
 #include <notrust.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define Z3_TOYS_SCOPED
 #define Z3_TOYS_IMPL
 #define Z3_STRING_IMPL
 #define Z3_HASHMAP_IMPL
 #define Z3_VECTOR_IMPL
+#define Z3_ARENA_IMPL
+#define Z3_SHA256_IMPL
+#include <z3_arena.h>
 #include <z3_hashmap.h>
+#include <z3_sha256.h>
 #include <z3_string.h>
 #include <z3_toys.h>
 #include <z3_vector.h>
 
+#include "blob.h"
+#include "build.h"
 #include "config.h"
+#include "jobserver.h"
+#include "watch.h"
 #include "yaml.h"
 
 String int_to_str (int num);
@@ -40,8 +51,6 @@ String float_to_str (float num);
     z3_drops (&s);                                             \
   }
 
-z3_vec_drop_fn (String, z3_drops);
-
 static void print_anvil_config (const AnvilConfig* config) {
   if (!config) {
     printf ("AnvilConfig is NULL\n");
@@ -63,11 +72,20 @@ static void print_anvil_config (const AnvilConfig* config) {
   printf ("\n-- Targets -- %zu\n", config->targets->count);
   if (config->targets) {
     for (usize i = 0; i < config->targets->count; i++) {
-      TargetConfig* tgt = config->targets->target[i];
+      TargetConfig* tgt = &config->targets->target[i];
       printf ("Target %zu:\n", i);
       printf ("  Name: %s\n", tgt->name);
       printf ("  Type: %s\n", tgt->type);
       printf ("  Main: %s\n", tgt->main);
+      if (tgt->pch) printf ("  Pch: %s\n", tgt->pch);
+      if (tgt->lto) printf ("  Lto: %s\n", tgt->lto);
+      if (tgt->unity) printf ("  Unity: %zu\n", tgt->unity);
+      if (tgt->macros) {
+        HashMapIterator mit = z3_hashmap_iterator (tgt->macros);
+        while (z3_hashmap_iter_next (&mit)) {
+          printf ("    %s = %s\n", mit.key, (char*)mit.val);
+        }
+      }
       for (usize j = 0; j < tgt->target_count; j++) {
         printf ("    for[%zu]: %s\n", j, tgt->target[j]);
       }
@@ -110,6 +128,18 @@ static void print_anvil_config (const AnvilConfig* config) {
     }
   }
 
+  printf ("Hooks:\n");
+  if (config->build->hooks) {
+    HashMapIterator it;
+    z3_hashmap_iter_init (&it, config->build->hooks);
+    while (z3_hashmap_iter_next (&it)) {
+      ArgumentConfig* hook = it.val;
+      printf ("  %s\n", it.key);
+      printf ("    validation   = %s\n", hook->validation);
+      printf ("    cache_policy = %s\n", hook->cache_policy);
+    }
+  }
+
   printf ("Dependencies:\n");
   for (usize i = 0; i < config->build->deps_count; i++) {
     DependencyConfig dep = config->build->deps[i];
@@ -118,6 +148,7 @@ static void print_anvil_config (const AnvilConfig* config) {
     printf ("    Type: %s\n", dep.type);
     printf ("    Repo: %s\n", dep.repo);
     printf ("    Path: %s\n", dep.path);
+    if (dep.ref) printf ("    Ref: %s\n", dep.ref);
   }
 
   // Profiles
@@ -126,10 +157,10 @@ static void print_anvil_config (const AnvilConfig* config) {
     HashMapIterator it;
     z3_hashmap_iter_init (&it, config->profiles);
     while (z3_hashmap_iter_next (&it)) {
-      Vector* profc = it.val;
-      printf ("  %s (%zu):\n", it.key, profc->len);
-      for (usize i = 0; i < profc->len; i++) {
-        printf ("      [%zu] %s\n", i, *(char**)z3_get (*profc, i));
+      ProfileConfig* profc = it.val;
+      printf ("  %s (%zu):\n", it.key, profc->flags_count);
+      for (usize i = 0; i < profc->flags_count; i++) {
+        printf ("      [%zu] %s\n", i, profc->flags[i]);
       }
     }
   }
@@ -137,27 +168,258 @@ static void print_anvil_config (const AnvilConfig* config) {
   printf ("====================\n");
 }
 
-int main (int argc, char** argv) {
-  IGNORE_UNUSED (char* _this_file = popf (argc, argv));  // NOLINT (concurrency-mt-unsafe)
-  char* file_name = popf (argc, argv);                   // NOLINT (concurrency-mt-unsafe)
+// The manifest is only parsed again when it changed since the last run, nullptr if it
+// can't be parsed
+static AnvilConfig* config_load (Trace* trace, YamlStore* store, ConfigBlob* blob) {
+  u64 started = trace_now (trace);
+  AnvilConfig* config = config_blob_load (blob, ANVIL_MANIFEST, CONFIG_BLOB_PATH);
+  trace_span (trace, "config", "load " CONFIG_BLOB_PATH, started);
+  if (config) return config;
 
-  YamlStore store;
-  Node* root = parse_yaml (file_name, &store);
+  started = trace_now (trace);
+  // next to the strings it points into, and freed with them
+  config = lower_anvil_config (ANVIL_MANIFEST, store);
+  trace_span (trace, "config", "lower " ANVIL_MANIFEST, started);
 
-  if (!root) {
+  if (!config) {
     errpfmt ("Failed to parse YAML\n");
+    free_yaml (store);
+    return nullptr;
+  }
+
+  started = trace_now (trace);
+  if (!config_blob_save (config, ANVIL_MANIFEST, CONFIG_BLOB_PATH)) {
+    errpfmt ("could not cache the config at '%s'\n", CONFIG_BLOB_PATH);
+  }
+  trace_span (trace, "config", "save " CONFIG_BLOB_PATH, started);
+  return config;
+}
+
+static void config_unload (AnvilConfig* config, YamlStore* store, ConfigBlob* blob) {
+  if (blob->data) {
+    config_blob_drop (blob);
+  } else {
+    free_anvil_config (config);
+    free_yaml (store);
+  }
+}
+
+// Load the manifest in a child, the parser exits on an error and `watch` has to outlive a
+// typo. A good one is left lowered in the blob, for the caller to load it from there
+static bool config_check (void) {
+  fflush (stdout);  // NOLINT (cert-err33-c)
+  pid_t pid = fork ();
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (pid < 0) die ("could not fork to load %s: %s\n", ANVIL_MANIFEST, strerror (errno));
+
+  if (pid == 0) {
+    YamlStore store = {0};
+    ConfigBlob blob;
+    _exit (config_load (nullptr, &store, &blob) ? 0 : 1);
+  }
+
+  int wstatus = 0;
+  while (waitpid (pid, &wstatus, 0) < 0 && errno == EINTR);
+  return WIFEXITED (wstatus) && WEXITSTATUS (wstatus) == 0;
+}
+
+// `watch`: build, then build again as soon as a file the build depends on changes. The
+// config, macros and hook values are kept until anvil.yaml changes, and so are the stats
+// of every file until inotify says otherwise, so a rebuild only looks at what changed
+static int watch_builds (BuildOptions* opts) {
+  rstr cwd = getcwd (nullptr, 0);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (!cwd) die ("could not get working directory: %s\n", strerror (errno));
+  ScopedString manifest = z3_strcpy ((cstr)cwd);
+  free (cwd);
+  z3_pushc (&manifest, '/');
+  z3_pushlit (&manifest, ANVIL_MANIFEST);
+
+  Watch w;
+  watch_init (&w, &manifest);
+  while (true) {
+    if (!config_check ()) {
+      printf ("%12s for %s to be fixed\n", "Waiting", ANVIL_MANIFEST);
+      fflush (stdout);  // NOLINT (cert-err33-c)
+      while (!(watch_wait (&w) & WATCH_MANIFEST));
+      continue;
+    }
+
+    YamlStore store = {0};
+    ConfigBlob blob;
+    AnvilConfig* config = config_load (nullptr, &store, &blob);
+    if (!config) die ("%s changed while it was loaded\n", ANVIL_MANIFEST);
+
+    Jobserver js;
+    jobserver_init (&js, config->build ? config->build->jobs : 0);
+    opts->js = &js;
+
+    BuildContext base;
+    build_context_init (&base, config, opts);
+    base.stat_memo = w.stats;
+    watch_set_outputs (&w, &base.build_dir);
+
+    usize count = 0;
+    BuildContext* units = build_units_init (&base, opts->triple, &count);
+    WatchChange change = WATCH_NONE;
+    while (!(change & WATCH_MANIFEST)) {
+      build_targets (units, count);
+      // --rebuild is for the first build only
+      for (usize i = 0; i < count; i++) units[i].rebuild = false;
+
+      // saved while it was building
+      change = watch_arm (&w);
+      if (change != WATCH_NONE) continue;
+
+      printf ("%12s for changes, Ctrl-C to stop\n", "Watching");
+      fflush (stdout);  // NOLINT (cert-err33-c)
+      change = watch_wait (&w);
+    }
+    opts->rebuild = false;
+
+    build_units_drop (units, count);
+    build_context_drop (&base);
+    jobserver_drop (&js);
+    opts->js = nullptr;
+    config_unload (config, &store, &blob);
+  }
+}
+
+static void print_usage (nstr argv_zero) {
+  printf ("Usage: %s <command> [options] [-- args]\n\n", argv_zero);
+  printf ("Commands:\n");
+  printf ("  build    Build a target\n");
+  printf ("  run      Build and run a target, args after `--` are passed to it\n");
+  printf ("  watch    Build, then again whenever a source or %s changes\n", ANVIL_MANIFEST);
+  printf ("  config   Print the lowered %s\n\n", ANVIL_MANIFEST);
+  printf ("Options:\n");
+  printf ("  -t, --target <name|index>  Target to build, index 0 by default\n");
+  printf (
+    "  -p, --profile <name>       Profile to build with, `%s` by default\n", DEFAULT_PROFILE
+  );
+  printf ("      --triple <triple>      Build only for this triple, all of `for` by default\n");
+  printf ("      --all-triples          Build every triple of `for`, even for `run`\n");
+  printf ("  -r, --rebuild              Compile every object, even when up to date\n");
+  printf ("      --pgo <generate|use>   Instrument for profiles, or optimize with them\n");
+  printf (
+    "      --timings              Write %s and %s to the build folder\n", TRACE_FILE_NAME,
+    TIMINGS_FILE_NAME
+  );
+}
+
+int main (int argc, char** argv) {
+  nstr this_file = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+  nstr command = argc > 0 ? popf (argc, argv) : "build";
+
+  BuildOptions opts = {0};
+  Trace trace;
+  while (argc > 0) {
+    nstr arg = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+    if (strcmp (arg, "--") == 0) break;
+
+    if (strcmp (arg, "-t") == 0 || strcmp (arg, "--target") == 0) {
+      opts.target = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+    } else if (strcmp (arg, "-p") == 0 || strcmp (arg, "--profile") == 0) {
+      opts.profile = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+    } else if (strcmp (arg, "--triple") == 0) {
+      opts.triple = popf (argc, argv);  // NOLINT (concurrency-mt-unsafe)
+    } else if (strcmp (arg, "--all-triples") == 0) {
+      opts.all_triples = true;
+    } else if (strcmp (arg, "-r") == 0 || strcmp (arg, "--rebuild") == 0) {
+      opts.rebuild = true;
+    } else if (strcmp (arg, "--pgo") == 0) {
+      nstr mode = argc > 0 ? popf (argc, argv) : "";  // NOLINT (concurrency-mt-unsafe)
+      if (strcmp (mode, "generate") == 0) {
+        opts.pgo = PGO_GENERATE;
+      } else if (strcmp (mode, "use") == 0) {
+        opts.pgo = PGO_USE;
+      } else {
+        errpfmt ("--pgo takes 'generate' or 'use', not '%s'\n", mode);
+        return 1;
+      }
+    } else if (strcmp (arg, "--timings") == 0) {
+      opts.trace = &trace;
+    } else if (strcmp (arg, "-h") == 0 || strcmp (arg, "--help") == 0) {
+      print_usage (this_file);
+      return 0;
+    } else {
+      errpfmt ("unknown option '%s'\n", arg);
+      print_usage (this_file);
+      return 1;
+    }
+  }
+
+  bool run = strcmp (command, "run") == 0;
+  bool print = strcmp (command, "config") == 0;
+  bool watch = strcmp (command, "watch") == 0;
+  if (!run && !print && !watch && strcmp (command, "build") != 0) {
+    errpfmt ("unknown command '%s'\n", command);
+    print_usage (this_file);
     return 1;
   }
 
-  AnvilConfig* config = malloc (sizeof (AnvilConfig));
-  dset_anvil_config (config, root);
-  print_anvil_config (config);
-  free_anvil_config (config);
-  free_yaml (root);
-  z3_vec_drop_String (&store.str_pools);
-  z3_vec_drop_String (&store.owned_strs);
+  if (watch) {
+    if (opts.trace) {
+      errpfmt ("--timings needs a build that ends, it can't be used with watch\n");
+      return 1;
+    }
+    return watch_builds (&opts);
+  }
+
+  if (opts.trace) trace_init (opts.trace);
+
+  YamlStore store = {0};
+  ConfigBlob blob;
+  AnvilConfig* config = config_load (opts.trace, &store, &blob);
+  if (!config) return 1;
+
+  int status = 0;
+  if (print) {
+    print_anvil_config (config);
+  } else {
+    // before the hooks, they may run builds of their own
+    Jobserver js;
+    jobserver_init (&js, config->build ? config->build->jobs : 0);
+    opts.js = &js;
+
+    BuildContext base;
+    build_context_init (&base, config, &opts);
+
+    nstr triple = opts.triple;
+    if (run && !triple && !opts.all_triples) triple = build_host_triple (&base);
+
+    usize count = 0;
+    BuildContext* units = build_units_init (&base, triple, &count);
+    status = build_targets (units, count) ? 0 : 1;
+    // the build is over, even when the target runs next
+    if (!trace_write (opts.trace, &base.build_dir))
+      errpfmt ("could not write the timings to '%s'\n", base.build_dir.chr);
+
+    if (status == 0 && run) {
+      // the host one when every triple was built
+      BuildContext* ctx = &units[0];
+      nstr host = build_host_triple (&base);
+      for (usize i = 0; i < count; i++) {
+        if (units[i].triple == host) ctx = &units[i];
+      }
+
+      // the target gets the MAKEFLAGS anvil was started with
+      jobserver_drop (&js);
+      fflush (stdout);  // NOLINT (cert-err33-c)
+      // argv is still nullptr terminated after the popped `--`
+      argv[-1] = (rstr)ctx->bin.chr;
+      execv ((nstr)ctx->bin.chr, argv - 1);
+      // NOLINTNEXTLINE (concurrency-mt-unsafe)
+      die ("could not run '%s': %s\n", ctx->bin.chr, strerror (errno));
+    }
+    build_units_drop (units, count);
+    build_context_drop (&base);
+    jobserver_drop (&js);
+  }
+  trace_drop (opts.trace);
+  config_unload (config, &store, &blob);
 
-  return 0;
+  return status;
 }
 
 #ifdef _IGNORE
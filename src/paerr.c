@@ -101,11 +101,23 @@ static void parser_error (YamlParser* yp, YamlError error) {
 
   String* filename = z3_get (yp->store->str_pools, 0);
 
+  // a mapped parser does not count lines while scanning
+  if (yp->mapped) {
+    yp->line = 0;
+    yp->lpos = 0;
+    for (usize i = 0; i < yp->cpos; i++) {
+      yp->lpos++;
+      if (yp->chunk[i] != CHAR_NEWLINE) continue;
+      yp->line++;
+      yp->lpos = 0;
+    }
+  }
+
   ScopedString err_msg = z3_strcpy ((cstr)yaml_error_messages[error.kind]);
   ScopedString ferr_msg = z3_interp (&err_msg, parser_filler, &error);
 
   eprintf ("YamlError::%s\n", yaml_error_to_string (error.kind));
-  eprintf ("%s:%hu:%hu -> %s\n", filename->chr, yp->line, yp->lpos, ferr_msg.chr);
+  eprintf ("%s:%u:%u -> %s\n", filename->chr, yp->line, yp->lpos, ferr_msg.chr);
 
   fflush (stderr);  // NOLINT (cert-err33-c)
   _exit (EXIT_FAILURE);
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "pkgconfig.h"
+
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+#include "cache.h"
+#include "runner.h"
+
+#define PKGCONFIG_READ_SIZE 4096
+
+// The default search path, then the cflags and the libs of "$@", a line each;
+// $0 is the pkg-config executable
+static const char PKGCONFIG_SCRIPT[] =
+  "set -e\n"
+  "\"$0\" --variable pc_path pkg-config\n"
+  "\"$0\" --cflags \"$@\"\n"
+  "\"$0\" --libs \"$@\"\n";
+
+// What changes the output of pkg-config, besides the `.pc` files
+static const nstr PKGCONFIG_ENV[] = {
+  "PKG_CONFIG_PATH",
+  "PKG_CONFIG_LIBDIR",
+  "PKG_CONFIG_SYSROOT_DIR",
+  "PKG_CONFIG_ALLOW_SYSTEM_CFLAGS",
+  "PKG_CONFIG_ALLOW_SYSTEM_LIBS",
+};
+
+// The resolved flags, and what they were resolved from
+typedef struct {
+  u64 fingerprint;  // of the inputs as they were, see pkg_fingerprint
+  Vector paths;     // String, folders of the search path and every `.pc` file read
+  String cflags;    // `--cflags` of every package, as pkg-config printed them
+  String libs;      // `--libs` of every package
+} PkgRecord;
+
+static void pkg_record_drop (PkgRecord* rec) {
+  z3_vec_drop_String (&rec->paths);
+  z3_drops (&rec->cflags);
+  z3_drops (&rec->libs);
+}
+
+static nstr pkg_tool (void) {
+  nstr tool = getenv ("PKG_CONFIG");  // NOLINT (concurrency-mt-unsafe)
+  return (tool && tool[0] != '\0') ? tool : "pkg-config";
+}
+
+// The executable, environment, package names and the stat of every recorded path
+static u64 pkg_fingerprint (nstr tool, const BuildConfig* bconf, const Vector* paths) {
+  u64 h = cache_compiler_id (tool);
+
+  for (usize i = 0; i < sizeof (PKGCONFIG_ENV) / sizeof (*PKGCONFIG_ENV); i++) {
+    nstr value = getenv (PKGCONFIG_ENV[i]);  // NOLINT (concurrency-mt-unsafe)
+    // unset and empty differ for PKG_CONFIG_LIBDIR
+    if (value) h = z3_hash_bytes (h, value, strlen (value) + 1);
+    h = z3_hash_bytes (h, &(u8) {value != nullptr}, 1);
+  }
+
+  for (usize i = 0; i < bconf->deps_count; i++) {
+    const DependencyConfig* dep = &bconf->deps[i];
+    if (!dep->type || strcmp ((nstr)dep->type, "pkg-config") != 0) continue;
+    h = z3_hash_bytes (h, dep->name, strlen ((nstr)dep->name) + 1);
+  }
+
+  for (usize i = 0; i < paths->len; i++) {
+    String* path = z3_at_String (paths, i);
+    h = z3_hash_bytes (h, path->chr, path->len + 1);
+
+    // a missing folder is recorded too, creating it may shadow a package
+    struct stat st = {0};
+    if (stat ((nstr)path->chr, &st) != 0) continue;
+    h = z3_hash_bytes (h, &st.st_size, sizeof (st.st_size));
+    h = z3_hash_bytes (h, &st.st_mtim.tv_sec, sizeof (st.st_mtim.tv_sec));
+    h = z3_hash_bytes (h, &st.st_mtim.tv_nsec, sizeof (st.st_mtim.tv_nsec));
+  }
+  return h;
+}
+
+// Layout: u32 magic, version, path count and padding, the u64 fingerprint, u32 length of
+// cflags and libs, then each path (u32 length and bytes), cflags and libs
+static bool pkg_load (const String* cache_path, PkgRecord* rec) {
+  ScopedString data = z3_str (PKGCONFIG_READ_SIZE);
+  if (!z3_read_file ((nstr)cache_path->chr, &data)) return false;
+
+  u32 head[4];
+  u32 lens[2];
+  usize pos = sizeof (head) + sizeof (rec->fingerprint) + sizeof (lens);
+  if (data.len < pos) return false;
+  memcpy (head, data.chr, sizeof (head));
+  if (head[0] != PKGCONFIG_MAGIC || head[1] != PKGCONFIG_VERSION) return false;
+  memcpy (&rec->fingerprint, data.chr + sizeof (head), sizeof (rec->fingerprint));
+  memcpy (lens, data.chr + sizeof (head) + sizeof (rec->fingerprint), sizeof (lens));
+
+  for (u32 i = 0; i < head[2]; i++) {
+    u32 len = 0;
+    if (data.len - pos < sizeof (len)) return false;
+    memcpy (&len, data.chr + pos, sizeof (len));
+    pos += sizeof (len);
+    if (data.len - pos < len) return false;
+
+    String path = z3_str (len + 1);
+    z3_pushl (&path, (nstr)data.chr + pos, len);
+    z3_push_String (&rec->paths, path);
+    pos += len;
+  }
+
+  if (data.len - pos != (usize)lens[0] + lens[1]) return false;
+  z3_pushl (&rec->cflags, (nstr)data.chr + pos, lens[0]);
+  z3_pushl (&rec->libs, (nstr)data.chr + pos + lens[0], lens[1]);
+  return true;
+}
+
+static bool pkg_save (const String* cache_path, const PkgRecord* rec) {
+  ScopedString data = z3_str (PKGCONFIG_READ_SIZE);
+  u32 head[4] = {PKGCONFIG_MAGIC, PKGCONFIG_VERSION, (u32)rec->paths.len, 0};
+  u32 lens[2] = {(u32)rec->cflags.len, (u32)rec->libs.len};
+  z3_pushl (&data, (nstr)head, sizeof (head));
+  z3_pushl (&data, (nstr)&rec->fingerprint, sizeof (rec->fingerprint));
+  z3_pushl (&data, (nstr)lens, sizeof (lens));
+
+  for (usize i = 0; i < rec->paths.len; i++) {
+    String* path = z3_at_String (&rec->paths, i);
+    u32 len = (u32)path->len;
+    z3_pushl (&data, (nstr)&len, sizeof (len));
+    z3_pushl (&data, (nstr)path->chr, path->len);
+  }
+  z3_pushl (&data, (nstr)rec->cflags.chr, rec->cflags.len);
+  z3_pushl (&data, (nstr)rec->libs.chr, rec->libs.len);
+
+  ScopedString dest = z3_strdup (cache_path);
+  create_parent_dirs (&dest);
+  return z3_write_atomic ((nstr)cache_path->chr, &data);
+}
+
+// Run `argv` with its stdout captured in `out`, false if it can't be run or fails
+static bool pkg_run (nstr const* argv, String* out) {
+  RunnerSpawn how = {.out = out};
+  return runner_run (argv, &how) == 0;
+}
+
+// Push the `:` separated entries of `list` to `dirs`
+static void push_dirs (Vector* dirs, nstr list, usize len) {
+  nstr end = list + len;
+  while (list < end) {
+    nstr sep = memchr (list, ':', (usize)(end - list));
+    usize dlen = sep ? (usize)(sep - list) : (usize)(end - list);
+    if (dlen > 0) {
+      String dir = z3_str (dlen + 1);
+      z3_pushl (&dir, list, dlen);
+      z3_push_String (dirs, dir);
+    }
+    list += dlen + 1;
+  }
+}
+
+static bool is_space (char c) {
+  return c == ' ' || c == '\t' || c == ',' || c == '\r' || c == '\n';
+}
+
+// What follows `field` if `line` starts with it, nullptr otherwise
+static nstr field_value (nstr line, nstr field) {
+  usize len = strlen (field);
+  return strncmp (line, field, len) == 0 ? line + len : nullptr;
+}
+
+// Record the `.pc` file of `name` and, through its `Requires` and `Requires.private`
+// (both matter for `--cflags`), every package it pulls in
+static void pkg_closure (const Vector* dirs, nstr name, HashMap* seen, Vector* paths) {
+  if (z3_hashmap_has (seen, name)) return;
+  z3_hashmap_put (seen, name, seen);  // any non-null value
+
+  ScopedString pc = z3_str (PKGCONFIG_READ_SIZE);
+  for (usize i = 0; i < dirs->len; i++) {
+    String* dir = z3_at_String (dirs, i);
+    pc.len = 0;
+    z3_pushl (&pc, (nstr)dir->chr, dir->len);
+    z3_pushf (&pc, "/%s.pc", name);
+    if (access ((nstr)pc.chr, R_OK) == 0) break;
+    pc.len = 0;
+  }
+  if (pc.len == 0) return;  // pkg-config found it, but not where it was asked to look
+  z3_push_String (paths, z3_strdup (&pc));
+
+  ScopedString data = z3_str (PKGCONFIG_READ_SIZE);
+  if (!z3_read_file ((nstr)pc.chr, &data)) return;
+
+  nstr line = (nstr)data.chr;
+  while (line && *line) {
+    nstr eol = strchr (line, '\n');
+    nstr next = eol ? eol + 1 : nullptr;
+    usize llen = eol ? (usize)(eol - line) : strlen (line);
+
+    nstr at = field_value (line, "Requires:");
+    if (!at) at = field_value (line, "Requires.private:");
+
+    // `a >= 1.0, b c`, a version follows each comparison
+    bool version = false;
+    nstr end = line + llen;
+    while (at && at < end) {
+      while (at < end && is_space (*at)) at++;
+      nstr tok = at;
+      while (at < end && !is_space (*at)) at++;
+      usize tlen = (usize)(at - tok);
+      if (tlen == 0) break;
+
+      bool op = strchr ("<>=!", tok[0]) != nullptr;
+      if (!op && !version && !memchr (tok, '$', tlen)) {
+        ScopedString dep = z3_str (tlen + 1);
+        z3_pushl (&dep, tok, tlen);
+        pkg_closure (dirs, (nstr)dep.chr, seen, paths);
+      }
+      version = op;
+    }
+    line = next;
+  }
+}
+
+// Split flags the way pkg-config quotes them, a backslash escapes the next character
+static void push_flags (Vector* out, const String* flags) {
+  usize i = 0;
+  while (i < flags->len) {
+    while (i < flags->len && is_space ((char)flags->chr[i])) i++;
+    if (i == flags->len) break;
+
+    String flag = z3_str (PKGCONFIG_READ_SIZE / 16);  // NOLINT (readability-magic-numbers)
+    while (i < flags->len && !is_space ((char)flags->chr[i])) {
+      if (flags->chr[i] == '\\' && i + 1 < flags->len) i++;
+      z3_pushc (&flag, flags->chr[i++]);
+    }
+    z3_push_String (out, flag);
+  }
+}
+
+// Take the next line of `out` from `*at`, without its newline
+static void take_line (const String* out, usize* at, String* line) {
+  nstr start = (nstr)out->chr + *at;
+  nstr eol = memchr (start, '\n', out->len - *at);
+  usize len = eol ? (usize)(eol - start) : out->len - *at;
+  z3_pushl (line, start, len);
+  *at += eol ? len + 1 : len;
+}
+
+bool pkgconfig_resolve (
+  const BuildConfig* bconf, const String* build_dir, bool fresh, Trace* tr, Vector* cflags,
+  Vector* libs
+) {
+  if (!bconf) return true;
+
+  nstr tool = pkg_tool ();
+  ScopedVector argv = z3_vec (nstr);
+  nstr head[] = {"sh", "-c", PKGCONFIG_SCRIPT, tool};
+  z3_push_n (argv, head, sizeof (head) / sizeof (*head));
+  for (usize i = 0; i < bconf->deps_count; i++) {
+    const DependencyConfig* dep = &bconf->deps[i];
+    if (!dep->type || strcmp ((nstr)dep->type, "pkg-config") != 0) continue;
+    if (!dep->name) {
+      errpfmt ("`pkg-config` dependency %zu has no `name`\n", i);
+      return false;
+    }
+    z3_push (argv, dep->name);
+  }
+  if (argv.len == sizeof (head) / sizeof (*head)) return true;
+
+  ScopedString cache_path = z3_strdup (build_dir);
+  z3_pushc (&cache_path, '/');
+  z3_pushlit (&cache_path, PKGCONFIG_CACHE_NAME);
+
+  PkgRecord rec = {.paths = z3_vec (String), .cflags = z3_str (0), .libs = z3_str (0)};
+  // a no-op build stats a few files and forks nothing
+  if (!fresh && pkg_load (&cache_path, &rec) &&
+      pkg_fingerprint (tool, bconf, &rec.paths) == rec.fingerprint) {
+    push_flags (cflags, &rec.cflags);
+    push_flags (libs, &rec.libs);
+    pkg_record_drop (&rec);
+    return true;
+  }
+  pkg_record_drop (&rec);
+  rec = (PkgRecord) {.paths = z3_vec (String), .cflags = z3_str (0), .libs = z3_str (0)};
+
+  nstr null = nullptr;
+  z3_push (argv, null);
+  ScopedString out = z3_str (PKGCONFIG_READ_SIZE);
+  u64 started = trace_now (tr);
+  u32 lane = trace_lane (tr);
+  bool ok = pkg_run (argv.val, &out);
+  trace_proc (tr, "fetch", "pkg-config", started, lane);
+  if (!ok) {
+    errpfmt ("%s could not resolve the `pkg-config` dependencies\n", tool);
+    pkg_record_drop (&rec);
+    return false;
+  }
+
+  usize at = 0;
+  ScopedString pc_path = z3_str (PKGCONFIG_READ_SIZE);
+  take_line (&out, &at, &pc_path);
+  take_line (&out, &at, &rec.cflags);
+  take_line (&out, &at, &rec.libs);
+
+  // searched in this order by pkg-config, PKG_CONFIG_LIBDIR replaces the default
+  ScopedVector_ (String) dirs = z3_vec (String);
+  nstr env = getenv ("PKG_CONFIG_PATH");  // NOLINT (concurrency-mt-unsafe)
+  if (env) push_dirs (&dirs, env, strlen (env));
+  env = getenv ("PKG_CONFIG_LIBDIR");  // NOLINT (concurrency-mt-unsafe)
+  if (env)
+    push_dirs (&dirs, env, strlen (env));
+  else
+    push_dirs (&dirs, (nstr)pc_path.chr, pc_path.len);
+
+  for (usize i = 0; i < dirs.len; i++)
+    z3_push_String (&rec.paths, z3_strdup (z3_at_String (&dirs, i)));
+
+  HashMap* seen = z3_hashmap_create ();
+  for (usize i = sizeof (head) / sizeof (*head); i + 1 < argv.len; i++)
+    pkg_closure (&dirs, *(nstr*)z3_get (argv, i), seen, &rec.paths);
+  z3_hashmap_drop_shallow (seen);
+
+  rec.fingerprint = pkg_fingerprint (tool, bconf, &rec.paths);
+  if (!pkg_save (&cache_path, &rec))
+    errpfmt ("could not write the pkg-config cache to '%s'\n", cache_path.chr);
+
+  push_flags (cflags, &rec.cflags);
+  push_flags (libs, &rec.libs);
+  pkg_record_drop (&rec);
+  return true;
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define PKGCONFIG_CACHE_NAME ".pkgconfig"  // in workspace.build
+#define PKGCONFIG_MAGIC      0x43474B50    // "PKGC"
+#define PKGCONFIG_VERSION    1
+
+// Flags (String) of every `pkg-config` dependency into `cflags` and `libs`, resolved by a
+// single pkg-config run and cached in `<build_dir>/PKGCONFIG_CACHE_NAME` until a `.pc` file
+// they came from or a folder of the search path changes, `fresh` ignores the cache.
+// False if pkg-config failed
+bool pkgconfig_resolve (
+  const BuildConfig* bconf, const String* build_dir, bool fresh, Trace* tr, Vector* cflags,
+  Vector* libs
+);
@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+// posix_spawn_file_actions_addchdir_np, hooks run in the project root
+#define _GNU_SOURCE
+
+#include "runner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <notrust.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+
+// exit code of a shell-style "command not found"
+#define RUNNER_EXEC_FAILED 127
+// shells report a child killed by a signal as 128 + signo
+#define RUNNER_SIGNAL_BASE 128
+// what each of the 3 polls of a slot is for
+#define RUNNER_POLL_OUT  0
+#define RUNNER_POLL_ERR  1
+#define RUNNER_POLL_EXIT 2
+// owner of the poll on the jobserver, past every slot
+#define RUNNER_POLL_TOKEN UINT32_MAX
+
+extern char** environ;
+
+usize runner_default_jobs (void) {
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (usize)n : 1;
+}
+
+void runner_init (Runner* rn, usize jobs, Jobserver* js) {
+  rn->max = jobs == 0 ? runner_default_jobs () : jobs;
+  rn->running = 0;
+  rn->procs = calloc (rn->max, sizeof (RunnerProc));
+  rn->polls = calloc ((rn->max * 3) + 1, sizeof (struct pollfd));
+  rn->owner = calloc ((rn->max * 3) + 1, sizeof (u32));
+  if (rn->procs == nullptr || rn->polls == nullptr || rn->owner == nullptr)
+    die ("Runner: requested %zu slots\n", rn->max);
+  for (usize i = 0; i < rn->max; i++)
+    rn->procs[i] = (RunnerProc) {.out = -1, .err = -1, .pidfd = -1};
+
+  rn->js = (js && js->rfd >= 0) ? js : nullptr;
+  rn->held = 0;
+  rn->wants_token = false;
+  rn->tokens = rn->js ? malloc (rn->max) : nullptr;
+  if (rn->js && rn->tokens == nullptr) die ("Runner: requested %zu tokens\n", rn->max);
+}
+
+bool runner_has_slot (Runner* rn) {
+  rn->wants_token = false;
+  if (rn->running >= rn->max) return false;
+  // the first process runs on the token this one was started with
+  if (!rn->js || rn->running < rn->held + 1) return true;
+
+  u8 token = 0;
+  if (!jobserver_take (rn->js, &token)) {
+    rn->wants_token = true;
+    return false;
+  }
+  rn->tokens[rn->held++] = token;
+  return true;
+}
+
+// Give back the tokens no process runs on, the rest of the tree may use them meanwhile
+static void give_unused (Runner* rn) {
+  while (rn->held > 0 && rn->held + 1 > rn->running)
+    jobserver_give (rn->js, rn->tokens[--rn->held]);
+}
+
+// A descriptor that is readable once `pid` exits, -1 if the kernel can't give one
+static int open_pidfd (pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall (SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+static void close_fd (int* fd) {
+  if (*fd < 0) return;
+  close (*fd);
+  *fd = -1;
+}
+
+// Read what `*fd` has into `buf`, closing it at the end of file (or right away if `last`)
+static void pipe_read (int* fd, String* buf, bool last) {
+  while (*fd >= 0) {
+    z3_reserve (buf, RUNNER_READ_SIZE);
+    isize n = read (*fd, buf->chr + buf->len, buf->max - buf->len - 1);
+    if (n > 0) {
+      buf->len += (usize)n;
+      buf->chr[buf->len] = '\0';
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN && !last) return;
+    close_fd (fd);
+  }
+}
+
+// Pipe for the output of a child: the read end is non-blocking and kept here, the write
+// end is given to it, both close on exec
+static void out_pipe (int fds[2], nstr what) {
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (pipe (fds) != 0) die ("could not make a pipe for '%s': %s\n", what, strerror (errno));
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+}
+
+pid_t runner_spawn (Runner* rn, nstr const* argv, usize tag, const RunnerSpawn* how) {
+  RunnerProc* slot = nullptr;
+  for (usize i = 0; i < rn->max; i++) {
+    if (rn->procs[i].pid == 0) {
+      slot = &rn->procs[i];
+      break;
+    }
+  }
+  if (slot == nullptr) die ("Runner: no free slot to spawn '%s'\n", argv[0]);
+
+  int out[2];
+  int err[2];
+  out_pipe (out, argv[0]);
+  out_pipe (err, argv[0]);
+
+  posix_spawn_file_actions_t acts;
+  posix_spawn_file_actions_init (&acts);
+  posix_spawn_file_actions_adddup2 (&acts, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2 (&acts, err[1], STDERR_FILENO);
+  if (how && how->dir) posix_spawn_file_actions_addchdir_np (&acts, how->dir);
+
+  // a vfork, the child shares this address space until it execs
+  pid_t pid = 0;
+  int failed = 0;
+  KILL_CAST_QUAL (
+    failed = posix_spawnp (&pid, argv[0], &acts, nullptr, (char* const*)argv, environ);
+  )
+  posix_spawn_file_actions_destroy (&acts);
+  close (out[1]);
+  close (err[1]);
+
+  slot->tag = tag;
+  slot->sink = how ? how->out : nullptr;
+  slot->outbuf.len = 0;
+  slot->errbuf.len = 0;
+  rn->running++;
+
+  if (failed != 0) {
+    errpfmt ("could not run '%s': %s\n", argv[0], strerror (failed));
+    close (out[0]);
+    close (err[0]);
+    *slot = (RunnerProc) {
+      .pid = -1, .tag = tag, .out = -1, .err = -1, .pidfd = -1, .exited = true,
+      .status = RUNNER_EXEC_FAILED, .outbuf = slot->outbuf, .errbuf = slot->errbuf,
+    };
+    return -1;
+  }
+
+  slot->pid = pid;
+  slot->out = out[0];
+  slot->err = err[0];
+  slot->pidfd = open_pidfd (pid);
+  slot->exited = false;
+  return pid;
+}
+
+// Collect the exit of a child, if it is not `blocking` only when it already exited
+static void proc_wait (RunnerProc* p, bool blocking) {
+  int wstatus = 0;
+  pid_t got = 0;
+  while ((got = waitpid (p->pid, &wstatus, blocking ? 0 : WNOHANG)) < 0 && errno == EINTR);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (got < 0) die ("could not wait for child processes: %s\n", strerror (errno));
+  if (got == 0) return;
+
+  if (WIFEXITED (wstatus))
+    p->status = WEXITSTATUS (wstatus);
+  else if (WIFSIGNALED (wstatus))
+    p->status = RUNNER_SIGNAL_BASE + WTERMSIG (wstatus);
+  else
+    p->status = -1;
+  p->exited = true;
+  close_fd (&p->pidfd);
+}
+
+// Whether `p` is over. Its output was written before it exited, what is in the pipes is
+// all of it (a background process it left holding them is not waited for)
+static bool proc_done (RunnerProc* p) {
+  // no pidfd, the end of its output is the only sign it is exiting
+  if (!p->exited && p->pidfd < 0 && p->out < 0 && p->err < 0) proc_wait (p, true);
+  if (!p->exited) return false;
+
+  pipe_read (&p->out, p->sink ? p->sink : &p->outbuf, true);
+  pipe_read (&p->err, &p->errbuf, true);
+  return true;
+}
+
+// Hand a finished child to the caller, with its output written out in one piece
+static void proc_reaped (Runner* rn, RunnerProc* p, usize* tag, i32* status) {
+  if (p->outbuf.len > 0) {
+    fwrite (p->outbuf.chr, 1, p->outbuf.len, stdout);  // NOLINT (cert-err33-c)
+    fflush (stdout);                                   // NOLINT (cert-err33-c)
+  }
+  if (p->errbuf.len > 0) fwrite (p->errbuf.chr, 1, p->errbuf.len, stderr);  // NOLINT
+
+  *tag = p->tag;
+  *status = p->status;
+  p->pid = 0;
+  rn->running--;
+  rn->wants_token = false;  // a slot of its own is free, runner_has_slot is asked again
+  if (rn->js) give_unused (rn);
+}
+
+bool runner_reap (Runner* rn, usize* tag, i32* status) {
+  if (rn->js) give_unused (rn);
+  if (rn->running == 0) return false;
+
+  while (true) {
+    usize n = 0;
+    for (usize i = 0; i < rn->max; i++) {
+      RunnerProc* p = &rn->procs[i];
+      if (p->pid == 0) continue;
+      if (proc_done (p)) {
+        proc_reaped (rn, p, tag, status);
+        return true;
+      }
+
+      int fds[3] = {p->out, p->err, p->pidfd};
+      for (u32 w = 0; w < 3; w++) {
+        if (fds[w] < 0) continue;
+        rn->polls[n] = (struct pollfd) {.fd = fds[w], .events = POLLIN};
+        rn->owner[n++] = (u32)i * 3 + w;
+      }
+    }
+
+    // a token given back by the rest of the tree is a slot, not only an exit of ours
+    if (rn->wants_token) {
+      rn->polls[n] = (struct pollfd) {.fd = rn->js->rfd, .events = POLLIN};
+      rn->owner[n++] = RUNNER_POLL_TOKEN;
+    }
+
+    if (poll (rn->polls, n, -1) < 0) {
+      if (errno == EINTR) continue;
+      // NOLINTNEXTLINE (concurrency-mt-unsafe)
+      die ("could not wait for child processes: %s\n", strerror (errno));
+    }
+
+    for (usize k = 0; k < n; k++) {
+      if (rn->polls[k].revents == 0) continue;
+      if (rn->owner[k] == RUNNER_POLL_TOKEN) {
+        // readable for every process waiting on the pipe, another one may get it first
+        u8 token = 0;
+        if (!jobserver_take (rn->js, &token)) {
+          // a pipe nobody writes to again would stay readable, stop waiting on it
+          if (rn->polls[k].revents & (POLLERR | POLLHUP | POLLNVAL)) rn->wants_token = false;
+          continue;
+        }
+        rn->tokens[rn->held++] = token;
+        rn->wants_token = false;
+        *tag = RUNNER_TOKEN;
+        *status = 0;
+        return true;
+      }
+
+      RunnerProc* p = &rn->procs[rn->owner[k] / 3];
+      switch (rn->owner[k] % 3) {
+        case RUNNER_POLL_OUT:
+          pipe_read (&p->out, p->sink ? p->sink : &p->outbuf, false);
+          break;
+        case RUNNER_POLL_ERR:
+          pipe_read (&p->err, &p->errbuf, false);
+          break;
+        case RUNNER_POLL_EXIT:
+          proc_wait (p, false);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+void runner_drain (Runner* rn) {
+  usize tag = 0;
+  i32 status = 0;
+  rn->wants_token = false;
+  while (runner_reap (rn, &tag, &status));
+}
+
+void runner_drop (Runner* rn) {
+  if (rn->js) {
+    while (rn->held > 0) jobserver_give (rn->js, rn->tokens[--rn->held]);
+  }
+  for (usize i = 0; i < rn->max; i++) {
+    RunnerProc* p = &rn->procs[i];
+    close_fd (&p->out);
+    close_fd (&p->err);
+    close_fd (&p->pidfd);
+    z3_drops (&p->outbuf);
+    z3_drops (&p->errbuf);
+  }
+  free (rn->tokens);
+  free (rn->owner);
+  free (rn->polls);
+  free (rn->procs);
+  rn->procs = nullptr;
+  rn->polls = nullptr;
+  rn->owner = nullptr;
+  rn->tokens = nullptr;
+  rn->max = 0;
+  rn->running = 0;
+}
+
+i32 runner_run (nstr const* argv, const RunnerSpawn* how) {
+  Runner rn;
+  runner_init (&rn, 1, nullptr);
+  runner_spawn (&rn, argv, 0, how);
+
+  usize tag = 0;
+  i32 status = 0;
+  runner_reap (&rn, &tag, &status);
+  runner_drop (&rn);
+  return status;
+}
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <z3_string.h>
+
+#include "jobserver.h"
+
+#define RUNNER_READ_SIZE 4096      // bytes read from a child pipe at once
+#define RUNNER_TOKEN     SIZE_MAX  // tag of runner_reap when a jobserver token came instead
+
+// A child process spawned by the runner
+typedef struct {
+  pid_t pid;      // process id, 0 if the slot is free (-1 if it could not be started)
+  usize tag;      // caller defined id, given back when reaped
+  int out;        // read end of its stdout, -1 once closed
+  int err;        // read end of its stderr, -1 once closed
+  int pidfd;      // readable once it exits, -1 when the kernel has none
+  i32 status;     // exit status, once `exited`
+  bool exited;    // waited for, only what is left in its pipes is read
+  String* sink;   // collects its stdout, nullptr -> `outbuf`
+  String outbuf;  // its stdout, written to anvil's once it is reaped
+  String errbuf;  // its stderr, written to anvil's once it is reaped
+} RunnerProc;
+
+// Where a child runs and where its stdout goes, for runner_spawn (every field is optional)
+typedef struct {
+  nstr dir;     // working directory, nullptr -> the one of anvil
+  String* out;  // collects its stdout, nullptr -> written out once it is reaped
+} RunnerSpawn;
+
+// Fixed size pool of child processes, started with posix_spawn (no page tables to copy),
+// with their output kept per process so diagnostics of parallel jobs never interleave. A
+// single poll () waits on the pipes and the exit of every child
+typedef struct {
+  usize max;             // maximum processes in flight
+  usize running;         // processes currently in flight
+  RunnerProc* procs;     // `max` slots
+  struct pollfd* polls;  // 3 per slot: stdout, stderr and pidfd, then the jobserver
+  u32* owner;            // slot * 3 + which of them, for each of `polls`
+  Jobserver* js;         // every process after the first takes a token, nullptr -> `max` only
+  u8* tokens;            // taken from `js` and not given back yet (`max` bytes)
+  usize held;            // tokens in `tokens`
+  bool wants_token;      // runner_has_slot found none free, runner_reap waits for one too
+} Runner;
+
+// Number of online CPUs, used when `jobs` is 0
+usize runner_default_jobs (void);
+
+// Initialize a pool with up to `jobs` processes in flight (0 -> auto), sharing the tokens
+// of `js` with the rest of the process tree when it is not nullptr
+void runner_init (Runner* rn, usize jobs, Jobserver* js);
+
+// Whether another process can be spawned without going over `max` or the jobserver, a token
+// for it is taken now (and given back by runner_reap if nothing was spawned)
+bool runner_has_slot (Runner* rn);
+
+// Spawn `argv` (nullptr terminated, looked up in PATH) in a free slot, dies if there is
+// none. `how` may be nullptr. If it can't be started, the error is printed and it is reaped
+// as a command that was not found
+pid_t runner_spawn (Runner* rn, nstr const* argv, usize tag, const RunnerSpawn* how);
+
+// Wait for any child to exit, its output is written out before it returns. Returns false
+// if nothing is running. After runner_has_slot found no jobserver token it also waits for
+// one to be given back, then takes it and returns with `tag` set to RUNNER_TOKEN
+bool runner_reap (Runner* rn, usize* tag, i32* status);
+
+// Wait for every child still running, ignoring their results
+void runner_drain (Runner* rn);
+
+// Free the pool slots
+void runner_drop (Runner* rn);
+
+// Run a single command to the end, its exit status
+i32 runner_run (nstr const* argv, const RunnerSpawn* how);
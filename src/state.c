@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "state.h"
+
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+
+static nstr state_path_at (BuildState* st, u32 idx) {
+  return (nstr)st->strs + st->paths[idx];
+}
+
+// Check the whole file before trusting any offset, and index the records
+static bool state_index (BuildState* st) {
+  if (st->size < sizeof (StateHeader)) return false;
+
+  const StateHeader* head = (const StateHeader*)st->data;
+  if (head->magic != STATE_MAGIC || head->version != STATE_VERSION) return false;
+
+  usize table = sizeof (StateHeader) + head->records_size;
+  usize strs = table + (usize)head->path_count * sizeof (u32);
+  if (head->records_size > st->size || strs > st->size) return false;
+  if (strs + head->strs_size != st->size) return false;
+  if (head->strs_size > 0 && st->data[st->size - 1] != '\0') return false;
+
+  st->path_count = head->path_count;
+  // NOLINTNEXTLINE (cast-align) offsets are aligned by the writer
+  st->paths = (const u32*)(st->data + table);
+  st->strs = st->data + strs;
+  for (u32 i = 0; i < st->path_count; i++) {
+    if (st->paths[i] >= head->strs_size) return false;
+  }
+
+  usize pos = sizeof (StateHeader);
+  for (u32 i = 0; i < head->record_count; i++) {
+    if (table - pos < sizeof (StateRecord)) return false;
+
+    // NOLINTNEXTLINE (cast-align) records are 8 byte aligned
+    const StateRecord* rec = (const StateRecord*)(st->data + pos);
+    if (rec->output >= st->path_count) return false;
+    pos += sizeof (StateRecord);
+
+    if ((table - pos) / sizeof (StateEdge) < rec->dep_count) return false;
+    // NOLINTNEXTLINE (cast-align)
+    const StateEdge* edges = (const StateEdge*)(st->data + pos);
+    for (u32 e = 0; e < rec->dep_count; e++) {
+      if (edges[e].path >= st->path_count) return false;
+    }
+    pos += rec->dep_count * sizeof (StateEdge);
+
+    KILL_CAST_QUAL (z3_hashmap_put (st->outputs, state_path_at (st, rec->output), (void*)rec);)
+  }
+
+  return pos == table;
+}
+
+void state_load (BuildState* st, String* path) {
+  *st = (BuildState) {0};
+  st->outputs = z3_hashmap_create ();
+  st->stats = z3_hashmap_create ();
+
+  // the state takes the buffer, records point into it
+  String data = {0};
+  if (!z3_read_file ((nstr)path->chr, &data) || data.len == 0) {
+    z3_drops (&data);
+    return;
+  }
+  st->data = data.chr;
+  st->size = data.len;
+  if (state_index (st)) return;
+
+  // corrupt or from another version, build as if there was none
+  z3_hashmap_drop_shallow (st->outputs);
+  st->outputs = z3_hashmap_create ();
+  free (st->data);
+  st->data = nullptr;
+  st->size = 0;
+  st->path_count = 0;
+}
+
+void state_drop (BuildState* st) {
+  // records point into `data`
+  z3_hashmap_drop_shallow (st->outputs);
+  z3_hashmap_drop (st->stats);
+  free (st->data);
+  *st = (BuildState) {0};
+}
+
+StateStat state_stat (BuildState* st, nstr path) {
+  StateStat* known = z3_hashmap_get (st->stats, path);
+  if (known) return *known;
+
+  StateStat* info = malloc (sizeof (StateStat));
+  if (info == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (StateStat));
+
+  // seen by an earlier run of the same process, and not changed since
+  StateStat* kept = st->memo ? z3_hashmap_get (st->memo, path) : nullptr;
+  struct stat fst;
+  if (kept) {
+    *info = *kept;
+  } else if (stat (path, &fst) == 0) {
+    *info = (StateStat) {
+      .sec = fst.st_mtim.tv_sec,
+      .nsec = fst.st_mtim.tv_nsec,
+      .size = fst.st_size,
+    };
+  } else {
+    *info = (StateStat) {.size = -1};
+  }
+
+  z3_hashmap_put (st->stats, path, info);
+  if (st->memo && !kept) {
+    StateStat* copy = malloc (sizeof (StateStat));
+    if (copy == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (StateStat));
+    *copy = *info;
+    z3_hashmap_put (st->memo, path, copy);
+  }
+  return *info;
+}
+
+void state_forget (BuildState* st, nstr path) {
+  z3_hashmap_remove (st->stats, path);
+  if (st->memo) z3_hashmap_remove (st->memo, path);
+}
+
+const StateRecord* state_find (BuildState* st, nstr output) {
+  return z3_hashmap_get (st->outputs, output);
+}
+
+static const StateEdge* state_edges (const StateRecord* rec) {
+  return (const StateEdge*)(rec + 1);
+}
+
+nstr state_dep_path (BuildState* st, const StateRecord* rec, u32 i) {
+  return state_path_at (st, state_edges (rec)[i].path);
+}
+
+bool state_stat_equal (StateStat a, StateStat b) {
+  return a.sec == b.sec && a.nsec == b.nsec && a.size == b.size;
+}
+
+bool state_record_fresh (BuildState* st, const StateRecord* rec, u64 cmd_hash) {
+  if (rec->cmd_hash != cmd_hash) return false;
+
+  // any change counts, an older file restored by git is as stale as a newer one
+  StateStat out = state_stat (st, state_path_at (st, rec->output));
+  if (out.size < 0 || !state_stat_equal (out, rec->stat)) return false;
+
+  const StateEdge* edges = state_edges (rec);
+  for (u32 i = 0; i < rec->dep_count; i++) {
+    StateStat now = state_stat (st, state_path_at (st, edges[i].path));
+    if (!state_stat_equal (now, edges[i].stat)) return false;
+  }
+
+  return true;
+}
+
+bool state_dep_changed (BuildState* st, const StateRecord* rec, nstr path) {
+  const StateEdge* edges = state_edges (rec);
+  for (u32 i = 0; i < rec->dep_count; i++) {
+    if (strcmp (state_path_at (st, edges[i].path), path) != 0) continue;
+    return !state_stat_equal (state_stat (st, path), edges[i].stat);
+  }
+  return false;
+}
+
+void state_writer_init (StateWriter* w) {
+  // NOLINTNEXTLINE (readability-magic-numbers)
+  *w = (StateWriter) {.records = z3_str (4096), .strs = z3_str (4096)};
+  w->offsets = z3_vec (u32);
+  w->indices = z3_hashmap_create ();
+}
+
+void state_writer_drop (StateWriter* w) {
+  z3_drops (&w->records);
+  z3_drops (&w->strs);
+  z3_drop_vec (w->offsets);
+  z3_hashmap_drop_shallow (w->indices);
+}
+
+// Index of `path` in the path table being written
+static u32 writer_intern (StateWriter* w, nstr path) {
+  void* known = z3_hashmap_get (w->indices, path);
+  if (known) return (u32)((uintptr_t)known - 1);
+
+  u32 offset = (u32)w->strs.len;
+  z3_pushl (&w->strs, path, strlen (path) + 1);
+  z3_push (w->offsets, offset);
+
+  // index + 1, values can't be null
+  z3_hashmap_put (w->indices, path, (void*)(uintptr_t)w->offsets.len);
+  return (u32)(w->offsets.len - 1);
+}
+
+void state_writer_add (StateWriter* w, BuildState* st, nstr output, u64 cmd_hash, Vector deps) {
+  // just written, what was seen before the build is stale
+  state_forget (st, output);
+
+  StateRecord rec = {
+    .output = writer_intern (w, output),
+    .dep_count = (u32)deps.len,
+    .cmd_hash = cmd_hash,
+    .stat = state_stat (st, output),
+  };
+  z3_pushl (&w->records, (nstr)&rec, sizeof (rec));
+
+  for (usize i = 0; i < deps.len; i++) {
+    nstr dep = (nstr)((String*)z3_get (deps, i))->chr;
+    // stats from before the compile, a change made while it ran is caught next time
+    StateEdge edge = {.path = writer_intern (w, dep), .stat = state_stat (st, dep)};
+    z3_pushl (&w->records, (nstr)&edge, sizeof (edge));
+  }
+
+  w->count++;
+}
+
+void state_writer_keep (StateWriter* w, BuildState* st, const StateRecord* rec) {
+  StateRecord copy = *rec;
+  copy.output = writer_intern (w, state_path_at (st, rec->output));
+  z3_pushl (&w->records, (nstr)&copy, sizeof (copy));
+
+  const StateEdge* edges = state_edges (rec);
+  for (u32 i = 0; i < rec->dep_count; i++) {
+    StateEdge edge = edges[i];
+    edge.path = writer_intern (w, state_path_at (st, edges[i].path));
+    z3_pushl (&w->records, (nstr)&edge, sizeof (edge));
+  }
+
+  w->count++;
+}
+
+bool state_writer_save (StateWriter* w, String* path) {
+  StateHeader head = {
+    .magic = STATE_MAGIC,
+    .version = STATE_VERSION,
+    .record_count = w->count,
+    .path_count = (u32)w->offsets.len,
+    .records_size = w->records.len,
+    .strs_size = w->strs.len,
+  };
+
+  create_parent_dirs (path);
+  struct iovec parts[] = {
+    {.iov_base = &head, .iov_len = sizeof (head)},
+    {.iov_base = w->records.chr, .iov_len = w->records.len},
+    {.iov_base = w->offsets.val, .iov_len = w->offsets.len * sizeof (u32)},
+    {.iov_base = w->strs.chr, .iov_len = w->strs.len},
+  };
+
+  // a half written state would be thrown away on load, but don't replace a good one
+  return z3_write_atomicv ((nstr)path->chr, parts, sizeof (parts) / sizeof (*parts));
+}
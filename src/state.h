@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#define STATE_FILE_NAME ".anvil_state"
+#define STATE_MAGIC     0x53564E41  // "ANVS"
+#define STATE_VERSION   1
+
+// Head of the state file, followed by the records, path offsets and paths
+typedef struct {
+  u32 magic;         // STATE_MAGIC
+  u32 version;       // STATE_VERSION
+  u32 record_count;  // records in the file
+  u32 path_count;    // entries in the path table
+  u64 records_size;  // bytes of records and edges
+  u64 strs_size;     // bytes of NUL terminated paths
+} StateHeader;
+
+// What stat() said about a file
+typedef struct {
+  i64 sec;   // mtime seconds
+  i64 nsec;  // mtime nanoseconds
+  i64 size;  // -1 if the file doesn't exist
+} StateStat;
+
+// Output (object or binary) as it was last built, followed by its edges
+typedef struct {
+  u32 output;     // index in the path table
+  u32 dep_count;  // edges that follow the record
+  u64 cmd_hash;   // hash of the command that built it
+  StateStat stat; // the output right after it was built
+} StateRecord;
+
+// Dependency of an output, and how it looked when the output was built
+typedef struct {
+  u32 path;  // index in the path table
+  u32 _padding;
+  StateStat stat;
+} StateEdge;
+
+// Build state of a folder, loaded from a single read of its state file
+typedef struct {
+  u8* data;          // whole state file
+  usize size;        // bytes in `data`
+  u32 path_count;    // entries in the path table
+  const u32* paths;  // path table, offsets into `strs`
+  cstr strs;         // NUL terminated paths
+  HashMap* outputs;  // output path -> StateRecord* (into `data`)
+  HashMap* stats;    // path -> StateStat*, each file is stat()'d once per run
+  HashMap* memo;     // path -> StateStat*, kept across runs by `watch`, nullptr otherwise
+} BuildState;
+
+// Records the outputs of a build, to be written as the next state file
+typedef struct {
+  String records;    // StateRecord and StateEdge, back to back
+  String strs;       // NUL terminated paths
+  Vector offsets;    // u32, offset of each path in `strs`
+  HashMap* indices;  // path -> index + 1
+  u32 count;         // records written
+} StateWriter;
+
+// Load the state file at `path`, a missing or corrupt file is an empty state
+void state_load (BuildState* st, String* path);
+
+// Free the loaded state
+void state_drop (BuildState* st);
+
+// stat() a file once per run, later calls are served from memory (from `memo` too, so
+// whoever keeps it has to drop the files that change)
+StateStat state_stat (BuildState* st, nstr path);
+
+// Drop the remembered stat of a file that was just written
+void state_forget (BuildState* st, nstr path);
+
+// Same mtime and size, a missing file only equals another missing one
+bool state_stat_equal (StateStat a, StateStat b);
+
+// Last record of `output`, nullptr if it was never built
+const StateRecord* state_find (BuildState* st, nstr output);
+
+// Path of the i-th dependency of a record
+nstr state_dep_path (BuildState* st, const StateRecord* rec, u32 i);
+
+// Whether the output, its command and all of its dependencies are unchanged
+bool state_record_fresh (BuildState* st, const StateRecord* rec, u64 cmd_hash);
+
+// Whether `path` is a dependency of the record and changed since it was recorded
+bool state_dep_changed (BuildState* st, const StateRecord* rec, nstr path);
+
+void state_writer_init (StateWriter* w);
+void state_writer_drop (StateWriter* w);
+
+// Record an output that was just built from `deps` (Vector of String)
+void state_writer_add (StateWriter* w, BuildState* st, nstr output, u64 cmd_hash, Vector deps);
+
+// Carry a record that is still fresh over to the next state
+void state_writer_keep (StateWriter* w, BuildState* st, const StateRecord* rec);
+
+// Write the state file atomically, false on failure
+bool state_writer_save (StateWriter* w, String* path);
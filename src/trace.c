@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "trace.h"
+
+#include <notrust.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+
+#define TRACE_US_PER_SEC  1000000
+#define TRACE_NS_PER_US   1000
+#define TRACE_US_PER_MS   1000.0
+#define TRACE_CLANG_PHASE 2  // Frontend and Backend
+
+static void drop_span (TraceSpan* span) { z3_drops (&span->name); }
+
+static void drop_path (TracePath* path) {
+  z3_drops (&path->label);
+  z3_drop_vec (path->spans);
+}
+
+z3_vec_drop_fn (TraceSpan, drop_span);
+z3_vec_drop_fn (TracePath, drop_path);
+
+void trace_init (Trace* tr) {
+  *tr = (Trace) {.spans = z3_vec (TraceSpan), .lanes = z3_vec (bool)};
+  tr->paths = z3_vec (TracePath);
+  clock_gettime (CLOCK_MONOTONIC, &tr->origin);
+}
+
+void trace_drop (Trace* tr) {
+  if (!tr) return;
+
+  z3_vec_drop_TraceSpan (&tr->spans);
+  z3_vec_drop_TracePath (&tr->paths);
+  z3_drop_vec (tr->lanes);
+}
+
+u64 trace_now (const Trace* tr) {
+  if (!tr) return 0;
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  i64 sec = now.tv_sec - tr->origin.tv_sec;
+  i64 nsec = now.tv_nsec - tr->origin.tv_nsec;
+  return (u64)(sec * TRACE_US_PER_SEC + nsec / TRACE_NS_PER_US);
+}
+
+static usize trace_add (Trace* tr, nstr cat, nstr name, u64 start, u32 lane) {
+  u64 end = trace_now (tr);
+  TraceSpan span = {
+    .cat = cat,
+    .name = z3_strcpy ((cstr)name),
+    .start = start,
+    .dur = end > start ? end - start : 0,
+    .lane = lane,
+  };
+  z3_push (tr->spans, span);
+  return tr->spans.len;
+}
+
+usize trace_span (Trace* tr, nstr cat, nstr name, u64 start) {
+  if (!tr) return 0;
+  return trace_add (tr, cat, name, start, 0);
+}
+
+u32 trace_lane (Trace* tr) {
+  if (!tr) return 0;
+
+  usize i = 0;
+  while (i < tr->lanes.len && *(bool*)z3_get (tr->lanes, i)) i++;
+  if (i == tr->lanes.len) {
+    bool taken = true;
+    z3_push (tr->lanes, taken);
+  }
+  *(bool*)z3_get (tr->lanes, i) = true;
+  return (u32)i + 1;
+}
+
+usize trace_proc (Trace* tr, nstr cat, nstr name, u64 start, u32 lane) {
+  if (!tr) return 0;
+
+  if (lane > 0 && lane <= tr->lanes.len) *(bool*)z3_get (tr->lanes, lane - 1) = false;
+  return trace_add (tr, cat, name, start, lane);
+}
+
+TraceSpan* trace_get (Trace* tr, usize span) {
+  if (!tr || span == 0 || span > tr->spans.len) return nullptr;
+  return z3_get (tr->spans, span - 1);
+}
+
+void trace_path (Trace* tr, nstr label, const Vector* spans) {
+  if (!tr) return;
+
+  TracePath path = {.label = z3_strcpy ((cstr)label), .spans = z3_vec (usize)};
+  z3_extend (path.spans, *spans);
+  z3_push (tr->paths, path);
+}
+
+static bool has_at (cstr hay, usize len, nstr needle) {
+  usize nlen = strlen (needle);
+  for (usize i = 0; i + nlen <= len; i++) {
+    if (memcmp (hay + i, needle, nlen) == 0) return true;
+  }
+  return false;
+}
+
+// `"dur":` of a top level event, 0 if it has none
+static u64 event_dur (cstr event, usize len) {
+  static const c8 key[] = "\"dur\":";
+  for (usize i = 0; i + sizeof (key) - 1 < len; i++) {
+    if (memcmp (event + i, key, sizeof (key) - 1) == 0)
+      return strtoull ((nstr)event + i + sizeof (key) - 1, nullptr, 10);
+  }
+  return 0;
+}
+
+void trace_clang (Trace* tr, usize span, nstr json_path) {
+  TraceSpan* sp = trace_get (tr, span);
+  if (!sp) return;
+
+  ScopedString json = {0};
+  if (!z3_read_file (json_path, &json)) return;
+  unlink (json_path);
+
+  // events are the objects inside `traceEvents`, clang names one `Frontend` and one
+  // `Backend` per compile (and writes `Total ...` summaries too, not counted here)
+  static const nstr names[TRACE_CLANG_PHASE] = {
+    "\"name\":\"Frontend\"", "\"name\":\"Backend\""
+  };
+  u64* phase[TRACE_CLANG_PHASE] = {&sp->frontend, &sp->backend};
+
+  usize depth = 0;
+  usize start = 0;
+  for (usize i = 0; i < json.len; i++) {
+    u8 c = json.chr[i];
+    if (c == '"') {
+      for (i++; i < json.len && json.chr[i] != '"'; i++)
+        if (json.chr[i] == '\\') i++;
+    } else if (c == '{' || c == '[') {
+      if (++depth == 3) start = i;
+    } else if (c == '}' || c == ']') {
+      if (depth == 3 && c == '}') {
+        cstr event = json.chr + start;
+        usize len = i + 1 - start;
+        for (usize p = 0; p < TRACE_CLANG_PHASE; p++)
+          if (has_at (event, len, names[p])) *phase[p] += event_dur (event, len);
+      }
+      if (depth > 0) depth--;
+    }
+  }
+}
+
+static void json_str (String* out, const String* str) {
+  z3_pushc (out, '"');
+  for (usize i = 0; i < str->len; i++) {
+    u8 c = str->chr[i];
+    if (c == '"' || c == '\\') {
+      z3_pushc (out, '\\');
+      z3_pushc (out, c);
+    } else if (c < ' ') {
+      z3_pushf (out, "\\u%04x", c);
+    } else {
+      z3_pushc (out, c);
+    }
+  }
+  z3_pushc (out, '"');
+}
+
+static void trace_json (Trace* tr, String* out) {
+  z3_pushlit (out, "{\"traceEvents\":[\n");
+  z3_pushlit (out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,");
+  z3_pushlit (out, "\"args\":{\"name\":\"anvil\"}}");
+  for (usize i = 0; i < tr->lanes.len; i++) {
+    z3_pushf (out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,", i + 1);
+    z3_pushf (out, "\"args\":{\"name\":\"job %zu\"}}", i + 1);
+  }
+
+  for (usize i = 0; i < tr->spans.len; i++) {
+    TraceSpan* sp = z3_get (tr->spans, i);
+    z3_pushlit (out, ",\n{\"name\":");
+    json_str (out, &sp->name);
+    z3_pushf (out, ",\"cat\":\"%s\",\"ph\":\"X\",", sp->cat);
+    z3_pushf (out, "\"ts\":%llu,", (unsigned long long)sp->start);
+    z3_pushf (out, "\"dur\":%llu,\"pid\":1,\"tid\":%u", (unsigned long long)sp->dur, sp->lane);
+    if (sp->frontend || sp->backend) {
+      z3_pushf (out, ",\"args\":{\"frontend_us\":%llu,", (unsigned long long)sp->frontend);
+      z3_pushf (out, "\"backend_us\":%llu}", (unsigned long long)sp->backend);
+    }
+    z3_pushc (out, '}');
+  }
+  z3_pushlit (out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+static f64 ms (u64 us) { return (f64)us / TRACE_US_PER_MS; }
+
+static int slower_first (const void* a, const void* b) {
+  const TraceSpan* x = *(const TraceSpan* const*)a;
+  const TraceSpan* y = *(const TraceSpan* const*)b;
+  return (x->dur < y->dur) - (x->dur > y->dur);
+}
+
+static void trace_summary (Trace* tr, String* out) {
+  static const nstr phases[] = {"config", "hooks", "fetch", "deps",
+                                "preprocess", "compile", "link"};
+  usize phase_count = sizeof (phases) / sizeof (*phases);
+
+  u64 total = 0;
+  for (usize i = 0; i < tr->spans.len; i++) {
+    TraceSpan* sp = z3_get (tr->spans, i);
+    if (sp->start + sp->dur > total) total = sp->start + sp->dur;
+  }
+  z3_pushf (out, "anvil --timings: %.1f ms wall\n\n", ms (total));
+
+  // processes overlap, so these add up to more than the wall time
+  z3_pushlit (out, "Phases (summed over every span):\n");
+  for (usize p = 0; p < phase_count; p++) {
+    u64 sum = 0;
+    usize count = 0;
+    for (usize i = 0; i < tr->spans.len; i++) {
+      TraceSpan* sp = z3_get (tr->spans, i);
+      if (strcmp (sp->cat, phases[p]) != 0) continue;
+      sum += sp->dur;
+      count++;
+    }
+    z3_pushf (out, "  %-10s %10.1f ms  %5zu spans\n", phases[p], ms (sum), count);
+  }
+
+  ScopedVector slowest = z3_vec (TraceSpan*);
+  for (usize i = 0; i < tr->spans.len; i++) {
+    TraceSpan* sp = z3_get (tr->spans, i);
+    if (strcmp (sp->cat, "compile") == 0) z3_push (slowest, sp);
+  }
+  if (slowest.len > 0) qsort (slowest.val, slowest.len, slowest.esz, slower_first);
+
+  z3_pushlit (out, "\nSlowest translation units:\n");
+  for (usize i = 0; i < slowest.len && i < TRACE_SLOWEST; i++) {
+    TraceSpan* sp = *(TraceSpan**)z3_get (slowest, i);
+    z3_pushf (out, "  %10.1f ms  %s", ms (sp->dur), sp->name.chr);
+    if (sp->frontend || sp->backend) {
+      f64 front = ms (sp->frontend);
+      z3_pushf (out, "  (frontend %.1f ms, backend %.1f ms)", front, ms (sp->backend));
+    }
+    z3_pushc (out, '\n');
+  }
+
+  for (usize i = 0; i < tr->paths.len; i++) {
+    TracePath* path = z3_get (tr->paths, i);
+    u64 first = 0;
+    u64 last = 0;
+    for (usize j = 0; j < path->spans.len; j++) {
+      TraceSpan* sp = trace_get (tr, *(usize*)z3_get (path->spans, j));
+      if (!sp) continue;
+      if (j == 0) first = sp->start;
+      last = sp->start + sp->dur;
+    }
+
+    z3_pushf (out, "\nCritical path of %s: %.1f ms\n", path->label.chr, ms (last - first));
+    for (usize j = 0; j < path->spans.len; j++) {
+      TraceSpan* sp = trace_get (tr, *(usize*)z3_get (path->spans, j));
+      if (!sp) continue;
+      z3_pushf (out, "  %10.1f ms  %-10s %s\n", ms (sp->dur), sp->cat, sp->name.chr);
+    }
+  }
+}
+
+static bool write_file (const String* dir, nstr name, const String* data) {
+  ScopedString path = z3_strdup (dir);
+  z3_pushc (&path, '/');
+  z3_pushl (&path, name, strlen (name));
+  create_parent_dirs (&path);
+  return z3_write_atomic ((nstr)path.chr, data);
+}
+
+bool trace_write (Trace* tr, const String* dir) {
+  if (!tr) return true;
+
+  ScopedString json = z3_str (tr->spans.len * 128);  // NOLINT (readability-magic-numbers)
+  trace_json (tr, &json);
+  ScopedString summary = z3_str (4096);  // NOLINT (readability-magic-numbers)
+  trace_summary (tr, &summary);
+
+  bool ok = write_file (dir, TRACE_FILE_NAME, &json);
+  return write_file (dir, TIMINGS_FILE_NAME, &summary) && ok;
+}
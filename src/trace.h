@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <time.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#define TRACE_FILE_NAME   "trace.json"   // Chrome trace events, in workspace.build
+#define TIMINGS_FILE_NAME "timings.txt"  // summary of the same trace
+#define TRACE_SLOWEST     10             // translation units listed in the summary
+
+// Something anvil did or waited for, times in microseconds since the trace started
+typedef struct {
+  nstr cat;      // phase: `config`, `hooks`, `fetch`, `deps`, `compile` or `link`
+  String name;   // what it was about, a path or a hook name
+  u64 start;     // when it started
+  u64 dur;       // how long it took
+  u32 lane;      // 0 for anvil itself, processes get a lane of their own while they run
+  u64 frontend;  // from clang's -ftime-trace, 0 if unknown
+  u64 backend;   // from clang's -ftime-trace, 0 if unknown
+} TraceSpan;
+
+// A dependency chain, as indices in `spans`
+typedef struct {
+  String label;  // what the chain belongs to
+  Vector spans;  // usize, first to last
+} TracePath;
+
+// The spans of a `--timings` run, every call takes nullptr as a disabled trace
+typedef struct {
+  struct timespec origin;  // CLOCK_MONOTONIC at trace_init
+  Vector spans;            // TraceSpan
+  Vector lanes;            // bool, whether lane `i + 1` is taken
+  Vector paths;            // TracePath, the critical path of each unit
+} Trace;
+
+void trace_init (Trace* tr);
+void trace_drop (Trace* tr);
+
+// Microseconds since trace_init, 0 without a trace
+u64 trace_now (const Trace* tr);
+
+// Record a span of anvil itself from `start` until now, returns its index + 1 (0 if none)
+usize trace_span (Trace* tr, nstr cat, nstr name, u64 start);
+
+// Lowest lane no running process has, to be given back by trace_proc
+u32 trace_lane (Trace* tr);
+
+// Record a process that ran on `lane` from `start` until now and free its lane,
+// returns the index of its span + 1 (0 if none)
+usize trace_proc (Trace* tr, nstr cat, nstr name, u64 start, u32 lane);
+
+// Frontend and backend time of a span, from the -ftime-trace file clang wrote
+void trace_clang (Trace* tr, usize span, nstr json_path);
+
+// Span `span` (index + 1, as returned) or nullptr
+TraceSpan* trace_get (Trace* tr, usize span);
+
+// Record the critical path of a unit, `spans` (usize, index + 1) from first to last
+void trace_path (Trace* tr, nstr label, const Vector* spans);
+
+// Write TRACE_FILE_NAME and TIMINGS_FILE_NAME into `dir`, false if either fails
+bool trace_write (Trace* tr, const String* dir);
@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#include "watch.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <notrust.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_toys.h>
+#include <z3_vector.h>
+
+#include "build.h"
+#include "state.h"
+
+#define WATCH_READ_SIZE (16 * (sizeof (struct inotify_event) + NAME_MAX + 1))
+
+// Anything that can change the stat of an entry, and the folder going away
+#define WATCH_MASK                                                                         \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |        \
+   IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// A watched folder
+typedef struct {
+  int wd;     // its watch descriptor
+  u64 armed;  // Watch.arms when it was added
+} WatchDir;
+
+// `name` ends in `.<ext>`
+static bool has_ext (nstr name, char ext) {
+  usize len = strlen (name);
+  return len > 2 && name[len - 2] == '.' && name[len - 1] == ext;
+}
+
+static bool is_output (const Watch* w, const String* path) {
+  return w->outputs.len > 0 && path->len > w->outputs.len &&
+         memcmp (path->chr, w->outputs.chr, w->outputs.len) == 0 &&
+         path->chr[w->outputs.len] == '/';
+}
+
+// A folder a stat()'d source is in, it's where new sources and headers are expected
+static bool holds_source (const Watch* w, const String* dir) {
+  HashMapIterator it = z3_hashmap_iterator (w->stats);
+  while (z3_hashmap_iter_next (&it)) {
+    nstr path = it.key;
+    nstr slash = strrchr (path, '/');
+    if (slash && (usize)(slash - path) == dir->len && memcmp (path, dir->chr, dir->len) == 0 &&
+        has_ext (slash + 1, 'c'))
+      return true;
+  }
+  return false;
+}
+
+// Nothing known can be trusted once events were lost
+static void forget_all (Watch* w) {
+  ScopedVector_ (String) keys = z3_vec (String);
+  HashMapIterator it = z3_hashmap_iterator (w->stats);
+  while (z3_hashmap_iter_next (&it)) z3_push_String (&keys, z3_strcpy ((cstr)it.key));
+
+  for (usize i = 0; i < keys.len; i++)
+    z3_hashmap_remove (w->stats, (nstr)z3_at_String (&keys, i)->chr);
+}
+
+// The watch of `dir`, added now if there was none yet, nullptr if it can't be watched
+static WatchDir* watch_dir (Watch* w, nstr dir) {
+  WatchDir* known = z3_hashmap_get (w->dirs, dir);
+  if (known) return known;
+
+  int wd = inotify_add_watch (w->fd, dir, WATCH_MASK);
+  if (wd < 0) return nullptr;
+
+  String empty = {0};
+  while (w->names.len <= (usize)wd) z3_push_String (&w->names, empty);
+  // another path to a folder already watched (a symlink), events only carry one name
+  String* name = z3_at_String (&w->names, (usize)wd);
+  if (name->len > 0) return nullptr;
+  *name = z3_strcpy ((cstr)dir);
+
+  WatchDir* entry = malloc (sizeof (WatchDir));
+  if (entry == nullptr) die ("Out of memory allocating %zu bytes\n", sizeof (WatchDir));
+  *entry = (WatchDir) {.wd = wd, .armed = w->arms};
+  z3_hashmap_put (w->dirs, dir, entry);
+  return entry;
+}
+
+static void watch_event (Watch* w, const struct inotify_event* ev, String* path, u32* change) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    forget_all (w);
+    *change |= WATCH_SOURCES;
+    return;
+  }
+  if (ev->wd < 0 || (usize)ev->wd >= w->names.len) return;
+  String* dir = z3_at_String (&w->names, (usize)ev->wd);
+  if (dir->len == 0) return;
+
+  if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+    // the folder moved or is gone, and so did everything known under it
+    if (!is_output (w, dir)) *change |= WATCH_SOURCES;
+    if (ev->mask & IN_IGNORED) {
+      z3_hashmap_remove (w->dirs, (nstr)dir->chr);
+      z3_drops (dir);
+    }
+    forget_all (w);
+    return;
+  }
+  if (ev->len == 0) return;
+
+  path->len = 0;
+  z3_pushl (path, (nstr)dir->chr, dir->len);
+  z3_pushc (path, '/');
+  z3_pushl (path, ev->name, strlen (ev->name));
+  // what a build writes only has to be stat()'d again
+  bool output = is_output (w, path);
+
+  if (z3_hashmap_get (w->stats, (nstr)path->chr)) {
+    z3_hashmap_remove (w->stats, (nstr)path->chr);
+    if (!output) *change |= WATCH_SOURCES;
+  }
+  bool added = (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+               (has_ext (ev->name, 'c') || has_ext (ev->name, 'h'));
+  if (strcmp ((nstr)path->chr, (nstr)w->manifest.chr) == 0) {
+    *change |= WATCH_MANIFEST;
+  } else if (!output && added && holds_source (w, dir)) {
+    // new sources are found from the headers, a new header may be included already; the
+    // temporary files a compiler makes next to some system header are not sources
+    *change |= WATCH_SOURCES;
+  }
+}
+
+// Handle a read of events, waiting up to `timeout` ms (-1 blocks); false if there was none
+static bool watch_read (Watch* w, int timeout, u32* change) {
+  struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+  int ready = poll (&pfd, 1, timeout);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (ready < 0 && errno != EINTR) die ("could not wait for changes: %s\n", strerror (errno));
+  if (ready <= 0) return false;
+
+  u8 buf[WATCH_READ_SIZE] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  isize n = read (w->fd, buf, sizeof (buf));
+  if (n <= 0) return false;
+
+  ScopedString path = z3_str (PATH_MAX);
+  for (isize at = 0; at < n;) {
+    // NOLINTNEXTLINE (cast-align) the buffer is aligned for it
+    const struct inotify_event* ev = (const struct inotify_event*)(buf + at);
+    watch_event (w, ev, &path, change);
+    at += (isize)(sizeof (*ev) + ev->len);
+  }
+  return true;
+}
+
+void watch_init (Watch* w, const String* manifest) {
+  *w = (Watch) {.manifest = z3_strdup (manifest), .names = z3_vec (String)};
+  w->stats = z3_hashmap_create ();
+  w->dirs = z3_hashmap_create ();
+
+  w->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (w->fd < 0) die ("could not start watching files: %s\n", strerror (errno));
+
+  // not a dependency of any object, its folder is watched from the start
+  ScopedString dir = z3_strdup (manifest);
+  nstr slash = strrchr ((nstr)dir.chr, '/');
+  dir.len = slash ? (usize)(slash - (nstr)dir.chr) : 0;
+  dir.chr[dir.len] = '\0';
+  if (!watch_dir (w, (nstr)dir.chr)) {
+    // NOLINTNEXTLINE (concurrency-mt-unsafe)
+    die ("could not watch '%s': %s\n", dir.chr, strerror (errno));
+  }
+}
+
+void watch_drop (Watch* w) {
+  close (w->fd);
+  z3_hashmap_drop (w->stats);
+  z3_hashmap_drop (w->dirs);
+  z3_vec_drop_String (&w->names);
+  z3_drops (&w->manifest);
+  z3_drops (&w->outputs);
+}
+
+void watch_set_outputs (Watch* w, const String* dir) {
+  z3_drops (&w->outputs);
+  w->outputs = z3_strdup (dir);
+}
+
+WatchChange watch_arm (Watch* w) {
+  u32 change = WATCH_NONE;
+  while (watch_read (w, 0, &change));
+  w->arms++;
+
+  ScopedVector_ (String) stale = z3_vec (String);
+  ScopedString dir = z3_str (PATH_MAX);
+  HashMapIterator it = z3_hashmap_iterator (w->stats);
+  while (z3_hashmap_iter_next (&it)) {
+    nstr path = it.key;
+    nstr slash = strrchr (path, '/');
+    WatchDir* wdir = nullptr;
+    if (slash) {
+      dir.len = 0;
+      z3_pushl (&dir, path, slash == path ? 1 : (usize)(slash - path));
+      wdir = watch_dir (w, (nstr)dir.chr);
+    }
+    // unwatched, stat()'d again by every build
+    if (!wdir) {
+      z3_push_String (&stale, z3_strcpy ((cstr)path));
+      continue;
+    }
+    if (wdir->armed != w->arms) continue;
+
+    // watched only now, a change made while the build ran has no event
+    struct stat fst;
+    StateStat now = {.size = -1};
+    if (stat (path, &fst) == 0) {
+      now = (StateStat) {
+        .sec = fst.st_mtim.tv_sec,
+        .nsec = fst.st_mtim.tv_nsec,
+        .size = fst.st_size,
+      };
+    }
+    if (state_stat_equal (now, *(StateStat*)it.val)) continue;
+
+    String changed = z3_strcpy ((cstr)path);
+    if (!is_output (w, &changed)) change |= WATCH_SOURCES;
+    z3_push_String (&stale, changed);
+  }
+
+  for (usize i = 0; i < stale.len; i++)
+    z3_hashmap_remove (w->stats, (nstr)z3_at_String (&stale, i)->chr);
+  return (WatchChange)change;
+}
+
+WatchChange watch_wait (Watch* w) {
+  u32 change = WATCH_NONE;
+  while (change == WATCH_NONE) watch_read (w, -1, &change);
+  while (watch_read (w, WATCH_SETTLE_MS, &change));
+  return (WatchChange)change;
+}
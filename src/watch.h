@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// Copyright (c) 2025-present Klapptnot
+
+#pragma once
+
+#include <notrust.h>
+#include <z3_hashmap.h>
+#include <z3_string.h>
+#include <z3_vector.h>
+
+#define WATCH_SETTLE_MS 50  // quiet time after the last event, editors write more than once
+
+// What a batch of events touched
+typedef enum {
+  WATCH_NONE = 0,
+  WATCH_SOURCES = 1 << 0,   // a file some object depends on, or a new source or header
+  WATCH_MANIFEST = 1 << 1,  // anvil.yaml, the config has to be loaded again
+} WatchChange;
+
+// inotify on the folder of every file the builds stat()'d, so the stat of a file stays
+// valid in `stats` until an event says it changed
+typedef struct {
+  int fd;           // inotify instance
+  HashMap* stats;   // path -> StateStat*, given to the builds as BuildContext.stat_memo
+  HashMap* dirs;    // watched folder -> its descriptor, and the arm that added it
+  Vector names;     // String, the folder of each watch descriptor (index)
+  String manifest;  // absolute path of anvil.yaml
+  String outputs;   // workspace.build, changes in it never start a build
+  u64 arms;         // watch_arm calls, tells apart the folders the last one added
+} Watch;
+
+// Start watching `manifest` (absolute), dies if inotify is not available
+void watch_init (Watch* w, const String* manifest);
+void watch_drop (Watch* w);
+
+// Files written under `dir` are only forgotten, they are what the builds produce
+void watch_set_outputs (Watch* w, const String* dir);
+
+// Watch the folder of every file in `stats` after a build, what changed while it ran
+WatchChange watch_arm (Watch* w);
+
+// Block until a change lands and settles, never WATCH_NONE
+WatchChange watch_wait (Watch* w);
@@ -6,17 +6,29 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef TEST_YAML_PARSER
 #include <stdio.h>
 #define Z3_TOYS_IMPL
 #define Z3_STRING_IMPL
+#define Z3_ARENA_IMPL
+#define Z3_HASHMAP_IMPL
+#define Z3_VECTOR_IMPL
 #endif
 
 #include <notrust.h>
 #include <yaml.h>
+#include <z3_arena.h>
+#include <z3_hashmap.h>
 #include <z3_string.h>
 #include <z3_toys.h>
 #include <z3_vector.h>
@@ -26,6 +38,7 @@
 extern nstr token_kind_strings[];
 extern nstr node_kind_names[];
 static Node* parse_value (YamlParser* yp);
+static void emit_value (YamlParser* yp, const YamlHandler* h);
 
 #define token_kind_to_string(kind) token_kind_strings[kind]
 #define is_number_parseable(c)     (isdigit (c) || (c) == '.' || (c) == '-' || (c) == '+')
@@ -38,6 +51,69 @@ static Node* parse_value (YamlParser* yp);
     .kind = (k), .raw = (v), .length = (l) \
   }
 
+// Block scanners, used over a mapping where the whole input is in memory.
+// Both stop at `len`, so the trailing NUL of a mapping is never looked at
+#define SCAN_BLOCK 16
+
+// Index of the first byte of `s` that is `a`, `b` or `c`, `len` if there is none
+static usize scan_any (cstr s, usize len, u8 a, u8 b, u8 c) {
+  usize i = 0;
+#if defined(__SSE2__)
+  __m128i va = _mm_set1_epi8 ((char)a);
+  __m128i vb = _mm_set1_epi8 ((char)b);
+  __m128i vc = _mm_set1_epi8 ((char)c);
+  for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+    __m128i v = _mm_loadu_si128 ((const __m128i*)(s + i));
+    __m128i m = _mm_or_si128 (
+      _mm_or_si128 (_mm_cmpeq_epi8 (v, va), _mm_cmpeq_epi8 (v, vb)), _mm_cmpeq_epi8 (v, vc)
+    );
+    u32 bits = (u32)_mm_movemask_epi8 (m);
+    if (bits) return i + (usize)__builtin_ctz (bits);
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t va = vdupq_n_u8 (a);
+  uint8x16_t vb = vdupq_n_u8 (b);
+  uint8x16_t vc = vdupq_n_u8 (c);
+  for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+    uint8x16_t v = vld1q_u8 (s + i);
+    uint8x16_t m = vorrq_u8 (vorrq_u8 (vceqq_u8 (v, va), vceqq_u8 (v, vb)), vceqq_u8 (v, vc));
+    // 4 bits per byte, there's no movemask
+    uint8x8_t n = vshrn_n_u16 (vreinterpretq_u16_u8 (m), 4);
+    u64 bits = vget_lane_u64 (vreinterpret_u64_u8 (n), 0);
+    if (bits) return i + (usize)(__builtin_ctzll (bits) >> 2);
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] == a || s[i] == b || s[i] == c) return i;
+  }
+  return len;
+}
+
+// Index of the first byte of `s` that is not a space, `len` if there is none
+static usize scan_spaces (cstr s, usize len) {
+  usize i = 0;
+#if defined(__SSE2__)
+  __m128i sp = _mm_set1_epi8 (CHAR_SPACE);
+  for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+    __m128i v = _mm_loadu_si128 ((const __m128i*)(s + i));
+    u32 bits = ~(u32)_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, sp)) & 0xFFFF;
+    if (bits) return i + (usize)__builtin_ctz (bits);
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t sp = vdupq_n_u8 (CHAR_SPACE);
+  for (; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+    uint8x16_t m = vmvnq_u8 (vceqq_u8 (vld1q_u8 (s + i), sp));
+    uint8x8_t n = vshrn_n_u16 (vreinterpretq_u16_u8 (m), 4);
+    u64 bits = vget_lane_u64 (vreinterpret_u64_u8 (n), 0);
+    if (bits) return i + (usize)(__builtin_ctzll (bits) >> 2);
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] != CHAR_SPACE) return i;
+  }
+  return len;
+}
+
 static i32 fd_open_file (nstr filepath) {
   if (!filepath) return -1;
 
@@ -54,12 +130,18 @@ static i32 fd_open_file (nstr filepath) {
 }
 
 static void refill_buffers (YamlParser* yp) {
+  // the whole file is there, cpos stays at the trailing NUL
+  if (yp->mapped) {
+    yp->reof = true;
+    return;
+  }
+
   i64 n = read (yp->iffd, yp->chunk, YAML_CHUNK_SIZE);
   // NOLINTNEXTLINE (concurrency-mt-unsafe)
   if (n < 0) die ("could not continue reading file: %s", strerror (errno));
 
   yp->cpos = 0;
-  yp->blen = (u16)n;
+  yp->blen = (usize)n;
   yp->reof = n == 0;
 }
 
@@ -79,19 +161,44 @@ static bool eof_reached (YamlParser* yp) {
   return yp->reof != 0;
 }
 
+// A mapped parser counts no lines, parser_error finds them from cpos
 [[clang::always_inline]]
 static void skip_char (YamlParser* yp) {
-  if (peek_char (yp) == CHAR_NEWLINE) {
-    yp->line++;
-    yp->lpos = 0;
-  } else {
-    yp->lpos++;
+  if (!yp->mapped) {
+    if (peek_char (yp) == CHAR_NEWLINE) {
+      yp->line++;
+      yp->lpos = 0;
+    } else {
+      yp->lpos++;
+    }
   }
   if (++yp->cpos >= yp->blen) refill_buffers (yp);
 }
 
+// Move a mapped parser `n` bytes forward, what skip_char does n times
+[[clang::always_inline]]
+static void skip_mapped (YamlParser* yp, usize n) {
+  yp->cpos += n;
+  if (yp->cpos >= yp->blen) {
+    yp->cpos = yp->blen;
+    yp->reof = true;
+  }
+}
+
+// Bytes left in a mapping, from the cursor
+[[clang::always_inline]]
+static usize mapped_left (YamlParser* yp) {
+  return yp->blen - yp->cpos;
+}
+
 [[clang::always_inline]]
 static void skip_comment (YamlParser* yp) {
+  if (yp->mapped) {
+    cstr at = yp->chunk + yp->cpos;
+    skip_mapped (yp, scan_any (at, mapped_left (yp), CHAR_NEWLINE, CHAR_NEWLINE, CHAR_NEWLINE));
+    return;
+  }
+
   while (!eof_reached (yp) && peek_char (yp) != CHAR_NEWLINE) {
     skip_char (yp);
   }
@@ -99,9 +206,14 @@ static void skip_comment (YamlParser* yp) {
 
 // skip and count whitespace (excluding newlines)
 static void skip_whitespace (YamlParser* yp) {
-  while (peek_char (yp) == CHAR_SPACE) {
-    if (eof_reached (yp)) return;
-    skip_char (yp);
+  if (yp->mapped) {
+    cstr at = yp->chunk + yp->cpos;
+    if (!eof_reached (yp)) skip_mapped (yp, scan_spaces (at, mapped_left (yp)));
+  } else {
+    while (peek_char (yp) == CHAR_SPACE) {
+      if (eof_reached (yp)) return;
+      skip_char (yp);
+    }
   }
 
   if (peek_char (yp) == CHAR_TAB) {
@@ -124,6 +236,11 @@ static c8 skip_all_whitespace (YamlParser* yp) {
     if (c != CHAR_NEWLINE) return c;
 
     // it IS a newline, do-while
+    if (yp->mapped) {
+      while (peek_char (yp) == CHAR_NEWLINE) skip_mapped (yp, 1);
+      continue;
+    }
+
     yp->lpos = 0;
     do {
       if (++yp->cpos >= yp->blen) {
@@ -159,8 +276,109 @@ static String* get_string_line (YamlParser* yp, usize reqsz) {
   return z3_get (store->str_pools, store->str_pools.len - 1);
 }
 
+// Hash of a map key or anchor name, as stored in YamlIntern and YamlMapEntry
+[[clang::always_inline]]
+static u32 map_key_hash (cstr key, usize len) {
+  return (u32)z3_hash_bytes (Z3_HASH_SEED, key, len);
+}
+
+// Slot of a string in the intern table, a free one if it is not there
+static YamlIntern* intern_slot (YamlStore* store, cstr str, u32 len, u32 hash) {
+  usize mask = store->intern_cap - 1;
+  for (usize pos = hash & mask;; pos = (pos + 1) & mask) {
+    YamlIntern* slot = &store->interns[pos];
+    if (slot->str == nullptr) return slot;
+    if (slot->str == str) return slot;
+    if (slot->hash == hash && slot->len == len && memcmp (slot->str, str, len) == 0)
+      return slot;
+  }
+}
+
+static void intern_grow (YamlStore* store) {
+  YamlIntern* old = store->interns;
+  usize cap = store->intern_cap;
+
+  store->intern_cap = cap ? cap * 2 : YAML_INTERN_CAPACITY;
+  store->interns = calloc (store->intern_cap, sizeof (YamlIntern));
+  if (!store->interns)
+    die ("Out of memory allocating %zu bytes", sizeof (YamlIntern) * store->intern_cap);
+
+  for (usize i = 0; i < cap; i++) {
+    if (old[i].str) *intern_slot (store, old[i].str, old[i].len, old[i].hash) = old[i];
+  }
+  free (old);
+}
+
+// Shared copy of a key or anchor name. The first occurrence is used as is, or copied to
+// the pools with `copy` when it won't outlive the token (chunk, or not NUL terminated)
+static YamlIntern* intern (YamlParser* yp, cstr str, u32 len, bool copy) {
+  YamlStore* store = yp->store;
+  if ((store->intern_len + 1) * 2 > store->intern_cap) intern_grow (store);
+
+  u32 hash = map_key_hash (str, len);
+  YamlIntern* slot = intern_slot (store, str, len, hash);
+  if (slot->str) return slot;
+
+  if (copy) {
+    String* hold = get_string_line (yp, len);
+    usize at = hold->len;
+    if (len > 0) z3_pushl (hold, (nstr)str, len);
+    z3_pushc (hold, 0);
+    str = hold->chr + at;
+  }
+
+  *slot = (YamlIntern) {.str = str, .hash = hash, .len = len, .anchor = nullptr};
+  store->intern_len++;
+  return slot;
+}
+
+// Token of an interned string
+[[clang::always_inline]]
+static Token intern_token (YamlParser* yp, TokenKind kind, cstr str, u32 len, bool copy) {
+  YamlIntern* slot = intern (yp, str, len, copy);
+  Token token = create_token (kind, slot->str, slot->len);
+  token.hash = slot->hash;
+  return (yp->cur_token = token);
+}
+
+// try_string_unesc over a mapping, the string is only copied if it has escapes
+static Token slice_string_unesc (YamlParser* yp) {
+  ustr start = yp->chunk + yp->cpos;
+  bool escaped = false;
+
+  while (!eof_reached (yp)) {
+    cstr at = yp->chunk + yp->cpos;
+    skip_mapped (yp, scan_any (at, mapped_left (yp), CHAR_QUOTE_DOUBLE, CHAR_NEWLINE, '\\'));
+    if (peek_char (yp) != '\\') break;
+    escaped = true;
+    skip_mapped (yp, 1);
+  }
+
+  if (peek_char (yp) != CHAR_QUOTE_DOUBLE) {
+    c8 c = peek_char (yp);
+    parser_error (
+      yp,
+      (YamlError) {.kind = UNCLOSED_QUOTE, .got = !eof_reached (yp) ? &c : "EOF", .exp = "\""}
+    );
+  }
+
+  ustr end = yp->chunk + yp->cpos;
+  skip_char (yp);  // skip closing quote
+
+  if (!escaped) {
+    *end = 0;  // where the closing quote was
+    return (yp->cur_token = create_token (TOKEN_STRING, start, (u32)(end - start)));
+  }
+
+  String unesc = z3_unescape (start, (usize)(end - start));
+  z3_push (yp->store->owned_strs, unesc);
+
+  return (yp->cur_token = create_token (TOKEN_STRING, unesc.chr, (u32)unesc.len));
+}
+
 static Token try_string_unesc (YamlParser* yp) {
   skip_char (yp);  // skip opening quote
+  if (yp->mapped) return slice_string_unesc (yp);
 
   ScopedString s = z3_str (HEAP_VALUE_MIN_SIZE);
   c8 ilubsm[STR_ALLOC_SIZE_BASE] = {0};
@@ -193,7 +411,43 @@ static Token try_string_unesc (YamlParser* yp) {
   return (yp->cur_token = create_token (TOKEN_STRING, unesc.chr, (u32)unesc.len));
 }
 
+// try_string_lit over a mapping, '' is collapsed in place
+static Token slice_string_lit (YamlParser* yp) {
+  ustr start = yp->chunk + yp->cpos + 1;
+  ustr end = start;  // behind the cursor once a '' was seen
+
+  while (peek_char (yp) == CHAR_QUOTE_SINGLE) {
+    skip_char (yp);  // open quote, or the second one of ''
+
+    if (!eof_reached (yp)) {
+      ustr at = yp->chunk + yp->cpos;
+      usize n = scan_any (at, mapped_left (yp), CHAR_QUOTE_SINGLE, CHAR_NEWLINE, CHAR_NEWLINE);
+      if (end != at) memmove (end, at, n);
+      end += n;
+      skip_mapped (yp, n);
+    }
+
+    if (peek_char (yp) != CHAR_QUOTE_SINGLE) {
+      c8 c = peek_char (yp);
+      parser_error (
+        yp,
+        (YamlError) {.kind = UNCLOSED_QUOTE, .got = !eof_reached (yp) ? &c : "EOF", .exp = "'"}
+      );
+    }
+
+    skip_char (yp);
+    if (eof_reached (yp)) break;
+    if (peek_char (yp) != CHAR_QUOTE_SINGLE) break;
+    *end++ = CHAR_QUOTE_SINGLE;
+  }
+
+  *end = 0;  // at most where the closing quote was
+  return (yp->cur_token = create_token (TOKEN_STRING_LIT, start, (u32)(end - start)));
+}
+
 static Token try_string_lit (YamlParser* yp) {
+  if (yp->mapped) return slice_string_lit (yp);
+
   c8 ilubsm[STR_ALLOC_SIZE_BASE] = {0};
   u16 len = 0;
   String* hold = nullptr;
@@ -260,38 +514,33 @@ static Token try_string_lit (YamlParser* yp) {
 }
 
 static Token try_anchor_or_alias (YamlParser* yp, c8 prefix) {
+  TokenKind kind = (prefix == '&') ? TOKEN_ANCHOR : TOKEN_ALIAS;
+
+  // the name ends at a delimiter that is still needed, copied if new
+  if (yp->mapped) {
+    cstr start = yp->chunk + yp->cpos;
+    while (!eof_reached (yp) && is_valid_anchor (peek_char (yp))) skip_mapped (yp, 1);
+    return intern_token (yp, kind, start, (u32)(yp->chunk + yp->cpos - start), true);
+  }
+
   c8 ilubsm[STR_ALLOC_SIZE_BASE];
   u32 len = 0;
-  String* hold = nullptr;
+  ScopedString spill = {0};  // names longer than ilubsm
 
   while (!eof_reached (yp) && is_valid_anchor (peek_char (yp))) {
-    if (len > STR_ALLOC_SIZE_BASE) {
-      hold = hold ? hold : get_string_line (yp, len);
-      z3_pushl (hold, ilubsm, len);
+    if (len >= STR_ALLOC_SIZE_BASE) {
+      if (!spill.chr) spill = z3_str (STR_ALLOC_SIZE_BASE * 2);
+      z3_pushl (&spill, ilubsm, len);
       len = 0;
     }
     ilubsm[len++] = peek_char (yp);
     skip_char (yp);
   }
 
-  ustr start = nullptr;
-  u32 tlen = 0;
-
-  if (hold) {
-    if (len > 0) z3_pushl (hold, ilubsm, len);
-    start = hold->chr;
-    tlen = (u32)hold->len;
-  } else {
-    hold = get_string_line (yp, len);
-    usize beginning = hold->len;
-    if (len > 0) z3_pushl (hold, ilubsm, len);
-    tlen = (u32)(hold->len - beginning);
-    z3_pushc (hold, 0);
-    start = (hold->chr + beginning);
-  }
+  if (!spill.chr) return intern_token (yp, kind, (cstr)ilubsm, len, true);
 
-  TokenKind kind = (prefix == '&') ? TOKEN_ANCHOR : TOKEN_ALIAS;
-  return (yp->cur_token = create_token (kind, start, tlen));
+  z3_pushl (&spill, ilubsm, len);
+  return intern_token (yp, kind, spill.chr, (u32)spill.len, true);
 }
 
 static int try_number (YamlParser* yp, ustr ilubsm) {
@@ -332,7 +581,37 @@ static i32 try_boolean (YamlParser* yp, ustr ilubsm) {
   return (i32)(len + 'x');
 }
 
+// try_key over a mapping, `len` bytes of it (true/false prefix) are already consumed
+static Token slice_key (YamlParser* yp, u32 len) {
+  usize colon = 0;  // the `:` that ended the key was consumed
+  while (!eof_reached (yp) && len < STR_ALLOC_SIZE_BASE) {
+    usize window = mapped_left (yp);
+    if (window > STR_ALLOC_SIZE_BASE - len) window = STR_ALLOC_SIZE_BASE - len;
+
+    usize n = scan_any (yp->chunk + yp->cpos, window, CHAR_COLON, CHAR_COLON, CHAR_COLON);
+    skip_mapped (yp, n);
+    len += (u32)n;
+    if (n == window) continue;  // limit or EOF, checked by the loop
+
+    skip_mapped (yp, 1);
+    if (eof_reached (yp) || peek_char (yp) == CHAR_SPACE) {
+      colon = 1;
+      break;
+    }
+    len++;
+  }
+
+  if (len >= STR_ALLOC_SIZE_BASE)
+    parser_error (yp, (YamlError) {.kind = KEY_TOO_LONG, .exp = "", .got = ""});
+
+  ustr end = yp->chunk + yp->cpos - colon;
+  *end = 0;
+  return intern_token (yp, TOKEN_KEY, end - len, len, false);
+}
+
 static Token try_key (YamlParser* yp, ustr ilubsm, u32 blen) {
+  if (yp->mapped) return slice_key (yp, blen);
+
   u32 len = blen;
   while (!eof_reached (yp)) {
     if (len >= STR_ALLOC_SIZE_BASE)
@@ -353,16 +632,15 @@ static Token try_key (YamlParser* yp, ustr ilubsm, u32 blen) {
   if (len >= STR_ALLOC_SIZE_BASE)
     parser_error (yp, (YamlError) {.kind = KEY_TOO_LONG, .exp = "", .got = ""});
 
-  String* hold = get_string_line (yp, len);
-  cstr start = hold->len == 0 ? hold->chr : hold->chr + hold->len;
-
-  if (len > 0) z3_pushl (hold, (nstr)ilubsm, len);
-  z3_pushc (hold, 0);
-
-  return (yp->cur_token = create_token (TOKEN_KEY, start, len));
+  return intern_token (yp, TOKEN_KEY, ilubsm, len, true);
 }
 
 static Token next_token (YamlParser* yp) {
+  if (yp->replay) {
+    yp->replay = false;
+    return yp->cur_token;
+  }
+
   c8 prefix_char = 0;
 go_back_to_start:
   if (eof_reached (yp)) {
@@ -433,9 +711,14 @@ go_back_to_start:
       u32 len = 0;
 
       if (is_number_parseable (c)) {
+        ustr begin = yp->chunk + yp->cpos;
         i32 tlen = try_number (yp, ilubsm);
         len = (u32)tlen;
 
+        // parse_number copies it with its length, a mapped number needs no NUL
+        if (tlen != -1 && yp->mapped)
+          return (yp->cur_token = create_token (TOKEN_NUMBER, begin, (u32)tlen));
+
         if (tlen != -1) {
           String* hold = get_string_line (yp, len);
 
@@ -443,11 +726,12 @@ go_back_to_start:
           if (len > 0) z3_pushl (hold, (nstr)ilubsm, len);
           z3_pushc (hold, 0);
 
-          return create_token (TOKEN_NUMBER, start, (u32)tlen);
+          return (yp->cur_token = create_token (TOKEN_NUMBER, start, (u32)tlen));
         }
       } else if (c == 't' || c == 'f') {
         i32 is_bool = try_boolean (yp, ilubsm);
-        if (is_bool < 'x') return create_token (TOKEN_BOOLEAN, nullptr, (u32)is_bool);
+        if (is_bool < 'x')
+          return (yp->cur_token = create_token (TOKEN_BOOLEAN, nullptr, (u32)is_bool));
         len = (u32)(is_bool - 'x');
       }
 
@@ -455,34 +739,25 @@ go_back_to_start:
   }
 }
 
-static Node* create_node (NodeKind kind) {
-  Node* node = (Node*)malloc (sizeof (Node));
-
-  if (!node) die ("Out of memory allocating %zu bytes", sizeof (Node));
-
+// Nodes and their children arrays live in the arena of the store
+static Node* create_node (YamlParser* yp, NodeKind kind) {
+  Arena* arena = &yp->store->arena;
+  Node* node = (Node*)z3_alloc (arena, sizeof (Node));
   node->kind = kind;
-  node->rcount = 0;
 
   switch (kind) {
     case NODE_MAP:
       node->map.size = 0;
       node->map.capacity = NODE_INITIAL_CAPACITY;
-      node->map.entries = (YamlMapEntry*)malloc (sizeof (YamlMapEntry) * NODE_INITIAL_CAPACITY);
-      if (!node->map.entries) {
-        free (node);
-        die (
-          "Out of memory allocating %zu bytes", sizeof (YamlMapEntry) * NODE_INITIAL_CAPACITY
-        );
-      }
+      node->map.entries = z3_alloc (arena, sizeof (YamlMapEntry) * NODE_INITIAL_CAPACITY);
+      node->map.index = nullptr;
+      node->map.index_cap = 0;
       break;
 
     case NODE_LIST:
       node->list.size = 0;
       node->list.capacity = NODE_INITIAL_CAPACITY;
-      node->list.items = (Node**)malloc (sizeof (Node*) * NODE_INITIAL_CAPACITY);
-      if (!node->list.items) {
-        die ("Out of memory allocating %zu bytes", sizeof (Node*) * NODE_INITIAL_CAPACITY);
-      }
+      node->list.items = (Node**)z3_alloc (arena, sizeof (Node*) * NODE_INITIAL_CAPACITY);
       break;
 
     case NODE_STRING:
@@ -495,102 +770,162 @@ static Node* create_node (NodeKind kind) {
   return node;
 }
 
-static void free_node (Node* node) {
-  if (!node) return;
-  if (node->rcount > 0) {
-    node->rcount--;
-    return;
-  }
+static void map_index_insert (YamlMap* map, usize i) {
+  usize mask = map->index_cap - 1;
+  usize pos = map->entries[i].hash & mask;
+  while (map->index[pos] != 0) pos = (pos + 1) & mask;
+  map->index[pos] = (u32)(i + 1);
+}
 
-  switch (node->kind) {
-    case NODE_MAP:
-      for (usize i = 0; i < node->map.size; i++) {
-        free_node (node->map.entries[i].val);
-      }
-      free (node->map.entries);
-      break;
+// Build the index of a map again with 1/4 of the slots used, map_add fills it up to half
+// before it is built again
+static void map_reindex (YamlParser* yp, YamlMap* map) {
+  map->index_cap = next_power_of2 (map->size * 4);
+  map->index = z3_alloc (&yp->store->arena, sizeof (u32) * map->index_cap);
+  memset (map->index, 0, sizeof (u32) * map->index_cap);
 
-    case NODE_LIST:
-      for (usize i = 0; i < node->list.size; i++) {
-        free_node (node->list.items[i]);
-      }
-      free ((void*)node->list.items);
-      break;
+  for (usize i = 0; i < map->size; i++) map_index_insert (map, i);
+}
 
-    case NODE_STRING:  // not needed to
-    // No dynamic memory to free
-    case NODE_NUMBER:
-    case NODE_BOOLEAN:
-      break;
+// Parsed keys are interned, only a key from outside needs strcmp
+[[clang::always_inline]]
+static bool map_key_equal (const YamlMapEntry* entry, cstr key, u32 hash) {
+  if (entry->hash != hash) return false;
+  return entry->key == key || strcmp ((nstr)entry->key, (nstr)key) == 0;
+}
+
+// Entry of `key` in a map, nullptr if there is none
+static YamlMapEntry* map_find (const YamlMap* map, cstr key, u32 hash) {
+  if (map->index == nullptr) {
+    for (usize i = 0; i < map->size; i++) {
+      YamlMapEntry* entry = &map->entries[i];
+      if (map_key_equal (entry, key, hash)) return entry;
+    }
+    return nullptr;
   }
 
-  free (node);
-  node = nullptr;
+  usize mask = map->index_cap - 1;
+  for (usize pos = hash & mask; map->index[pos] != 0; pos = (pos + 1) & mask) {
+    YamlMapEntry* entry = &map->entries[map->index[pos] - 1];
+    if (map_key_equal (entry, key, hash)) return entry;
+  }
+  return nullptr;
 }
 
-static void map_add (YamlMap* map, cstr key, Node* val) {
+static void map_add (YamlParser* yp, YamlMap* map, YamlMapEntry entry) {
   if (map->size >= map->capacity) {
+    usize size = sizeof (YamlMapEntry) * map->capacity;
+    map->entries = z3_resize (&yp->store->arena, map->entries, size, size * 2);
     map->capacity *= 2;
-    YamlMapEntry* new_entries =
-      (YamlMapEntry*)realloc (map->entries, sizeof (YamlMapEntry) * map->capacity);
+  }
 
-    if (!new_entries)
-      die ("Out of memory allocating %zu bytes", sizeof (YamlMapEntry) * map->capacity);
+  map->entries[map->size++] = entry;
 
-    map->entries = new_entries;
+  // at most half of the slots are used, so probes stay short
+  if (map->index && map->size * 2 <= map->index_cap)
+    map_index_insert (map, map->size - 1);
+  else if (map->size >= YAML_MAP_INDEX_MIN)
+    map_reindex (yp, map);
+}
+
+// Set a key of a map: an explicit key replaces a merged one, and a merged key never
+// replaces anything. False if the key was set explicitly already
+static bool map_put (YamlParser* yp, YamlMap* map, YamlMapEntry entry) {
+  YamlMapEntry* found = map_find (map, entry.key, entry.hash);
+  if (found == nullptr) {
+    map_add (yp, map, entry);
+    return true;
   }
 
-  map->entries[map->size].key = key;
-  map->entries[map->size].val = val;
-  map->size++;
+  if (entry.merged) return true;
+  if (!found->merged) return false;
+
+  found->val = entry.val;
+  found->merged = false;
+  return true;
 }
 
-static void list_add (YamlList* seq, Node* item) {
+static void list_add (YamlParser* yp, YamlList* seq, Node* item) {
   if (seq->size >= seq->capacity) {
+    usize size = sizeof (Node*) * seq->capacity;
+    seq->items = (Node**)z3_resize (&yp->store->arena, (void*)seq->items, size, size * 2);
     seq->capacity *= 2;
-    Node** new_items = (Node**)realloc ((void*)seq->items, sizeof (Node*) * seq->capacity);
-
-    if (!new_items) die ("Out of memory allocating %zu bytes", sizeof (Node*) * seq->capacity);
-
-    seq->items = new_items;
   }
 
   seq->items[seq->size] = item;
   seq->size++;
 }
 
-static Node* parse_alias (YamlParser* yp, cstr alias) {
-  usize aliases = yp->aliases.len;
-  if (aliases == 0) return nullptr;
-
-  for (usize i = 0; i < aliases; i++) {
-    YamlAlias* a = (YamlAlias*)z3_get (yp->aliases, i);
-    if (strcmp ((nstr)a->name, (nstr)alias) == 0) {
-      return a->value;
-    }
+// A mapped number is not NUL terminated, so strtod gets a bounded copy of it
+static f64 parse_number (Token token) {
+  c8 digits[MAX_NUMBER_LENGTH + 1];
+  usize len = 0;
+  for (u32 i = 0; i < token.length && len < MAX_NUMBER_LENGTH; i++) {
+    // Allowing `1_000_000` to be `1000000`
+    if (token.raw[i] == '_') continue;
+    digits[len++] = (c8)token.raw[i];
   }
-  return nullptr;
+  digits[len] = '\0';
+
+  return strtod (digits, nullptr);
 }
 
-static Node* parse_number (Token token) {
-  Node* node = create_node (NODE_NUMBER);
+// Call a handler callback, if it has one
+#define emit(h, event, ...)                                            \
+  do {                                                                 \
+    if ((h)->event) (h)->event ((h)->ctx __VA_OPT__ (, ) __VA_ARGS__); \
+  } while (0)
 
-  u8 ver_value[MAX_NUMBER_LENGTH] = {0};
-  cstr value = token.raw;
-  u8 i = 0;
-  u8 l = 0;
-  while (i++ <= token.length) {
-    // Allowing `1_000_000` to be `1000000`
-    if (value[i] == '_') continue;
-    ver_value[l++] = value[i];
+// Node of `&name` for `*name`
+static Node* find_anchor (YamlParser* yp, Token token) {
+  Node* value = intern_slot (yp->store, token.raw, token.length, token.hash)->anchor;
+  if (value == nullptr)
+    parser_error (yp, (YamlError) {.kind = UNDEFINED_ALIAS, .got = (nstr)token.raw, .exp = ""});
+
+  return value;
+}
+
+// Report a key of the map being parsed, a handler refusing it fails the parse at it
+static void emit_key (YamlParser* yp, const YamlHandler* h, const YamlMapEntry* key) {
+  if (h->on_key && !h->on_key (h->ctx, key)) {
+    parser_error (yp, (YamlError) {.kind = KEY_REDEFINITION, .got = (nstr)key->key, .exp = ""});
   }
+}
 
-  node->number = strtod ((nstr)value, nullptr);
-  return node;
+// Report a parsed value, as is if the handler takes nodes, or walked as events.
+// Keys of a node are unique already, so whether the handler takes them is not asked
+static void emit_node (const YamlHandler* h, Node* node) {
+  if (h->on_node) {
+    h->on_node (h->ctx, node);
+    return;
+  }
+
+  switch (node->kind) {
+    case NODE_MAP:
+      emit (h, on_map_start);
+      for (usize i = 0; i < node->map.size; i++) {
+        emit (h, on_key, &node->map.entries[i]);
+        emit_node (h, node->map.entries[i].val);
+      }
+      emit (h, on_map_end);
+      break;
+
+    case NODE_LIST:
+      emit (h, on_seq_start);
+      for (usize i = 0; i < node->list.size; i++) emit_node (h, node->list.items[i]);
+      emit (h, on_seq_end);
+      break;
+
+    case NODE_STRING:
+    case NODE_NUMBER:
+    case NODE_BOOLEAN:
+      emit (h, on_scalar, node);
+      break;
+  }
 }
 
-static Node* parse_list (YamlParser* yp) {
-  Node* node = create_node (NODE_LIST);
+static void emit_list (YamlParser* yp, const YamlHandler* h) {
+  emit (h, on_seq_start);
 
   while (true) {
     if (peek_char (yp) == CHAR_CLOSE_BRACKET) {
@@ -598,7 +933,7 @@ static Node* parse_list (YamlParser* yp) {
       break;
     };
 
-    Node* item = parse_value (yp);
+    emit_value (yp, h);
     Token token = next_token (yp);
 
     if (token.kind == TOKEN_EOF)
@@ -621,17 +956,19 @@ static Node* parse_list (YamlParser* yp) {
         }
       );
 
-    list_add (&node->list, item);
     if (token.kind == TOKEN_CLOSE_SEQ) break;
   }
 
-  return node;
+  emit (h, on_seq_end);
 }
 
-static void parse_map (YamlParser* yp, Node* node) {
+// Report the entries of a map, `merged` when they come from a `<<: {...}`.
+// The caller reports its start and end, a merged map has neither
+static void emit_map (YamlParser* yp, const YamlHandler* h, bool merged) {
   yp->root_mark++;
 
   TokenKind expected_next = TOKEN_UNKNOWN;
+  usize count = 0;
   while (true) {
     Token token = next_token (yp);
 
@@ -644,7 +981,7 @@ static void parse_map (YamlParser* yp, Node* node) {
         goto unexpected_token_inloop;
       }
       token = next_token (yp);
-    } else if (node->map.size > 0 && yp->root_mark > 1) {
+    } else if (count > 0 && yp->root_mark > 1) {
       expected_next = TOKEN_COMMA;
       goto unexpected_token_inloop;
     }
@@ -666,37 +1003,40 @@ static void parse_map (YamlParser* yp, Node* node) {
       goto unexpected_token_inloop;
     }
 
+    count++;
     if (token.length == 2 && !memcmp (token.raw, "<<", 2)) {
       // this is… not ideal, but doing this way, stops earlier
       c8 c = skip_all_whitespace (yp);
 
-      if (c == CHAR_OPEN_BRACE) {  // literal map
-        token = next_token (yp);   // consume token, as parse_value does
-        parse_map (yp, node);      // just append to current map
+      if (c == CHAR_OPEN_BRACE) {   // literal map
+        token = next_token (yp);    // consume token, as emit_value does
+        emit_map (yp, h, true);     // just append to current map
         continue;
       }
 
       if (c == CHAR_ASTERISK) {  // alias, unknown type
-        Node* value = parse_value (yp);
+        token = next_token (yp);
+        Node* value = token.kind == TOKEN_ALIAS ? find_anchor (yp, token) : nullptr;
 
-        if (value->kind != NODE_MAP) {
+        if (value == nullptr || value->kind != NODE_MAP) {
           parser_error (
             yp,
             (YamlError) {
               .kind = UNEXPECTED_TOKEN,
               .exp = "map",
-              .got = node_kind_names[value->kind],
+              .got = value ? node_kind_names[value->kind] : token_kind_to_string (token.kind),
             }
           );
         }
 
+        // nodes are shared, the arena frees them once
         for (usize j = 0; j < value->map.size; j++) {
-          if (value->rcount > 0) value->map.entries[j].val->rcount++;
-          map_add (&node->map, value->map.entries[j].key, value->map.entries[j].val);
+          YamlMapEntry entry = value->map.entries[j];
+          entry.merged = true;
+          emit_key (yp, h, &entry);
+          emit_node (h, entry.val);
         }
 
-        value->rcount--;
-
         continue;
       }
 
@@ -711,8 +1051,9 @@ static void parse_map (YamlParser* yp, Node* node) {
       );
     }
 
-    Node* val = parse_value (yp);
-    map_add (&node->map, token.raw, val);
+    YamlMapEntry key = {.key = token.raw, .val = nullptr, .hash = token.hash, .merged = merged};
+    emit_key (yp, h, &key);
+    emit_value (yp, h);
 
     continue;
 
@@ -730,77 +1071,77 @@ static void parse_map (YamlParser* yp, Node* node) {
   yp->root_mark--;
 }
 
-Node* parse_value (YamlParser* yp) {
+static void emit_value (YamlParser* yp, const YamlHandler* h) {
   Token token = next_token (yp);
 
   switch (token.kind) {
     case TOKEN_ANCHOR: {
-      // prevents to add more than one anchor (`item: &this &that ["value"]`)
-      if (yp->aliases.len > 0 &&
-          ((YamlAlias*)z3_get (yp->aliases, yp->aliases.len - 1))->value == nullptr)
+      YamlStore* store = yp->store;
+      if (intern_slot (store, token.raw, token.length, token.hash)->anchor != nullptr) {
         parser_error (
           yp,
           (YamlError) {// plz clang-format v22 in arch :sob:
-                       .kind = UNEXPECTED_TOKEN,
-                       .got = token_kind_to_string (token.kind),
-                       .exp = "a value"
+                       .kind = REDEFINED_ALIAS,
+                       .got = (nstr)token.raw,
+                       .exp = ""
           }
         );
+      }
 
-      if (parse_alias (yp, token.raw) != nullptr) {
+      // prevents to add more than one anchor (`item: &this &that ["value"]`)
+      Token next = next_token (yp);
+      if (next.kind == TOKEN_ANCHOR)
         parser_error (
           yp,
           (YamlError) {// plz clang-format v22 in arch :sob:
-                       .kind = REDEFINED_ALIAS,
-                       .got = (nstr)token.raw,
-                       .exp = ""
+                       .kind = UNEXPECTED_TOKEN,
+                       .got = token_kind_to_string (next.kind),
+                       .exp = "a value"
           }
         );
-      }
 
-      yp->aliases.len++;
+      // an anchored value is kept as a tree, to replay it for its aliases
+      yp->replay = true;
       Node* value = parse_value (yp);
-      yp->aliases.len--;
 
-      z3_push (yp->aliases, ((YamlAlias) {token.raw, value}));
-      return value;
+      // the table may have grown while parsing the value
+      intern_slot (store, token.raw, token.length, token.hash)->anchor = value;
+      emit_node (h, value);
+      return;
     }
 
-    case TOKEN_ALIAS: {
-      Node* value = parse_alias (yp, token.raw);
-      if (value == nullptr)
-        parser_error (
-          yp, (YamlError) {.kind = UNDEFINED_ALIAS, .got = (nstr)token.raw, .exp = ""}
-        );
-
-      value->rcount++;
-      return value;
-    }
+    case TOKEN_ALIAS:
+      emit_node (h, find_anchor (yp, token));
+      return;
 
     case TOKEN_STRING:
     case TOKEN_STRING_LIT: {
-      Node* node = create_node (NODE_STRING);
-      node->string = token.raw;
-      return node;
+      Node scalar = {.kind = NODE_STRING, .string = token.raw};
+      emit (h, on_scalar, &scalar);
+      return;
     }
 
-    case TOKEN_NUMBER:
-      return parse_number (token);
+    case TOKEN_NUMBER: {
+      Node scalar = {.kind = NODE_NUMBER, .number = parse_number (token)};
+      emit (h, on_scalar, &scalar);
+      return;
+    }
 
     case TOKEN_BOOLEAN: {
-      Node* node = create_node (NODE_BOOLEAN);
-
-      node->boolean = (token.length == 1);
-      return node;
+      Node scalar = {.kind = NODE_BOOLEAN, .boolean = (token.length == 1)};
+      emit (h, on_scalar, &scalar);
+      return;
     }
 
     case TOKEN_OPEN_MAP:
-      Node* node = create_node (NODE_MAP);
-      parse_map (yp, node);
-      return node;
+      emit (h, on_map_start);
+      emit_map (yp, h, false);
+      emit (h, on_map_end);
+      return;
 
     case TOKEN_OPEN_SEQ:
-      return parse_list (yp);
+      emit_list (yp, h);
+      return;
 
     default:
       errpfmt ("unweachabwe :3\n");
@@ -815,16 +1156,132 @@ Node* parse_value (YamlParser* yp) {
   }
 }
 
-void free_yaml (Node* node) {
-  free_node (node);
-  node = nullptr;
+// An open container of the tree, and the key of its next value if it is a map
+typedef struct {
+  Node* node;
+  YamlMapEntry key;
+} TreeFrame;
+
+#define TREE_FRAME_CAPACITY 8  // nesting before the frames grow
+
+// Handler context that builds the node tree out of the events
+typedef struct {
+  YamlParser* yp;
+  TreeFrame* frames;  // open containers from the arena, the innermost one last
+  usize depth;        // open containers
+  usize capacity;     // frames allocated
+  Node* root;         // the whole value, once it is complete
+} TreeBuilder;
+
+static void tree_attach (TreeBuilder* tb, Node* node) {
+  if (tb->depth == 0) {
+    tb->root = node;
+    return;
+  }
+
+  TreeFrame* top = &tb->frames[tb->depth - 1];
+  if (top->node->kind == NODE_LIST) {
+    list_add (tb->yp, &top->node->list, node);
+    return;
+  }
+
+  YamlMapEntry entry = top->key;
+  entry.val = node;
+  if (!map_put (tb->yp, &top->node->map, entry)) {
+    YamlError error = {.kind = KEY_REDEFINITION, .got = (nstr)entry.key, .exp = ""};
+    parser_error (tb->yp, error);
+  }
+}
+
+static void tree_open (TreeBuilder* tb, NodeKind kind) {
+  if (tb->depth >= tb->capacity) {
+    usize size = sizeof (TreeFrame) * tb->capacity;
+    usize capacity = tb->capacity == 0 ? TREE_FRAME_CAPACITY : tb->capacity * 2;
+    Arena* arena = &tb->yp->store->arena;
+    tb->frames = z3_resize (arena, tb->frames, size, sizeof (TreeFrame) * capacity);
+    tb->capacity = capacity;
+  }
+
+  tb->frames[tb->depth++] = (TreeFrame) {.node = create_node (tb->yp, kind)};
 }
 
-Node* parse_yaml (nstr filepath, YamlStore* store) {
-  int file_fd = fd_open_file (filepath);
+static void tree_open_map (void* ctx) {
+  tree_open (ctx, NODE_MAP);
+}
 
+static void tree_open_seq (void* ctx) {
+  tree_open (ctx, NODE_LIST);
+}
+
+static void tree_close (void* ctx) {
+  TreeBuilder* tb = ctx;
+  tree_attach (tb, tb->frames[--tb->depth].node);
+}
+
+// Redefined keys are found by map_put, once the value is attached
+static bool tree_key (void* ctx, const YamlMapEntry* key) {
+  TreeBuilder* tb = ctx;
+  tb->frames[tb->depth - 1].key = *key;
+  return true;
+}
+
+static void tree_scalar (void* ctx, const Node* scalar) {
+  TreeBuilder* tb = ctx;
+  Node* node = create_node (tb->yp, scalar->kind);
+  *node = *scalar;
+  tree_attach (tb, node);
+}
+
+// Aliases share the node, the arena frees it once
+static void tree_node (void* ctx, Node* node) {
+  tree_attach (ctx, node);
+}
+
+static const YamlHandler tree_handler = {
+  .ctx = nullptr,
+  .on_map_start = tree_open_map,
+  .on_map_end = tree_close,
+  .on_key = tree_key,
+  .on_seq_start = tree_open_seq,
+  .on_seq_end = tree_close,
+  .on_scalar = tree_scalar,
+  .on_node = tree_node,
+};
+
+// Build the tree of the next value
+static Node* parse_value (YamlParser* yp) {
+  TreeBuilder tb = {.yp = yp, .frames = nullptr, .depth = 0, .capacity = 0, .root = nullptr};
+  YamlHandler h = tree_handler;
+  h.ctx = &tb;
+
+  emit_value (yp, &h);
+  return tb.root;
+}
+
+void free_yaml (YamlStore* store) {
+  z3_drop_arena (&store->arena);
+  free (store->interns);
+  store->interns = nullptr;
+
+  for (usize i = 0; i < store->str_pools.len; i++) z3_drops (z3_get (store->str_pools, i));
+  for (usize i = 0; i < store->owned_strs.len; i++) z3_drops (z3_get (store->owned_strs, i));
+  z3_drop_vec (store->str_pools);
+  z3_drop_vec (store->owned_strs);
+
+  if (store->map) munmap (store->map, store->map_len);
+  store->map = nullptr;
+}
+
+// Set up the pools of a store, the first one starts with the file path for errors
+static void init_store (YamlStore* store, nstr filepath) {
   store->str_pools = z3_vec (String);
   store->owned_strs = z3_vec (String);
+  store->map = nullptr;
+  store->map_len = 0;
+  store->arena = z3_arena ();
+  store->interns = nullptr;
+  store->intern_len = 0;
+  store->intern_cap = 0;
 
   z3_vec_init_capacity (store->str_pools, 4);
   z3_vec_init_capacity (store->owned_strs, 4);
@@ -833,105 +1290,142 @@ Node* parse_yaml (nstr filepath, YamlStore* store) {
   z3_pushl (&fst, filepath, strlen (filepath));
   z3_pushc (&fst, 0);
   z3_push (store->str_pools, fst);
+}
 
-  usize curr_str_len = fst.len;
-
-  // NOLINTNEXTLINE (concurrency-mt-unsafe)
-  if (file_fd < 0) die ("could not open file %s: %s\n", filepath, strerror (errno));
-
-  u8 yaml_chunk[YAML_CHUNK_SIZE];
-
-  YamlParser yp = {0};
-  yp.store = store;
-  yp.chunk = yaml_chunk;
-  yp.iffd = file_fd;
-
-  // Initialize with 4 as size, since the push function starts with 32
-  yp.aliases = z3_vec (YamlAlias);
-  z3_vec_init_capacity (yp.aliases, 4);
-
-  refill_buffers (&yp);
-  if (eof_reached (&yp)) die ("File is empty");
-
-  Token first = next_token (&yp);
-  Node* root = nullptr;
+static void emit_document (YamlParser* yp, const YamlHandler* h) {
+  Token first = next_token (yp);
 
   switch (first.kind) {
     case TOKEN_OPEN_SEQ:
-      yp.root_mark++;  // any not global map is flow-style
-      root = parse_list (&yp);
+      yp->root_mark++;  // any not global map is flow-style
+      emit_list (yp, h);
       break;
 
     case TOKEN_OPEN_MAP:
-      yp.root_mark++;  // it is flow already
-      root = create_node (NODE_MAP);
-      parse_map (&yp, root);
+      yp->root_mark++;  // it is flow already
+      emit (h, on_map_start);
+      emit_map (yp, h, false);
+      emit (h, on_map_end);
       break;
 
     case TOKEN_KEY:
-      // Backtrack since parse_map will consume the key
-      yp.cpos = 0;
-      yp.line = 0;
-      yp.lpos = 0;
-
-      if (((String*)z3_get (store->str_pools, 0))->len != curr_str_len) {
-        ((String*)z3_get (store->str_pools, 0))->len = curr_str_len;
-      } else {
-        z3_drops ((String*)z3_get (store->str_pools, 1));
-      }
-
-      root = create_node (NODE_MAP);
-      parse_map (&yp, root);
+      // Replay the key, since emit_map will consume it
+      yp->replay = true;
+      emit (h, on_map_start);
+      emit_map (yp, h, false);
+      emit (h, on_map_end);
       break;
 
     default:
-      // Backtrack and parse as single value
-      yp.cpos = 0;
-      yp.line = 0;
-      yp.lpos = 0;
-
-      if (((String*)z3_get (store->str_pools, 0))->len != curr_str_len) {
-        ((String*)z3_get (store->str_pools, 0))->len = curr_str_len;
-      } else if (store->str_pools.len == 2) {
-        z3_drops ((String*)z3_get (store->str_pools, 1));
-      } else {
-        z3_drops ((String*)z3_get (store->owned_strs, 0));
-      }
-
-      root = parse_value (&yp);
+      // Replay and parse as single value
+      yp->replay = true;
+      emit_value (yp, h);
       break;
   }
 
-  first = next_token (&yp);  // last
+  first = next_token (yp);  // last
 
   if (first.kind != TOKEN_EOF) {
     parser_error (
-      &yp,
+      yp,
       (YamlError) {
         .kind = UNEXPECTED_TOKEN,
-        .got = token_kind_to_string (yp.cur_token.kind),
+        .got = token_kind_to_string (yp->cur_token.kind),
         .exp = token_kind_to_string (TOKEN_EOF),
       }
     );
   }
+}
 
-  z3_drop_vec (yp.aliases);
+static Node* parse_document (YamlParser* yp) {
+  TreeBuilder tb = {.yp = yp, .frames = nullptr, .depth = 0, .capacity = 0, .root = nullptr};
+  YamlHandler h = tree_handler;
+  h.ctx = &tb;
+
+  emit_document (yp, &h);
+  return tb.root;
+}
+
+Node* parse_yaml (nstr filepath, YamlStore* store) {
+  int file_fd = fd_open_file (filepath);
+  init_store (store, filepath);
+
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (file_fd < 0) die ("could not open file %s: %s\n", filepath, strerror (errno));
+
+  u8 yaml_chunk[YAML_CHUNK_SIZE];
+
+  YamlParser yp = {0};
+  yp.store = store;
+  yp.chunk = yaml_chunk;
+  yp.iffd = file_fd;
+
+  refill_buffers (&yp);
+  if (eof_reached (&yp)) die ("File is empty");
+
+  Node* root = parse_document (&yp);
+  close (file_fd);
   return root;
 }
 
+// Map a file for a parser, tokens point into the mapping of the store
+static void map_parser (YamlParser* yp, nstr filepath, YamlStore* store) {
+  int file_fd = fd_open_file (filepath);
+  init_store (store, filepath);
+
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (file_fd < 0) die ("could not open file %s: %s\n", filepath, strerror (errno));
+
+  struct stat st;
+  if (fstat (file_fd, &st) == -1) die ("could not stat file %s\n", filepath);
+  if (st.st_size == 0) die ("File is empty");
+
+  // One more byte than the file, so the last token can be NUL terminated in place.
+  // The anonymous mapping reserves it, the file is then mapped over the rest
+  usize size = (usize)st.st_size;
+  store->map_len = size + 1;
+
+  void* map = mmap (
+    nullptr, store->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+  );
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (map == MAP_FAILED) die ("could not map file %s: %s\n", filepath, strerror (errno));
+  store->map = map;
+
+  map = mmap (map, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file_fd, 0);
+  // NOLINTNEXTLINE (concurrency-mt-unsafe)
+  if (map == MAP_FAILED) die ("could not map file %s: %s\n", filepath, strerror (errno));
+  close (file_fd);
+
+  *yp = (YamlParser) {0};
+  yp->store = store;
+  yp->chunk = store->map;
+  yp->blen = size;
+  yp->iffd = -1;
+  yp->mapped = true;
+}
+
+Node* parse_yaml_mmap (nstr filepath, YamlStore* store) {
+  YamlParser yp;
+  map_parser (&yp, filepath, store);
+  return parse_document (&yp);
+}
+
+void parse_yaml_events (nstr filepath, YamlStore* store, const YamlHandler* handler) {
+  YamlParser yp;
+  map_parser (&yp, filepath, store);
+  emit_document (&yp, handler);
+}
+
 Node* map_get_node (Node* node, nstr key) {
   if (!node || node->kind != NODE_MAP) {
     errpfmt ("not a map\n");
     return nullptr;
   }
 
-  for (usize i = 0; i < node->map.size; i++) {
-    if (strcmp ((nstr)node->map.entries[i].key, key) == 0) {
-      return node->map.entries[i].val;
-    }
-  }
-
-  return nullptr;
+  u32 hash = map_key_hash ((cstr)key, strlen (key));
+  YamlMapEntry* entry = map_find (&node->map, (cstr)key, hash);
+  return entry ? entry->val : nullptr;
 }
 
 nstr token_kind_strings[] = {
@@ -973,7 +1467,7 @@ nstr node_kind_names[] = {
     free (v);                                                                            \
   }
 
-[[clang::always_inline]] static nstr node_value (Node* node) {
+[[clang::always_inline]] static nstr node_value (const Node* node) {
   static c8 _buf[20];  // NOLINT (readability-magic-numbers)
 
   switch (node->kind) {
@@ -1127,29 +1621,74 @@ static void hex_dump (cstr buf, usize len) {
   }
 }
 
-z3_vec_drop_fn (String, z3_drops);
+static void print_event (nstr name, i32 depth) {
+  printf ("\x1b[1;35m%*s%s\x1b[0m\n", depth * 2, "", name);
+}
+
+static void event_map_start (void* ctx) {
+  print_event ("MAP_START", (*(i32*)ctx)++);
+}
+
+static void event_map_end (void* ctx) {
+  print_event ("MAP_END", --(*(i32*)ctx));
+}
+
+static void event_seq_start (void* ctx) {
+  print_event ("SEQ_START", (*(i32*)ctx)++);
+}
+
+static void event_seq_end (void* ctx) {
+  print_event ("SEQ_END", --(*(i32*)ctx));
+}
+
+static bool event_key (void* ctx, const YamlMapEntry* key) {
+  nstr merged = key->merged ? " <<" : "";
+  printf ("%*s\x1b[1;36mKEY\x1b[0m %s%s\n", *(i32*)ctx * 2, "", key->key, merged);
+  return true;
+}
+
+static void event_scalar (void* ctx, const Node* scalar) {
+  printf (
+    "%*s\x1b[1;32m%s\x1b[0m %s\n",
+    *(i32*)ctx * 2,
+    "",
+    node_kind_to_string (scalar->kind),
+    node_value (scalar)
+  );
+}
 
 // this main function is just for debug
-// this runs the tokenizer and prints all tokens
+// this runs the tokenizer and prints all tokens, `mmap` parses with parse_yaml_mmap instead,
+// and `events` prints what parse_yaml_events reports
 i32 main (i32 argc, c8** argv) {
   IGNORE_UNUSED (nstr _this_file = popf (argc, argv));
   nstr filepath = popf (argc, argv);
   nstr hmmm = argv[0];
+  bool mapped = hmmm && strcmp (hmmm, "mmap") == 0;
+
+  if (hmmm && strcmp (hmmm, "events") == 0) {
+    i32 depth = 0;
+    YamlHandler handler = {
+      .ctx = &depth,
+      .on_map_start = event_map_start,
+      .on_map_end = event_map_end,
+      .on_key = event_key,
+      .on_seq_start = event_seq_start,
+      .on_seq_end = event_seq_end,
+      .on_scalar = event_scalar,
+      .on_node = nullptr,
+    };
 
-  if (hmmm) {
     YamlStore store;
-    i32 file_fd = fd_open_file (filepath);
-
-    store.str_pools = z3_vec (String);
-    store.owned_strs = z3_vec (String);
-
-    z3_vec_init_capacity (store.str_pools, 4);
-    z3_vec_init_capacity (store.owned_strs, 4);
+    parse_yaml_events (filepath, &store, &handler);
+    free_yaml (&store);
+    return 0;
+  }
 
-    String fst = z3_str (STR_ALLOC_SIZE_BASE);
-    z3_pushl (&fst, filepath, strlen (filepath));
-    z3_pushc (&fst, 0);
-    z3_push (store.str_pools, fst);
+  if (hmmm && !mapped) {
+    YamlStore store;
+    i32 file_fd = fd_open_file (filepath);
+    init_store (&store, filepath);
 
     // NOLINTNEXTLINE (concurrency-mt-unsafe)
     if (file_fd < 0) die ("could not open file %s: %s\n", filepath, strerror (errno));
@@ -1161,10 +1700,6 @@ i32 main (i32 argc, c8** argv) {
     yp.chunk = yaml_chunk;
     yp.iffd = file_fd;
 
-    // Initialize with 4 as size, since the push function starts with 32
-    yp.aliases = z3_vec (YamlAlias);
-    z3_vec_init_capacity (yp.aliases, 4);
-
     refill_buffers (&yp);
     if (eof_reached (&yp)) die ("File is empty");
     while (!eof_reached (&yp)) {
@@ -1173,14 +1708,12 @@ i32 main (i32 argc, c8** argv) {
       if (token.kind == TOKEN_UNKNOWN) break;
       if (token.kind == TOKEN_EOF) break;
     }
-    z3_vec_drop_String (&store.str_pools);
-    z3_vec_drop_String (&store.owned_strs);
-    z3_drop_vec (yp.aliases);
+    free_yaml (&store);
     printf ("\n");
   }
 
   YamlStore stores;
-  Node* root = parse_yaml (filepath, &stores);
+  Node* root = mapped ? parse_yaml_mmap (filepath, &stores) : parse_yaml (filepath, &stores);
 
   if (!root) {
     errpfmt ("Failed to parse YAML\n");
@@ -1206,9 +1739,7 @@ i32 main (i32 argc, c8** argv) {
       "\x1b[1;32m%s:\x1b[0m %s = %s\n", node_kind_to_string (root->kind), ".", node_value (root)
     );
 
-  free_yaml (root);
-  z3_vec_drop_String (&stores.str_pools);
-  z3_vec_drop_String (&stores.owned_strs);
+  free_yaml (&stores);
 
   return 0;
 }